@@ -1,504 +1,8208 @@
+#define _GNU_SOURCE
 #include "lib_tar.h"
 
-/**
- * Checks whether the archive is valid.
- *
- * Each non-null header of a valid archive has:
- *  - a magic value of "ustar" and a null,
- *  - a version value of "00" and no null,
- *  - a correct checksum
- *
- * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
- *
- * @return a zero or positive value if the archive is valid, representing the number of non-null headers in the archive,
- *         -1 if the archive contains a header with an invalid magic value,
- *         -2 if the archive contains a header with an invalid version value,
- *         -3 if the archive contains a header with an invalid checksum value
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
+
+typedef struct tar_index tar_index_t;
+typedef struct name_table name_table_t;
+typedef struct index_scan index_scan_t;
+
+/* Validates a header under a policy, returning as valid_archive() */
+typedef int (*header_check_fn)(const tar_header_t *header, int nheader);
+
+/* Per-archive state attached to a file descriptor */
+struct tar
+{
+    int fd;
+    header_check_fn check;        /* validation of the policy set with tar_set_policy() */
+    int advice;                   /* TAR_ADVISE_* flags set with tar_set_advice() */
+    int direct_fd;                /* O_DIRECT descriptor of the archive, -1 until opened, -2 if unsupported */
+    int prefetch;                 /* headers read ahead by index builds, set with tar_set_prefetch() */
+    int index_mode;               /* TAR_INDEX_* lookup table of index builds, set with tar_set_index_mode() */
+    tar_index_t *index;           /* current version, replaced whole by tar_index(), NULL while not indexed */
+    pthread_mutex_t index_lock;   /* serializes the builds of new index versions, never taken by lookups */
+    tar_index_t *retired;         /* versions replaced, freed once no reader can still see them */
+    uint64_t serial;              /* tells apart handles allocated at the same address, see tar_err() */
+    tar_error_t err;              /* last error of fd_state, handles keep theirs per thread */
+    tar_log_fn log;
+    void *log_arg;
+    tar_trace_fn trace;
+    void *trace_arg;
+    tar_stats_t stats;            /* updated atomically, a handle may be shared by threads */
+};
+
+/*
+ * Handles are found by file descriptor in a two-level table whose chunks are never freed,
+ * so that lookups need no lock. Only attaching and detaching take handle_lock.
  */
-int check_archive(int tar_fd)
+#define HANDLE_CHUNK  1024
+#define HANDLE_CHUNKS 1024
+static tar_t **handle_chunks[HANDLE_CHUNKS];
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* State of the file descriptors without a handle, kept per thread */
+static __thread tar_t fd_state;
+static tar_log_fn fd_log;
+static void *fd_log_arg;
+static tar_trace_fn fd_trace;
+static void *fd_trace_arg;
+static int fd_policy = TAR_DEFAULT_POLICY;
+static int fd_advice = TAR_DEFAULT_ADVICE;
+
+/*
+ * The last errors on handles are kept per thread, so that threads sharing a handle never write to it.
+ * A thread allocates a slot for a handle on its first error there, reusing those of detached handles.
+ */
+typedef struct tar_err_slot
 {
-    tar_header_t header;
-    int valid_arch;
-    int nheader = 0;
+    int fd;
+    const tar_t *tar;
+    uint64_t serial;
+    tar_error_t err;
+    struct tar_err_slot *next;
+} tar_err_slot_t;
 
-    while (read(tar_fd, (void *)&header, sizeof(tar_header_t)) == sizeof(tar_header_t))
-    {
-        valid_arch = valid_archive(header, nheader);
-        if (valid_arch != 0)
-        {
-            return valid_arch;
-        }
-        nheader++;
+static __thread tar_err_slot_t *err_slots;
+static __thread tar_error_t err_lost;   /* error of a handle whose slot could not be allocated */
+static const tar_error_t err_none = {TAR_OK, 0, NULL, -1, -1, NULL};
+static uint64_t tar_serial;
+static pthread_key_t err_key;
+static pthread_once_t err_once = PTHREAD_ONCE_INIT;
 
-        if (lseek(tar_fd, aligned_size(header), SEEK_CUR) == -1)
-        {
-            perror("fseek failed");
-            return -3;
-        }
-    }
-    if (lseek(tar_fd, 0, SEEK_SET) == -1)
+/*
+ * Index versions are immutable once published and are read without locks. A thread reading them
+ * announces the epoch in which its read section started; a version replaced in epoch E is freed once
+ * no thread is in a read section started at or before E. Public calls are read sections, see op_begin().
+ */
+typedef struct rcu_reader
+{
+    uint64_t epoch;               /* rcu_epoch when the outermost read section started, 0 outside one */
+    int depth;                    /* nesting of read sections */
+    int registered;
+    struct rcu_reader *prev;
+    struct rcu_reader *next;
+} rcu_reader_t;
+
+static uint64_t rcu_epoch = 1;
+static rcu_reader_t *rcu_readers;
+static pthread_mutex_t rcu_lock = PTHREAD_MUTEX_INITIALIZER; /* guards the list of readers, not the reads */
+static pthread_key_t rcu_key;
+static pthread_once_t rcu_once = PTHREAD_ONCE_INIT;
+static __thread rcu_reader_t rcu_self;
+
+/*
+ * Operation in progress on the calling thread. The work done is counted here without atomics
+ * and added to the handle counters once, when the operation returns.
+ */
+typedef struct tar_op
+{
+    tar_t *tar;
+    int op;                       /* -1 for a call nested in another operation */
+    const char *path;
+    uint64_t start;
+    uint64_t headers;
+    uint64_t reads;
+    uint64_t bytes_read;
+    uint64_t seeks;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t index_probes;
+    uint64_t index_filtered;
+} tar_op_t;
+
+static __thread tar_op_t *cur_op;
+
+static const char *const op_names[TAR_OP_COUNT] = {
+    "check_archive", "exists", "check_flag", "list", "get_symlink", "read_file",
+    "tar_find", "tar_walk", "tar_list", "tar_verify", "tar_cache_read_file", "tar_diff",
+    "tar_delta_create", "tar_delta_apply", "tar_recover", "tar_stat",
+};
+
+/* Returns 1 if the checksum matches the header bytes summed as signed chars, as some old tars did */
+static int check_sum_signed(const tar_header_t *header)
+{
+    const signed char *bytes = (const signed char *)header;
+    long checksum = strtol(header->chksum, NULL, 8);
+    long sum = 0;
+    for (size_t i = 0; i < sizeof(tar_header_t); i++)
     {
-        perror("fseek failed");
-        return -3;
+        sum += (i >= 148 && i < 156) ? ' ' : bytes[i];
     }
-    return nheader;
+    return sum == checksum;
 }
 
-/**
- * Validates a tar archive header.
- *
- * Checks the header's `magic`, `version`, and checksum for validity.
- * Returns the header index if `magic` is empty, signaling the end of the archive.
- *
- * @param header The tar header to validate.
- * @param nheader The current header index in the archive.
- *
- * @return `nheader` if `magic` is empty, 0 if valid,
- *         -1 for invalid `magic`, -2 for invalid `version`, -3 for invalid checksum.
+/*
+ * Checks a header under a policy. Being always inlined with a constant policy, each policy gets its
+ * own copy with the checks of the others folded away, so the strict ustar check is as before.
  */
-int valid_archive(tar_header_t header, int nheader)
+static inline __attribute__((always_inline)) int check_header(const tar_header_t *header, int nheader, int policy)
 {
-    if (header.magic[0] == '\0')
+    /* pre-POSIX headers have no magic, the end of the archive is only told by an empty name */
+    int old = (policy == TAR_POLICY_V7 || policy == TAR_POLICY_PERMISSIVE);
+    if (old ? header->name[0] == '\0' : header->magic[0] == '\0')
     {
         return nheader;
     }
-    else if (strncmp(header.magic, TMAGIC, TMAGLEN) != 0)
+
+    if (policy == TAR_POLICY_USTAR)
     {
-        perror("magic value not valid");
-        return -1;
+        if (strncmp(header->magic, TMAGIC, TMAGLEN) != 0)
+        {
+            return -1;
+        }
+        if (strncmp(header->version, TVERSION, TVERSLEN) != 0)
+        {
+            return -2;
+        }
     }
-    else if (strncmp(header.version, TVERSION, TVERSLEN) != 0)
+    else if (policy == TAR_POLICY_GNU || policy == TAR_POLICY_V7)
     {
-        perror("version not valid");
-        return -2;
+        /* GNU tar writes "ustar " and a version of " " and a null */
+        int ustar = memcmp(header->magic, TMAGIC, TMAGLEN) == 0;
+        int gnu = memcmp(header->magic, "ustar ", TMAGLEN) == 0;
+        if (!ustar && !gnu && !(policy == TAR_POLICY_V7 && header->magic[0] == '\0'))
+        {
+            return -1;
+        }
+        if ((ustar && memcmp(header->version, TVERSION, TVERSLEN) != 0) ||
+            (gnu && memcmp(header->version, " ", TVERSLEN) != 0))
+        {
+            return -2;
+        }
     }
-    else if (check_sum(header) == 0)
+
+    if (check_sum(*header) == 0 && (policy != TAR_POLICY_PERMISSIVE || !check_sum_signed(header)))
     {
-        perror("checksum not valid");
         return -3;
     }
     return 0;
 }
 
-/**
- * Computes the aligned size of a file in a tar archive.
- *
- * @param header A tar header structure containing metadata about the file, including its size in octal format.
- *
- * @return The aligned size of the file, in bytes.
- */
-long aligned_size(tar_header_t header)
+static int check_ustar(const tar_header_t *header, int nheader)
 {
-    unsigned int size = strtol(header.size, NULL, 8);
-    return (size % 512 == 0) ? size : size + (512 - (size % 512));
+    return check_header(header, nheader, TAR_POLICY_USTAR);
 }
 
-/**
- * Validates the checksum of a TAR archive header.
- *
- * @param header A tar_header_t structure representing a single header of the TAR archive.
- *
- * @return 1 if the calculated checksum matches the stored checksum, indicating the header is valid.
- *         0 if the calculated checksum does not match the stored checksum, indicating the header is invalid.
- *
- */
-int check_sum(tar_header_t header)
+static int check_gnu(const tar_header_t *header, int nheader)
 {
-    unsigned char *header_bytes = (unsigned char *)&header;
-    unsigned int checksum = strtol(header.chksum, NULL, 8);
-    unsigned int sum = 0;
+    return check_header(header, nheader, TAR_POLICY_GNU);
+}
 
-    for (int i = 0; i < sizeof(tar_header_t); i++)
-    {
-        if (i >= 148 && i <= 155)
-        {
-            sum += ' ';
-        }
-        else
-        {
-            sum += header_bytes[i];
-        }
-    }
-    return (sum == checksum);
+static int check_v7(const tar_header_t *header, int nheader)
+{
+    return check_header(header, nheader, TAR_POLICY_V7);
 }
 
+static int check_permissive(const tar_header_t *header, int nheader)
+{
+    return check_header(header, nheader, TAR_POLICY_PERMISSIVE);
+}
+
+/* Indexed by TAR_POLICY_* */
+static const header_check_fn header_checks[] = {check_ustar, check_gnu, check_v7, check_permissive};
+
 /**
- * Checks whether an entry exists in the archive.
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
+ * Validates a header met by a scan of the members. Scans end where check_archive() does: under the
+ * policies requiring a magic value, a header without one ends the archive even if it has a name.
  *
- * @return zero if no entry at the given path exists in the archive,
- *         any other value otherwise.
+ * @return 0 for a member, 1 at the end of the archive, -1 to -3 for an invalid header as check_archive().
  */
-int exists(int tar_fd, char *path)
+static int scan_check(header_check_fn check, const tar_header_t *header)
 {
-    tar_header_t header;
+    int ret = check(header, 1);
+    return ret > 0 ? 1 : ret;
+}
 
-    while (read(tar_fd, (void *)&header, sizeof(tar_header_t)) == sizeof(tar_header_t))
+/* Returns the handle attached to tar_fd, NULL if there is none */
+static tar_t *handle_at(int tar_fd)
+{
+    if (tar_fd >= 0 && tar_fd < HANDLE_CHUNK * HANDLE_CHUNKS)
     {
-
-        if (header.name[0] == '\0')
+        tar_t **chunk = __atomic_load_n(&handle_chunks[tar_fd / HANDLE_CHUNK], __ATOMIC_ACQUIRE);
+        if (chunk != NULL)
         {
-            return 0;
-        }
-        else if (strcmp(header.name, path) == 0)
-        {
-            return 1;
+            return __atomic_load_n(&chunk[tar_fd % HANDLE_CHUNK], __ATOMIC_ACQUIRE);
         }
+    }
+    return NULL;
+}
 
-        if (lseek(tar_fd, aligned_size(header), SEEK_CUR) == -1)
-        {
-            perror("fseek failed");
-            return -3;
-        }
+/* Returns the handle attached to tar_fd, or the per-thread state if there is none */
+static tar_t *tar_get(int tar_fd)
+{
+    tar_t *tar = handle_at(tar_fd);
+    if (tar != NULL)
+    {
+        return tar;
     }
-    if (lseek(tar_fd, 0, SEEK_SET) == -1)
+    fd_state.fd = tar_fd;
+    fd_state.check = header_checks[fd_policy];
+    fd_state.advice = fd_advice;
+    return &fd_state;
+}
+
+/* Frees the error slots of an exiting thread */
+static void err_free(void *arg)
+{
+    tar_err_slot_t *slot = arg;
+    while (slot != NULL)
     {
-        perror("fseek failed");
-        return -3;
+        tar_err_slot_t *next = slot->next;
+        free(slot);
+        slot = next;
     }
+}
 
-    return 0;
+static void err_init(void)
+{
+    pthread_key_create(&err_key, err_free);
 }
 
-/**
- * Checks whether an entry in the archive matches the specified typeflag.
- *
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
- * @param typeflag The typeflag to check against.
+/*
+ * Returns the last error of the calling thread on `tar`.
  *
- * @return zero if no entry at the given path exists in the archive or the entry is not the flag,
- *         any other value otherwise.
+ * @return the error, NULL if the thread never failed on the handle and `create` is 0.
  */
-int check_flag(int tar_fd, char *path, char typeflag)
+static tar_error_t *tar_err(tar_t *tar, int create)
 {
-    tar_header_t header;
-    if (lseek(tar_fd, 0, SEEK_SET) == -1)
+    if (tar == &fd_state)
     {
-        perror("lseek failed");
-        return -1;
+        return &fd_state.err;
     }
-
-    while (read(tar_fd, (void *)&header, sizeof(tar_header_t)) == sizeof(tar_header_t))
+    tar_err_slot_t *unused = NULL;
+    for (tar_err_slot_t *slot = err_slots; slot != NULL; slot = slot->next)
     {
-
-        if (header.name[0] == '\0')
+        if (slot->tar == tar && slot->serial == tar->serial)
         {
-            return 0;
+            return &slot->err;
         }
-        if (strcmp(header.name, path) == 0)
+        if (create && unused == NULL && (handle_at(slot->fd) != slot->tar || slot->tar->serial != slot->serial))
         {
-
-            if (typeflag == REGTYPE && ((header.typeflag == REGTYPE) || (header.typeflag == AREGTYPE)))
-            {
-                return 1;
-            }
-            if (header.typeflag == typeflag)
-            {
-                return 1;
-            }
-            return 0;
+            unused = slot;
         }
-
-        if (lseek(tar_fd, aligned_size(header), SEEK_CUR) == -1)
+    }
+    if (!create)
+    {
+        return NULL;
+    }
+    if (unused == NULL)
+    {
+        pthread_once(&err_once, err_init);
+        unused = malloc(sizeof(tar_err_slot_t));
+        if (unused == NULL)
         {
-            perror("fseek failed");
-            return -3;
+            return &err_lost;
         }
+        unused->next = err_slots;
+        err_slots = unused;
+        pthread_setspecific(err_key, err_slots);
     }
-    if (lseek(tar_fd, 0, SEEK_SET) == -1)
+    unused->fd = tar->fd;
+    unused->tar = tar;
+    unused->serial = tar->serial;
+    unused->err = err_none;
+    return &unused->err;
+}
+
+/* Resets the last error of the calling thread on `tar` to TAR_OK */
+static void tar_clear(tar_t *tar)
+{
+    tar_error_t *err = tar_err(tar, 0);
+    if (err != NULL)
     {
-        perror("fseek failed");
-        return -3;
+        err->code = TAR_OK;
     }
-    return 0;
 }
 
-/**
- * Checks whether an entry exists in the archive and is a directory.
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
- *
- * @return zero if no entry at the given path exists in the archive or the entry is not a directory,
- *         any other value otherwise.
- */
-int is_dir(int tar_fd, char *path)
+/* Returns the state of tar_fd with its last error cleared, at the start of a public call */
+static tar_t *tar_begin(int tar_fd)
 {
-    return check_flag(tar_fd, path, DIRTYPE);
+    tar_t *tar = tar_get(tar_fd);
+    tar_clear(tar);
+    return tar;
 }
 
-/**
- * Checks whether an entry exists in the archive and is a file.
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
- *
- * @return zero if no entry at the given path exists in the archive or the entry is not a file,
- *         any other value otherwise.
- */
-int is_file(int tar_fd, char *path)
+/* Removes the reader of an exiting thread from the list */
+static void rcu_unregister(void *arg)
 {
-    return check_flag(tar_fd, path, REGTYPE);
+    rcu_reader_t *self = arg;
+    pthread_mutex_lock(&rcu_lock);
+    if (self->prev != NULL)
+    {
+        self->prev->next = self->next;
+    }
+    else
+    {
+        rcu_readers = self->next;
+    }
+    if (self->next != NULL)
+    {
+        self->next->prev = self->prev;
+    }
+    pthread_mutex_unlock(&rcu_lock);
 }
 
-/**
- * Checks whether an entry exists in the archive and is a symlink.
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
- * @return zero if no entry at the given path exists in the archive or the entry is not symlink,
- *         any other value otherwise.
- */
-int is_symlink(int tar_fd, char *path)
+static void rcu_init(void)
 {
-    return check_flag(tar_fd, path, SYMTYPE);
+    pthread_key_create(&rcu_key, rcu_unregister);
 }
 
-/**
- * Lists the entries at a given path in the archive.
- * list() does not recurse into the directories listed at the given path.
- *
- * Example:
- *  dir/          list(..., "dir/", ...) lists "dir/a", "dir/b", "dir/c/" and "dir/e/"
- *   ├── a
- *   ├── b
- *   ├── c/
- *   │   └── d
- *   └── e/
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive. If the entry is a symlink, it must be resolved to its linked-to entry.
- * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
- * @param no_entries An in-out argument.
- *                   The caller sets it to the number of entries in `entries`.
- *                   The callee sets it to the number of entries listed.
- *
- * @return 0 if no directory at the given path exists in the archive,
- *         a positive number for the number of entries listed,
- *         or a negative value for an error.
- */
-int list(int tar_fd, char *path, char **entries, size_t *no_entries)
+/* Adds the reader of the calling thread to the list, on its first read section */
+static void rcu_register(void)
 {
-    tar_header_t header;
-    size_t path_len = strlen(path);
-    size_t count = 0;
-
-
-    char path_slash[101];
-    snprintf(path_slash, sizeof(path_slash), "%s", path);
-    if (path[path_len - 1] != '/')
+    pthread_once(&rcu_once, rcu_init);
+    pthread_mutex_lock(&rcu_lock);
+    rcu_self.prev = NULL;
+    rcu_self.next = rcu_readers;
+    if (rcu_readers != NULL)
     {
-        strcat(path_slash, "/");
+        rcu_readers->prev = &rcu_self;
     }
-    path_len = strlen(path_slash);
-
-
+    rcu_readers = &rcu_self;
+    pthread_mutex_unlock(&rcu_lock);
+    pthread_setspecific(rcu_key, &rcu_self);
+    rcu_self.registered = 1;
+}
 
-    if (path == NULL || entries == NULL || no_entries == NULL || tar_fd < 0 || path_len == 0)
+/* Starts a read section, in which the index versions loaded stay allocated */
+static void rcu_enter(void)
+{
+    if (rcu_self.depth++ > 0)
     {
-        fprintf(stderr, "Error: invalid arguments to list()\n");
-        return -1;
+        return;
     }
-
-    if (lseek(tar_fd, 0, SEEK_SET) == -1)
+    if (!rcu_self.registered)
     {
-        perror("fseek failed");
-        return -3;
+        rcu_register();
     }
+    /* index pointers are loaded with __ATOMIC_SEQ_CST too, after the epoch is announced */
+    __atomic_store_n(&rcu_self.epoch, __atomic_load_n(&rcu_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
 
-    if (is_symlink(tar_fd, path))
+/* Ends a read section started by rcu_enter() */
+static void rcu_exit(void)
+{
+    if (--rcu_self.depth == 0)
     {
-        char *new_path = get_symlink(tar_fd, path);
-        if (new_path == NULL)
-        {
-            return 0;
+        __atomic_store_n(&rcu_self.epoch, 0, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Ends the current epoch, after a version was unpublished.
+ *
+ * @return the epoch that ended: the version may be freed once rcu_oldest() is past it.
+ */
+static uint64_t rcu_advance(void)
+{
+    return __atomic_fetch_add(&rcu_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Returns the epoch of the oldest read section in progress, UINT64_MAX if there is none */
+static uint64_t rcu_oldest(void)
+{
+    uint64_t oldest = UINT64_MAX;
+    pthread_mutex_lock(&rcu_lock);
+    for (rcu_reader_t *r = rcu_readers; r != NULL; r = r->next)
+    {
+        uint64_t epoch = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+        if (epoch != 0 && epoch < oldest)
+        {
+            oldest = epoch;
         }
-        return list(tar_fd, new_path, entries, no_entries);
     }
+    pthread_mutex_unlock(&rcu_lock);
+    return oldest;
+}
 
-    if (!is_dir(tar_fd, path_slash))
+/* Records an error in `tar` and passes it to its logger */
+static void tar_fail_at(tar_t *tar, const char *func, int code, long header, off_t offset, const char *field)
+{
+    int sys_errno = errno;
+    tar_error_t *err = tar_err(tar, 1);
+    err->code = code;
+    err->sys_errno = (code == TAR_EIO || code == TAR_ENOMEM) ? sys_errno : 0;
+    err->func = (cur_op != NULL && cur_op->op >= 0) ? op_names[cur_op->op] : func;
+    err->header = header;
+    err->offset = offset;
+    err->field = field;
+
+    tar_log_fn log = (tar == &fd_state) ? fd_log : tar->log;
+    void *log_arg = (tar == &fd_state) ? fd_log_arg : tar->log_arg;
+    if (log != NULL)
     {
-        return 0;
+        log(err, log_arg);
     }
+}
+
+#define TAR_FAIL(tar, code, header, offset, field) tar_fail_at(tar, __func__, code, header, offset, field)
+
+/* Records the error matching a negative valid_archive() result */
+static void fail_header(tar_t *tar, const char *func, int valid, long header, off_t offset)
+{
+    static const int codes[] = {TAR_EMAGIC, TAR_EVERSION, TAR_ECHKSUM};
+    static const char *const fields[] = {"magic", "version", "chksum"};
+    tar_fail_at(tar, func, codes[-valid - 1], header, offset, fields[-valid - 1]);
+}
+
+/* Finds an entry in the index of a handle, defined with the index below */
+static int index_find(tar_t *tar, const char *path, tar_entry_t *entry);
+
+/* check_archive() reading headers with O_DIRECT, defined with the iterator below */
+static int check_direct(tar_t *tar, int tar_fd);
+
+/* list() into a single allocation, defined with tar_list() below */
+static int tar_list_impl(int tar_fd, const char *path, tar_list_t **out);
+
+/* Resolves the target of a symlink into an archive path, defined with tar_walk() below */
+static void link_target(const char *path, const char *linkname, char *out, size_t size);
+
+#define STAT_ADD(tar, field, n) __atomic_fetch_add(&(tar)->stats.field, (n), __ATOMIC_RELAXED)
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* Adds the work counted in `op` to the counters of `tar` */
+static void op_flush(tar_t *tar, const tar_op_t *op)
+{
+    STAT_ADD(tar, headers, op->headers);
+    STAT_ADD(tar, reads, op->reads);
+    STAT_ADD(tar, bytes_read, op->bytes_read);
+    STAT_ADD(tar, seeks, op->seeks);
+    STAT_ADD(tar, cache_hits, op->cache_hits);
+    STAT_ADD(tar, cache_misses, op->cache_misses);
+    STAT_ADD(tar, index_probes, op->index_probes);
+    STAT_ADD(tar, index_filtered, op->index_filtered);
+}
 
-    while (read(tar_fd, &header, sizeof(tar_header_t)) > 0 && header.name[0] != '\0')
+/*
+ * Starts measuring a public call on tar_fd. Public functions are thin wrappers bracketing
+ * their static *_impl() body with op_begin() and op_end(). A call made while another operation is in progress
+ * on the thread, such as is_dir() calling check_flag(), is folded into the outer one.
+ * The call is a read section: the index versions it loads stay allocated until it returns.
+ */
+static void op_begin(tar_op_t *op, int tar_fd, int id, const char *path)
+{
+    if (cur_op != NULL)
     {
-        if (strncmp(header.name, path_slash, path_len) == 0)
-        {
+        op->op = -1;
+        return;
+    }
+    memset(op, 0, sizeof(tar_op_t));
+    op->tar = tar_get(tar_fd);
+    op->op = id;
+    op->path = path;
 
-            const char *relative_path = header.name + path_len;
+    tar_trace_fn trace = (op->tar == &fd_state) ? fd_trace : op->tar->trace;
+    if (trace != NULL)
+    {
+        tar_trace_t event = {.op = id, .path = path};
+        trace(&event, (op->tar == &fd_state) ? fd_trace_arg : op->tar->trace_arg);
+    }
+    cur_op = op;
+    rcu_enter();
+    op->start = now_ns();
+}
 
-            if (strchr(relative_path, '/') == NULL ||
-                strchr(relative_path, '/') == relative_path + strlen(relative_path) - 1)
-            {
+/* Ends the call started by op_begin() and returns its result */
+static long op_end(tar_op_t *op, long result)
+{
+    if (op->op < 0)
+    {
+        return result;
+    }
+    uint64_t elapsed = now_ns() - op->start;
+    tar_t *tar = op->tar;
+    cur_op = NULL;
+    rcu_exit();
 
-                if (count < *no_entries && strcmp(path_slash, header.name) != 0)
-                {
-                    strncpy(entries[count], header.name, 100);
-                    entries[count][99] = '\0';
-                    count++;
-                }
-            }
-        }
+    op_flush(tar, op);
+    STAT_ADD(tar, ops[op->op].calls, 1);
+    STAT_ADD(tar, ops[op->op].time_ns, elapsed);
+    const tar_error_t *err = tar_err(tar, 0);
+    if (err != NULL && err->code != TAR_OK)
+    {
+        STAT_ADD(tar, ops[op->op].errors, 1);
+    }
 
-        off_t align_offset = aligned_size(header);
-        if (lseek(tar_fd, align_offset, SEEK_CUR) == -1)
-        {
-            perror("lseek failed");
-            return -3;
-        }
+    tar_trace_fn trace = (tar == &fd_state) ? fd_trace : tar->trace;
+    if (trace != NULL)
+    {
+        tar_trace_t event = {
+            .op = op->op,
+            .path = op->path,
+            .end = 1,
+            .result = result,
+            .time_ns = elapsed,
+            .headers = op->headers,
+            .bytes_read = op->bytes_read,
+        };
+        trace(&event, (tar == &fd_state) ? fd_trace_arg : tar->trace_arg);
     }
-    if (lseek(tar_fd, 0, SEEK_SET) == -1)
+    return result;
+}
+
+/* Counts an operation on the archive in the operation in progress, if any */
+#define OP_COUNT(field, n)           \
+    do                               \
+    {                                \
+        if (cur_op != NULL)          \
+        {                            \
+            cur_op->field += (n);    \
+        }                            \
+    } while (0)
+
+static ssize_t tar_read(int fd, void *buf, size_t n)
+{
+    ssize_t got = read(fd, buf, n);
+    OP_COUNT(reads, 1);
+    OP_COUNT(bytes_read, got > 0 ? got : 0);
+    return got;
+}
+
+static ssize_t tar_pread(int fd, void *buf, size_t n, off_t offset)
+{
+    ssize_t got = pread(fd, buf, n, offset);
+    OP_COUNT(reads, 1);
+    OP_COUNT(bytes_read, got > 0 ? got : 0);
+    return got;
+}
+
+static off_t tar_lseek(int fd, off_t offset, int whence)
+{
+    OP_COUNT(seeks, 1);
+    return lseek(fd, offset, whence);
+}
+
+/*
+ * A header walk seeking over the data of a large member defeats the kernel readahead, which only follows
+ * sequential reads: the next header is read synchronously after the seek. Members at least this large
+ * have their next header prefetched instead.
+ */
+#define ADVISE_SKIP_MIN  (128 << 10)
+
+/* Pages behind a scan are dropped in steps this large */
+#define ADVISE_DROP_STEP (8 << 20)
+
+/* Prefetches the header following a member of `skipped` bytes whose data a header walk seeks over */
+static void advise_skip(int fd, int advice, off_t next, size_t skipped)
+{
+    if ((advice & TAR_ADVISE_READAHEAD) && skipped >= ADVISE_SKIP_MIN)
     {
-        perror("lseek failed");
-        return -4;
+        posix_fadvise(fd, next, sizeof(tar_header_t), POSIX_FADV_WILLNEED);
     }
+}
 
-    *no_entries = count;
-    printf("no entries in list %ld\n", *no_entries);
+/* Prefetches the part of a member that a caller reading it in chunks asks for next */
+static void advise_next(int fd, int advice, off_t off, size_t len)
+{
+    if ((advice & TAR_ADVISE_READAHEAD) && len > 0)
+    {
+        readahead(fd, off, len);
+    }
+}
 
-    return count;
+/* Switches the readahead of fd to the larger window of sequential reads, or back */
+static void advise_sequential(int fd, int advice, int sequential)
+{
+    if (advice & TAR_ADVISE_READAHEAD)
+    {
+        posix_fadvise(fd, 0, 0, sequential ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_NORMAL);
+    }
 }
 
-// TODO handle symlink relative path
-char *get_symlink(int tar_fd, char *path)
+/*
+ * Drops the pages a scan left behind, from `*dropped` up to `upto`, once they span ADVISE_DROP_STEP
+ * or when the scan is done, so that scanning a large archive does not evict the rest of the page cache.
+ */
+static void advise_drop(int fd, int advice, off_t *dropped, off_t upto, int done)
 {
-    tar_header_t header;
+    if ((advice & TAR_ADVISE_DROPBEHIND) && upto > *dropped && (done || upto - *dropped >= ADVISE_DROP_STEP))
+    {
+        posix_fadvise(fd, *dropped, upto - *dropped, POSIX_FADV_DONTNEED);
+        *dropped = upto;
+    }
+}
+
+/*
+ * O_DIRECT reads must be aligned on the logical block size of the device, which this is a multiple of
+ * on common devices. A header walk over small members reads DIRECT_BATCH bytes at once, the following
+ * headers being likely in the batch, and a single block after a large member.
+ */
+#define DIRECT_ALIGN 4096
+#define DIRECT_BATCH (32 << 10)
 
-    if (lseek(tar_fd, 0, SEEK_SET) == -1)
+/*
+ * Returns the O_DIRECT descriptor of a handle's archive, opened on first use, or -1 if the handle
+ * reads through the page cache: it has no TAR_ADVISE_DIRECT flag or its file system has no O_DIRECT.
+ */
+static int direct_fd(tar_t *tar)
+{
+    if (tar == &fd_state || !(tar->advice & TAR_ADVISE_DIRECT))
     {
-        perror("fseek failed");
-        return NULL;
+        return -1;
+    }
+    int fd = __atomic_load_n(&tar->direct_fd, __ATOMIC_ACQUIRE);
+    if (fd != -1)
+    {
+        return fd < 0 ? -1 : fd;
     }
 
-    while (read(tar_fd, (void *)&header, sizeof(tar_header_t)) == sizeof(tar_header_t))
+    /* a descriptor of its own, so that the caller's descriptor keeps its flags */
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", tar->fd);
+    int opened = open(path, O_RDONLY | O_DIRECT);
+    int none = -1;
+    if (!__atomic_compare_exchange_n(&tar->direct_fd, &none, opened == -1 ? -2 : opened, 0, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE))
     {
-        if (header.name[0] == '\0')
+        /* another thread opened it meanwhile */
+        if (opened != -1)
         {
-            return NULL;
+            close(opened);
         }
-        if (strcmp(header.name, path) == 0)
+        return none < 0 ? -1 : none;
+    }
+    return opened;
+}
+
+/*
+ * Paths name the same entry when their components do: empty and "." components are ignored, and so are
+ * leading and trailing slashes. "./a/b", "a//b", "/a/b/" and "a/./b" all name "a/b". ".." is kept as is,
+ * as resolving it would need the entries the path goes through.
+ */
+
+/* Returns the next component of a path at or after `p`, setting its length, zero at the end */
+static const char *path_next(const char *p, size_t *len)
+{
+    for (;;)
+    {
+        while (*p == '/')
         {
-            if (header.linkname[0] != '\0')
-            {
-                char *symlink_target = strdup(header.linkname);
-                if (!symlink_target)
-                {
-                    perror("strdup failed");
-                    return NULL;
-                }
-                return symlink_target;
-            }
-            else
-            {
-                fprintf(stderr, "Error: not a symlink\n");
-                return NULL;
-            }
+            p++;
         }
-
-        if (lseek(tar_fd, aligned_size(header), SEEK_CUR) == -1)
+        size_t n = strcspn(p, "/");
+        if (n != 1 || p[0] != '.')
         {
-            perror("fseek failed");
-            return NULL;
+            *len = n;
+            return p;
         }
+        p++;
     }
-    if (lseek(tar_fd, 0, SEEK_SET) == -1)
+}
+
+/* Returns 1 if two paths name the same entry */
+static int path_eq(const char *a, const char *b)
+{
+    size_t a_len, b_len;
+    for (;;)
     {
-        perror("fseek failed");
-        return NULL;
+        a = path_next(a, &a_len);
+        b = path_next(b, &b_len);
+        if (a_len != b_len || memcmp(a, b, a_len) != 0)
+        {
+            return 0;
+        }
+        if (a_len == 0)
+        {
+            return 1;
+        }
+        a += a_len;
+        b += b_len;
     }
-    return NULL;
 }
 
 /**
- * Reads a file at a given path in the archive.
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it must be resolved to its linked-to entry.
- * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
- * @param dest A destination buffer to read the given file into.
- * @param len An in-out argument.
- *            The caller set it to the size of dest.
- *            The callee set it to the number of bytes written to dest.
- *
- * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
- *         -2 if the offset is outside the file total length,
- *         zero if the file was read in its entirety into the destination buffer,
- *         a positive value if the file was partially read, representing the remaining bytes left to be read to reach
- *         the end of the file.
+ * Writes the canonical form of a path: its components joined by single slashes, with a trailing slash if
+ * the path names a directory by ending with one. The path may be canonicalized in place, `out == path`.
  *
+ * @return the length of the canonical path, truncated to fit `size` bytes.
  */
-ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len)
+static size_t path_canon(const char *path, char *out, size_t size)
 {
-    tar_header_t header;
-
-    while (read(tar_fd, (void *)&header, sizeof(tar_header_t)) == sizeof(tar_header_t))
+    size_t len = strlen(path);
+    int dir = len > 0 && (path[len - 1] == '/' || (path[len - 1] == '.' && (len == 1 || path[len - 2] == '/')));
+    size_t n = 0;
+    size_t part;
+    for (const char *p = path_next(path, &part); part > 0 && n + 1 < size; p = path_next(p + part, &part))
     {
-        if (header.name[0] == '\0')
+        if (n > 0)
         {
-            break;
+            out[n++] = '/';
         }
+        size_t copy = part < size - 1 - n ? part : size - 1 - n;
+        memmove(out + n, p, copy);
+        n += copy;
+    }
+    if (dir && n > 0 && n + 1 < size)
+    {
+        out[n++] = '/';
+    }
+    if (size > 0)
+    {
+        out[n] = '\0';
+    }
+    return n;
+}
 
-        if (strcmp(header.name, path) == 0)
+/* Reads the header at the file offset of fd, returns the read() result */
+static ssize_t read_header(int fd, tar_header_t *header)
+{
+    ssize_t got = tar_read(fd, header, sizeof(tar_header_t));
+    if (got == sizeof(tar_header_t))
+    {
+        OP_COUNT(headers, 1);
+        long skipped = aligned_size(*header);
+        if (skipped >= ADVISE_SKIP_MIN)
         {
+            advise_skip(fd, tar_get(fd)->advice, tar_lseek(fd, 0, SEEK_CUR) + skipped, skipped);
+        }
+    }
+    return got;
+}
 
-            if (header.typeflag == SYMTYPE)
-            {
-                char *new_path = header.linkname;
-                if (lseek(tar_fd, 0, SEEK_SET) == -1)
-                {
-                    perror("lseek failed");
-                    return -3;
-                }
-                return read_file(tar_fd, new_path, offset, dest, len);
-            }
-            else if (header.typeflag != REGTYPE && header.typeflag != AREGTYPE)
-            {
-                return -1;
-            }
-
-            size_t file_size = strtol(header.size, NULL, 8);
-
-            if (offset >= file_size)
-            {
-                return -2;
-            }
-
-            if (lseek(tar_fd, offset, SEEK_CUR) == -1)
-            {
-                perror("fseek failed");
-                return -3;
-            }
+static int check_archive_impl(int tar_fd)
+{
+    tar_t *tar = tar_begin(tar_fd);
+    tar_header_t header;
+    int valid_arch;
+    int nheader = 0;
+    off_t offset = 0, dropped = 0;
 
-            size_t data_len = file_size - offset;
-            if (*len < data_len)
-            {
-                data_len = *len;
-            }
-            ssize_t bytes_read = read(tar_fd, dest, data_len);
-            if (bytes_read == -1)
+    if (direct_fd(tar) >= 0)
+    {
+        return check_direct(tar, tar_fd);
+    }
+    while (read_header(tar_fd, &header) == sizeof(tar_header_t))
+    {
+        valid_arch = tar->check(&header, nheader);
+        if (valid_arch != 0)
+        {
+            advise_drop(tar_fd, tar->advice, &dropped, offset, 1);
+            if (valid_arch < 0)
             {
-                perror("read failed");
-                return -3;
+                fail_header(tar, __func__, valid_arch, nheader, tar_lseek(tar_fd, 0, SEEK_CUR) - sizeof(tar_header_t));
             }
-            *len = bytes_read;
-            return file_size - offset - bytes_read;
+            return valid_arch;
         }
+        nheader++;
 
-        if (lseek(tar_fd, aligned_size(header), SEEK_CUR) == -1)
+        if (tar_lseek(tar_fd, aligned_size(header), SEEK_CUR) == -1)
         {
-            perror("fseek failed");
+            TAR_FAIL(tar, TAR_EIO, nheader - 1, -1, NULL);
             return -3;
         }
+        offset += sizeof(tar_header_t) + aligned_size(header);
+        advise_drop(tar_fd, tar->advice, &dropped, offset, 0);
     }
-    if (lseek(tar_fd, 0, SEEK_SET) == -1)
+    advise_drop(tar_fd, tar->advice, &dropped, offset, 1);
+    if (tar_lseek(tar_fd, 0, SEEK_SET) == -1)
     {
-        perror("fseek failed");
+        TAR_FAIL(tar, TAR_EIO, -1, 0, NULL);
         return -3;
     }
-    return -1;
+    return nheader;
+}
+
+/**
+ * Checks whether the archive is valid.
+ *
+ * Each non-null header of a valid archive has:
+ *  - a magic value of "ustar" and a null,
+ *  - a version value of "00" and no null,
+ *  - a correct checksum
+ *
+ * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ *
+ * @return a zero or positive value if the archive is valid, representing the number of non-null headers in the archive,
+ *         -1 if the archive contains a header with an invalid magic value,
+ *         -2 if the archive contains a header with an invalid version value,
+ *         -3 if the archive contains a header with an invalid checksum value
+ */
+int check_archive(int tar_fd)
+{
+    tar_op_t op;
+    op_begin(&op, tar_fd, TAR_OP_CHECK, NULL);
+    return op_end(&op, check_archive_impl(tar_fd));
+}
+
+/**
+ * Validates a tar archive header.
+ *
+ * Checks the header's `magic`, `version`, and checksum for validity.
+ * Returns the header index if `magic` is empty, signaling the end of the archive.
+ *
+ * @param header The tar header to validate.
+ * @param nheader The current header index in the archive.
+ *
+ * @return `nheader` if `magic` is empty, 0 if valid,
+ *         -1 for invalid `magic`, -2 for invalid `version`, -3 for invalid checksum.
+ */
+int valid_archive(tar_header_t header, int nheader)
+{
+    return check_ustar(&header, nheader);
+}
+
+/**
+ * Computes the aligned size of a file in a tar archive.
+ *
+ * @param header A tar header structure containing metadata about the file, including its size in octal format.
+ *
+ * @return The aligned size of the file, in bytes.
+ */
+long aligned_size(tar_header_t header)
+{
+    unsigned int size = strtol(header.size, NULL, 8);
+    return (size % 512 == 0) ? size : size + (512 - (size % 512));
+}
+
+/**
+ * Validates the checksum of a TAR archive header.
+ *
+ * @param header A tar_header_t structure representing a single header of the TAR archive.
+ *
+ * @return 1 if the calculated checksum matches the stored checksum, indicating the header is valid.
+ *         0 if the calculated checksum does not match the stored checksum, indicating the header is invalid.
+ *
+ */
+int check_sum(tar_header_t header)
+{
+    unsigned char *header_bytes = (unsigned char *)&header;
+    unsigned int checksum = strtol(header.chksum, NULL, 8);
+    unsigned int sum = 0;
+
+    for (size_t i = 0; i < sizeof(tar_header_t); i++)
+    {
+        if (i >= 148 && i <= 155)
+        {
+            sum += ' ';
+        }
+        else
+        {
+            sum += header_bytes[i];
+        }
+    }
+    return (sum == checksum);
+}
+
+static int exists_impl(int tar_fd, char *path)
+{
+    tar_t *tar = tar_begin(tar_fd);
+    tar_header_t header;
+    tar_entry_t entry;
+
+    int found = index_find(tar, path, &entry);
+    if (found >= 0)
+    {
+        return found;
+    }
+
+    while (read_header(tar_fd, &header) == sizeof(tar_header_t))
+    {
+
+        if (header.name[0] == '\0')
+        {
+            return 0;
+        }
+        else if (path_eq(header.name, path))
+        {
+            return 1;
+        }
+
+        if (tar_lseek(tar_fd, aligned_size(header), SEEK_CUR) == -1)
+        {
+            TAR_FAIL(tar, TAR_EIO, -1, -1, NULL);
+            return -3;
+        }
+    }
+    if (tar_lseek(tar_fd, 0, SEEK_SET) == -1)
+    {
+        TAR_FAIL(tar, TAR_EIO, -1, 0, NULL);
+        return -3;
+    }
+
+    return 0;
+}
+
+/**
+ * Checks whether an entry exists in the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int exists(int tar_fd, char *path)
+{
+    tar_op_t op;
+    op_begin(&op, tar_fd, TAR_OP_EXISTS, path);
+    return op_end(&op, exists_impl(tar_fd, path));
+}
+
+static int check_flag_impl(int tar_fd, char *path, char typeflag)
+{
+    tar_t *tar = tar_begin(tar_fd);
+    tar_header_t header;
+    tar_entry_t entry;
+
+    int found = index_find(tar, path, &entry);
+    if (found == 0)
+    {
+        return 0;
+    }
+    if (found == 1)
+    {
+        return entry.typeflag == typeflag || (typeflag == REGTYPE && entry.typeflag == AREGTYPE);
+    }
+    if (tar_lseek(tar_fd, 0, SEEK_SET) == -1)
+    {
+        TAR_FAIL(tar, TAR_EIO, -1, 0, NULL);
+        return -1;
+    }
+
+    while (read_header(tar_fd, &header) == sizeof(tar_header_t))
+    {
+
+        if (header.name[0] == '\0')
+        {
+            return 0;
+        }
+        if (path_eq(header.name, path))
+        {
+
+            if (typeflag == REGTYPE && ((header.typeflag == REGTYPE) || (header.typeflag == AREGTYPE)))
+            {
+                return 1;
+            }
+            if (header.typeflag == typeflag)
+            {
+                return 1;
+            }
+            return 0;
+        }
+
+        if (tar_lseek(tar_fd, aligned_size(header), SEEK_CUR) == -1)
+        {
+            TAR_FAIL(tar, TAR_EIO, -1, -1, NULL);
+            return -3;
+        }
+    }
+    if (tar_lseek(tar_fd, 0, SEEK_SET) == -1)
+    {
+        TAR_FAIL(tar, TAR_EIO, -1, 0, NULL);
+        return -3;
+    }
+    return 0;
+}
+
+/**
+ * Checks whether an entry in the archive matches the specified typeflag.
+ *
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ * @param typeflag The typeflag to check against.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not the flag,
+ *         any other value otherwise.
+ */
+int check_flag(int tar_fd, char *path, char typeflag)
+{
+    tar_op_t op;
+    op_begin(&op, tar_fd, TAR_OP_FLAG, path);
+    return op_end(&op, check_flag_impl(tar_fd, path, typeflag));
+}
+
+/**
+ * Checks whether an entry exists in the archive and is a directory.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a directory,
+ *         any other value otherwise.
+ */
+int is_dir(int tar_fd, char *path)
+{
+    return check_flag(tar_fd, path, DIRTYPE);
+}
+
+/**
+ * Checks whether an entry exists in the archive and is a file.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a file,
+ *         any other value otherwise.
+ */
+int is_file(int tar_fd, char *path)
+{
+    return check_flag(tar_fd, path, REGTYPE);
+}
+
+/**
+ * Checks whether an entry exists in the archive and is a symlink.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ * @return zero if no entry at the given path exists in the archive or the entry is not symlink,
+ *         any other value otherwise.
+ */
+int is_symlink(int tar_fd, char *path)
+{
+    return check_flag(tar_fd, path, SYMTYPE);
+}
+
+static int list_impl(int tar_fd, char *path, char **entries, size_t *no_entries)
+{
+    tar_t *tar = tar_begin(tar_fd);
+    tar_header_t header;
+    size_t count = 0;
+
+    if (path == NULL || entries == NULL || no_entries == NULL || tar_fd < 0 || path[0] == '\0')
+    {
+        TAR_FAIL(tar, TAR_EINVAL, -1, -1, NULL);
+        return -1;
+    }
+
+    if (__atomic_load_n(&tar->index, __ATOMIC_ACQUIRE) != NULL)
+    {
+        /* the index also holds the directories implied by the paths of their members */
+        tar_list_t *children;
+        int ret = tar_list_impl(tar_fd, path, &children);
+        if (ret <= 0)
+        {
+            *no_entries = 0;
+            return ret;
+        }
+        size_t n = children->count < *no_entries ? children->count : *no_entries;
+        for (size_t i = 0; i < n; i++)
+        {
+            strncpy(entries[i], children->pool + children->offsets[i], 100);
+            entries[i][99] = '\0';
+        }
+        tar_list_free(children);
+        *no_entries = n;
+        return n;
+    }
+
+    char path_slash[TAR_NAME_MAX + 1];
+    size_t path_len = path_canon(path, path_slash, sizeof(path_slash) - 1);
+    if (path_len == 0)
+    {
+        TAR_FAIL(tar, TAR_EINVAL, -1, -1, NULL);
+        return -1;
+    }
+
+    /* symlinks are resolved relative to their directory, with the hop limit of tar_list() */
+    for (int hops = 0;; hops++)
+    {
+        if (tar_lseek(tar_fd, 0, SEEK_SET) == -1)
+        {
+            TAR_FAIL(tar, TAR_EIO, -1, 0, NULL);
+            return -3;
+        }
+        if (path_len > 1 && path_slash[path_len - 1] == '/')
+        {
+            path_slash[--path_len] = '\0';
+        }
+        if (!is_symlink(tar_fd, path_slash))
+        {
+            break;
+        }
+        char *linkname = get_symlink(tar_fd, path_slash);
+        if (linkname == NULL || hops == 7)
+        {
+            free(linkname);
+            *no_entries = 0;
+            return 0;
+        }
+        char target[TAR_NAME_MAX];
+        link_target(path_slash, linkname, target, sizeof(target));
+        free(linkname);
+        path_len = path_canon(target, path_slash, sizeof(path_slash) - 1);
+        if (path_len == 0)
+        {
+            *no_entries = 0;
+            return 0;
+        }
+    }
+    if (path_slash[path_len - 1] != '/')
+    {
+        path_slash[path_len++] = '/';
+        path_slash[path_len] = '\0';
+    }
+
+    if (tar_lseek(tar_fd, 0, SEEK_SET) == -1)
+    {
+        TAR_FAIL(tar, TAR_EIO, -1, 0, NULL);
+        return -3;
+    }
+    if (!is_dir(tar_fd, path_slash))
+    {
+        *no_entries = 0;
+        return 0;
+    }
+
+    while (read_header(tar_fd, &header) > 0 && header.name[0] != '\0')
+    {
+        char name[sizeof(header.name) + 1];
+        snprintf(name, sizeof(name), "%.*s", (int)sizeof(header.name), header.name);
+        path_canon(name, name, sizeof(name));
+        if (strncmp(name, path_slash, path_len) == 0)
+        {
+
+            const char *relative_path = name + path_len;
+
+            if (strchr(relative_path, '/') == NULL ||
+                strchr(relative_path, '/') == relative_path + strlen(relative_path) - 1)
+            {
+
+                if (count < *no_entries && strcmp(path_slash, name) != 0)
+                {
+                    snprintf(entries[count], 100, "%.99s", name);
+                    count++;
+                }
+            }
+        }
+
+        off_t align_offset = aligned_size(header);
+        if (tar_lseek(tar_fd, align_offset, SEEK_CUR) == -1)
+        {
+            TAR_FAIL(tar, TAR_EIO, -1, -1, NULL);
+            return -3;
+        }
+    }
+    if (tar_lseek(tar_fd, 0, SEEK_SET) == -1)
+    {
+        TAR_FAIL(tar, TAR_EIO, -1, 0, NULL);
+        return -4;
+    }
+
+    *no_entries = count;
+
+    return count;
+}
+
+/**
+ * Lists the entries at a given path in the archive.
+ * list() does not recurse into the directories listed at the given path.
+ *
+ * Example:
+ *  dir/          list(..., "dir/", ...) lists "dir/a", "dir/b", "dir/c/" and "dir/e/"
+ *   ├── a
+ *   ├── b
+ *   ├── c/
+ *   │   └── d
+ *   └── e/
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive. If the entry is a symlink, it must be resolved to its linked-to entry,
+ *             relative to the directory containing it.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ * @param no_entries An in-out argument.
+ *                   The caller sets it to the number of entries in `entries`.
+ *                   The callee sets it to the number of entries listed.
+ *
+ * @return 0 if no directory at the given path exists in the archive,
+ *         a positive number for the number of entries listed,
+ *         or a negative value for an error.
+ */
+int list(int tar_fd, char *path, char **entries, size_t *no_entries)
+{
+    tar_op_t op;
+    op_begin(&op, tar_fd, TAR_OP_LIST, path);
+    return op_end(&op, list_impl(tar_fd, path, entries, no_entries));
+}
+
+static char *get_symlink_impl(int tar_fd, char *path)
+{
+    tar_t *tar = tar_begin(tar_fd);
+    tar_header_t header;
+    tar_entry_t entry;
+
+    int found = index_find(tar, path, &entry);
+    if (found == 0)
+    {
+        TAR_FAIL(tar, TAR_ENOENT, -1, -1, NULL);
+        return NULL;
+    }
+    if (found == 1)
+    {
+        if (entry.linkname[0] == '\0')
+        {
+            TAR_FAIL(tar, TAR_ETYPE, -1, entry.offset, "linkname");
+            return NULL;
+        }
+        char *symlink_target = strdup(entry.linkname);
+        if (!symlink_target)
+        {
+            TAR_FAIL(tar, TAR_ENOMEM, -1, -1, NULL);
+        }
+        return symlink_target;
+    }
+
+    if (tar_lseek(tar_fd, 0, SEEK_SET) == -1)
+    {
+        TAR_FAIL(tar, TAR_EIO, -1, 0, NULL);
+        return NULL;
+    }
+
+    while (read_header(tar_fd, &header) == sizeof(tar_header_t))
+    {
+        if (header.name[0] == '\0')
+        {
+            TAR_FAIL(tar, TAR_ENOENT, -1, -1, NULL);
+            return NULL;
+        }
+        if (path_eq(header.name, path))
+        {
+            if (header.linkname[0] != '\0')
+            {
+                char *symlink_target = strdup(header.linkname);
+                if (!symlink_target)
+                {
+                    TAR_FAIL(tar, TAR_ENOMEM, -1, -1, NULL);
+                    return NULL;
+                }
+                return symlink_target;
+            }
+            else
+            {
+                TAR_FAIL(tar, TAR_ETYPE, -1, tar_lseek(tar_fd, 0, SEEK_CUR) - sizeof(tar_header_t), "linkname");
+                return NULL;
+            }
+        }
+
+        if (tar_lseek(tar_fd, aligned_size(header), SEEK_CUR) == -1)
+        {
+            TAR_FAIL(tar, TAR_EIO, -1, -1, NULL);
+            return NULL;
+        }
+    }
+    if (tar_lseek(tar_fd, 0, SEEK_SET) == -1)
+    {
+        TAR_FAIL(tar, TAR_EIO, -1, 0, NULL);
+        return NULL;
+    }
+    TAR_FAIL(tar, TAR_ENOENT, -1, -1, NULL);
+    return NULL;
+}
+
+char *get_symlink(int tar_fd, char *path)
+{
+    tar_op_t op;
+    op_begin(&op, tar_fd, TAR_OP_SYMLINK, path);
+    char *target = get_symlink_impl(tar_fd, path);
+    op_end(&op, target == NULL ? -1 : 0);
+    return target;
+}
+
+/* Links read_file() follows before taking the chain for a cycle, as tar_list() */
+#define READ_HOPS 8
+
+/* read_file() of the target of a link, hops being the number of links followed so far */
+static ssize_t read_file_impl(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len, int hops);
+
+/*
+ * read_file() of an entry found in the index, whose data is read without moving the file offset.
+ * A symlink is resolved relative to its directory, as list() does. A hard link aliasing its target is
+ * read like the target, one that is not an alias is resolved by name.
+ */
+static ssize_t read_indexed(tar_t *tar, const tar_entry_t *entry, size_t offset, uint8_t *dest, size_t *len, int hops)
+{
+    if (entry->typeflag == SYMTYPE || (entry->typeflag == LNKTYPE && entry->size == 0))
+    {
+        if (hops == READ_HOPS)
+        {
+            TAR_FAIL(tar, TAR_ENOENT, -1, entry->offset, "linkname");
+            return -1;
+        }
+        char target[TAR_NAME_MAX];
+        if (entry->typeflag == SYMTYPE)
+        {
+            link_target(entry->name, entry->linkname, target, sizeof(target));
+        }
+        else
+        {
+            snprintf(target, sizeof(target), "%s", entry->linkname);
+        }
+        return read_file_impl(tar->fd, target, offset, dest, len, hops + 1);
+    }
+    if (entry->typeflag != REGTYPE && entry->typeflag != AREGTYPE && entry->typeflag != LNKTYPE)
+    {
+        TAR_FAIL(tar, TAR_ETYPE, -1, entry->offset, "typeflag");
+        return -1;
+    }
+    if (offset >= entry->size)
+    {
+        TAR_FAIL(tar, TAR_ERANGE, -1, entry->offset, "size");
+        return -2;
+    }
+
+    size_t data_len = entry->size - offset;
+    if (*len < data_len)
+    {
+        data_len = *len;
+    }
+    off_t data_off = entry->offset + sizeof(tar_header_t) + offset;
+    ssize_t bytes_read = tar_pread(tar->fd, dest, data_len, data_off);
+    if (bytes_read == -1)
+    {
+        TAR_FAIL(tar, TAR_EIO, -1, entry->offset, NULL);
+        return -3;
+    }
+    *len = bytes_read;
+    size_t rest = entry->size - offset - bytes_read;
+    advise_next(tar->fd, tar->advice, data_off + bytes_read, rest < data_len ? rest : data_len);
+    return rest;
+}
+
+static ssize_t read_file_impl(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len, int hops)
+{
+    tar_t *tar = tar_begin(tar_fd);
+    tar_header_t header;
+    tar_entry_t entry;
+
+    int found = index_find(tar, path, &entry);
+    if (found == 0)
+    {
+        TAR_FAIL(tar, TAR_ENOENT, -1, -1, NULL);
+        return -1;
+    }
+    if (found == 1)
+    {
+        return read_indexed(tar, &entry, offset, dest, len, hops);
+    }
+
+    while (read_header(tar_fd, &header) == sizeof(tar_header_t))
+    {
+        if (header.name[0] == '\0')
+        {
+            break;
+        }
+
+        if (path_eq(header.name, path))
+        {
+
+            /* hard links name their target by its full path, symlinks relative to their directory */
+            if (header.typeflag == SYMTYPE || header.typeflag == LNKTYPE)
+            {
+                char linkname[TAR_NAME_MAX];
+                snprintf(linkname, sizeof(linkname), "%.*s", (int)sizeof(header.linkname), header.linkname);
+                if (header.typeflag == SYMTYPE)
+                {
+                    char target[TAR_NAME_MAX];
+                    snprintf(target, sizeof(target), "%s", linkname);
+                    link_target(path, target, linkname, sizeof(linkname));
+                }
+                if (hops == READ_HOPS)
+                {
+                    TAR_FAIL(tar, TAR_ENOENT, -1, tar_lseek(tar_fd, 0, SEEK_CUR) - sizeof(tar_header_t), "linkname");
+                    return -1;
+                }
+                if (tar_lseek(tar_fd, 0, SEEK_SET) == -1)
+                {
+                    TAR_FAIL(tar, TAR_EIO, -1, 0, NULL);
+                    return -3;
+                }
+                return read_file_impl(tar_fd, linkname, offset, dest, len, hops + 1);
+            }
+            else if (header.typeflag != REGTYPE && header.typeflag != AREGTYPE)
+            {
+                TAR_FAIL(tar, TAR_ETYPE, -1, tar_lseek(tar_fd, 0, SEEK_CUR) - sizeof(tar_header_t), "typeflag");
+                return -1;
+            }
+
+            size_t file_size = strtol(header.size, NULL, 8);
+
+            if (offset >= file_size)
+            {
+                TAR_FAIL(tar, TAR_ERANGE, -1, tar_lseek(tar_fd, 0, SEEK_CUR) - sizeof(tar_header_t), "size");
+                return -2;
+            }
+
+            if (tar_lseek(tar_fd, offset, SEEK_CUR) == -1)
+            {
+                TAR_FAIL(tar, TAR_EIO, -1, -1, NULL);
+                return -3;
+            }
+
+            size_t data_len = file_size - offset;
+            if (*len < data_len)
+            {
+                data_len = *len;
+            }
+            ssize_t bytes_read = tar_read(tar_fd, dest, data_len);
+            if (bytes_read == -1)
+            {
+                TAR_FAIL(tar, TAR_EIO, -1, -1, NULL);
+                return -3;
+            }
+            *len = bytes_read;
+            size_t rest = file_size - offset - bytes_read;
+            if (rest > 0)
+            {
+                advise_next(tar_fd, tar->advice, tar_lseek(tar_fd, 0, SEEK_CUR), rest < data_len ? rest : data_len);
+            }
+            return rest;
+        }
+
+        if (tar_lseek(tar_fd, aligned_size(header), SEEK_CUR) == -1)
+        {
+            TAR_FAIL(tar, TAR_EIO, -1, -1, NULL);
+            return -3;
+        }
+    }
+    if (tar_lseek(tar_fd, 0, SEEK_SET) == -1)
+    {
+        TAR_FAIL(tar, TAR_EIO, -1, 0, NULL);
+        return -3;
+    }
+    TAR_FAIL(tar, TAR_ENOENT, -1, -1, NULL);
+    return -1;
+}
+
+/**
+ * Reads a file at a given path in the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it must be resolved to its linked-to entry,
+ *             relative to the directory containing it. A hard link is read as the member it links to.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return -1 if no entry at the given path exists in the archive, the entry is not a file
+ *         or its links form a cycle,
+ *         -2 if the offset is outside the file total length,
+ *         zero if the file was read in its entirety into the destination buffer,
+ *         a positive value if the file was partially read, representing the remaining bytes left to be read to reach
+ *         the end of the file.
+ *
+ */
+ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len)
+{
+    tar_op_t op;
+    op_begin(&op, tar_fd, TAR_OP_READ, path);
+    return op_end(&op, read_file_impl(tar_fd, path, offset, dest, len, 0));
+}
+
+/* Largest GNU or pax extension header payload decoded, bigger ones are skipped */
+#define ITER_EXT_MAX (1 << 20)
+
+/* Headers read ahead of a scan by a thread, defined with the iterator below */
+typedef struct header_pipe header_pipe_t;
+
+/**
+ * State of a sequential scan over the headers of an archive.
+ * Headers are read with pread() so the scan leaves the file offset untouched.
+ * GNU long name and pax extension headers are folded into the entry that follows them,
+ * whose name is put in canonical form by path_canon().
+ */
+typedef struct tar_iter
+{
+    int fd;
+    off_t next;                   /* offset of the next header to read */
+    tar_header_t header;
+    tar_entry_t entry;
+    char name[TAR_NAME_MAX];
+    char linkname[sizeof(((tar_header_t *)0)->linkname) + 1];
+    char *long_name;              /* path given by extension headers, overrides name */
+    char *long_link;              /* link target given by extension headers, overrides linkname */
+    int advice;
+    off_t dropped;                /* pages before this offset were dropped by advise_drop() */
+    int direct_fd;                /* direct_fd() of the handle, -1 to read through the page cache */
+    off_t direct_start;           /* archive offset of the blocks held in direct_buf */
+    size_t direct_len;
+    off_t direct_prev;            /* offset of the previous header read from direct_fd */
+    uint8_t direct_buf[DIRECT_BATCH + DIRECT_ALIGN];
+    header_pipe_t *pipe;          /* headers read ahead by pipe_start(), NULL to read them in the scan */
+    header_check_fn check;        /* policy of the handle, which tells where the archive ends */
+} tar_iter_t;
+
+static void iter_init(tar_iter_t *it, int tar_fd)
+{
+    tar_t *tar = tar_get(tar_fd);
+    it->fd = tar_fd;
+    it->next = 0;
+    it->advice = tar->advice;
+    it->check = tar->check;
+    it->dropped = 0;
+    it->direct_fd = direct_fd(tar);
+    it->direct_start = 0;
+    it->direct_len = 0;
+    it->direct_prev = 0;
+    it->pipe = NULL;
+    it->entry.name = it->name;
+    it->entry.linkname = it->linkname;
+    it->long_name = NULL;
+    it->long_link = NULL;
+}
+
+/* Releases the extension strings of the current entry */
+static void iter_free(tar_iter_t *it)
+{
+    free(it->long_name);
+    free(it->long_link);
+    it->long_name = NULL;
+    it->long_link = NULL;
+}
+
+static int is_extension(char typeflag)
+{
+    return typeflag == XHDTYPE || typeflag == XGLTYPE || typeflag == GNUTYPE_LONGNAME || typeflag == GNUTYPE_LONGLINK;
+}
+
+/* Replaces an extension string, keeping the previous one if memory ran out */
+static void iter_set(char **dst, const char *value, size_t len)
+{
+    char *copy = strndup(value, len);
+    if (copy != NULL)
+    {
+        free(*dst);
+        *dst = copy;
+    }
+}
+
+/**
+ * Records the path and link target carried by the data of an extension header,
+ * to be applied to the entry that follows it. Global pax headers are ignored.
+ */
+static void iter_extension(tar_iter_t *it, char typeflag, const char *data, size_t size)
+{
+    if (typeflag == GNUTYPE_LONGNAME)
+    {
+        iter_set(&it->long_name, data, size);
+        return;
+    }
+    if (typeflag == GNUTYPE_LONGLINK)
+    {
+        iter_set(&it->long_link, data, size);
+        return;
+    }
+    if (typeflag != XHDTYPE)
+    {
+        return;
+    }
+
+    /* pax records are "<length> <key>=<value>\n", length counting the whole record */
+    const char *p = data;
+    const char *end = data + size;
+    while (p < end)
+    {
+        char *key;
+        long len = strtol(p, &key, 10);
+        if (len <= 0 || len > end - p || *key != ' ')
+        {
+            break;
+        }
+        key++;
+        const char *record_end = p + len;
+        const char *eq = memchr(key, '=', record_end - key);
+        if (eq != NULL && record_end[-1] == '\n')
+        {
+            size_t key_len = eq - key;
+            size_t value_len = record_end - 1 - (eq + 1);
+            if (key_len == 4 && memcmp(key, "path", 4) == 0)
+            {
+                iter_set(&it->long_name, eq + 1, value_len);
+            }
+            else if (key_len == 8 && memcmp(key, "linkpath", 8) == 0)
+            {
+                iter_set(&it->long_link, eq + 1, value_len);
+            }
+        }
+        p = record_end;
+    }
+}
+
+/* Fills `it->entry` from the header read at `it->next` and moves past its data */
+static void iter_decode(tar_iter_t *it)
+{
+    if (it->header.prefix[0] != '\0')
+    {
+        snprintf(it->name, sizeof(it->name), "%.*s/%.*s",
+                 (int)sizeof(it->header.prefix), it->header.prefix,
+                 (int)sizeof(it->header.name), it->header.name);
+    }
+    else
+    {
+        snprintf(it->name, sizeof(it->name), "%.*s", (int)sizeof(it->header.name), it->header.name);
+    }
+    snprintf(it->linkname, sizeof(it->linkname), "%.*s", (int)sizeof(it->header.linkname), it->header.linkname);
+
+    char *name = it->long_name ? it->long_name : it->name;
+    path_canon(name, name, strlen(name) + 1);
+    it->entry.name = name;
+    it->entry.linkname = it->long_link ? it->long_link : it->linkname;
+    it->entry.typeflag = it->header.typeflag;
+    it->entry.size = TAR_INT(it->header.size);
+    it->entry.offset = it->next;
+    it->next += sizeof(tar_header_t) + aligned_size(it->header);
+}
+
+/* Bytes read at once by the thread of a header pipe over small members, as DIRECT_BATCH */
+#define PIPE_WINDOW (64 << 10)
+
+/* A header read ahead by the thread of a header pipe */
+typedef struct pipe_slot
+{
+    off_t offset;
+    ssize_t n;                    /* bytes of the header read, less at the end of the file, -1 on a read error */
+    tar_header_t header;
+} pipe_slot_t;
+
+/*
+ * Header discovery is serial, the offset of a header being known from the size in the previous one.
+ * A header pipe runs the chain of reads on a thread of its own, which reads the next header as soon as
+ * it found its offset, while the scan validates and processes the previous ones. Up to `depth` headers
+ * wait for the scan, so the reads never stall on the scan and the scan only waits on I/O it could not overlap.
+ */
+struct header_pipe
+{
+    int fd;
+    off_t next;                   /* offset of the next header read by the thread */
+    pipe_slot_t *slots;           /* header i is in slot i % depth */
+    size_t depth;
+    size_t produced;
+    size_t consumed;
+    int stop;                     /* set by the scan to end the thread */
+    int done;                     /* set by the thread once it read the last header */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    uint8_t *buf;                 /* PIPE_WINDOW bytes, aligned for an O_DIRECT descriptor */
+    off_t buf_start;
+    size_t buf_len;
+    tar_op_t counted;             /* reads of the thread, added to the scan when the pipe stops */
+};
+
+/* Reads the header at `off` into `slot`, from the window of the archive read last when it holds it */
+static void pipe_read(header_pipe_t *p, off_t off, off_t prev, pipe_slot_t *slot)
+{
+    slot->offset = off;
+    if (off < p->buf_start || off + sizeof(tar_header_t) > p->buf_start + p->buf_len)
+    {
+        off_t start = off & ~(off_t)(DIRECT_ALIGN - 1);
+        ssize_t n = tar_pread(p->fd, p->buf, off - prev <= PIPE_WINDOW ? PIPE_WINDOW : DIRECT_ALIGN, start);
+        p->buf_start = start;
+        p->buf_len = n > 0 ? n : 0;
+        if (n == -1)
+        {
+            slot->n = -1;
+            return;
+        }
+    }
+    off_t end = p->buf_start + p->buf_len;
+    slot->n = off >= end ? 0 : end - off < (off_t)sizeof(tar_header_t) ? end - off : (off_t)sizeof(tar_header_t);
+    memcpy(&slot->header, p->buf + (off - p->buf_start), slot->n);
+}
+
+static void *pipe_thread(void *arg)
+{
+    header_pipe_t *p = arg;
+    cur_op = &p->counted;
+    off_t prev = p->next;
+
+    for (int last = 0; !last;)
+    {
+        pthread_mutex_lock(&p->lock);
+        while (!p->stop && p->produced - p->consumed == p->depth)
+        {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        int stop = p->stop;
+        pthread_mutex_unlock(&p->lock);
+        if (stop)
+        {
+            break;
+        }
+
+        pipe_slot_t slot;
+        off_t off = p->next;
+        pipe_read(p, off, prev, &slot);
+        prev = off;
+        last = slot.n != sizeof(tar_header_t) || slot.header.name[0] == '\0';
+        if (!last)
+        {
+            p->next = off + sizeof(tar_header_t) + aligned_size(slot.header);
+        }
+
+        pthread_mutex_lock(&p->lock);
+        p->slots[p->produced % p->depth] = slot;
+        p->produced++;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->done = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    cur_op = NULL;
+    return NULL;
+}
+
+/**
+ * Starts reading the headers of the archive ahead of an iterator, from its next header on.
+ * The pipe reads from the O_DIRECT descriptor of the iterator if it has one.
+ *
+ * @return 0 on success, -1 if the thread could not be started, the iterator then reads its headers itself.
+ */
+static int pipe_start(header_pipe_t *p, tar_iter_t *it, size_t depth)
+{
+    memset(p, 0, sizeof(header_pipe_t));
+    p->fd = it->direct_fd >= 0 ? it->direct_fd : it->fd;
+    p->next = it->next;
+    p->depth = depth;
+    p->counted.op = -1;
+    p->slots = malloc(depth * sizeof(pipe_slot_t));
+    p->buf = aligned_alloc(DIRECT_ALIGN, PIPE_WINDOW);
+    if (p->slots == NULL || p->buf == NULL)
+    {
+        free(p->slots);
+        free(p->buf);
+        return -1;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    if (pthread_create(&p->thread, NULL, pipe_thread, p) != 0)
+    {
+        pthread_mutex_destroy(&p->lock);
+        pthread_cond_destroy(&p->cond);
+        free(p->slots);
+        free(p->buf);
+        return -1;
+    }
+    it->pipe = p;
+    return 0;
+}
+
+/* Stops the thread of a pipe, whatever it read ahead being dropped, and counts its reads in the scan */
+static void pipe_stop(header_pipe_t *p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+
+    OP_COUNT(reads, p->counted.reads);
+    OP_COUNT(bytes_read, p->counted.bytes_read);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+    free(p->slots);
+    free(p->buf);
+}
+
+/**
+ * Takes the header at `off` from a pipe, waiting for its thread to read it.
+ *
+ * @return as iter_header(), -2 if the pipe does not hold that header.
+ */
+static ssize_t pipe_take(header_pipe_t *p, off_t off, tar_header_t *header)
+{
+    pthread_mutex_lock(&p->lock);
+    while (p->produced == p->consumed && !p->done)
+    {
+        pthread_cond_wait(&p->cond, &p->lock);
+    }
+    ssize_t n = -2;
+    if (p->produced != p->consumed && p->slots[p->consumed % p->depth].offset == off)
+    {
+        pipe_slot_t *slot = &p->slots[p->consumed % p->depth];
+        n = slot->n;
+        if (n > 0)
+        {
+            memcpy(header, &slot->header, n);
+        }
+        p->consumed++;
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return n;
+}
+
+/**
+ * Reads the header at `off` into `it->header`, from the pipe reading ahead of the scan if it has one.
+ * With an O_DIRECT descriptor, only the aligned blocks holding headers are read, bypassing the page cache,
+ * and headers found in the blocks already read cost no I/O.
+ *
+ * @return the size of a header if it was read, less at the end of the file, -1 on a read error.
+ */
+static ssize_t iter_header(tar_iter_t *it, off_t off)
+{
+    if (it->pipe != NULL)
+    {
+        ssize_t n = pipe_take(it->pipe, off, &it->header);
+        if (n != -2)
+        {
+            return n;
+        }
+        /* the scan left the chain of headers read ahead */
+        it->pipe = NULL;
+    }
+    if (it->direct_fd < 0)
+    {
+        return tar_pread(it->fd, &it->header, sizeof(tar_header_t), off);
+    }
+
+    uint8_t *buf = (uint8_t *)(((uintptr_t)it->direct_buf + DIRECT_ALIGN - 1) & ~(uintptr_t)(DIRECT_ALIGN - 1));
+    if (off < it->direct_start || off + sizeof(tar_header_t) > it->direct_start + it->direct_len)
+    {
+        off_t start = off & ~(off_t)(DIRECT_ALIGN - 1);
+        size_t want = off - it->direct_prev <= DIRECT_BATCH ? DIRECT_BATCH : DIRECT_ALIGN;
+        ssize_t n = tar_pread(it->direct_fd, buf, want, start);
+        if (n == -1)
+        {
+            return -1;
+        }
+        it->direct_start = start;
+        it->direct_len = n;
+    }
+    it->direct_prev = off;
+
+    /* short at the end of the file */
+    off_t end = it->direct_start + it->direct_len;
+    size_t n = off >= end ? 0 : end - off < (off_t)sizeof(tar_header_t) ? (size_t)(end - off) : sizeof(tar_header_t);
+    memcpy(&it->header, buf + (off - it->direct_start), n);
+    return n;
+}
+
+/**
+ * Reads the next header of the archive and fills `it->entry` from it.
+ *
+ * The archive ends at an empty block, or where scan_check() ends it.
+ *
+ * @return 1 if an entry was read, 0 at the end of the archive, -3 on a read error or if memory ran out.
+ */
+static int iter_next(tar_iter_t *it)
+{
+    iter_free(it);
+
+    for (;;)
+    {
+        ssize_t n = iter_header(it, it->next);
+        if (n == -1)
+        {
+            return -3;
+        }
+        if (n != sizeof(tar_header_t) || it->header.name[0] == '\0' || scan_check(it->check, &it->header) > 0)
+        {
+            advise_drop(it->fd, it->advice, &it->dropped, it->next, 1);
+            return 0;
+        }
+        OP_COUNT(headers, 1);
+        if (!is_extension(it->header.typeflag))
+        {
+            break;
+        }
+
+        size_t size = TAR_INT(it->header.size);
+        off_t data_off = it->next + sizeof(tar_header_t);
+        it->next = data_off + aligned_size(it->header);
+        if (size > ITER_EXT_MAX)
+        {
+            continue;
+        }
+        char *data = malloc(size);
+        if (data == NULL)
+        {
+            return -3;
+        }
+        if (tar_pread(it->fd, data, size, data_off) != (ssize_t)size)
+        {
+            free(data);
+            return -3;
+        }
+        iter_extension(it, it->header.typeflag, data, size);
+        free(data);
+    }
+
+    iter_decode(it);
+    advise_drop(it->fd, it->advice, &it->dropped, it->entry.offset, 0);
+    advise_skip(it->fd, it->advice, it->next, it->next - it->entry.offset - sizeof(tar_header_t));
+    return 1;
+}
+
+/*
+ * check_archive() reading the headers from the O_DIRECT descriptor of the handle, starting at the file
+ * offset of tar_fd. The file offset is only moved to rewind it once the whole archive is valid.
+ */
+static int check_direct(tar_t *tar, int tar_fd)
+{
+    tar_iter_t it;
+    iter_init(&it, tar_fd);
+    off_t offset = tar_lseek(tar_fd, 0, SEEK_CUR);
+    int nheader = 0;
+
+    while (iter_header(&it, offset) == sizeof(tar_header_t))
+    {
+        OP_COUNT(headers, 1);
+        int valid_arch = tar->check(&it.header, nheader);
+        if (valid_arch != 0)
+        {
+            if (valid_arch < 0)
+            {
+                fail_header(tar, "check_archive", valid_arch, nheader, offset);
+            }
+            return valid_arch;
+        }
+        nheader++;
+        offset += sizeof(tar_header_t) + aligned_size(it.header);
+    }
+    if (tar_lseek(tar_fd, 0, SEEK_SET) == -1)
+    {
+        TAR_FAIL(tar, TAR_EIO, -1, 0, NULL);
+        return -3;
+    }
+    return nheader;
+}
+
+/* Scanning of the entries from the index of a handle, defined with the index below */
+static tar_index_t *index_fresh(tar_t *tar);
+/* Entries scanned by tar_find(), tar_walk() and tar_list(), from the index when the archive has one */
+struct index_scan
+{
+    tar_index_t *index;           /* the version loaded at the start of the scan, NULL to scan the headers */
+    uint32_t *range;              /* entries of the range of names scanned, NULL to scan every record */
+    size_t count;
+    size_t pos;                   /* next record or entry of the range to scan */
+    int preorder;                 /* the range is in the order of walk_cmp() rather than in archive order */
+};
+
+static void scan_start(index_scan_t *scan, tar_index_t *index, const char *prefix, int max_depth, int preorder);
+static int scan_next(index_scan_t *scan, tar_iter_t *it);
+static void scan_free(index_scan_t *scan);
+
+/**
+ * Matches a bracket expression against a character.
+ *
+ * @param p The pattern, just past the opening bracket.
+ * @param c The character to match.
+ * @param matched Set to whether `c` belongs to the class.
+ *
+ * @return a pointer just past the closing bracket, NULL if the class is not terminated.
+ */
+static const char *glob_class(const char *p, char c, int *matched)
+{
+    int negate = (*p == '!' || *p == '^');
+    if (negate)
+    {
+        p++;
+    }
+
+    *matched = 0;
+    const char *start = p;
+    while (*p != '\0' && (*p != ']' || p == start))
+    {
+        char lo = *p;
+        char hi = lo;
+        if (p[1] == '-' && p[2] != '\0' && p[2] != ']')
+        {
+            hi = p[2];
+            p += 2;
+        }
+        if (c >= lo && c <= hi)
+        {
+            *matched = 1;
+        }
+        p++;
+    }
+    if (*p != ']')
+    {
+        return NULL;
+    }
+    if (negate)
+    {
+        *matched = !*matched;
+    }
+    return p + 1;
+}
+
+/**
+ * Matches a path against a shell glob.
+ * `*`, `?` and classes never match a slash, `**` matches across slashes and a `**` path segment
+ * matches zero or more whole segments.
+ *
+ * @return 1 if `s` matches `p`, 0 otherwise.
+ */
+static int glob_match(const char *p, const char *s)
+{
+    const char *pattern = p;
+    /*
+     * A failed match resumes after the last star, which takes one more character, or after the last
+     * double star if the star would have to take a slash. Each position is retried at most once per
+     * star, rather than every way of splitting the text between the stars.
+     */
+    const char *star_p = NULL, *star_s = NULL;
+    const char *any_p = NULL, *any_s = NULL;
+    int any_segments = 0;
+
+    for (;;)
+    {
+        if (*p == '*')
+        {
+            if (p[1] == '*')
+            {
+                /* a "**" segment stands for zero or more whole segments */
+                any_segments = p[2] == '/' && (p == pattern || p[-1] == '/');
+                p += 2;
+                p += any_segments;
+                any_p = p;
+                any_s = s;
+                star_p = NULL;
+                continue;
+            }
+            star_p = ++p;
+            star_s = s;
+            continue;
+        }
+        if (*p == '\0' && *s == '\0')
+        {
+            return 1;
+        }
+
+        const char *next = NULL;
+        int matched;
+        switch (*p)
+        {
+        case '\0':
+            break;
+        case '?':
+            if (*s != '\0' && *s != '/')
+            {
+                next = p + 1;
+            }
+            break;
+        case '[':
+            if (*s == '\0' || *s == '/')
+            {
+                break;
+            }
+            next = glob_class(p + 1, *s, &matched);
+            if (next == NULL)
+            {
+                next = *s == '[' ? p + 1 : NULL;
+            }
+            else if (!matched)
+            {
+                next = NULL;
+            }
+            break;
+        case '\\':
+            if (p[1] != '\0')
+            {
+                p++;
+            }
+            /* fall through */
+        default:
+            if (*p == *s)
+            {
+                next = p + 1;
+            }
+        }
+        if (next != NULL)
+        {
+            p = next;
+            s++;
+            continue;
+        }
+
+        if (star_p != NULL && *star_s != '\0' && *star_s != '/')
+        {
+            p = star_p;
+            s = ++star_s;
+            continue;
+        }
+        if (any_p == NULL)
+        {
+            return 0;
+        }
+        if (any_segments)
+        {
+            any_s = strchr(any_s, '/');
+        }
+        if (any_s == NULL || *any_s == '\0')
+        {
+            return 0;
+        }
+        p = any_p;
+        s = ++any_s;
+        star_p = NULL;
+    }
+}
+
+/**
+ * Computes the literal directory prefix shared by every path a pattern can match.
+ *
+ * For a glob, this is everything up to the last slash before the first wildcard.
+ * For a regex without alternation, this is the literal run following a leading `^`,
+ * minus any character made optional by a quantifier.
+ *
+ * @return the length of the prefix, written (unterminated) into `prefix`.
+ */
+static size_t pattern_prefix(const char *pattern, int flags, char *prefix, size_t size)
+{
+    size_t len = 0;
+
+    if (flags & TAR_FIND_REGEX)
+    {
+        if (*pattern != '^' || strchr(pattern, '|') != NULL)
+        {
+            return 0;
+        }
+        for (const char *p = pattern + 1; *p != '\0' && len < size; p++)
+        {
+            if (strchr(".[]()*+?{}|^$\\", *p) != NULL)
+            {
+                if (len > 0 && strchr("*?{", *p) != NULL)
+                {
+                    len--;
+                }
+                break;
+            }
+            prefix[len++] = *p;
+        }
+        return len;
+    }
+
+    size_t last_slash = 0;
+    for (const char *p = pattern; *p != '\0' && len < size; p++)
+    {
+        if (strchr("*?[\\", *p) != NULL)
+        {
+            return last_slash;
+        }
+        prefix[len++] = *p;
+        if (*p == '/')
+        {
+            last_slash = len;
+        }
+    }
+    /* a pattern without wildcards is its own prefix */
+    return len;
+}
+
+static int tar_find_impl(int tar_fd, const char *pattern, int flags, tar_entry_cb cb, void *arg)
+{
+    tar_t *tar = tar_begin(tar_fd);
+    if (tar_fd < 0 || pattern == NULL || cb == NULL)
+    {
+        TAR_FAIL(tar, TAR_EINVAL, -1, -1, NULL);
+        return -1;
+    }
+
+    regex_t regex;
+    if ((flags & TAR_FIND_REGEX) && regcomp(&regex, pattern, REG_EXTENDED | REG_NOSUB) != 0)
+    {
+        TAR_FAIL(tar, TAR_EINVAL, -1, -1, NULL);
+        return -1;
+    }
+
+    char prefix[TAR_NAME_MAX];
+    size_t prefix_len = pattern_prefix(pattern, flags, prefix, sizeof(prefix) - 1);
+
+    /* the literal directories of a glob are canonical like the names, a trailing slash keeps directories only */
+    char glob[TAR_NAME_MAX];
+    int dirs_only = 0;
+    if (!(flags & TAR_FIND_REGEX))
+    {
+        prefix[prefix_len] = '\0';
+        size_t len = path_canon(prefix, glob, sizeof(glob));
+        len += snprintf(glob + len, sizeof(glob) - len, "%s", pattern + prefix_len);
+        if (len > 1 && len < sizeof(glob) && glob[len - 1] == '/')
+        {
+            glob[len - 1] = '\0';
+            dirs_only = 1;
+        }
+        pattern = glob;
+        prefix_len = pattern_prefix(pattern, flags, prefix, sizeof(prefix) - 1);
+    }
+
+    /* an indexed archive is scanned over the names below the literal directories only */
+    char dir[TAR_NAME_MAX];
+    size_t dir_len = prefix_len;
+    if (flags & TAR_FIND_REGEX)
+    {
+        while (dir_len > 0 && prefix[dir_len - 1] != '/')
+        {
+            dir_len--;
+        }
+    }
+    memcpy(dir, prefix, dir_len);
+    dir[dir_len] = '\0';
+
+    tar_iter_t it;
+    iter_init(&it, tar_fd);
+    index_scan_t scan;
+    scan_start(&scan, index_fresh(tar), dir, 0, 0);
+    int count = 0;
+    int ret;
+
+    while ((ret = scan_next(&scan, &it)) == 1)
+    {
+        if (it.entry.offset == -1)
+        {
+            /* a directory implied by the index has no header */
+            continue;
+        }
+
+        /* match canonical names, directories without their trailing slash */
+        char name[TAR_NAME_MAX];
+        size_t name_len = path_canon(it.entry.name, name, sizeof(name));
+        int is_dir = it.entry.typeflag == DIRTYPE || (name_len > 0 && name[name_len - 1] == '/');
+        if (name_len > 1 && name[name_len - 1] == '/')
+        {
+            name[name_len - 1] = '\0';
+        }
+        if (strncmp(name, prefix, prefix_len) != 0 || (dirs_only && !is_dir))
+        {
+            continue;
+        }
+
+        int match = (flags & TAR_FIND_REGEX) ? regexec(&regex, name, 0, NULL, 0) == 0
+                                             : glob_match(pattern, name);
+        if (match)
+        {
+            count++;
+            if (cb(&it.entry, arg) != 0)
+            {
+                break;
+            }
+        }
+    }
+
+    iter_free(&it);
+    scan_free(&scan);
+    if (flags & TAR_FIND_REGEX)
+    {
+        regfree(&regex);
+    }
+    if (ret < 0)
+    {
+        TAR_FAIL(tar, TAR_EIO, -1, it.next, NULL);
+        return ret;
+    }
+    return count;
+}
+
+/**
+ * Finds the entries of the archive whose path matches a pattern, in a single pass over the headers.
+ *
+ * By default the pattern is a shell glob: `*` and `?` do not match a slash, `[...]` is a character class
+ * and a `**` path segment matches zero or more directories, so a pattern starting with one matches at any depth.
+ * With TAR_FIND_REGEX, the pattern is a POSIX extended regular expression matched anywhere in the path.
+ * Paths are matched in canonical form, directories without their trailing slash, and the literal leading
+ * directories of a glob are canonicalized alike, "./d/?" finding what "d/?" finds. A glob ending with a slash
+ * only matches directories.
+ * Headers outside the literal leading directories of the pattern are skipped without being matched. When the
+ * archive is indexed, only the names below them are visited, and a member shadowed by a later one of the
+ * same name is not reported.
+ * The file offset of tar_fd is left untouched.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ * @param pattern The glob or regular expression to match entry paths against.
+ * @param flags Zero or TAR_FIND_REGEX.
+ * @param cb A callback invoked for each matching entry, in archive order.
+ * @param arg A user argument passed to `cb`.
+ *
+ * @return the number of matching entries reported to `cb`,
+ *         -1 if the arguments or the pattern are invalid,
+ *         -3 if the archive could not be read.
+ */
+int tar_find(int tar_fd, const char *pattern, int flags, tar_entry_cb cb, void *arg)
+{
+    tar_op_t op;
+    op_begin(&op, tar_fd, TAR_OP_FIND, pattern);
+    return op_end(&op, tar_find_impl(tar_fd, pattern, flags, cb, arg));
+}
+
+/**
+ * Resolves the target of a symlink into an archive path.
+ * Relative targets are resolved against the directory containing the link.
+ */
+static void link_target(const char *path, const char *linkname, char *out, size_t size)
+{
+    if (linkname[0] == '/')
+    {
+        snprintf(out, size, "%s", linkname + 1);
+        return;
+    }
+    const char *slash = strrchr(path, '/');
+    int dir_len = slash == NULL ? 0 : (int)(slash - path + 1);
+    snprintf(out, size, "%.*s%s", dir_len, path, linkname);
+}
+
+/* Returns the TAR_WALK_* type bit of a typeflag */
+static int walk_type(char typeflag)
+{
+    switch (typeflag)
+    {
+    case REGTYPE:
+    case AREGTYPE:
+        return TAR_WALK_FILES;
+    case DIRTYPE:
+        return TAR_WALK_DIRS;
+    case SYMTYPE:
+        return TAR_WALK_SYMLINKS;
+    case LNKTYPE:
+        return TAR_WALK_LINKS;
+    default:
+        return TAR_WALK_OTHER;
+    }
+}
+
+/* Counts the path components of a relative path, ignoring a trailing slash */
+static int path_depth(const char *rel)
+{
+    int depth = 1;
+    for (const char *p = rel; *p != '\0'; p++)
+    {
+        if (*p == '/' && p[1] != '\0')
+        {
+            depth++;
+        }
+    }
+    return depth;
+}
+
+/* An entry buffered by tar_walk() until the whole archive has been scanned */
+typedef struct walk_node
+{
+    tar_entry_t entry;
+    int depth;
+    size_t name_off;              /* offsets into the name pool, which moves while growing */
+    size_t link_off;
+} walk_node_t;
+
+/**
+ * Compares two paths component by component, a slash sorting before any other character.
+ * `post` selects whether a path sorts before (pre-order) or after (post-order) the paths it prefixes.
+ */
+static int walk_cmp(const char *a, const char *b, int post)
+{
+    while (*a != '\0' && *a == *b)
+    {
+        a++;
+        b++;
+    }
+    if (*a == '\0' || *b == '\0')
+    {
+        int r = (*a == *b) ? 0 : (*a == '\0' ? -1 : 1);
+        return post ? -r : r;
+    }
+    int ca = (*a == '/') ? 0 : (unsigned char)*a;
+    int cb = (*b == '/') ? 0 : (unsigned char)*b;
+    return ca - cb;
+}
+
+static int walk_cmp_pre(const void *a, const void *b)
+{
+    return walk_cmp(((const walk_node_t *)a)->entry.name, ((const walk_node_t *)b)->entry.name, 0);
+}
+
+static int walk_cmp_post(const void *a, const void *b)
+{
+    return walk_cmp(((const walk_node_t *)a)->entry.name, ((const walk_node_t *)b)->entry.name, 1);
+}
+
+/* Appends a string to a growing pool, returning its offset or -1 if memory ran out */
+static ssize_t pool_add(char **pool, size_t *len, size_t *cap, const char *str)
+{
+    size_t n = strlen(str) + 1;
+    if (*len + n > *cap)
+    {
+        size_t new_cap = *cap ? *cap * 2 : 4096;
+        while (new_cap < *len + n)
+        {
+            new_cap *= 2;
+        }
+        char *grown = realloc(*pool, new_cap);
+        if (grown == NULL)
+        {
+            return -1;
+        }
+        *pool = grown;
+        *cap = new_cap;
+    }
+    memcpy(*pool + *len, str, n);
+    *len += n;
+    return *len - n;
+}
+
+static int tar_walk_impl(int tar_fd, const char *path, const tar_walk_opts_t *opts, tar_walk_cb cb, void *arg)
+{
+    static const tar_walk_opts_t defaults = {0, TAR_WALK_ALL, TAR_WALK_ARCHIVE};
+
+    tar_t *tar = tar_begin(tar_fd);
+    if (tar_fd < 0 || cb == NULL)
+    {
+        TAR_FAIL(tar, TAR_EINVAL, -1, -1, NULL);
+        return -1;
+    }
+    if (opts == NULL)
+    {
+        opts = &defaults;
+    }
+    int types = opts->types ? opts->types : TAR_WALK_ALL;
+
+    char root[TAR_NAME_MAX];
+    char target[TAR_NAME_MAX];
+    path_canon(path ? path : "", root, sizeof(root));
+    tar_index_t *index = index_fresh(tar);
+
+    for (int hops = 0; hops < 8; hops++)
+    {
+        size_t root_len = strlen(root);
+        if (root_len > 0 && root[root_len - 1] != '/' && root_len + 1 < sizeof(root))
+        {
+            root[root_len++] = '/';
+            root[root_len] = '\0';
+        }
+
+        walk_node_t *nodes = NULL;
+        size_t nnodes = 0, cap_nodes = 0;
+        char *pool = NULL;
+        size_t pool_len = 0, cap_pool = 0;
+        int symlink = 0;
+        int found = 0;
+        int count = 0;
+        int ret;
+
+        tar_iter_t it;
+        iter_init(&it, tar_fd);
+        index_scan_t scan;
+        scan_start(&scan, index, root, opts->max_depth, opts->order != TAR_WALK_ARCHIVE);
+
+        while ((ret = scan_next(&scan, &it)) == 1)
+        {
+            const char *name = it.entry.name;
+            if (strncmp(name, root, root_len) != 0)
+            {
+                if (it.entry.typeflag == SYMTYPE && root_len > 0 &&
+                    strncmp(name, root, root_len - 1) == 0 && name[root_len - 1] == '\0')
+                {
+                    symlink = 1;
+                    link_target(name, it.entry.linkname, target, sizeof(target));
+                }
+                continue;
+            }
+            if (name[root_len] == '\0')
+            {
+                continue;
+            }
+            found = 1;
+
+            int depth = path_depth(name + root_len);
+            if ((opts->max_depth > 0 && depth > opts->max_depth) || !(walk_type(it.entry.typeflag) & types))
+            {
+                continue;
+            }
+
+            if (opts->order == TAR_WALK_ARCHIVE || (opts->order == TAR_WALK_PREORDER && scan.preorder))
+            {
+                count++;
+                if (cb(&it.entry, depth, arg) != 0)
+                {
+                    break;
+                }
+                continue;
+            }
+
+            if (nnodes == cap_nodes)
+            {
+                cap_nodes = cap_nodes ? cap_nodes * 2 : 64;
+                walk_node_t *grown = realloc(nodes, cap_nodes * sizeof(walk_node_t));
+                if (grown == NULL)
+                {
+                    ret = -1;
+                    break;
+                }
+                nodes = grown;
+            }
+            walk_node_t *node = &nodes[nnodes];
+            ssize_t name_off = pool_add(&pool, &pool_len, &cap_pool, name);
+            ssize_t link_off = pool_add(&pool, &pool_len, &cap_pool, it.entry.linkname);
+            if (name_off < 0 || link_off < 0)
+            {
+                ret = -1;
+                break;
+            }
+            node->entry = it.entry;
+            node->depth = depth;
+            node->name_off = name_off;
+            node->link_off = link_off;
+            nnodes++;
+        }
+
+        /* nodes is still NULL when nothing was walked */
+        if (ret == 0 && opts->order != TAR_WALK_ARCHIVE && nnodes > 0)
+        {
+            for (size_t i = 0; i < nnodes; i++)
+            {
+                nodes[i].entry.name = pool + nodes[i].name_off;
+                nodes[i].entry.linkname = pool + nodes[i].link_off;
+            }
+            qsort(nodes, nnodes, sizeof(walk_node_t),
+                  opts->order == TAR_WALK_POSTORDER ? walk_cmp_post : walk_cmp_pre);
+            for (size_t i = 0; i < nnodes; i++)
+            {
+                count++;
+                if (cb(&nodes[i].entry, nodes[i].depth, arg) != 0)
+                {
+                    break;
+                }
+            }
+        }
+        iter_free(&it);
+        scan_free(&scan);
+        free(nodes);
+        free(pool);
+
+        if (ret < 0)
+        {
+            TAR_FAIL(tar, ret == -1 ? TAR_ENOMEM : TAR_EIO, -1, it.next, NULL);
+            return ret;
+        }
+        if (found || !symlink)
+        {
+            return count;
+        }
+        path_canon(target, root, sizeof(root));
+    }
+    return 0;
+}
+
+/**
+ * Walks all the descendants of a directory in the archive, in a single pass over the headers.
+ * Unlike list(), the walk recurses into subdirectories, up to an optional maximum depth.
+ *
+ * Example:
+ *  dir/          with max_depth 2 and TAR_WALK_PREORDER, tar_walk(..., "dir/", ...) reports
+ *   ├── a        "dir/a" (1), "dir/c/" (1) and "dir/c/d/" (2), "dir/c/d/e" is too deep
+ *   └── c/
+ *       └── d/
+ *           └── e
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ * @param path The directory to walk, NULL or "" for the whole archive. If the entry is a symlink,
+ *             it is resolved relative to the directory containing it.
+ * @param opts The depth limit, entry types and order of the walk, NULL for the defaults.
+ * @param cb A callback invoked for each entry walked.
+ * @param arg A user argument passed to `cb`.
+ *
+ * @return the number of entries reported to `cb`,
+ *         -1 if the arguments are invalid or memory ran out,
+ *         -3 if the archive could not be read.
+ */
+int tar_walk(int tar_fd, const char *path, const tar_walk_opts_t *opts, tar_walk_cb cb, void *arg)
+{
+    tar_op_t op;
+    op_begin(&op, tar_fd, TAR_OP_WALK, path);
+    return op_end(&op, tar_walk_impl(tar_fd, path, opts, cb, arg));
+}
+
+static int tar_list_impl(int tar_fd, const char *path, tar_list_t **out)
+{
+    tar_t *tar = tar_begin(tar_fd);
+    if (tar_fd < 0 || path == NULL || out == NULL || path[0] == '\0')
+    {
+        TAR_FAIL(tar, TAR_EINVAL, -1, -1, NULL);
+        return -1;
+    }
+    *out = NULL;
+
+    char dir[TAR_NAME_MAX];
+    char target[TAR_NAME_MAX];
+    tar_index_t *index = index_fresh(tar);
+    if (path_canon(path, dir, sizeof(dir)) == 0)
+    {
+        TAR_FAIL(tar, TAR_EINVAL, -1, -1, NULL);
+        return -1;
+    }
+
+    for (int hops = 0; hops < 8; hops++)
+    {
+        size_t dir_len = strlen(dir);
+        if (dir[dir_len - 1] != '/' && dir_len + 1 < sizeof(dir))
+        {
+            dir[dir_len++] = '/';
+            dir[dir_len] = '\0';
+        }
+
+        size_t *offsets = NULL;
+        size_t count = 0, cap = 0;
+        char *pool = NULL;
+        size_t pool_len = 0, pool_cap = 0;
+        int is_dir = 0, symlink = 0;
+        int ret;
+
+        tar_iter_t it;
+        iter_init(&it, tar_fd);
+        index_scan_t scan;
+        scan_start(&scan, index, dir, 1, 0);
+        while ((ret = scan_next(&scan, &it)) == 1)
+        {
+            const char *name = it.entry.name;
+            if (strncmp(name, dir, dir_len - 1) != 0)
+            {
+                continue;
+            }
+            if (name[dir_len - 1] == '\0')
+            {
+                if (it.entry.typeflag == SYMTYPE)
+                {
+                    symlink = 1;
+                    link_target(name, it.entry.linkname, target, sizeof(target));
+                }
+                continue;
+            }
+            if (name[dir_len - 1] != '/')
+            {
+                continue;
+            }
+            if (name[dir_len] == '\0')
+            {
+                is_dir |= (it.entry.typeflag == DIRTYPE);
+                continue;
+            }
+
+            /* keep direct children only, directories ending with the only slash */
+            const char *slash = strchr(name + dir_len, '/');
+            if (slash != NULL && slash[1] != '\0')
+            {
+                continue;
+            }
+            if (count == cap)
+            {
+                cap = cap ? cap * 2 : 64;
+                size_t *grown = realloc(offsets, cap * sizeof(size_t));
+                if (grown == NULL)
+                {
+                    ret = -1;
+                    break;
+                }
+                offsets = grown;
+            }
+            ssize_t off = pool_add(&pool, &pool_len, &pool_cap, name);
+            if (off < 0)
+            {
+                ret = -1;
+                break;
+            }
+            offsets[count++] = off;
+        }
+        iter_free(&it);
+        scan_free(&scan);
+
+        if (ret == 0 && is_dir)
+        {
+            tar_list_t *list = malloc(sizeof(tar_list_t) + count * sizeof(size_t) + pool_len);
+            if (list == NULL)
+            {
+                ret = -1;
+            }
+            else
+            {
+                list->count = count;
+                list->offsets = (size_t *)(list + 1);
+                list->pool = (char *)(list->offsets + count);
+                /* an empty directory allocated neither array */
+                if (count > 0)
+                {
+                    memcpy(list->offsets, offsets, count * sizeof(size_t));
+                    memcpy(list->pool, pool, pool_len);
+                }
+                *out = list;
+                ret = 1;
+            }
+        }
+        free(offsets);
+        free(pool);
+
+        if (ret < 0)
+        {
+            TAR_FAIL(tar, ret == -1 ? TAR_ENOMEM : TAR_EIO, -1, it.next, NULL);
+        }
+        if (ret != 0 || !symlink)
+        {
+            return ret;
+        }
+        if (path_canon(target, dir, sizeof(dir)) == 0)
+        {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Lists the entries at a given path in the archive, like list(), into a single allocation.
+ * There is no limit on the number of entries or on the length of their paths, which include
+ * ustar prefixes and GNU or pax long names. The file offset of tar_fd is left untouched.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved relative to
+ *             the directory containing it.
+ * @param out Set to the entries listed, to be released with tar_list_free(), or to NULL on failure.
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         a positive value otherwise, even if the directory is empty,
+ *         -1 if the arguments are invalid or memory ran out,
+ *         -3 if the archive could not be read.
+ */
+int tar_list(int tar_fd, const char *path, tar_list_t **out)
+{
+    tar_op_t op;
+    op_begin(&op, tar_fd, TAR_OP_LIST_ALLOC, path);
+    return op_end(&op, tar_list_impl(tar_fd, path, out));
+}
+
+/**
+ * Releases the entries returned by tar_list().
+ *
+ * @param list The entries to release, may be NULL.
+ */
+void tar_list_free(tar_list_t *list)
+{
+    free(list);
+}
+
+/* Size of the reads issued while hashing member data */
+#define VERIFY_BUFSIZE (1 << 20)
+
+/* Running state of one of the TAR_DIGEST_* algorithms */
+typedef struct digest
+{
+    int alg;
+    uint64_t total;
+    union
+    {
+        uint32_t crc;
+        struct
+        {
+            uint64_t v[4];
+            uint8_t mem[32];
+            size_t memsize;
+        } xxh;
+        struct
+        {
+            uint64_t acc[8];
+            uint8_t buf[256];         /* input not consumed yet, whose last stripe stays at the end once consumed */
+            size_t bufsize;
+            size_t stripes;           /* stripes accumulated in the current block */
+        } xxh3;
+        struct
+        {
+            uint32_t h[8];
+            uint8_t block[64];
+            size_t blocksize;
+        } sha;
+    } u;
+} digest_t;
+
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init_table(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++)
+        {
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+        }
+        crc32c_table[i] = crc;
+    }
+}
+
+static uint32_t crc32c_soft(uint32_t crc, const uint8_t *p, size_t n)
+{
+    pthread_once(&crc32c_once, crc32c_init_table);
+    while (n--)
+    {
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t n)
+{
+    uint64_t crc64 = crc;
+    while (n >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        n -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (n--)
+    {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+static uint32_t crc32c_update(uint32_t crc, const uint8_t *p, size_t n)
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        return crc32c_sse42(crc, p, n);
+    }
+#endif
+    return crc32c_soft(crc, p, n);
+}
+
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_PRIME1;
+}
+
+static inline uint64_t xxh64_avalanche(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    return h ^ (h >> 32);
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+static void xxh64_update(digest_t *d, const uint8_t *p, size_t n)
+{
+    uint64_t *v = d->u.xxh.v;
+
+    if (d->u.xxh.memsize + n < 32)
+    {
+        memcpy(d->u.xxh.mem + d->u.xxh.memsize, p, n);
+        d->u.xxh.memsize += n;
+        return;
+    }
+    if (d->u.xxh.memsize > 0)
+    {
+        size_t fill = 32 - d->u.xxh.memsize;
+        memcpy(d->u.xxh.mem + d->u.xxh.memsize, p, fill);
+        for (int i = 0; i < 4; i++)
+        {
+            v[i] = xxh64_round(v[i], read64(d->u.xxh.mem + 8 * i));
+        }
+        p += fill;
+        n -= fill;
+        d->u.xxh.memsize = 0;
+    }
+    while (n >= 32)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            v[i] = xxh64_round(v[i], read64(p + 8 * i));
+        }
+        p += 32;
+        n -= 32;
+    }
+    memcpy(d->u.xxh.mem, p, n);
+    d->u.xxh.memsize = n;
+}
+
+static uint64_t xxh64_final(const digest_t *d)
+{
+    const uint64_t *v = d->u.xxh.v;
+    uint64_t h;
+
+    if (d->total >= 32)
+    {
+        h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18);
+        for (int i = 0; i < 4; i++)
+        {
+            h = xxh64_merge(h, v[i]);
+        }
+    }
+    else
+    {
+        h = v[2] + XXH_PRIME5;
+    }
+    h += d->total;
+
+    const uint8_t *p = d->u.xxh.mem;
+    size_t n = d->u.xxh.memsize;
+    for (; n >= 8; p += 8, n -= 8)
+    {
+        h ^= xxh64_round(0, read64(p));
+        h = rotl64(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if (n >= 4)
+    {
+        h ^= (uint64_t)read32(p) * XXH_PRIME1;
+        h = rotl64(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+        n -= 4;
+    }
+    for (; n > 0; p++, n--)
+    {
+        h ^= *p * XXH_PRIME5;
+        h = rotl64(h, 11) * XXH_PRIME1;
+    }
+
+    return xxh64_avalanche(h);
+}
+
+/*
+ * XXH3-64 with a zero seed and the default secret: inputs of up to XXH3_MIDSIZE bytes are hashed at once,
+ * longer ones by 64-byte stripes into eight accumulators, scrambled after each block of XXH3_BLOCK_STRIPES.
+ */
+#define XXH3_PRIME32_1 0x9E3779B1U
+#define XXH3_PRIME32_2 0x85EBCA77U
+#define XXH3_PRIME32_3 0xC2B2AE3DU
+#define XXH3_PRIME_MX1 0x165667919E3779F9ULL
+#define XXH3_PRIME_MX2 0x9FB21C651E98DF25ULL
+#define XXH3_MIDSIZE 240
+#define XXH3_STRIPE 64
+#define XXH3_BLOCK_STRIPES 16    /* (sizeof(xxh3_secret) - XXH3_STRIPE) / 8 */
+
+static const uint8_t xxh3_secret[192] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+/* Folds the 128-bit product of two 64-bit values */
+static inline uint64_t xxh3_mul_fold(uint64_t a, uint64_t b)
+{
+    unsigned __int128 product = (unsigned __int128)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static inline uint64_t xxh3_avalanche(uint64_t h)
+{
+    h ^= h >> 37;
+    h *= XXH3_PRIME_MX1;
+    return h ^ (h >> 32);
+}
+
+static inline uint64_t xxh3_mix16(const uint8_t *p, const uint8_t *secret)
+{
+    return xxh3_mul_fold(read64(p) ^ read64(secret), read64(p + 8) ^ read64(secret + 8));
+}
+
+/* Hashes an input of up to XXH3_MIDSIZE bytes */
+static uint64_t xxh3_short(const uint8_t *p, size_t n)
+{
+    const uint8_t *secret = xxh3_secret;
+    if (n == 0)
+    {
+        return xxh64_avalanche(read64(secret + 56) ^ read64(secret + 64));
+    }
+    if (n <= 3)
+    {
+        uint32_t combined = (uint32_t)p[0] << 16 | (uint32_t)p[n >> 1] << 24 | p[n - 1] | (uint32_t)n << 8;
+        return xxh64_avalanche(combined ^ (uint64_t)(read32(secret) ^ read32(secret + 4)));
+    }
+    if (n <= 8)
+    {
+        uint64_t input = read32(p + n - 4) + ((uint64_t)read32(p) << 32);
+        uint64_t h = input ^ (read64(secret + 8) ^ read64(secret + 16));
+        h ^= rotl64(h, 49) ^ rotl64(h, 24);
+        h *= XXH3_PRIME_MX2;
+        h ^= (h >> 35) + n;
+        h *= XXH3_PRIME_MX2;
+        return h ^ (h >> 28);
+    }
+    if (n <= 16)
+    {
+        uint64_t lo = read64(p) ^ (read64(secret + 24) ^ read64(secret + 32));
+        uint64_t hi = read64(p + n - 8) ^ (read64(secret + 40) ^ read64(secret + 48));
+        return xxh3_avalanche(n + __builtin_bswap64(lo) + hi + xxh3_mul_fold(lo, hi));
+    }
+
+    uint64_t acc = n * XXH_PRIME1;
+    if (n <= 128)
+    {
+        /* pairs of 16 bytes from both ends, as many as the input covers */
+        for (size_t i = 0; i < 4 && n > 32 * i; i++)
+        {
+            acc += xxh3_mix16(p + 16 * i, secret + 32 * i);
+            acc += xxh3_mix16(p + n - 16 * (i + 1), secret + 32 * i + 16);
+        }
+        return xxh3_avalanche(acc);
+    }
+    for (size_t i = 0; i < 8; i++)
+    {
+        acc += xxh3_mix16(p + 16 * i, secret + 16 * i);
+    }
+    acc = xxh3_avalanche(acc);
+    for (size_t i = 8; i < n / 16; i++)
+    {
+        acc += xxh3_mix16(p + 16 * i, secret + 16 * (i - 8) + 3);
+    }
+    acc += xxh3_mix16(p + n - 16, secret + 136 - 17);
+    return xxh3_avalanche(acc);
+}
+
+/* The accumulators are updated two by two with SSE2 where available, as part of the x86-64 baseline */
+static inline void xxh3_accumulate(uint64_t *acc, const uint8_t *stripe, const uint8_t *secret)
+{
+#if defined(__SSE2__)
+    for (int i = 0; i < 4; i++)
+    {
+        __m128i value = _mm_loadu_si128((const __m128i *)stripe + i);
+        __m128i key = _mm_xor_si128(value, _mm_loadu_si128((const __m128i *)secret + i));
+        __m128i product = _mm_mul_epu32(key, _mm_shuffle_epi32(key, _MM_SHUFFLE(0, 3, 0, 1)));
+        __m128i sum = _mm_add_epi64(_mm_loadu_si128((__m128i *)acc + i), _mm_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2)));
+        _mm_storeu_si128((__m128i *)acc + i, _mm_add_epi64(product, sum));
+    }
+#else
+    for (int i = 0; i < 8; i++)
+    {
+        uint64_t value = read64(stripe + 8 * i);
+        uint64_t key = value ^ read64(secret + 8 * i);
+        acc[i ^ 1] += value;
+        acc[i] += (key & 0xFFFFFFFF) * (key >> 32);
+    }
+#endif
+}
+
+static inline void xxh3_scramble(uint64_t *acc)
+{
+    const uint8_t *secret = xxh3_secret + sizeof(xxh3_secret) - XXH3_STRIPE;
+#if defined(__SSE2__)
+    const __m128i prime = _mm_set1_epi32((int)XXH3_PRIME32_1);
+    for (int i = 0; i < 4; i++)
+    {
+        __m128i a = _mm_loadu_si128((__m128i *)acc + i);
+        a = _mm_xor_si128(_mm_xor_si128(a, _mm_srli_epi64(a, 47)), _mm_loadu_si128((const __m128i *)secret + i));
+        __m128i lo = _mm_mul_epu32(a, prime);
+        __m128i hi = _mm_mul_epu32(_mm_shuffle_epi32(a, _MM_SHUFFLE(0, 3, 0, 1)), prime);
+        _mm_storeu_si128((__m128i *)acc + i, _mm_add_epi64(lo, _mm_slli_epi64(hi, 32)));
+    }
+#else
+    for (int i = 0; i < 8; i++)
+    {
+        acc[i] = (acc[i] ^ (acc[i] >> 47) ^ read64(secret + 8 * i)) * XXH3_PRIME32_1;
+    }
+#endif
+}
+
+/* Accumulates `count` stripes, scrambling at the end of each block */
+static void xxh3_stripes(uint64_t *acc, size_t *stripes, const uint8_t *p, size_t count)
+{
+    for (size_t i = 0; i < count; i++, p += XXH3_STRIPE)
+    {
+        xxh3_accumulate(acc, p, xxh3_secret + 8 * *stripes);
+        if (++*stripes == XXH3_BLOCK_STRIPES)
+        {
+            xxh3_scramble(acc);
+            *stripes = 0;
+        }
+    }
+}
+
+/* Consumes whole buffers of input, always keeping the last bytes, that xxh3_final() may hash at once */
+static void xxh3_update(digest_t *d, const uint8_t *p, size_t n)
+{
+    uint8_t *buf = d->u.xxh3.buf;
+    size_t room = sizeof(d->u.xxh3.buf) - d->u.xxh3.bufsize;
+    if (n <= room)
+    {
+        memcpy(buf + d->u.xxh3.bufsize, p, n);
+        d->u.xxh3.bufsize += n;
+        return;
+    }
+    if (d->u.xxh3.bufsize > 0)
+    {
+        memcpy(buf + d->u.xxh3.bufsize, p, room);
+        xxh3_stripes(d->u.xxh3.acc, &d->u.xxh3.stripes, buf, sizeof(d->u.xxh3.buf) / XXH3_STRIPE);
+        p += room;
+        n -= room;
+    }
+    if (n > sizeof(d->u.xxh3.buf))
+    {
+        size_t count = (n - 1) / XXH3_STRIPE;
+        xxh3_stripes(d->u.xxh3.acc, &d->u.xxh3.stripes, p, count);
+        p += count * XXH3_STRIPE;
+        n -= count * XXH3_STRIPE;
+        memcpy(buf + sizeof(d->u.xxh3.buf) - XXH3_STRIPE, p - XXH3_STRIPE, XXH3_STRIPE);
+    }
+    memcpy(buf, p, n);
+    d->u.xxh3.bufsize = n;
+}
+
+static uint64_t xxh3_final(const digest_t *d)
+{
+    const uint8_t *buf = d->u.xxh3.buf;
+    size_t n = d->u.xxh3.bufsize;
+    if (d->total <= XXH3_MIDSIZE)
+    {
+        return xxh3_short(buf, n);
+    }
+
+    uint64_t acc[8];
+    size_t stripes = d->u.xxh3.stripes;
+    memcpy(acc, d->u.xxh3.acc, sizeof(acc));
+    uint8_t last[XXH3_STRIPE];
+    if (n >= XXH3_STRIPE)
+    {
+        xxh3_stripes(acc, &stripes, buf, (n - 1) / XXH3_STRIPE);
+        memcpy(last, buf + n - XXH3_STRIPE, XXH3_STRIPE);
+    }
+    else
+    {
+        /* the stripe ending the input starts in the bytes consumed last */
+        memcpy(last, buf + sizeof(d->u.xxh3.buf) - (XXH3_STRIPE - n), XXH3_STRIPE - n);
+        memcpy(last + XXH3_STRIPE - n, buf, n);
+    }
+    xxh3_accumulate(acc, last, xxh3_secret + sizeof(xxh3_secret) - XXH3_STRIPE - 7);
+
+    uint64_t h = d->total * XXH_PRIME1;
+    for (int i = 0; i < 4; i++)
+    {
+        h += xxh3_mul_fold(acc[2 * i] ^ read64(xxh3_secret + 11 + 16 * i), acc[2 * i + 1] ^ read64(xxh3_secret + 19 + 16 * i));
+    }
+    return xxh3_avalanche(h);
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static inline uint32_t rotr32(uint32_t x, int r)
+{
+    return (x >> r) | (x << (32 - r));
+}
+
+static void sha256_block(uint32_t *h, const uint8_t *block)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+    {
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+               (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; i++)
+    {
+        uint32_t t1 = k + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += k;
+}
+
+static void sha256_update(digest_t *d, const uint8_t *p, size_t n)
+{
+    if (d->u.sha.blocksize > 0)
+    {
+        size_t fill = 64 - d->u.sha.blocksize;
+        if (fill > n)
+        {
+            fill = n;
+        }
+        memcpy(d->u.sha.block + d->u.sha.blocksize, p, fill);
+        d->u.sha.blocksize += fill;
+        p += fill;
+        n -= fill;
+        if (d->u.sha.blocksize < 64)
+        {
+            return;
+        }
+        sha256_block(d->u.sha.h, d->u.sha.block);
+        d->u.sha.blocksize = 0;
+    }
+    for (; n >= 64; p += 64, n -= 64)
+    {
+        sha256_block(d->u.sha.h, p);
+    }
+    memcpy(d->u.sha.block, p, n);
+    d->u.sha.blocksize = n;
+}
+
+static void digest_init(digest_t *d, int alg)
+{
+    static const uint32_t sha256_h0[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                          0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memset(d, 0, sizeof(*d));
+    d->alg = alg;
+    switch (alg)
+    {
+    case TAR_DIGEST_CRC32C:
+        d->u.crc = 0xFFFFFFFF;
+        break;
+    case TAR_DIGEST_XXH64:
+        d->u.xxh.v[0] = XXH_PRIME1 + XXH_PRIME2;
+        d->u.xxh.v[1] = XXH_PRIME2;
+        d->u.xxh.v[2] = 0;
+        d->u.xxh.v[3] = -XXH_PRIME1;
+        break;
+    case TAR_DIGEST_SHA256:
+        memcpy(d->u.sha.h, sha256_h0, sizeof(sha256_h0));
+        break;
+    case TAR_DIGEST_XXH3:
+    {
+        static const uint64_t xxh3_acc0[8] = {XXH3_PRIME32_3, XXH_PRIME1, XXH_PRIME2, XXH_PRIME3,
+                                              XXH_PRIME4,     XXH3_PRIME32_2, XXH_PRIME5, XXH3_PRIME32_1};
+        memcpy(d->u.xxh3.acc, xxh3_acc0, sizeof(xxh3_acc0));
+        break;
+    }
+    }
+}
+
+static void digest_update(digest_t *d, const uint8_t *p, size_t n)
+{
+    d->total += n;
+    switch (d->alg)
+    {
+    case TAR_DIGEST_CRC32C:
+        d->u.crc = crc32c_update(d->u.crc, p, n);
+        break;
+    case TAR_DIGEST_XXH64:
+        xxh64_update(d, p, n);
+        break;
+    case TAR_DIGEST_SHA256:
+        sha256_update(d, p, n);
+        break;
+    case TAR_DIGEST_XXH3:
+        xxh3_update(d, p, n);
+        break;
+    }
+}
+
+/* Finishes a digest and writes it as lowercase hex into `hex`, TAR_DIGEST_MAX bytes long */
+static void digest_final(digest_t *d, char *hex)
+{
+    switch (d->alg)
+    {
+    case TAR_DIGEST_CRC32C:
+        snprintf(hex, TAR_DIGEST_MAX, "%08x", d->u.crc ^ 0xFFFFFFFF);
+        break;
+    case TAR_DIGEST_XXH64:
+        snprintf(hex, TAR_DIGEST_MAX, "%016llx", (unsigned long long)xxh64_final(d));
+        break;
+    case TAR_DIGEST_SHA256:
+    {
+        uint64_t bits = d->total * 8;
+        uint8_t pad[72] = {0x80};
+        size_t padlen = (d->u.sha.blocksize < 56 ? 56 : 120) - d->u.sha.blocksize;
+        for (int i = 0; i < 8; i++)
+        {
+            pad[padlen + i] = (uint8_t)(bits >> (56 - 8 * i));
+        }
+        sha256_update(d, pad, padlen + 8);
+        for (int i = 0; i < 8; i++)
+        {
+            snprintf(hex + 8 * i, TAR_DIGEST_MAX - 8 * i, "%08x", d->u.sha.h[i]);
+        }
+        break;
+    }
+    case TAR_DIGEST_XXH3:
+        snprintf(hex, TAR_DIGEST_MAX, "%016llx", (unsigned long long)xxh3_final(d));
+        break;
+    }
+}
+
+/* A sequential reader of the archive issuing large reads */
+typedef struct tar_stream
+{
+    int fd;
+    uint8_t *buf;
+    size_t len;                   /* bytes available in buf */
+    size_t pos;                   /* bytes of buf already consumed */
+    off_t off;                    /* archive offset of buf[len] */
+    int advice;
+    off_t dropped;
+} tar_stream_t;
+
+/**
+ * Returns up to `max` contiguous bytes of the archive, refilling the buffer when it is exhausted.
+ *
+ * @return the number of bytes available at `*data`, 0 at the end of the file, -1 on a read error.
+ */
+static ssize_t stream_chunk(tar_stream_t *s, size_t max, const uint8_t **data)
+{
+    if (s->pos == s->len)
+    {
+        advise_drop(s->fd, s->advice, &s->dropped, s->off, 0);
+        ssize_t n = tar_pread(s->fd, s->buf, VERIFY_BUFSIZE, s->off);
+        if (n <= 0)
+        {
+            return n;
+        }
+        s->off += n;
+        s->len = n;
+        s->pos = 0;
+    }
+    size_t n = s->len - s->pos;
+    if (n > max)
+    {
+        n = max;
+    }
+    *data = s->buf + s->pos;
+    s->pos += n;
+    return n;
+}
+
+/**
+ * Consumes `n` bytes of the archive, feeding them to `d` unless it is NULL.
+ *
+ * @return 1 if all the bytes were consumed, 0 if the file ended first, -1 on a read error.
+ */
+static int stream_consume(tar_stream_t *s, size_t n, digest_t *d, uint8_t *copy)
+{
+    while (n > 0)
+    {
+        const uint8_t *data;
+        ssize_t got = stream_chunk(s, n, &data);
+        if (got <= 0)
+        {
+            return got;
+        }
+        if (d != NULL)
+        {
+            digest_update(d, data, got);
+        }
+        if (copy != NULL)
+        {
+            memcpy(copy, data, got);
+            copy += got;
+        }
+        n -= got;
+    }
+    return 1;
+}
+
+/* Orders manifest entries by name, for bsearch() */
+static int manifest_cmp(const void *a, const void *b)
+{
+    return strcmp((*(const tar_manifest_entry_t *const *)a)->name, (*(const tar_manifest_entry_t *const *)b)->name);
+}
+
+/* Verification state shared by the streaming pass and the worker threads */
+typedef struct verify_ctx
+{
+    tar_t *tar;
+    const tar_verify_opts_t *opts;
+    const tar_manifest_entry_t **sorted;    /* manifest sorted by name */
+    uint8_t *seen;                          /* manifest entries matched by a member */
+    tar_verify_cb cb;
+    void *arg;
+    int failures;
+    int stopped;
+} verify_ctx_t;
+
+/* Compares a member digest against the manifest and reports it */
+static void verify_report(verify_ctx_t *ctx, const tar_entry_t *entry, const char *digest)
+{
+    int status = TAR_VERIFY_OK;
+
+    if (ctx->sorted != NULL)
+    {
+        tar_manifest_entry_t key = {entry->name, NULL};
+        const tar_manifest_entry_t *keyp = &key;
+        const tar_manifest_entry_t **found =
+            bsearch(&keyp, ctx->sorted, ctx->opts->manifest_len, sizeof(*ctx->sorted), manifest_cmp);
+        if (found == NULL)
+        {
+            status = TAR_VERIFY_UNLISTED;
+        }
+        else
+        {
+            ctx->seen[found - ctx->sorted] = 1;
+            if (strcasecmp((*found)->digest, digest) != 0)
+            {
+                status = TAR_VERIFY_MISMATCH;
+                ctx->failures++;
+            }
+        }
+    }
+    if (ctx->cb != NULL && !ctx->stopped && ctx->cb(entry, digest, status, ctx->arg) != 0)
+    {
+        ctx->stopped = 1;
+    }
+}
+
+/**
+ * Verifies the archive in a single sequential pass, hashing member data as it streams by.
+ *
+ * @return 0 on success, a check_archive() error or -4 if the archive could not be read.
+ */
+static int verify_stream(int tar_fd, verify_ctx_t *ctx)
+{
+    tar_stream_t s = {tar_fd, malloc(VERIFY_BUFSIZE), 0, 0, 0, ctx->tar->advice, 0};
+    if (s.buf == NULL)
+    {
+        tar_fail_at(ctx->tar, "tar_verify", TAR_ENOMEM, -1, -1, NULL);
+        return -4;
+    }
+    advise_sequential(tar_fd, s.advice, 1);
+
+    tar_iter_t it;
+    iter_init(&it, tar_fd);
+    long nheader = 0;
+    int ret = 0;
+
+    for (; !ctx->stopped; nheader++)
+    {
+        int got = stream_consume(&s, sizeof(tar_header_t), NULL, (uint8_t *)&it.header);
+        if (got < 0)
+        {
+            ret = -4;
+            break;
+        }
+        if (got == 0 || it.header.name[0] == '\0')
+        {
+            break;
+        }
+        OP_COUNT(headers, 1);
+        ret = scan_check(ctx->tar->check, &it.header);
+        if (ret != 0)
+        {
+            if (ret < 0)
+            {
+                fail_header(ctx->tar, "tar_verify", ret, nheader, it.next);
+            }
+            ret = ret < 0 ? ret : 0;
+            break;
+        }
+
+        if (is_extension(it.header.typeflag))
+        {
+            size_t size = TAR_INT(it.header.size);
+            char *data = size <= ITER_EXT_MAX ? malloc(size + 1) : NULL;
+            if (stream_consume(&s, size, NULL, (uint8_t *)data) != 1 ||
+                stream_consume(&s, aligned_size(it.header) - size, NULL, NULL) < 0)
+            {
+                free(data);
+                ret = -4;
+                break;
+            }
+            if (data != NULL)
+            {
+                iter_extension(&it, it.header.typeflag, data, size);
+            }
+            free(data);
+            it.next += sizeof(tar_header_t) + aligned_size(it.header);
+            continue;
+        }
+        iter_decode(&it);
+
+        digest_t d;
+        int regular = (it.entry.typeflag == REGTYPE || it.entry.typeflag == AREGTYPE);
+        digest_init(&d, ctx->opts->digest);
+        if (stream_consume(&s, it.entry.size, regular ? &d : NULL, NULL) != 1 ||
+            stream_consume(&s, aligned_size(it.header) - it.entry.size, NULL, NULL) < 0)
+        {
+            ret = -4;
+            break;
+        }
+        if (regular)
+        {
+            char hex[TAR_DIGEST_MAX];
+            digest_final(&d, hex);
+            verify_report(ctx, &it.entry, hex);
+        }
+        iter_free(&it);
+    }
+    if (ret == -4)
+    {
+        tar_fail_at(ctx->tar, "tar_verify", TAR_EIO, nheader, it.next, NULL);
+    }
+    advise_drop(tar_fd, s.advice, &s.dropped, s.off, 1);
+    advise_sequential(tar_fd, s.advice, 0);
+    iter_free(&it);
+    free(s.buf);
+    return ret;
+}
+
+/* A member hashed by a worker thread of tar_verify() */
+typedef struct verify_job
+{
+    tar_entry_t entry;
+    char digest[TAR_DIGEST_MAX];
+    int err;
+} verify_job_t;
+
+typedef struct verify_pool
+{
+    int fd;
+    int alg;
+    int advice;
+    verify_job_t *jobs;
+    size_t njobs;
+    size_t next;                  /* next job to claim, updated atomically */
+    uint64_t reads;               /* work of the workers, added atomically */
+    uint64_t bytes_read;
+} verify_pool_t;
+
+static void *verify_worker(void *arg)
+{
+    verify_pool_t *pool = arg;
+    uint8_t *buf = malloc(VERIFY_BUFSIZE);
+
+    /* count the reads of this worker, they are added to the calling operation once joined */
+    tar_op_t *outer = cur_op;
+    tar_op_t counted = {.op = -1};
+    cur_op = &counted;
+
+    for (;;)
+    {
+        size_t i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+        if (i >= pool->njobs)
+        {
+            break;
+        }
+        verify_job_t *job = &pool->jobs[i];
+        if (buf == NULL)
+        {
+            job->err = 1;
+            continue;
+        }
+
+        digest_t d;
+        digest_init(&d, pool->alg);
+        off_t start = job->entry.offset + sizeof(tar_header_t);
+        off_t off = start;
+        size_t left = job->entry.size;
+        while (left > 0)
+        {
+            ssize_t n = tar_pread(pool->fd, buf, left < VERIFY_BUFSIZE ? left : VERIFY_BUFSIZE, off);
+            if (n <= 0)
+            {
+                job->err = 1;
+                break;
+            }
+            digest_update(&d, buf, n);
+            off += n;
+            left -= n;
+        }
+        digest_final(&d, job->digest);
+        /* members are hashed once, their pages are not needed anymore */
+        advise_drop(pool->fd, pool->advice, &start, off, 1);
+    }
+    free(buf);
+    __atomic_fetch_add(&pool->reads, counted.reads, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&pool->bytes_read, counted.bytes_read, __ATOMIC_RELAXED);
+    cur_op = outer;
+    return NULL;
+}
+
+/**
+ * Verifies the archive by scanning its headers, then hashing its members on several threads.
+ *
+ * @return 0 on success, a check_archive() error or -4 if the archive could not be read.
+ */
+static int verify_parallel(int tar_fd, verify_ctx_t *ctx)
+{
+    verify_pool_t pool = {tar_fd, ctx->opts->digest, ctx->tar->advice, NULL, 0, 0, 0, 0};
+    size_t cap = 0;
+    char *names = NULL;
+    size_t names_len = 0, names_cap = 0;
+    int ret = 0;
+    int got = 0;
+
+    tar_iter_t it;
+    iter_init(&it, tar_fd);
+    long nheader = 0;
+    for (; (got = iter_next(&it)) == 1; nheader++)
+    {
+        ret = scan_check(ctx->tar->check, &it.header);
+        if (ret != 0)
+        {
+            if (ret < 0)
+            {
+                fail_header(ctx->tar, "tar_verify", ret, nheader, it.entry.offset);
+            }
+            ret = ret < 0 ? ret : 0;
+            break;
+        }
+        if (it.entry.typeflag != REGTYPE && it.entry.typeflag != AREGTYPE)
+        {
+            continue;
+        }
+        if (pool.njobs == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            verify_job_t *grown = realloc(pool.jobs, cap * sizeof(verify_job_t));
+            if (grown == NULL)
+            {
+                tar_fail_at(ctx->tar, "tar_verify", TAR_ENOMEM, -1, -1, NULL);
+                ret = -4;
+                break;
+            }
+            pool.jobs = grown;
+        }
+        ssize_t name_off = pool_add(&names, &names_len, &names_cap, it.entry.name);
+        if (name_off < 0)
+        {
+            tar_fail_at(ctx->tar, "tar_verify", TAR_ENOMEM, -1, -1, NULL);
+            ret = -4;
+            break;
+        }
+        verify_job_t *job = &pool.jobs[pool.njobs++];
+        job->entry = it.entry;
+        job->entry.name = (const char *)(uintptr_t)name_off;
+        job->entry.linkname = "";
+        job->err = 0;
+    }
+    iter_free(&it);
+    if (got == -3)
+    {
+        tar_fail_at(ctx->tar, "tar_verify", TAR_EIO, nheader, it.next, NULL);
+        ret = -4;
+    }
+
+    if (ret == 0)
+    {
+        for (size_t i = 0; i < pool.njobs; i++)
+        {
+            pool.jobs[i].entry.name = names + (uintptr_t)pool.jobs[i].entry.name;
+        }
+
+        int nthreads = ctx->opts->threads;
+        pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+        int started = 0;
+        if (threads != NULL)
+        {
+            while (started < nthreads && pthread_create(&threads[started], NULL, verify_worker, &pool) == 0)
+            {
+                started++;
+            }
+        }
+        /* the calling thread always takes part, so the pool drains even if no thread started */
+        verify_worker(&pool);
+        for (int i = 0; i < started; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+        free(threads);
+        OP_COUNT(reads, pool.reads);
+        OP_COUNT(bytes_read, pool.bytes_read);
+
+        for (size_t i = 0; i < pool.njobs && !ctx->stopped; i++)
+        {
+            if (pool.jobs[i].err)
+            {
+                tar_fail_at(ctx->tar, "tar_verify", TAR_EIO, -1, pool.jobs[i].entry.offset, NULL);
+                ret = -4;
+                break;
+            }
+            verify_report(ctx, &pool.jobs[i].entry, pool.jobs[i].digest);
+        }
+    }
+    free(pool.jobs);
+    free(names);
+    return ret;
+}
+
+static int tar_verify_impl(int tar_fd, const tar_verify_opts_t *opts, tar_verify_cb cb, void *arg)
+{
+    tar_t *tar = tar_begin(tar_fd);
+    if (tar_fd < 0 || opts == NULL || opts->digest < TAR_DIGEST_CRC32C || opts->digest > TAR_DIGEST_XXH3 ||
+        (opts->manifest == NULL && opts->manifest_len > 0))
+    {
+        TAR_FAIL(tar, TAR_EINVAL, -1, -1, NULL);
+        return -4;
+    }
+
+    verify_ctx_t ctx = {tar, opts, NULL, NULL, cb, arg, 0, 0};
+    if (opts->manifest != NULL)
+    {
+        ctx.sorted = malloc(opts->manifest_len * sizeof(*ctx.sorted) + 1);
+        ctx.seen = calloc(opts->manifest_len + 1, 1);
+        if (ctx.sorted == NULL || ctx.seen == NULL)
+        {
+            free(ctx.sorted);
+            free(ctx.seen);
+            TAR_FAIL(tar, TAR_ENOMEM, -1, -1, NULL);
+            return -4;
+        }
+        for (size_t i = 0; i < opts->manifest_len; i++)
+        {
+            ctx.sorted[i] = &opts->manifest[i];
+        }
+        qsort(ctx.sorted, opts->manifest_len, sizeof(*ctx.sorted), manifest_cmp);
+    }
+
+    int ret = opts->threads > 1 ? verify_parallel(tar_fd, &ctx) : verify_stream(tar_fd, &ctx);
+
+    if (ret == 0 && ctx.sorted != NULL)
+    {
+        for (size_t i = 0; i < opts->manifest_len; i++)
+        {
+            if (ctx.seen[i])
+            {
+                continue;
+            }
+            ctx.failures++;
+            tar_entry_t missing = {ctx.sorted[i]->name, "", AREGTYPE, 0, -1};
+            if (cb != NULL && !ctx.stopped && cb(&missing, NULL, TAR_VERIFY_MISSING, arg) != 0)
+            {
+                ctx.stopped = 1;
+            }
+        }
+    }
+    free(ctx.sorted);
+    free(ctx.seen);
+    return ret < 0 ? ret : ctx.failures;
+}
+
+/**
+ * Verifies the contents of the archive by computing a digest of every regular file member.
+ *
+ * Headers are validated as by check_archive() while the archive is read sequentially with large reads,
+ * member data being hashed in the same pass. With more than one thread, the headers are scanned first
+ * and the members are then hashed concurrently with pread(). Each digest is compared against the
+ * manifest when one is given. Results are reported in archive order, followed by the missing entries.
+ *
+ * Digests are those of the reference implementations, as printed by xxhsum -H3 for TAR_DIGEST_XXH3,
+ * the fastest, and by xxhsum -H1 for TAR_DIGEST_XXH64, kept for the manifests written with it.
+ *
+ * @param tar_fd A file descriptor pointing to a tar archive file.
+ * @param opts The digest algorithm, the manifest and the parallelism of the verification.
+ * @param cb A callback invoked for each member checked, may be NULL.
+ * @param arg A user argument passed to `cb`.
+ *
+ * @return a zero or positive value if the archive could be read, representing the number of members
+ *         that do not match or are missing from the manifest,
+ *         -1, -2 or -3 if a header is invalid, as check_archive(),
+ *         -4 if the arguments are invalid, the archive could not be read or memory ran out.
+ */
+int tar_verify(int tar_fd, const tar_verify_opts_t *opts, tar_verify_cb cb, void *arg)
+{
+    tar_op_t op;
+    op_begin(&op, tar_fd, TAR_OP_VERIFY, NULL);
+    return op_end(&op, tar_verify_impl(tar_fd, opts, cb, arg));
+}
+
+/* Hashes a buffer with xxHash64 */
+static uint64_t xxh64(const void *p, size_t n, uint64_t seed)
+{
+    digest_t d;
+    digest_init(&d, TAR_DIGEST_XXH64);
+    for (int i = 0; i < 4; i++)
+    {
+        d.u.xxh.v[i] += seed;
+    }
+    digest_update(&d, p, n);
+    return xxh64_final(&d);
+}
+
+/* Hashes the canonical form of a path, without its trailing slash, so that paths naming the same entry collide */
+static uint64_t path_hash(const char *path, uint64_t seed)
+{
+    digest_t d;
+    digest_init(&d, TAR_DIGEST_XXH64);
+    for (int i = 0; i < 4; i++)
+    {
+        d.u.xxh.v[i] += seed;
+    }
+    size_t len;
+    for (const char *p = path_next(path, &len); len > 0; p = path_next(p + len, &len))
+    {
+        if (d.total > 0)
+        {
+            digest_update(&d, (const uint8_t *)"/", 1);
+        }
+        digest_update(&d, (const uint8_t *)p, len);
+    }
+    return xxh64_final(&d);
+}
+
+/*
+ * Index of the entries of an archive, keyed by name. Entries are appended as they are scanned, so a later
+ * member with the same name shadows the earlier one by taking over its slot.
+ * A version of the index is built privately and never modified once published in the handle, but for
+ * its name table, set once: members appended to the archive are indexed into a copy, which replaces the
+ * version that lookups may be reading.
+ *
+ * Entries are stored column by column, their strings in a single pool, so that an index of millions of
+ * entries is a few large allocations: per entry, 21 bytes of columns and 8 bytes per slot, with 1.3 to 2.7
+ * slots per name. A lookup reads one run of slots, whose tags skip the names that cannot match, then the name.
+ *
+ * With TAR_INDEX_PERFECT, the slots of a version are replaced once it is built by a minimal perfect hash
+ * of its names: 4 bytes per name and 1 per bucket of about four names, and a lookup reads a single
+ * position, then the name. Such a version cannot take more entries, its copies get slots again.
+ *
+ * Either way, a Bloom filter of the names answers most lookups of a name that is not indexed before they
+ * read the slots: it is sized for up to twice the names, with 12 to 24 bits per name.
+ */
+typedef struct index_slot
+{
+    uint32_t tag;                 /* low bits of the path_hash() of the name, which also place the slot */
+    uint32_t entry;               /* entry number plus one, 0 when the slot is empty */
+} index_slot_t;
+
+struct tar_index
+{
+    char *pool;                   /* name then linkname of each entry, both null-terminated */
+    size_t pool_len;
+    size_t pool_cap;
+    uint32_t *names_at;           /* offset of the name of each entry in the pool */
+    off_t *offsets;               /* header offset of each entry, -1 for an implied directory */
+    uint64_t *sizes;
+    char *types;                  /* typeflag of each entry */
+    uint64_t *shadowed;           /* bit set of the entries shadowed by a later one of the same name */
+    size_t count;                 /* entries, in archive order */
+    size_t cap;
+    index_slot_t *slots;          /* open addressing table, linear probing */
+    size_t mask;                  /* number of slots minus one */
+    size_t names;                 /* distinct names, the used slots */
+    uint32_t *pilots;             /* displacement of the names of each bucket of the perfect hash */
+    uint32_t *perfect;            /* entry number at each position of the perfect hash, NULL with slots */
+    size_t buckets;
+    uint64_t seed;                /* of the perfect hash, drawn again when a bucket finds no free positions */
+    uint32_t *filter;             /* split block Bloom filter of the tags of the names, NULL if memory ran out */
+    size_t filter_blocks;         /* blocks of 8 words */
+    size_t filter_cap;            /* names the filter is sized for, rebuilt larger past them */
+    off_t last;                   /* header offset of the last member indexed, -1 before the first */
+    name_table_t *table;          /* names in walk order, built by the first range scan, see index_names() */
+    off_t end;                    /* offset of the end-of-archive marker, where appended members start */
+    uint64_t stamp;               /* file_stamp() of the archive indexed */
+    uint64_t retired;             /* epoch that ended when the version was replaced */
+    tar_index_t *older;           /* next version in the list of retired ones */
+};
+
+/*
+ * Summarizes the size and modification time of the archive file. Appending may not change the size,
+ * as tar pads archives to whole records, so the modification time tells when to look past the marker.
+ */
+static uint64_t file_stamp(const struct stat *st)
+{
+    uint64_t mtime = (uint64_t)st->st_mtim.tv_sec * 1000000000u + st->st_mtim.tv_nsec;
+    return ((uint64_t)st->st_size * 0x9E3779B97F4A7C15u) ^ mtime;
+}
+
+/* Returns the slot holding `name`, or the empty slot where it belongs, `hash` being its path_hash() */
+static index_slot_t *index_slot(const tar_index_t *index, uint64_t hash, const char *name)
+{
+    uint32_t tag = (uint32_t)hash;
+    for (size_t i = tag & index->mask;; i = (i + 1) & index->mask)
+    {
+        index_slot_t *slot = &index->slots[i];
+        if (slot->entry == 0 || (slot->tag == tag && path_eq(index->pool + index->names_at[slot->entry - 1], name)))
+        {
+            return slot;
+        }
+    }
+}
+
+/* Mixes the bits of a hash, with the finalizer of MurmurHash3 */
+static uint64_t hash_mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDu;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53u;
+    x ^= x >> 33;
+    return x;
+}
+
+/* Maps a hash to [0, n), n being below 2^32, with a multiplication rather than a division */
+static size_t hash_range(uint64_t hash, size_t n)
+{
+    return (size_t)(((hash >> 32) * (uint64_t)n) >> 32);
+}
+
+/* Returns the bucket of the perfect hash holding a name, `hash` being its path_hash() */
+static size_t perfect_bucket(const tar_index_t *index, uint64_t hash)
+{
+    return hash_range(hash_mix(hash ^ index->seed), index->buckets);
+}
+
+/* Returns the position of a name in the perfect hash when its bucket is displaced by `pilot` */
+static size_t perfect_place(const tar_index_t *index, uint64_t hash, uint64_t pilot)
+{
+    return hash_range(hash_mix(hash ^ index->seed ^ (pilot + 1) * 0x9E3779B97F4A7C15u), index->names);
+}
+
+/* Bits of the filter per name it is sized for */
+#define FILTER_BITS 12
+
+/* Odd multipliers giving the bit set in each word of a filter block, from the Parquet split block filter */
+static const uint32_t filter_salts[8] = {0x47B6137Bu, 0x44974D91u, 0x8824AD5Bu, 0xA2B7289Du,
+                                         0x705495C7u, 0x2DF1424Bu, 0x9EFC4947u, 0x5C6BFB31u};
+
+/* Returns the block of the filter of an index holding the bits of a tag */
+static uint32_t *filter_block(const tar_index_t *index, uint32_t tag)
+{
+    return index->filter + 8 * (((uint64_t)tag * index->filter_blocks) >> 32);
+}
+
+/* Sets the bits of a tag in the filter of an index, one in each word of its block */
+static void filter_add(tar_index_t *index, uint32_t tag)
+{
+    uint32_t *block = filter_block(index, tag);
+    uint32_t key = (uint32_t)hash_mix(tag);
+    for (int i = 0; i < 8; i++)
+    {
+        block[i] |= 1u << ((key * filter_salts[i]) >> 27);
+    }
+}
+
+/* Returns 0 if no name of the tag is indexed, 1 if one may be */
+static int filter_has(const tar_index_t *index, uint32_t tag)
+{
+    if (index->filter == NULL)
+    {
+        return 1;
+    }
+    const uint32_t *block = filter_block(index, tag);
+    uint32_t key = (uint32_t)hash_mix(tag);
+    for (int i = 0; i < 8; i++)
+    {
+        if (!(block[i] & (1u << ((key * filter_salts[i]) >> 27))))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Sizes the filter of an index for twice its names and sets the tags of its slots in it. The filter is
+ * dropped if memory ran out, lookups reading the slots of every name then.
+ */
+static void filter_grow(tar_index_t *index)
+{
+    size_t cap = index->names * 2 > 1024 ? index->names * 2 : 1024;
+    size_t blocks = (cap * FILTER_BITS + 255) / 256;
+    free(index->filter);
+    index->filter = calloc(blocks * 8, sizeof(uint32_t));
+    index->filter_blocks = index->filter != NULL ? blocks : 0;
+    index->filter_cap = index->filter != NULL ? cap : SIZE_MAX;
+    for (size_t i = 0; index->filter != NULL && i <= index->mask; i++)
+    {
+        if (index->slots[i].entry != 0)
+        {
+            filter_add(index, index->slots[i].tag);
+        }
+    }
+}
+
+/* index_lookup() of a path whose path_hash() is known */
+static size_t index_lookup_hash(const tar_index_t *index, const char *path, uint64_t hash)
+{
+    if (!filter_has(index, (uint32_t)hash))
+    {
+        OP_COUNT(index_filtered, 1);
+        return 0;
+    }
+    if (index->perfect != NULL)
+    {
+        /* the only name that can be `path` */
+        uint32_t entry = index->perfect[perfect_place(index, hash, index->pilots[perfect_bucket(index, hash)])];
+        return path_eq(index->pool + index->names_at[entry], path) ? entry + 1 : 0;
+    }
+    return index_slot(index, hash, path)->entry;
+}
+
+/* Returns the number plus one of the entry named by `path` in any form, 0 if there is none */
+static size_t index_lookup(const tar_index_t *index, const char *path)
+{
+    return index_lookup_hash(index, path, path_hash(path, 0));
+}
+
+/* Fills `entry` with entry `i` of an index, whose strings stay valid as long as the index */
+static void index_entry(const tar_index_t *index, size_t i, tar_entry_t *entry)
+{
+    entry->name = index->pool + index->names_at[i];
+    entry->linkname = entry->name + strlen(entry->name) + 1;
+    entry->typeflag = index->types[i];
+    entry->size = index->sizes[i];
+    entry->offset = index->offsets[i];
+}
+
+/* Returns 1 if an entry is the last member of its name in an index, the one lookups see */
+static int index_visible(const tar_index_t *index, size_t i)
+{
+    return !(index->shadowed[i / 64] & (1ull << (i % 64)));
+}
+
+/* Names of a front-coded block, the first one stored whole */
+#define NAMES_BLOCK 16
+
+/*
+ * Names of the visible entries of an index version, sorted as by walk_cmp(), a slash sorting first, so that
+ * an entry and the entries below it are a contiguous range of names. Names are front coded in blocks of
+ * NAMES_BLOCK: each is stored as the length of the prefix it shares with the previous name and the rest
+ * of it, the first name of a block sharing none so that binary searches can start at any block.
+ */
+struct name_table
+{
+    uint8_t *data;                /* varint shared length, varint rest length and rest of each name */
+    uint32_t *restarts;           /* offset in data of the first name of each block */
+    uint32_t *entries;            /* entry number of each name */
+    size_t count;
+    size_t longest;               /* length of the longest name */
+};
+
+/* A position in a name table, with the name found there */
+typedef struct name_cursor
+{
+    const name_table_t *table;
+    size_t i;                     /* number of the current name, table->count past the last one */
+    size_t next;                  /* offset in data of the name following it */
+    char *name;                   /* the current name, table->longest + 1 bytes */
+} name_cursor_t;
+
+/* Appends a number to a buffer as a LEB128 varint, returning the bytes written */
+static size_t varint_put(uint8_t *p, size_t v)
+{
+    size_t n = 0;
+    for (; v >= 0x80; v >>= 7)
+    {
+        p[n++] = (uint8_t)(v | 0x80);
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+/* Reads a LEB128 varint, moving `p` past it */
+static size_t varint_get(const uint8_t **p)
+{
+    size_t v = 0;
+    for (int shift = 0;; shift += 7)
+    {
+        uint8_t byte = *(*p)++;
+        v |= (size_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+        {
+            return v;
+        }
+    }
+}
+
+/* Frees a name table */
+static void names_free(name_table_t *table)
+{
+    if (table == NULL)
+    {
+        return;
+    }
+    free(table->data);
+    free(table->restarts);
+    free(table->entries);
+    free(table);
+}
+
+/* A name to sort into a table */
+typedef struct name_sort
+{
+    const char *name;
+    uint32_t entry;
+} name_sort_t;
+
+static int name_sort_cmp(const void *a, const void *b)
+{
+    return walk_cmp(((const name_sort_t *)a)->name, ((const name_sort_t *)b)->name, 0);
+}
+
+/* Builds the name table of an index version, NULL if memory ran out */
+static name_table_t *names_build(const tar_index_t *index)
+{
+    size_t n = index->names;
+    name_table_t *table = calloc(1, sizeof(name_table_t));
+    name_sort_t *sorted = malloc((n + 1) * sizeof(name_sort_t));
+    size_t cap = index->pool_len / 2 + 64;
+    if (table != NULL)
+    {
+        table->data = malloc(cap);
+        table->restarts = malloc(((n + NAMES_BLOCK - 1) / NAMES_BLOCK + 1) * sizeof(uint32_t));
+        table->entries = malloc((n + 1) * sizeof(uint32_t));
+    }
+    if (table == NULL || sorted == NULL || table->data == NULL || table->restarts == NULL || table->entries == NULL)
+    {
+        names_free(table);
+        free(sorted);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < index->count; i++)
+    {
+        if (index_visible(index, i))
+        {
+            sorted[table->count].name = index->pool + index->names_at[i];
+            sorted[table->count++].entry = i;
+        }
+    }
+    qsort(sorted, table->count, sizeof(name_sort_t), name_sort_cmp);
+
+    size_t len = 0;
+    const char *prev = "";
+    for (size_t k = 0; k < table->count; k++)
+    {
+        const char *name = sorted[k].name;
+        size_t name_len = strlen(name);
+        size_t shared = 0;
+        if (k % NAMES_BLOCK != 0)
+        {
+            while (name[shared] != '\0' && name[shared] == prev[shared])
+            {
+                shared++;
+            }
+        }
+        else
+        {
+            table->restarts[k / NAMES_BLOCK] = len;
+        }
+        if (len + 2 * 10 + name_len - shared > cap)
+        {
+            while (len + 2 * 10 + name_len - shared > cap)
+            {
+                cap *= 2;
+            }
+            uint8_t *grown = cap <= UINT32_MAX ? realloc(table->data, cap) : NULL;
+            if (grown == NULL)
+            {
+                names_free(table);
+                free(sorted);
+                return NULL;
+            }
+            table->data = grown;
+        }
+        len += varint_put(table->data + len, shared);
+        len += varint_put(table->data + len, name_len - shared);
+        memcpy(table->data + len, name + shared, name_len - shared);
+        len += name_len - shared;
+        table->entries[k] = sorted[k].entry;
+        table->longest = name_len > table->longest ? name_len : table->longest;
+        prev = name;
+    }
+    free(sorted);
+    return table;
+}
+
+/* Decodes the name at offset `at` of the data of a table into the cursor, over the name preceding it */
+static void names_load(name_cursor_t *c, size_t at)
+{
+    const uint8_t *p = c->table->data + at;
+    size_t shared = varint_get(&p);
+    size_t rest = varint_get(&p);
+    memcpy(c->name + shared, p, rest);
+    c->name[shared + rest] = '\0';
+    c->next = p + rest - c->table->data;
+}
+
+/* Moves a cursor to the next name */
+static void names_step(name_cursor_t *c)
+{
+    if (++c->i < c->table->count)
+    {
+        names_load(c, c->next);
+    }
+}
+
+/* Moves a cursor to the first name sorting at or after `key`, with a binary search of the blocks */
+static void names_seek(name_cursor_t *c, const char *key)
+{
+    const name_table_t *table = c->table;
+    size_t lo = 0, hi = (table->count + NAMES_BLOCK - 1) / NAMES_BLOCK;
+    if (hi == 0)
+    {
+        c->i = 0;
+        return;
+    }
+    while (hi - lo > 1)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        names_load(c, table->restarts[mid]);
+        if (walk_cmp(c->name, key, 0) <= 0)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    c->i = lo * NAMES_BLOCK;
+    names_load(c, table->restarts[lo]);
+    while (c->i < table->count && walk_cmp(c->name, key, 0) < 0)
+    {
+        names_step(c);
+    }
+}
+
+/*
+ * Returns the name table of an index version, building it on first use. The version is otherwise immutable:
+ * threads racing to build the table publish the first one built and free theirs.
+ * Returns NULL if memory ran out.
+ */
+static const name_table_t *index_names(tar_index_t *index)
+{
+    name_table_t *table = __atomic_load_n(&index->table, __ATOMIC_ACQUIRE);
+    if (table != NULL)
+    {
+        return table;
+    }
+    table = names_build(index);
+    name_table_t *expected = NULL;
+    if (table != NULL &&
+        !__atomic_compare_exchange_n(&index->table, &expected, table, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        names_free(table);
+        table = expected;
+    }
+    return table;
+}
+
+/**
+ * Lists the entry named `prefix` and the entries below it, in the order of the name table, stopping
+ * `max_depth` levels below `prefix`: the names under a directory at that depth are skipped with a seek.
+ *
+ * @param prefix A canonical path without a trailing slash, "" for every name.
+ * @param max_depth The levels below `prefix` to list, zero for all.
+ * @param out Set to the entry numbers, to be freed by the caller.
+ *
+ * @return the number of entries listed, -1 if memory ran out.
+ */
+static ssize_t names_range(const name_table_t *table, const char *prefix, int max_depth, uint32_t **out)
+{
+    size_t plen = strlen(prefix);
+    name_cursor_t c = {table, 0, 0, malloc(table->longest + 1)};
+    char *key = malloc(table->longest + 2);
+    size_t count = 0, cap = 64;
+    uint32_t *entries = malloc(cap * sizeof(uint32_t));
+    if (c.name == NULL || key == NULL || entries == NULL)
+    {
+        free(c.name);
+        free(key);
+        free(entries);
+        return -1;
+    }
+
+    names_seek(&c, prefix);
+    while (c.i < table->count)
+    {
+        const char *name = c.name;
+        if (strncmp(name, prefix, plen) != 0 || (plen > 0 && name[plen] != '\0' && name[plen] != '/'))
+        {
+            break;
+        }
+        if (count == cap)
+        {
+            uint32_t *grown = realloc(entries, cap * 2 * sizeof(uint32_t));
+            if (grown == NULL)
+            {
+                free(c.name);
+                free(key);
+                free(entries);
+                return -1;
+            }
+            entries = grown;
+            cap *= 2;
+        }
+        entries[count++] = table->entries[c.i];
+
+        /* the slash ending the last component listed, the names past it being too deep */
+        const char *end = NULL;
+        if (max_depth > 0 && name[plen] != '\0')
+        {
+            end = name + plen + (plen > 0);
+            for (int depth = 0; depth < max_depth && end != NULL; depth++)
+            {
+                end = strchr(end + (depth > 0), '/');
+            }
+        }
+        if (end == NULL)
+        {
+            names_step(&c);
+            continue;
+        }
+        /* "a/b\x01" sorts after everything under "a/b/", a slash sorting first */
+        size_t key_len = end - name;
+        memcpy(key, name, key_len);
+        key[key_len] = '\x01';
+        key[key_len + 1] = '\0';
+        names_seek(&c, key);
+    }
+    free(c.name);
+    free(key);
+    *out = entries;
+    return count;
+}
+
+/* Doubles the slots of the index, returns -1 if memory ran out */
+static int index_grow(tar_index_t *index)
+{
+    size_t nslots = (index->mask + 1) * 2;
+    index_slot_t *slots = calloc(nslots, sizeof(index_slot_t));
+    if (slots == NULL)
+    {
+        return -1;
+    }
+    /* the tags hold the bits that place the slots, names need not be hashed again */
+    for (size_t i = 0; i <= index->mask; i++)
+    {
+        index_slot_t slot = index->slots[i];
+        if (slot.entry != 0)
+        {
+            size_t j = slot.tag & (nslots - 1);
+            while (slots[j].entry != 0)
+            {
+                j = (j + 1) & (nslots - 1);
+            }
+            slots[j] = slot;
+        }
+    }
+    free(index->slots);
+    index->slots = slots;
+    index->mask = nslots - 1;
+    return 0;
+}
+
+/* Grows the columns of the index to `cap` entries, returns -1 if memory ran out */
+static int index_reserve(tar_index_t *index, size_t cap)
+{
+    uint32_t *names_at = realloc(index->names_at, cap * sizeof(uint32_t));
+    index->names_at = names_at != NULL ? names_at : index->names_at;
+    off_t *offsets = realloc(index->offsets, cap * sizeof(off_t));
+    index->offsets = offsets != NULL ? offsets : index->offsets;
+    uint64_t *sizes = realloc(index->sizes, cap * sizeof(uint64_t));
+    index->sizes = sizes != NULL ? sizes : index->sizes;
+    char *types = realloc(index->types, cap);
+    index->types = types != NULL ? types : index->types;
+    uint64_t *shadowed = realloc(index->shadowed, (cap + 63) / 64 * sizeof(uint64_t));
+    index->shadowed = shadowed != NULL ? shadowed : index->shadowed;
+    if (names_at == NULL || offsets == NULL || sizes == NULL || types == NULL || shadowed == NULL)
+    {
+        return -1;
+    }
+    index->cap = cap;
+    return 0;
+}
+
+/* Adds an entry to the index, shadowing any earlier entry with the same name */
+static int index_add(tar_index_t *index, const tar_entry_t *entry)
+{
+    if (index->count == index->cap && index_reserve(index, index->cap ? index->cap * 2 : 64) == -1)
+    {
+        return -1;
+    }
+    if ((index->names + 1) * 4 > (index->mask + 1) * 3 && index_grow(index) == -1)
+    {
+        return -1;
+    }
+
+    size_t name_len = strlen(entry->name) + 1;
+    size_t link_len = strlen(entry->linkname) + 1;
+    size_t pool_len = index->pool_len + name_len + link_len;
+    if (pool_len > UINT32_MAX || index->count >= UINT32_MAX)
+    {
+        /* names_at and the slots hold 32-bit numbers */
+        return -1;
+    }
+    if (pool_len > index->pool_cap)
+    {
+        size_t cap = index->pool_cap ? index->pool_cap * 2 : 4096;
+        while (cap < pool_len)
+        {
+            cap *= 2;
+        }
+        char *pool = realloc(index->pool, cap);
+        if (pool == NULL)
+        {
+            return -1;
+        }
+        index->pool = pool;
+        index->pool_cap = cap;
+    }
+
+    uint64_t hash = path_hash(entry->name, 0);
+    index_slot_t *slot = index_slot(index, hash, entry->name);
+
+    size_t i = index->count++;
+    memcpy(index->pool + index->pool_len, entry->name, name_len);
+    memcpy(index->pool + index->pool_len + name_len, entry->linkname, link_len);
+    index->names_at[i] = index->pool_len;
+    index->pool_len = pool_len;
+    index->offsets[i] = entry->offset;
+    index->sizes[i] = entry->size;
+    index->types[i] = entry->typeflag;
+    if (i % 64 == 0)
+    {
+        index->shadowed[i / 64] = 0;
+    }
+
+    int added = slot->entry == 0;
+    if (added)
+    {
+        index->names++;
+    }
+    else
+    {
+        size_t old = slot->entry - 1;
+        index->shadowed[old / 64] |= 1ull << (old % 64);
+    }
+    slot->tag = (uint32_t)hash;
+    slot->entry = index->count;
+    if (index->names > index->filter_cap)
+    {
+        filter_grow(index);
+    }
+    else if (added)
+    {
+        filter_add(index, slot->tag);
+    }
+    return 0;
+}
+
+/*
+ * Adds a member of the archive to the index, after the directories its path implies that have no entry
+ * yet: "a/b/c" implies "a/" and "a/b/", which many archivers do not store. An implied directory has no
+ * header and is indexed with an offset of -1, a later member of the same name shadowing it.
+ *
+ * A hard link whose target is indexed becomes an alias of it: its entry takes the header offset and size
+ * of the target, so that reading it reads the target data and costs no lookup. Hard links to links or
+ * to empty files keep a size of zero and are resolved by name.
+ */
+static int index_add_member(tar_index_t *index, const tar_entry_t *entry)
+{
+    char dir[TAR_NAME_MAX];
+    const char *slash;
+    for (slash = strchr(entry->name, '/'); slash != NULL && slash[1] != '\0'; slash = strchr(slash + 1, '/'))
+    {
+        size_t len = slash - entry->name + 1;
+        if (len >= sizeof(dir))
+        {
+            break;
+        }
+        memcpy(dir, entry->name, len);
+        dir[len] = '\0';
+        if (index_lookup(index, dir) == 0)
+        {
+            tar_entry_t implied = {dir, "", DIRTYPE, 0, -1};
+            if (index_add(index, &implied) == -1)
+            {
+                return -1;
+            }
+        }
+    }
+
+    if (index_add(index, entry) == -1)
+    {
+        return -1;
+    }
+    index->last = entry->offset;
+    if (entry->typeflag == LNKTYPE)
+    {
+        size_t target = index_lookup(index, entry->linkname);
+        char type = target != 0 ? index->types[target - 1] : SYMTYPE;
+        if (type == REGTYPE || type == AREGTYPE || (type == LNKTYPE && index->sizes[target - 1] > 0))
+        {
+            index->offsets[index->count - 1] = index->offsets[target - 1];
+            index->sizes[index->count - 1] = index->sizes[target - 1];
+        }
+    }
+    return 0;
+}
+
+/**
+ * Indexes the members written over the previous end-of-archive marker of an unpublished index version.
+ *
+ * @param st The status of the archive file, whose stamp the index takes once up to date.
+ *
+ * @return the number of headers read, -1 to -3 for an invalid header as check_archive(),
+ *         -4 on a read error or if memory ran out.
+ */
+static int index_update(tar_t *tar, tar_index_t *index, const struct stat *st)
+{
+    tar_iter_t it;
+    iter_init(&it, tar->fd);
+    it.next = index->end;
+    header_pipe_t pipe;
+    int piped = tar->prefetch > 0 && pipe_start(&pipe, &it, tar->prefetch) == 0;
+    int nheader = 0;
+    int ret = 0;
+    int got;
+    while ((got = iter_next(&it)) == 1)
+    {
+        ret = scan_check(tar->check, &it.header);
+        if (ret != 0)
+        {
+            if (ret < 0)
+            {
+                fail_header(tar, "tar_index", ret, -1, it.entry.offset);
+            }
+            ret = ret < 0 ? ret : 0;
+            break;
+        }
+        nheader++;
+        if (index_add_member(index, &it.entry) == -1)
+        {
+            tar_fail_at(tar, "tar_index", TAR_ENOMEM, -1, -1, NULL);
+            ret = -4;
+            break;
+        }
+        /* resume after the last member indexed if the scan stops early */
+        index->end = it.next;
+    }
+    if (piped)
+    {
+        pipe_stop(&pipe);
+    }
+    iter_free(&it);
+    if (got == -3)
+    {
+        tar_fail_at(tar, "tar_index", TAR_EIO, -1, it.next, NULL);
+        ret = -4;
+    }
+    if (ret < 0)
+    {
+        return ret;
+    }
+    /* index->end is past the last member, at the marker or at the header ending the archive */
+    index->stamp = file_stamp(st);
+    return nheader;
+}
+
+/* Allocates an empty index, NULL if memory ran out */
+static tar_index_t *index_new(void)
+{
+    tar_index_t *index = calloc(1, sizeof(tar_index_t));
+    index_slot_t *slots = calloc(64, sizeof(index_slot_t));
+    if (index == NULL || slots == NULL)
+    {
+        free(index);
+        free(slots);
+        return NULL;
+    }
+    index->slots = slots;
+    index->mask = 63;
+    index->last = -1;
+    filter_grow(index);
+    return index;
+}
+
+/* Frees an index and the strings of its entries */
+static void index_free(tar_index_t *index)
+{
+    if (index == NULL)
+    {
+        return;
+    }
+    free(index->pool);
+    free(index->names_at);
+    free(index->offsets);
+    free(index->sizes);
+    free(index->types);
+    free(index->shadowed);
+    free(index->slots);
+    free(index->pilots);
+    free(index->perfect);
+    free(index->filter);
+    names_free(index->table);
+    free(index);
+}
+
+/* Builds the slots of an index from its visible entries, returns -1 if memory ran out */
+static int index_rehash(tar_index_t *index)
+{
+    size_t nslots = 64;
+    while (index->names * 4 > nslots * 3)
+    {
+        nslots *= 2;
+    }
+    index_slot_t *slots = calloc(nslots, sizeof(index_slot_t));
+    if (slots == NULL)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < index->count; i++)
+    {
+        if (index_visible(index, i))
+        {
+            uint32_t tag = (uint32_t)path_hash(index->pool + index->names_at[i], 0);
+            size_t j = tag & (nslots - 1);
+            while (slots[j].entry != 0)
+            {
+                j = (j + 1) & (nslots - 1);
+            }
+            slots[j].tag = tag;
+            slots[j].entry = i + 1;
+        }
+    }
+    index->slots = slots;
+    index->mask = nslots - 1;
+    return 0;
+}
+
+/*
+ * Places the names of the buckets of a perfect hash, the largest buckets first, while most positions are free.
+ * Each bucket takes the first pilot that moves all of its names to free positions.
+ *
+ * @param hashes The path_hash() of each name.
+ * @param order The names sorted by bucket, bucket b holding those from starts[b] to starts[b + 1].
+ *
+ * @return 0 if every bucket was placed, -1 if a bucket found no pilot under the current seed.
+ */
+static int perfect_place_all(tar_index_t *index, const uint64_t *hashes, const uint32_t *order,
+                             const uint32_t *starts, const uint32_t *by_size, size_t *taken_at, uint64_t *taken)
+{
+    /* a name alone in its bucket needs about names / free positions tries, the last one about names */
+    uint64_t max_pilot = (uint64_t)index->names * 64 + 1024;
+    max_pilot = max_pilot < UINT32_MAX ? max_pilot : UINT32_MAX;
+    for (size_t k = 0; k < index->buckets; k++)
+    {
+        size_t b = by_size[k];
+        size_t size = starts[b + 1] - starts[b];
+        uint64_t pilot;
+        for (pilot = 0; size > 0 && pilot < max_pilot; pilot++)
+        {
+            size_t j;
+            for (j = 0; j < size; j++)
+            {
+                size_t pos = perfect_place(index, hashes[order[starts[b] + j]], pilot);
+                if (taken[pos / 64] & (1ull << (pos % 64)))
+                {
+                    break;
+                }
+                taken[pos / 64] |= 1ull << (pos % 64);
+                taken_at[j] = pos;
+            }
+            if (j == size)
+            {
+                break;
+            }
+            while (j-- > 0)
+            {
+                taken[taken_at[j] / 64] &= ~(1ull << (taken_at[j] % 64));
+            }
+        }
+        if (pilot == max_pilot)
+        {
+            return -1;
+        }
+        index->pilots[b] = pilot;
+        for (size_t j = 0; j < size; j++)
+        {
+            index->perfect[perfect_place(index, hashes[order[starts[b] + j]], pilot)] = order[starts[b] + j];
+        }
+    }
+    return 0;
+}
+
+/*
+ * Replaces the slots of an index version by a minimal perfect hash of its names, with hash and displace:
+ * the names are spread into buckets of about four, and the names of each bucket are moved together to
+ * the free positions that a pilot value chosen for the bucket gives them, in a table of one position per name.
+ * The version keeps its slots if the names could not be placed or if memory ran out, lookups working either way.
+ *
+ * @return 0 if the version has a perfect hash, -1 if it keeps its slots.
+ */
+static int index_perfect(tar_index_t *index)
+{
+    size_t n = index->names;
+    if (index->perfect != NULL || n == 0)
+    {
+        return index->perfect != NULL ? 0 : -1;
+    }
+
+    size_t buckets = n / 4 + 1;
+    uint64_t *hashes = malloc(n * sizeof(uint64_t));
+    uint32_t *entries = malloc(n * sizeof(uint32_t));
+    uint32_t *order = malloc(n * sizeof(uint32_t));
+    uint32_t *starts = malloc((buckets + 1) * sizeof(uint32_t));
+    uint32_t *by_size = malloc(buckets * sizeof(uint32_t));
+    size_t *sizes = calloc(n + 1, sizeof(size_t));
+    size_t *taken_at = malloc(n * sizeof(size_t));
+    uint64_t *taken = malloc((n + 63) / 64 * sizeof(uint64_t));
+    index->pilots = malloc(buckets * sizeof(uint32_t));
+    index->perfect = malloc(n * sizeof(uint32_t));
+    int ret = -1;
+    if (hashes == NULL || entries == NULL || order == NULL || starts == NULL || by_size == NULL || sizes == NULL ||
+        taken_at == NULL || taken == NULL || index->pilots == NULL || index->perfect == NULL)
+    {
+        goto out;
+    }
+
+    size_t key = 0;
+    for (size_t i = 0; i < index->count; i++)
+    {
+        if (index_visible(index, i))
+        {
+            hashes[key] = path_hash(index->pool + index->names_at[i], 0);
+            entries[key++] = i;
+        }
+    }
+
+    index->buckets = buckets;
+    for (uint64_t attempt = 1; attempt <= 8 && ret == -1; attempt++)
+    {
+        index->seed = hash_mix(attempt);
+        /* counting sorts of the names by bucket, then of the buckets by decreasing size */
+        memset(starts, 0, (buckets + 1) * sizeof(uint32_t));
+        for (size_t k = 0; k < n; k++)
+        {
+            starts[perfect_bucket(index, hashes[k]) + 1]++;
+        }
+        memset(sizes, 0, (n + 1) * sizeof(size_t));
+        size_t largest = 0;
+        for (size_t b = 0; b < buckets; b++)
+        {
+            size_t size = starts[b + 1];
+            sizes[size]++;
+            largest = size > largest ? size : largest;
+            starts[b + 1] += starts[b];
+            index->pilots[b] = starts[b];
+        }
+        for (size_t k = 0; k < n; k++)
+        {
+            order[index->pilots[perfect_bucket(index, hashes[k])]++] = k;
+        }
+        size_t at = 0;
+        for (size_t size = largest + 1; size-- > 0;)
+        {
+            size_t nbuckets = sizes[size];
+            sizes[size] = at;
+            at += nbuckets;
+        }
+        for (size_t b = 0; b < buckets; b++)
+        {
+            by_size[sizes[starts[b + 1] - starts[b]]++] = b;
+        }
+
+        memset(taken, 0, (n + 63) / 64 * sizeof(uint64_t));
+        ret = perfect_place_all(index, hashes, order, starts, by_size, taken_at, taken);
+    }
+    if (ret == 0)
+    {
+        /* positions were given the numbers of the names, they take those of their entries */
+        for (size_t pos = 0; pos < n; pos++)
+        {
+            index->perfect[pos] = entries[index->perfect[pos]];
+        }
+    }
+
+out:
+    free(hashes);
+    free(entries);
+    free(order);
+    free(starts);
+    free(by_size);
+    free(sizes);
+    free(taken_at);
+    free(taken);
+    if (ret == -1)
+    {
+        free(index->pilots);
+        free(index->perfect);
+        index->pilots = NULL;
+        index->perfect = NULL;
+        index->buckets = 0;
+        return -1;
+    }
+    free(index->slots);
+    index->slots = NULL;
+    index->mask = 0;
+    return 0;
+}
+
+/*
+ * Copies an index version, so that members can be added to the copy while lookups read the original.
+ * The copy of a version with a perfect hash gets slots, built from the names.
+ */
+static tar_index_t *index_copy(const tar_index_t *index)
+{
+    tar_index_t *copy = calloc(1, sizeof(tar_index_t));
+    if (copy == NULL)
+    {
+        return NULL;
+    }
+    copy->pool = malloc(index->pool_cap);
+    copy->slots = index->slots != NULL ? malloc((index->mask + 1) * sizeof(index_slot_t)) : NULL;
+    if ((copy->pool == NULL && index->pool_cap > 0) || (copy->slots == NULL && index->slots != NULL) ||
+        (index->cap > 0 && index_reserve(copy, index->cap) == -1))
+    {
+        index_free(copy);
+        return NULL;
+    }
+    memcpy(copy->pool, index->pool, index->pool_len);
+    if (index->slots != NULL)
+    {
+        memcpy(copy->slots, index->slots, (index->mask + 1) * sizeof(index_slot_t));
+    }
+    memcpy(copy->names_at, index->names_at, index->count * sizeof(uint32_t));
+    memcpy(copy->offsets, index->offsets, index->count * sizeof(off_t));
+    memcpy(copy->sizes, index->sizes, index->count * sizeof(uint64_t));
+    memcpy(copy->types, index->types, index->count);
+    memcpy(copy->shadowed, index->shadowed, (index->count + 63) / 64 * sizeof(uint64_t));
+    copy->pool_len = index->pool_len;
+    copy->pool_cap = index->pool_cap;
+    copy->count = index->count;
+    copy->mask = index->mask;
+    copy->names = index->names;
+    copy->end = index->end;
+    copy->stamp = index->stamp;
+    copy->last = index->last;
+    if (copy->slots == NULL && index_rehash(copy) == -1)
+    {
+        index_free(copy);
+        return NULL;
+    }
+    copy->filter = index->filter != NULL ? malloc(index->filter_blocks * 8 * sizeof(uint32_t)) : NULL;
+    if (copy->filter != NULL)
+    {
+        memcpy(copy->filter, index->filter, index->filter_blocks * 8 * sizeof(uint32_t));
+        copy->filter_blocks = index->filter_blocks;
+        copy->filter_cap = index->filter_cap;
+    }
+    else
+    {
+        filter_grow(copy);
+    }
+    return copy;
+}
+
+/**
+ * Replaces the index version of a handle, the caller holding index_lock.
+ * The version replaced is freed once the read sections that may be reading it ended, along with
+ * the versions retired earlier that no reader can see anymore.
+ */
+static void index_publish(tar_t *tar, tar_index_t *index)
+{
+    tar_index_t *old = __atomic_exchange_n(&tar->index, index, __ATOMIC_SEQ_CST);
+    if (old != NULL)
+    {
+        old->retired = rcu_advance();
+        old->older = tar->retired;
+        tar->retired = old;
+    }
+
+    uint64_t oldest = rcu_oldest();
+    for (tar_index_t **link = &tar->retired; *link != NULL;)
+    {
+        tar_index_t *version = *link;
+        if (version->retired < oldest)
+        {
+            *link = version->older;
+            index_free(version);
+        }
+        else
+        {
+            link = &version->older;
+        }
+    }
+}
+
+/**
+ * Publishes a version of the index of a handle holding the members appended since the current one,
+ * the caller holding index_lock. An archive that shrank was rewritten and is indexed again from the start.
+ *
+ * @return as tar_index().
+ */
+static int index_reload(tar_t *tar)
+{
+    struct stat st;
+    if (fstat(tar->fd, &st) == -1)
+    {
+        tar_fail_at(tar, "tar_index", TAR_EIO, -1, -1, NULL);
+        return -4;
+    }
+    tar_index_t *current = tar->index;
+    int perfect = tar->index_mode == TAR_INDEX_PERFECT;
+    if (current != NULL && file_stamp(&st) == current->stamp &&
+        (!perfect || current->perfect != NULL || current->names == 0))
+    {
+        return 0;
+    }
+
+    tar_index_t *index = current != NULL && st.st_size >= current->end ? index_copy(current) : index_new();
+    if (index == NULL)
+    {
+        tar_fail_at(tar, "tar_index", TAR_ENOMEM, -1, -1, NULL);
+        return -4;
+    }
+    size_t count = index->count;
+    int ret = index_update(tar, index, &st);
+    if (ret < 0 && (current == NULL || index->count == count))
+    {
+        index_free(index);
+        return ret;
+    }
+    if (ret >= 0 && perfect)
+    {
+        index_perfect(index);
+    }
+    /* the members indexed before an error are still valid, the tail is scanned again on the next reload */
+    index_publish(tar, index);
+    return ret;
+}
+
+/*
+ * Returns the index version of a handle, first publishing a new one if the archive grew, NULL if there is none.
+ * The caller is in a read section. A build already in progress on another thread is not waited for,
+ * the current version being returned meanwhile.
+ */
+static tar_index_t *index_fresh(tar_t *tar)
+{
+    tar_index_t *index = __atomic_load_n(&tar->index, __ATOMIC_SEQ_CST);
+    if (index == NULL)
+    {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(tar->fd, &st) == 0 && file_stamp(&st) != index->stamp &&
+        pthread_mutex_trylock(&tar->index_lock) == 0)
+    {
+        if (index_reload(tar) < 0)
+        {
+            tar_clear(tar);
+        }
+        pthread_mutex_unlock(&tar->index_lock);
+        index = __atomic_load_n(&tar->index, __ATOMIC_SEQ_CST);
+    }
+    return index;
+}
+
+/**
+ * Finds an entry in the index of a handle, first bringing the index up to date if the archive grew.
+ * When a name appears several times in the archive, the last member wins.
+ *
+ * @param entry Filled with the entry found. Its strings stay valid until the read section of the caller ends.
+ *
+ * @return 1 if the entry was found, 0 if there is none, -1 if the archive is not indexed.
+ */
+static int index_find(tar_t *tar, const char *path, tar_entry_t *entry)
+{
+    /* the filter is only trusted once the version is known to cover the whole archive */
+    tar_index_t *index = index_fresh(tar);
+    if (index == NULL)
+    {
+        return -1;
+    }
+
+    uint64_t hash = path_hash(path, 0);
+    OP_COUNT(index_probes, 1);
+    if (!filter_has(index, (uint32_t)hash))
+    {
+        OP_COUNT(index_filtered, 1);
+        return 0;
+    }
+
+    size_t found = index_lookup_hash(index, path, hash);
+    if (found != 0)
+    {
+        index_entry(index, found - 1, entry);
+    }
+    return found != 0;
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Starts a scan of the entries named `prefix` or below it, up to `max_depth` levels below it, zero for all.
+ * An indexed archive is scanned through the name table, over these entries only; the scan falls back
+ * to every visible record of the index if memory runs out, and to the headers of the archive when
+ * `index` is NULL. The caller filters the entries it is given either way.
+ *
+ * @param prefix A canonical path, "" for the whole archive.
+ * @param preorder Nonzero to take the range in the order of walk_cmp(), zero for archive order.
+ */
+static void scan_start(index_scan_t *scan, tar_index_t *index, const char *prefix, int max_depth, int preorder)
+{
+    memset(scan, 0, sizeof(index_scan_t));
+    scan->index = index;
+    const name_table_t *table = index != NULL ? index_names(index) : NULL;
+    if (table == NULL)
+    {
+        return;
+    }
+
+    char key[TAR_NAME_MAX];
+    size_t len = snprintf(key, sizeof(key), "%s", prefix);
+    if (len > 0 && len < sizeof(key) && key[len - 1] == '/')
+    {
+        key[len - 1] = '\0';
+    }
+    ssize_t count = names_range(table, key, max_depth, &scan->range);
+    if (count < 0)
+    {
+        return;
+    }
+    scan->count = count;
+    scan->preorder = preorder;
+    if (!preorder)
+    {
+        qsort(scan->range, scan->count, sizeof(uint32_t), entry_cmp);
+    }
+}
+
+/**
+ * Moves a scan to its next entry: to the next entry of its range or visible record of its index,
+ * or to the next header when the archive is not indexed.
+ * Scanning the index skips the members shadowed by a later one and reports the implied directories.
+ * The caller is in a read section, in which the index of the scan was loaded.
+ *
+ * @return as iter_next(), with `it->entry` describing the entry.
+ */
+static int scan_next(index_scan_t *scan, tar_iter_t *it)
+{
+    tar_index_t *index = scan->index;
+    if (index == NULL)
+    {
+        return iter_next(it);
+    }
+    if (scan->range != NULL)
+    {
+        if (scan->pos == scan->count)
+        {
+            return 0;
+        }
+        index_entry(index, scan->range[scan->pos++], &it->entry);
+        return 1;
+    }
+    for (; scan->pos < index->count; scan->pos++)
+    {
+        if (index_visible(index, scan->pos))
+        {
+            index_entry(index, scan->pos++, &it->entry);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Releases the range of a scan */
+static void scan_free(index_scan_t *scan)
+{
+    free(scan->range);
+}
+
+/**
+ * Indexes the entries of a handle's archive by name, so that exists(), check_flag(), get_symlink(),
+ * read_file() and tar_cache_read_file() find entries without scanning the headers.
+ *
+ * The index follows the archive as members are appended to it: whenever the file changed, only the
+ * headers past the previous end-of-archive marker are scanned, and a member named like an earlier
+ * one shadows it. Members are expected to be appended, not rewritten in place.
+ *
+ * Directories are indexed from the paths of their members as well, whether or not the archive stores
+ * them: is_dir(), list(), tar_list(), tar_walk() and tar_stat() then see "a/" in an archive holding only
+ * "a/b". Such a directory has no header, its entries have an offset of -1.
+ *
+ * The first list(), tar_list() or tar_walk() on a version of the index sorts its names into a prefix
+ * compressed table, in which the entries below a directory are a range found by binary search: listing
+ * a directory then reads its children, skipping the subtrees below them, rather than every entry.
+ *
+ * Lookups take no lock: each update publishes a new version of the index, which the calls starting
+ * afterwards see while the calls in progress finish with the version they started with.
+ * A lookup that finds the archive changed builds the new version itself, unless another thread is
+ * building one, and tar_index() waits for a build in progress before starting its own.
+ * Every lookup first checks with fstat() whether the archive changed, so that a member appended is
+ * found by the next lookup; a path that the Bloom filter of the index rules out then reads no slot.
+ *
+ * @param tar The handle of the archive.
+ *
+ * @return the number of headers read to bring the index up to date, zero if it already was,
+ *         -1 to -3 if the archive contains an invalid header as check_archive(),
+ *         -4 if the archive could not be read or memory ran out.
+ */
+int tar_index(tar_t *tar)
+{
+    tar_clear(tar);
+    pthread_mutex_lock(&tar->index_lock);
+    int ret = index_reload(tar);
+    pthread_mutex_unlock(&tar->index_lock);
+    return ret;
+}
+
+/* Sidecar index files, see tar_index_save() */
+#define INDEX_FILE_MAGIC   "tarindex"
+#define INDEX_FILE_VERSION 2
+#define INDEX_FILE_ORDER   0x01020304u /* as written by the machine that saved the file */
+#define INDEX_FILE_PERFECT 0x1         /* the columns are followed by a perfect hash instead of slots */
+#define INDEX_FILE_FILTER  0x2         /* the lookup table is followed by the filter */
+
+/*
+ * Header of a sidecar index file. It is followed by the pool, the columns names_at, offsets, sizes,
+ * types and shadowed, then either the slots or the pilots and positions of the perfect hash, and the
+ * filter, all in the layout of the machine that wrote them.
+ */
+typedef struct index_file
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t order;               /* INDEX_FILE_ORDER in the byte order of the columns */
+    uint32_t off_size;            /* sizeof(off_t) of the columns */
+    uint32_t sections;            /* INDEX_FILE_* flags */
+    uint64_t size;                /* size of the archive file indexed */
+    uint64_t stamp;
+    int64_t end;
+    int64_t last;
+    uint64_t check;               /* xxh64() of the last member header, which must not have changed */
+    uint64_t count;
+    uint64_t names;
+    uint64_t pool_len;
+    uint64_t nslots;
+    uint64_t buckets;
+    uint64_t seed;
+    uint64_t filter_blocks;
+    uint64_t filter_cap;
+} index_file_t;
+
+/* Writes a whole buffer to a file descriptor, returns -1 on failure */
+static int write_all(int fd, const void *buf, size_t n)
+{
+    for (const char *p = buf; n > 0;)
+    {
+        ssize_t put = write(fd, p, n);
+        if (put <= 0)
+        {
+            if (put == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        p += put;
+        n -= put;
+    }
+    return 0;
+}
+
+/* Reads a whole buffer from a file descriptor, returns -1 on failure or if the file ends first */
+static int read_all(int fd, void *buf, size_t n)
+{
+    for (char *p = buf; n > 0;)
+    {
+        ssize_t got = read(fd, p, n);
+        if (got <= 0)
+        {
+            if (got == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            errno = got == 0 ? EIO : errno;
+            return -1;
+        }
+        p += got;
+        n -= got;
+    }
+    return 0;
+}
+
+/* Part of a sidecar file following its header, the address and length of an index column */
+typedef struct index_section
+{
+    void *data;
+    size_t len;
+} index_section_t;
+
+/* Most sections a sidecar file can hold */
+#define INDEX_FILE_SECTIONS 9
+
+/* Lists the sections of the sidecar file of an index, whose columns are allocated, returns their number */
+static int index_sections(const tar_index_t *index, index_section_t *sections)
+{
+    int n = 0;
+    sections[n++] = (index_section_t){index->pool, index->pool_len};
+    sections[n++] = (index_section_t){index->names_at, index->count * sizeof(uint32_t)};
+    sections[n++] = (index_section_t){index->offsets, index->count * sizeof(off_t)};
+    sections[n++] = (index_section_t){index->sizes, index->count * sizeof(uint64_t)};
+    sections[n++] = (index_section_t){index->types, index->count};
+    sections[n++] = (index_section_t){index->shadowed, (index->count + 63) / 64 * sizeof(uint64_t)};
+    if (index->perfect != NULL)
+    {
+        sections[n++] = (index_section_t){index->pilots, index->buckets * sizeof(uint32_t)};
+        sections[n++] = (index_section_t){index->perfect, index->names * sizeof(uint32_t)};
+    }
+    else
+    {
+        sections[n++] = (index_section_t){index->slots, (index->mask + 1) * sizeof(index_slot_t)};
+    }
+    if (index->filter != NULL)
+    {
+        sections[n++] = (index_section_t){index->filter, index->filter_blocks * 8 * sizeof(uint32_t)};
+    }
+    return n;
+}
+
+/* Hashes the last member header of an index into `check`, returns -1 on a read error */
+static int index_check(tar_t *tar, const tar_index_t *index, uint64_t *check)
+{
+    tar_header_t header;
+    *check = 0;
+    if (index->last == -1)
+    {
+        return 0;
+    }
+    if (tar_pread(tar->fd, &header, sizeof(header), index->last) != sizeof(header))
+    {
+        return -1;
+    }
+    *check = xxh64(&header, sizeof(header), 0);
+    return 0;
+}
+
+/* Returns 1 if the columns read from a sidecar file describe an index that lookups can trust */
+static int index_valid(const tar_index_t *index)
+{
+    if (index->count > 0 && (index->pool_len == 0 || index->pool[index->pool_len - 1] != '\0'))
+    {
+        return 0;
+    }
+    size_t visible = 0;
+    for (size_t i = 0; i < index->count; i++)
+    {
+        size_t at = index->names_at[i];
+        if (at >= index->pool_len || at + strlen(index->pool + at) + 1 >= index->pool_len)
+        {
+            return 0;
+        }
+        visible += index_visible(index, i);
+    }
+    if (visible != index->names)
+    {
+        return 0;
+    }
+    if (index->perfect != NULL)
+    {
+        for (size_t pos = 0; pos < index->names; pos++)
+        {
+            if (index->perfect[pos] >= index->count)
+            {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    size_t used = 0;
+    for (size_t i = 0; i <= index->mask; i++)
+    {
+        if (index->slots[i].entry > index->count)
+        {
+            return 0;
+        }
+        used += index->slots[i].entry != 0;
+    }
+    /* probes end at an empty slot */
+    return used == index->names && used <= index->mask;
+}
+
+/**
+ * Writes the index of a handle to a sidecar file, from which tar_index_load() loads it in other processes
+ * instead of scanning the headers of the archive. The sidecar holds the lookup table of the index as
+ * built, a minimal perfect hash with TAR_INDEX_PERFECT, and the Bloom filter answering lookups of absent
+ * paths. It is only valid on machines of the same layout.
+ *
+ * @param tar The handle of an indexed archive.
+ * @param index_fd A file descriptor open for writing, where the sidecar is written from its current position.
+ *
+ * @return 0 on success, -1 if the archive is not indexed, -4 if the sidecar could not be written
+ *         or the archive could not be read.
+ */
+int tar_index_save(tar_t *tar, int index_fd)
+{
+    tar_clear(tar);
+    rcu_enter();
+    tar_index_t *index = __atomic_load_n(&tar->index, __ATOMIC_SEQ_CST);
+    if (index == NULL)
+    {
+        rcu_exit();
+        TAR_FAIL(tar, TAR_EINVAL, -1, -1, NULL);
+        return -1;
+    }
+
+    struct stat st;
+    index_file_t file = {.magic = INDEX_FILE_MAGIC, .version = INDEX_FILE_VERSION, .order = INDEX_FILE_ORDER,
+                         .off_size = sizeof(off_t)};
+    file.sections = (index->perfect != NULL ? INDEX_FILE_PERFECT : 0) | (index->filter != NULL ? INDEX_FILE_FILTER : 0);
+    file.stamp = index->stamp;
+    file.end = index->end;
+    file.last = index->last;
+    file.count = index->count;
+    file.names = index->names;
+    file.pool_len = index->pool_len;
+    file.nslots = index->slots != NULL ? index->mask + 1 : 0;
+    file.buckets = index->buckets;
+    file.seed = index->seed;
+    file.filter_blocks = index->filter_blocks;
+    file.filter_cap = index->filter_cap;
+    if (fstat(tar->fd, &st) == -1 || index_check(tar, index, &file.check) == -1)
+    {
+        rcu_exit();
+        TAR_FAIL(tar, TAR_EIO, -1, index->last, NULL);
+        return -4;
+    }
+    file.size = st.st_size;
+
+    index_section_t sections[INDEX_FILE_SECTIONS];
+    int nsections = index_sections(index, sections);
+    int ret = write_all(index_fd, &file, sizeof(file));
+    for (int i = 0; i < nsections && ret == 0; i++)
+    {
+        ret = write_all(index_fd, sections[i].data, sections[i].len);
+    }
+    rcu_exit();
+    if (ret == -1)
+    {
+        TAR_FAIL(tar, TAR_EIO, -1, -1, NULL);
+        return -4;
+    }
+    return 0;
+}
+
+/**
+ * Loads the index of a handle from a sidecar file written by tar_index_save(), in place of tar_index().
+ *
+ * The sidecar must have been saved for this archive: it is refused if the archive is smaller than when
+ * it was saved or if the header of the last member indexed changed. Members appended to the archive
+ * since are indexed by the next lookup, as with tar_index().
+ *
+ * @param tar The handle of the archive.
+ * @param index_fd A file descriptor open for reading, at the start of the sidecar.
+ *
+ * @return 0 on success, -1 if the file is not a sidecar of the archive or was written on a machine of
+ *         another layout, -4 if the sidecar or the archive could not be read or memory ran out.
+ */
+int tar_index_load(tar_t *tar, int index_fd)
+{
+    tar_clear(tar);
+    index_file_t file;
+    if (read_all(index_fd, &file, sizeof(file)) == -1)
+    {
+        TAR_FAIL(tar, TAR_EIO, -1, -1, NULL);
+        return -4;
+    }
+    int perfect = (file.sections & INDEX_FILE_PERFECT) != 0;
+    int filter = (file.sections & INDEX_FILE_FILTER) != 0;
+    if (memcmp(file.magic, INDEX_FILE_MAGIC, sizeof(file.magic)) != 0 || file.version != INDEX_FILE_VERSION ||
+        file.order != INDEX_FILE_ORDER || file.off_size != sizeof(off_t) || file.count > UINT32_MAX ||
+        file.pool_len > UINT32_MAX || file.names > file.count ||
+        (perfect ? file.buckets != file.names / 4 + 1 || file.names == 0
+                 : file.nslots == 0 || (file.nslots & (file.nslots - 1)) != 0 || file.nslots > 1ull << 34) ||
+        (filter && (file.filter_cap < file.names || file.filter_cap > 1ull << 34 ||
+                    file.filter_blocks != (file.filter_cap * FILTER_BITS + 255) / 256)))
+    {
+        TAR_FAIL(tar, TAR_EINVAL, -1, -1, NULL);
+        return -1;
+    }
+
+    tar_index_t *index = calloc(1, sizeof(tar_index_t));
+    if (index == NULL)
+    {
+        TAR_FAIL(tar, TAR_ENOMEM, -1, -1, NULL);
+        return -4;
+    }
+    index->pool_len = index->pool_cap = file.pool_len;
+    index->count = file.count;
+    index->names = file.names;
+    index->end = file.end;
+    index->last = file.last;
+    index->stamp = file.stamp;
+    index->pool = malloc(file.pool_len);
+    if (perfect)
+    {
+        index->buckets = file.buckets;
+        index->seed = file.seed;
+        index->pilots = malloc(file.buckets * sizeof(uint32_t));
+        index->perfect = malloc(file.names * sizeof(uint32_t));
+    }
+    else
+    {
+        index->mask = file.nslots - 1;
+        index->slots = malloc(file.nslots * sizeof(index_slot_t));
+    }
+    index->filter_cap = SIZE_MAX;
+    if (filter)
+    {
+        index->filter_blocks = file.filter_blocks;
+        index->filter_cap = file.filter_cap;
+        index->filter = malloc(file.filter_blocks * 8 * sizeof(uint32_t));
+    }
+    if ((index->pool == NULL && file.pool_len > 0) || (file.count > 0 && index_reserve(index, file.count) == -1) ||
+        (perfect ? index->pilots == NULL || index->perfect == NULL : index->slots == NULL) ||
+        (filter && index->filter == NULL))
+    {
+        index_free(index);
+        TAR_FAIL(tar, TAR_ENOMEM, -1, -1, NULL);
+        return -4;
+    }
+
+    index_section_t sections[INDEX_FILE_SECTIONS];
+    int nsections = index_sections(index, sections);
+    for (int i = 0; i < nsections; i++)
+    {
+        if (read_all(index_fd, sections[i].data, sections[i].len) == -1)
+        {
+            index_free(index);
+            TAR_FAIL(tar, TAR_EIO, -1, -1, NULL);
+            return -4;
+        }
+    }
+
+    struct stat st;
+    uint64_t check = 0;
+    if (fstat(tar->fd, &st) == -1 || (st.st_size >= file.end && index_check(tar, index, &check) == -1))
+    {
+        index_free(index);
+        TAR_FAIL(tar, TAR_EIO, -1, file.last, NULL);
+        return -4;
+    }
+    if ((uint64_t)st.st_size < file.size || st.st_size < file.end || check != file.check || !index_valid(index))
+    {
+        index_free(index);
+        TAR_FAIL(tar, TAR_EINVAL, -1, -1, NULL);
+        return -1;
+    }
+
+    pthread_mutex_lock(&tar->index_lock);
+    index_publish(tar, index);
+    pthread_mutex_unlock(&tar->index_lock);
+    return 0;
+}
+
+/**
+ * Finds an entry by path in the index of the handle or with a scan of the headers, following symlinks
+ * and the hard links that the index did not make aliases of their target.
+ * Relative symlink targets are resolved against the directory containing the link.
+ * The caller releases `it` with iter_free().
+ *
+ * @return 1 with `it->entry` describing the entry found, 0 if there is none, -3 on a read error.
+ */
+static int lookup(int tar_fd, const char *path, tar_iter_t *it)
+{
+    char target[TAR_NAME_MAX];
+
+    for (int hops = 0; hops < 8; hops++)
+    {
+        iter_init(it, tar_fd);
+        int ret = index_find(tar_get(tar_fd), path, &it->entry);
+        if (ret == -1)
+        {
+            while ((ret = iter_next(it)) == 1 && !path_eq(it->entry.name, path))
+            {
+            }
+        }
+        if (ret == 1 && it->entry.typeflag == LNKTYPE && it->entry.size == 0)
+        {
+            snprintf(target, sizeof(target), "%s", it->entry.linkname);
+            path = target;
+            continue;
+        }
+        if (ret != 1 || it->entry.typeflag != SYMTYPE)
+        {
+            return ret;
+        }
+        link_target(it->entry.name, it->entry.linkname, target, sizeof(target));
+        path = target;
+    }
+    return 0;
+}
+
+/* Returns the file type bits of a typeflag */
+static mode_t type_mode(char typeflag)
+{
+    switch (typeflag)
+    {
+    case DIRTYPE:
+        return S_IFDIR;
+    case SYMTYPE:
+        return S_IFLNK;
+    case CHRTYPE:
+        return S_IFCHR;
+    case BLKTYPE:
+        return S_IFBLK;
+    case FIFOTYPE:
+        return S_IFIFO;
+    default:
+        return S_IFREG;
+    }
+}
+
+/* Fills `st` for the entry at `path`, a hard link being described by its target, as by lstat() */
+static int stat_path(tar_t *tar, int tar_fd, const char *path, struct stat *st, int hops)
+{
+    tar_iter_t it;
+    iter_init(&it, tar_fd);
+    int found = index_find(tar, path, &it.entry);
+    if (found == -1)
+    {
+        while ((found = iter_next(&it)) == 1 && !path_eq(it.entry.name, path))
+        {
+        }
+    }
+    else if (found == 1 && it.entry.offset != -1 &&
+             tar_pread(tar_fd, &it.header, sizeof(tar_header_t), it.entry.offset) != sizeof(tar_header_t))
+    {
+        found = -3;
+    }
+    if (found != 1)
+    {
+        iter_free(&it);
+        TAR_FAIL(tar, found == 0 ? TAR_ENOENT : TAR_EIO, -1, -1, NULL);
+        return found == 0 ? -1 : -3;
+    }
+
+    memset(st, 0, sizeof(struct stat));
+    if (it.entry.offset == -1)
+    {
+        /* a directory implied by the paths of its members, there is no header to describe it */
+        st->st_mode = S_IFDIR | 0755;
+        st->st_nlink = 2;
+        st->st_ino = path_hash(path, 0) | (1ull << 63);
+        st->st_blksize = sizeof(tar_header_t);
+        iter_free(&it);
+        return 0;
+    }
+
+    const tar_header_t *h = &it.header;
+    st->st_mode = type_mode(it.entry.typeflag) | (TAR_INT(h->mode) & 07777);
+    st->st_nlink = it.entry.typeflag == DIRTYPE ? 2 : 1;
+    st->st_uid = TAR_INT(h->uid);
+    st->st_gid = TAR_INT(h->gid);
+    st->st_size = it.entry.typeflag == SYMTYPE ? (off_t)strlen(it.entry.linkname) : (off_t)it.entry.size;
+    st->st_mtime = strtoll(h->mtime, NULL, 8);
+    st->st_atime = st->st_mtime;
+    st->st_ctime = st->st_mtime;
+    if (it.entry.typeflag == CHRTYPE || it.entry.typeflag == BLKTYPE)
+    {
+        st->st_rdev = makedev(TAR_INT(h->devmajor), TAR_INT(h->devminor));
+    }
+    /* the header offset identifies the member */
+    st->st_ino = it.entry.offset / sizeof(tar_header_t) + 1;
+    st->st_blksize = sizeof(tar_header_t);
+    st->st_blocks = (it.entry.size + sizeof(tar_header_t) - 1) / sizeof(tar_header_t);
+
+    /* the index made most hard links aliases of their target, the others are looked up by name */
+    if (it.entry.typeflag == LNKTYPE && it.entry.size == 0 && hops < 8)
+    {
+        char target[TAR_NAME_MAX];
+        snprintf(target, sizeof(target), "%s", it.entry.linkname);
+        struct stat linked;
+        if (stat_path(tar, tar_fd, target, &linked, hops + 1) == 0)
+        {
+            *st = linked;
+        }
+        /* a hard link to a missing member is described by its own header */
+        tar_clear(tar);
+    }
+    iter_free(&it);
+    return 0;
+}
+
+static int tar_stat_impl(int tar_fd, const char *path, struct stat *st)
+{
+    tar_t *tar = tar_begin(tar_fd);
+    if (path == NULL || st == NULL)
+    {
+        TAR_FAIL(tar, TAR_EINVAL, -1, -1, NULL);
+        return -1;
+    }
+    return stat_path(tar, tar_fd, path, st, 0);
+}
+
+/**
+ * Reads the attributes of an entry, as lstat() does: a symlink is described, not followed.
+ * A hard link is described by the member it links to, sharing its inode number.
+ * Uses the index of the handle when there is one, the file offset of tar_fd is then left untouched.
+ * A directory the index implies from member paths is described with mode 0755, no owner and no time.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ * @param path A path to an entry in the archive, directories ending with a slash.
+ * @param st Filled with the type and permissions, owner, size and modification time of the entry.
+ *           The inode number is derived from the offset of the member in the archive.
+ *
+ * @return 0 on success, -1 if there is no entry at the given path, -3 if the archive could not be read.
+ */
+int tar_stat(int tar_fd, const char *path, struct stat *st)
+{
+    tar_op_t op;
+    op_begin(&op, tar_fd, TAR_OP_STAT, path);
+    return op_end(&op, tar_stat_impl(tar_fd, path, st));
+}
+
+/* Identity of an archive file, which changes whenever the archive is rewritten or appended to */
+typedef struct archive_id
+{
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime_sec;
+    long mtime_nsec;
+} archive_id_t;
+
+/* A distinct member content held by the cache */
+typedef struct cache_blob
+{
+    uint64_t hash;
+    size_t size;
+    size_t refs;                  /* entries pointing to this content */
+    struct cache_blob *next;      /* next blob in the same bucket */
+    uint8_t data[];
+} cache_blob_t;
+
+/* A cached (archive, path) pair */
+typedef struct cache_entry
+{
+    uint64_t hash;
+    archive_id_t id;
+    cache_blob_t *blob;
+    struct cache_entry *next;     /* next entry in the same bucket */
+    struct cache_entry *lru_prev;
+    struct cache_entry *lru_next;
+    char path[];
+} cache_entry_t;
+
+struct tar_cache
+{
+    pthread_mutex_t lock;
+    size_t budget;
+    size_t max_member;
+    cache_entry_t **entries;      /* hash table of entries, entry_buckets long */
+    size_t entry_buckets;
+    cache_blob_t **blobs;         /* hash table of blobs, blob_buckets long */
+    size_t blob_buckets;
+    cache_entry_t lru;            /* sentinel, lru.lru_next is the most recently used entry */
+    tar_cache_stats_t stats;
+};
+
+/**
+ * Creates a read cache for tar_cache_read_file().
+ *
+ * Members are cached whole, keyed by the archive identity (device, inode, size and modification time)
+ * and their path, and their contents are stored once per distinct xxHash64, so identical members of
+ * different archives share memory. The least recently used entries are evicted to stay within budget.
+ *
+ * @param budget The most member data bytes held by the cache.
+ * @param max_member The largest member cached, zero for TAR_CACHE_MAX_MEMBER. Larger members are read
+ *                   from the archive on every call.
+ *
+ * @return the new cache, NULL if memory ran out.
+ */
+tar_cache_t *tar_cache_new(size_t budget, size_t max_member)
+{
+    tar_cache_t *cache = calloc(1, sizeof(tar_cache_t));
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+    cache->budget = budget;
+    cache->max_member = max_member ? max_member : TAR_CACHE_MAX_MEMBER;
+    cache->entry_buckets = 64;
+    cache->blob_buckets = 64;
+    cache->entries = calloc(cache->entry_buckets, sizeof(cache_entry_t *));
+    cache->blobs = calloc(cache->blob_buckets, sizeof(cache_blob_t *));
+    if (cache->entries == NULL || cache->blobs == NULL || pthread_mutex_init(&cache->lock, NULL) != 0)
+    {
+        free(cache->entries);
+        free(cache->blobs);
+        free(cache);
+        return NULL;
+    }
+    cache->lru.lru_next = cache->lru.lru_prev = &cache->lru;
+    return cache;
+}
+
+/**
+ * Frees a cache and everything it holds. No other thread may be using it.
+ *
+ * @param cache The cache to free, may be NULL.
+ */
+void tar_cache_free(tar_cache_t *cache)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+    for (size_t i = 0; i < cache->entry_buckets; i++)
+    {
+        for (cache_entry_t *e = cache->entries[i], *next; e != NULL; e = next)
+        {
+            next = e->next;
+            free(e);
+        }
+    }
+    for (size_t i = 0; i < cache->blob_buckets; i++)
+    {
+        for (cache_blob_t *b = cache->blobs[i], *next; b != NULL; b = next)
+        {
+            next = b->next;
+            free(b);
+        }
+    }
+    free(cache->entries);
+    free(cache->blobs);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+static int archive_id_eq(const archive_id_t *a, const archive_id_t *b)
+{
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec;
+}
+
+/* Finds a cached entry, the cache being locked */
+static cache_entry_t *cache_find(tar_cache_t *cache, uint64_t hash, const archive_id_t *id, const char *path)
+{
+    for (cache_entry_t *e = cache->entries[hash & (cache->entry_buckets - 1)]; e != NULL; e = e->next)
+    {
+        if (e->hash == hash && archive_id_eq(&e->id, id) && path_eq(e->path, path))
+        {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void lru_unlink(cache_entry_t *e)
+{
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+}
+
+static void lru_push(tar_cache_t *cache, cache_entry_t *e)
+{
+    e->lru_prev = &cache->lru;
+    e->lru_next = cache->lru.lru_next;
+    cache->lru.lru_next->lru_prev = e;
+    cache->lru.lru_next = e;
+}
+
+/* Doubles a table of chained buckets once it holds more items than buckets, keeping it as is if memory ran out */
+#define CACHE_GROW(cache, table, nbuckets, count, type)                       \
+    do                                                                        \
+    {                                                                         \
+        if ((count) <= (cache)->nbuckets)                                     \
+        {                                                                     \
+            break;                                                            \
+        }                                                                     \
+        size_t grown_n = (cache)->nbuckets * 2;                               \
+        type **grown = calloc(grown_n, sizeof(type *));                       \
+        if (grown == NULL)                                                    \
+        {                                                                     \
+            break;                                                            \
+        }                                                                     \
+        for (size_t i = 0; i < (cache)->nbuckets; i++)                        \
+        {                                                                     \
+            for (type *item = (cache)->table[i], *next; item != NULL; item = next) \
+            {                                                                 \
+                next = item->next;                                            \
+                item->next = grown[item->hash & (grown_n - 1)];               \
+                grown[item->hash & (grown_n - 1)] = item;                     \
+            }                                                                 \
+        }                                                                     \
+        free((cache)->table);                                                 \
+        (cache)->table = grown;                                               \
+        (cache)->nbuckets = grown_n;                                          \
+    } while (0)
+
+/* Drops a reference to a blob, freeing it with its last reference, the cache being locked */
+static void blob_release(tar_cache_t *cache, cache_blob_t *blob)
+{
+    if (--blob->refs > 0)
+    {
+        return;
+    }
+    cache_blob_t **pp = &cache->blobs[blob->hash & (cache->blob_buckets - 1)];
+    while (*pp != blob)
+    {
+        pp = &(*pp)->next;
+    }
+    *pp = blob->next;
+    cache->stats.bytes -= blob->size;
+    cache->stats.blobs--;
+    free(blob);
+}
+
+/* Evicts the least recently used entry, the cache being locked */
+static void cache_evict(tar_cache_t *cache)
+{
+    cache_entry_t *e = cache->lru.lru_prev;
+    cache_entry_t **pp = &cache->entries[e->hash & (cache->entry_buckets - 1)];
+    while (*pp != e)
+    {
+        pp = &(*pp)->next;
+    }
+    *pp = e->next;
+    lru_unlink(e);
+    blob_release(cache, e->blob);
+    cache->stats.entries--;
+    free(e);
+}
+
+/**
+ * Inserts a freshly read member, sharing the content of an identical blob if there is one.
+ * `blob` is consumed: either inserted or freed. The cache must be locked.
+ */
+static void cache_insert(tar_cache_t *cache, uint64_t hash, const archive_id_t *id, const char *path,
+                         cache_blob_t *blob)
+{
+    cache_entry_t *e = cache_find(cache, hash, id, path);
+    if (e != NULL)
+    {
+        /* another thread cached it meanwhile */
+        free(blob);
+        return;
+    }
+
+    size_t path_len = strlen(path) + 1;
+    e = malloc(sizeof(cache_entry_t) + path_len);
+    if (e == NULL)
+    {
+        free(blob);
+        return;
+    }
+
+    cache_blob_t *shared = cache->blobs[blob->hash & (cache->blob_buckets - 1)];
+    while (shared != NULL &&
+           (shared->hash != blob->hash || shared->size != blob->size || memcmp(shared->data, blob->data, blob->size)))
+    {
+        shared = shared->next;
+    }
+    if (shared != NULL)
+    {
+        free(blob);
+        blob = shared;
+    }
+    else
+    {
+        blob->refs = 0;
+        CACHE_GROW(cache, blobs, blob_buckets, cache->stats.blobs + 1, cache_blob_t);
+        blob->next = cache->blobs[blob->hash & (cache->blob_buckets - 1)];
+        cache->blobs[blob->hash & (cache->blob_buckets - 1)] = blob;
+        cache->stats.bytes += blob->size;
+        cache->stats.blobs++;
+    }
+    blob->refs++;
+
+    e->hash = hash;
+    e->id = *id;
+    e->blob = blob;
+    memcpy(e->path, path, path_len);
+    CACHE_GROW(cache, entries, entry_buckets, cache->stats.entries + 1, cache_entry_t);
+    e->next = cache->entries[hash & (cache->entry_buckets - 1)];
+    cache->entries[hash & (cache->entry_buckets - 1)] = e;
+    lru_push(cache, e);
+    cache->stats.entries++;
+
+    while (cache->stats.bytes > cache->budget && cache->lru.lru_prev != e)
+    {
+        cache_evict(cache);
+    }
+}
+
+/* Copies the requested range of a member into the caller's buffer, with the read_file() return value */
+static ssize_t copy_range(const uint8_t *data, size_t size, size_t offset, uint8_t *dest, size_t *len)
+{
+    if (offset >= size)
+    {
+        return -2;
+    }
+    size_t n = size - offset;
+    if (*len < n)
+    {
+        n = *len;
+    }
+    memcpy(dest, data + offset, n);
+    *len = n;
+    return size - offset - n;
+}
+
+static ssize_t tar_cache_read_file_impl(tar_cache_t *cache, int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len)
+{
+    tar_t *tar = tar_begin(tar_fd);
+    struct stat st;
+    if (cache == NULL || path == NULL || dest == NULL || len == NULL)
+    {
+        TAR_FAIL(tar, TAR_EINVAL, -1, -1, NULL);
+        return -3;
+    }
+    if (fstat(tar_fd, &st) == -1)
+    {
+        TAR_FAIL(tar, TAR_EIO, -1, -1, NULL);
+        return -3;
+    }
+
+    archive_id_t id;
+    memset(&id, 0, sizeof(id));
+    id.dev = st.st_dev;
+    id.ino = st.st_ino;
+    id.size = st.st_size;
+    id.mtime_sec = st.st_mtim.tv_sec;
+    id.mtime_nsec = st.st_mtim.tv_nsec;
+    uint64_t hash = path_hash(path, xxh64(&id, sizeof(id), 0));
+
+    pthread_mutex_lock(&cache->lock);
+    cache_entry_t *e = cache_find(cache, hash, &id, path);
+    if (e != NULL)
+    {
+        lru_unlink(e);
+        lru_push(cache, e);
+        cache->stats.hits++;
+        OP_COUNT(cache_hits, 1);
+        ssize_t ret = copy_range(e->blob->data, e->blob->size, offset, dest, len);
+        pthread_mutex_unlock(&cache->lock);
+        if (ret < 0)
+        {
+            TAR_FAIL(tar, TAR_ERANGE, -1, -1, "size");
+        }
+        return ret;
+    }
+    cache->stats.misses++;
+    OP_COUNT(cache_misses, 1);
+    pthread_mutex_unlock(&cache->lock);
+
+    tar_iter_t it;
+    int found = lookup(tar_fd, path, &it);
+    iter_free(&it);
+    if (found != 1)
+    {
+        TAR_FAIL(tar, found == 0 ? TAR_ENOENT : TAR_EIO, -1, -1, NULL);
+        return found == 0 ? -1 : -3;
+    }
+    if (it.entry.typeflag != REGTYPE && it.entry.typeflag != AREGTYPE && it.entry.typeflag != LNKTYPE)
+    {
+        TAR_FAIL(tar, TAR_ETYPE, -1, it.entry.offset, "typeflag");
+        return -1;
+    }
+
+    off_t data_off = it.entry.offset + sizeof(tar_header_t);
+    size_t size = it.entry.size;
+    if (size > cache->max_member || size > cache->budget)
+    {
+        if (offset >= size)
+        {
+            TAR_FAIL(tar, TAR_ERANGE, -1, it.entry.offset, "size");
+            return -2;
+        }
+        size_t n = size - offset < *len ? size - offset : *len;
+        ssize_t got = tar_pread(tar_fd, dest, n, data_off + offset);
+        if (got == -1)
+        {
+            TAR_FAIL(tar, TAR_EIO, -1, data_off + offset, NULL);
+            return -3;
+        }
+        *len = got;
+        size_t rest = size - offset - got;
+        advise_next(tar_fd, tar->advice, data_off + offset + got, rest < n ? rest : n);
+        return rest;
+    }
+
+    cache_blob_t *blob = malloc(sizeof(cache_blob_t) + size);
+    if (blob == NULL)
+    {
+        TAR_FAIL(tar, TAR_ENOMEM, -1, -1, NULL);
+        return -3;
+    }
+    blob->size = size;
+    for (size_t done = 0; done < size;)
+    {
+        ssize_t got = tar_pread(tar_fd, blob->data + done, size - done, data_off + done);
+        if (got <= 0)
+        {
+            free(blob);
+            TAR_FAIL(tar, TAR_EIO, -1, data_off + done, NULL);
+            return -3;
+        }
+        done += got;
+    }
+    blob->hash = xxh64(blob->data, size, 0);
+
+    ssize_t ret = copy_range(blob->data, size, offset, dest, len);
+    if (ret < 0)
+    {
+        TAR_FAIL(tar, TAR_ERANGE, -1, it.entry.offset, "size");
+    }
+    pthread_mutex_lock(&cache->lock);
+    cache_insert(cache, hash, &id, path, blob);
+    pthread_mutex_unlock(&cache->lock);
+    return ret;
+}
+
+/**
+ * Reads a file at a given path in the archive, through a cache.
+ * Same contract as read_file(), except that relative symlinks are resolved against the directory
+ * containing them and that the file offset of tar_fd is left untouched. Safe to call concurrently.
+ *
+ * @param cache The cache to serve the read from and to fill on a miss.
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ * @param path A path to an entry in the archive to read from. If the entry is a symlink, it is resolved.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return as read_file(), -3 if the archive could not be read or memory ran out.
+ */
+ssize_t tar_cache_read_file(tar_cache_t *cache, int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len)
+{
+    tar_op_t op;
+    op_begin(&op, tar_fd, TAR_OP_CACHE_READ, path);
+    return op_end(&op, tar_cache_read_file_impl(cache, tar_fd, path, offset, dest, len));
+}
+
+/**
+ * Reads the counters of a cache.
+ *
+ * @param cache The cache to inspect.
+ * @param stats Filled with the current counters.
+ */
+void tar_cache_stats(tar_cache_t *cache, tar_cache_stats_t *stats)
+{
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* A member of one side of tar_diff(), the last one with its name */
+typedef struct diff_node
+{
+    tar_entry_t entry;            /* name and linkname hold pool offsets until the scan ends */
+    off_t start;                  /* offset of the first extension header of the member, or of its header */
+    unsigned long mode;
+    unsigned long uid;
+    unsigned long gid;
+    long long mtime;
+    uint64_t hash;                /* xxHash64 of the data, only computed when the sizes match */
+} diff_node_t;
+
+/* One of the two archives compared by tar_diff(), scanned and hashed on its own thread */
+typedef struct diff_side
+{
+    int fd;
+    header_check_fn check;        /* validation policy of the archive */
+    diff_node_t *nodes;
+    size_t count;
+    size_t cap;
+    char *pool;
+    size_t pool_len;
+    size_t pool_cap;
+    diff_node_t **jobs;           /* members to hash, sorted by offset */
+    size_t njobs;
+    int ret;                      /* 0, a check_archive() error or -4 */
+    int code;                     /* TAR_EIO or TAR_ENOMEM when ret is -4 */
+    int sys_errno;                /* errno of the thread when it failed */
+    long nheader;                 /* header of the error */
+    off_t offset;                 /* offset of the error */
+    tar_op_t counted;             /* work of the thread, added to the calling operation once joined */
+} diff_side_t;
+
+/* A difference between the archives, reported once the members to compare are hashed */
+typedef struct diff_result
+{
+    const diff_node_t *old_node;
+    const diff_node_t *new_node;
+    int status;
+    int changes;
+    int hashed;                   /* the contents decide whether the member changed */
+} diff_result_t;
+
+static int diff_node_cmp(const void *a, const void *b)
+{
+    const diff_node_t *x = a, *y = b;
+    int cmp = strcmp(x->entry.name, y->entry.name);
+    if (cmp != 0)
+    {
+        return cmp;
+    }
+    return (x->entry.offset > y->entry.offset) - (x->entry.offset < y->entry.offset);
+}
+
+static int diff_job_cmp(const void *a, const void *b)
+{
+    const diff_node_t *x = *(diff_node_t *const *)a, *y = *(diff_node_t *const *)b;
+    return (x->entry.offset > y->entry.offset) - (x->entry.offset < y->entry.offset);
+}
+
+/* Scans one archive into side->nodes, sorted by name with only the last member of each name kept */
+static void *diff_collect(void *arg)
+{
+    diff_side_t *side = arg;
+    tar_op_t *outer = cur_op;
+    cur_op = &side->counted;
+
+    tar_iter_t it;
+    iter_init(&it, side->fd);
+    off_t start = 0;
+    int ret = 0;
+    int got;
+    for (side->nheader = 0; (got = iter_next(&it)) == 1; side->nheader++, start = it.next)
+    {
+        ret = scan_check(side->check, &it.header);
+        if (ret != 0)
+        {
+            side->offset = it.entry.offset;
+            ret = ret < 0 ? ret : 0;
+            break;
+        }
+        if (side->count == side->cap)
+        {
+            size_t cap = side->cap ? side->cap * 2 : 64;
+            diff_node_t *grown = realloc(side->nodes, cap * sizeof(diff_node_t));
+            if (grown == NULL)
+            {
+                side->code = TAR_ENOMEM;
+                ret = -4;
+                break;
+            }
+            side->nodes = grown;
+            side->cap = cap;
+        }
+        ssize_t name = pool_add(&side->pool, &side->pool_len, &side->pool_cap, it.entry.name);
+        ssize_t link = name < 0 ? -1 : pool_add(&side->pool, &side->pool_len, &side->pool_cap, it.entry.linkname);
+        if (link < 0)
+        {
+            side->code = TAR_ENOMEM;
+            ret = -4;
+            break;
+        }
+        diff_node_t *node = &side->nodes[side->count++];
+        node->entry = it.entry;
+        node->start = start;
+        node->entry.name = (const char *)(uintptr_t)name;
+        node->entry.linkname = (const char *)(uintptr_t)link;
+        node->mode = TAR_INT(it.header.mode);
+        node->uid = TAR_INT(it.header.uid);
+        node->gid = TAR_INT(it.header.gid);
+        node->mtime = strtoll(it.header.mtime, NULL, 8);
+    }
+    iter_free(&it);
+    if (got == -3)
+    {
+        side->code = TAR_EIO;
+        side->offset = it.next;
+        ret = -4;
+    }
+    side->ret = ret;
+    side->sys_errno = errno;
+    cur_op = outer;
+    if (ret < 0)
+    {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < side->count; i++)
+    {
+        side->nodes[i].entry.name = side->pool + (uintptr_t)side->nodes[i].entry.name;
+        side->nodes[i].entry.linkname = side->pool + (uintptr_t)side->nodes[i].entry.linkname;
+    }
+    qsort(side->nodes, side->count, sizeof(diff_node_t), diff_node_cmp);
+    size_t kept = 0;
+    for (size_t i = 0; i < side->count; i++)
+    {
+        if (i + 1 < side->count && strcmp(side->nodes[i].entry.name, side->nodes[i + 1].entry.name) == 0)
+        {
+            continue;
+        }
+        side->nodes[kept++] = side->nodes[i];
+    }
+    side->count = kept;
+    return NULL;
+}
+
+/* Hashes the data of side->jobs in archive order */
+static void *diff_hash(void *arg)
+{
+    diff_side_t *side = arg;
+    tar_op_t *outer = cur_op;
+    cur_op = &side->counted;
+
+    uint8_t *buf = malloc(VERIFY_BUFSIZE);
+    side->ret = buf == NULL ? -4 : 0;
+    side->code = TAR_ENOMEM;
+    qsort(side->jobs, side->njobs, sizeof(diff_node_t *), diff_job_cmp);
+
+    /* the jobs are read in archive order */
+    int advice = tar_get(side->fd)->advice;
+    advise_sequential(side->fd, advice, 1);
+    for (size_t i = 0; i < side->njobs && side->ret == 0; i++)
+    {
+        diff_node_t *node = side->jobs[i];
+        digest_t d;
+        digest_init(&d, TAR_DIGEST_XXH64);
+        off_t off = node->entry.offset + sizeof(tar_header_t);
+        size_t left = node->entry.size;
+        while (left > 0)
+        {
+            ssize_t n = tar_pread(side->fd, buf, left < VERIFY_BUFSIZE ? left : VERIFY_BUFSIZE, off);
+            if (n <= 0)
+            {
+                side->ret = -4;
+                side->code = TAR_EIO;
+                side->offset = node->entry.offset;
+                break;
+            }
+            digest_update(&d, buf, n);
+            off += n;
+            left -= n;
+        }
+        node->hash = xxh64_final(&d);
+    }
+    advise_sequential(side->fd, advice, 0);
+    free(buf);
+    side->sys_errno = errno;
+    cur_op = outer;
+    return NULL;
+}
+
+/* Records the error of a side that failed */
+static void diff_fail(tar_t *tar, const diff_side_t *side)
+{
+    errno = side->sys_errno;
+    if (side->ret == -4)
+    {
+        TAR_FAIL(tar, side->code, side->nheader, side->offset, NULL);
+    }
+    else
+    {
+        fail_header(tar, __func__, side->ret, side->nheader, side->offset);
+    }
+}
+
+/* Adds the work of a side's thread to the operation in progress */
+static void diff_account(diff_side_t *side)
+{
+    OP_COUNT(headers, side->counted.headers);
+    OP_COUNT(reads, side->counted.reads);
+    OP_COUNT(bytes_read, side->counted.bytes_read);
+    memset(&side->counted, 0, sizeof(tar_op_t));
+    side->counted.op = -1;
+}
+
+/* Runs `fn` on both sides at once, the old side on a new thread when one can be started */
+static void diff_run(void *(*fn)(void *), diff_side_t *sides)
+{
+    pthread_t thread;
+    int started = pthread_create(&thread, NULL, fn, &sides[0]) == 0;
+    if (!started)
+    {
+        fn(&sides[0]);
+    }
+    fn(&sides[1]);
+    if (started)
+    {
+        pthread_join(thread, NULL);
+    }
+    diff_account(&sides[0]);
+    diff_account(&sides[1]);
+}
+
+/* Returns the TAR_DIFF_* fields that differ between two members with the same name */
+static int diff_changes(const diff_node_t *a, const diff_node_t *b)
+{
+    int changes = 0;
+    int a_regular = a->entry.typeflag == REGTYPE || a->entry.typeflag == AREGTYPE;
+    int b_regular = b->entry.typeflag == REGTYPE || b->entry.typeflag == AREGTYPE;
+    if (a->entry.typeflag != b->entry.typeflag && !(a_regular && b_regular))
+    {
+        changes |= TAR_DIFF_TYPE;
+    }
+    if (a->entry.size != b->entry.size)
+    {
+        changes |= TAR_DIFF_SIZE | TAR_DIFF_CONTENT;
+    }
+    if ((a->mode & 07777) != (b->mode & 07777))
+    {
+        changes |= TAR_DIFF_MODE;
+    }
+    if (a->uid != b->uid || a->gid != b->gid)
+    {
+        changes |= TAR_DIFF_OWNER;
+    }
+    if (a->mtime != b->mtime)
+    {
+        changes |= TAR_DIFF_MTIME;
+    }
+    if (strcmp(a->entry.linkname, b->entry.linkname) != 0)
+    {
+        changes |= TAR_DIFF_LINK;
+    }
+    return changes;
+}
+
+/* Releases the sides of a diff */
+static void diff_free(diff_side_t *sides, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        free(sides[i].nodes);
+        free(sides[i].pool);
+        free(sides[i].jobs);
+    }
+}
+
+/**
+ * Compares the members of two archives, scanning both at once and merging them in sorted name order.
+ * The results are kept in `*out`, released by the caller with free(), and both sides in `sides`,
+ * released with diff_free().
+ *
+ * @return the number of results, -1 to -3 for an invalid header, -4 on a read error or if memory ran out.
+ */
+static ssize_t diff_compute(tar_t *tar, diff_side_t *sides, diff_result_t **out)
+{
+    *out = NULL;
+    diff_run(diff_collect, sides);
+    for (int i = 0; i < 2; i++)
+    {
+        if (sides[i].ret < 0)
+        {
+            diff_fail(tar, &sides[i]);
+            return sides[i].ret;
+        }
+    }
+
+    diff_side_t *old_side = &sides[0], *new_side = &sides[1];
+    diff_result_t *results = malloc((old_side->count + new_side->count + 1) * sizeof(diff_result_t));
+    old_side->jobs = malloc((old_side->count + 1) * sizeof(diff_node_t *));
+    new_side->jobs = malloc((new_side->count + 1) * sizeof(diff_node_t *));
+    if (results == NULL || old_side->jobs == NULL || new_side->jobs == NULL)
+    {
+        free(results);
+        TAR_FAIL(tar, TAR_ENOMEM, -1, -1, NULL);
+        return -4;
+    }
+
+    size_t n = 0, i = 0, j = 0;
+    while (i < old_side->count || j < new_side->count)
+    {
+        diff_node_t *a = i < old_side->count ? &old_side->nodes[i] : NULL;
+        diff_node_t *b = j < new_side->count ? &new_side->nodes[j] : NULL;
+        int cmp = a == NULL ? 1 : b == NULL ? -1 : strcmp(a->entry.name, b->entry.name);
+        diff_result_t *r = &results[n];
+        if (cmp < 0)
+        {
+            *r = (diff_result_t){a, NULL, TAR_DIFF_REMOVED, 0, 0};
+            i++;
+        }
+        else if (cmp > 0)
+        {
+            *r = (diff_result_t){NULL, b, TAR_DIFF_ADDED, 0, 0};
+            j++;
+        }
+        else
+        {
+            *r = (diff_result_t){a, b, TAR_DIFF_CHANGED, diff_changes(a, b), 0};
+            i++;
+            j++;
+            /* metadata first: the contents are only read when they could be equal */
+            int regular = (a->entry.typeflag == REGTYPE || a->entry.typeflag == AREGTYPE) &&
+                          (b->entry.typeflag == REGTYPE || b->entry.typeflag == AREGTYPE);
+            if (regular && a->entry.size == b->entry.size && a->entry.size > 0)
+            {
+                r->hashed = 1;
+                old_side->jobs[old_side->njobs++] = a;
+                new_side->jobs[new_side->njobs++] = b;
+            }
+        }
+        if (r->status != TAR_DIFF_CHANGED || r->changes != 0 || r->hashed)
+        {
+            n++;
+        }
+    }
+
+    if (old_side->njobs > 0)
+    {
+        diff_run(diff_hash, sides);
+        for (int k = 0; k < 2; k++)
+        {
+            if (sides[k].ret < 0)
+            {
+                free(results);
+                sides[k].nheader = -1;
+                diff_fail(tar, &sides[k]);
+                return -4;
+            }
+        }
+    }
+
+    size_t kept = 0;
+    for (size_t k = 0; k < n; k++)
+    {
+        diff_result_t *r = &results[k];
+        if (r->hashed && r->old_node->hash != r->new_node->hash)
+        {
+            r->changes |= TAR_DIFF_CONTENT;
+        }
+        if (r->status == TAR_DIFF_CHANGED && r->changes == 0)
+        {
+            continue;
+        }
+        results[kept++] = *r;
+    }
+    *out = results;
+    return kept;
+}
+
+static int tar_diff_impl(int old_fd, int new_fd, tar_diff_cb cb, void *arg)
+{
+    tar_t *tar = tar_begin(old_fd);
+    if (old_fd < 0 || new_fd < 0)
+    {
+        TAR_FAIL(tar, TAR_EINVAL, -1, -1, NULL);
+        return -4;
+    }
+
+    diff_side_t sides[2] = {
+        {.fd = old_fd, .check = tar_get(old_fd)->check, .counted.op = -1},
+        {.fd = new_fd, .check = tar_get(new_fd)->check, .counted.op = -1},
+    };
+    diff_result_t *results;
+    ssize_t n = diff_compute(tar, sides, &results);
+    for (ssize_t i = 0; i < n; i++)
+    {
+        const diff_result_t *r = &results[i];
+        if (cb != NULL && cb(r->old_node ? &r->old_node->entry : NULL, r->new_node ? &r->new_node->entry : NULL,
+                             r->status, r->changes, arg) != 0)
+        {
+            n = i + 1;
+            break;
+        }
+    }
+    free(results);
+    diff_free(sides, 2);
+    return n;
+}
+
+/**
+ * Compares two archives without extracting them, reporting the members added, removed or changed.
+ *
+ * Both archives are scanned at once on two threads and their members merged in sorted name order,
+ * the last member of a name shadowing earlier ones. Members with the same name are compared on their
+ * header metadata first: only regular files of equal size have their contents hashed, again reading
+ * both archives at once, to tell whether the data changed.
+ *
+ * @param old_fd A file descriptor of the older archive. Errors are recorded in its state.
+ * @param new_fd A file descriptor of the newer archive.
+ * @param cb Called for each difference in name order, may be NULL to only count them.
+ * @param arg A user argument passed to `cb`.
+ *
+ * @return the number of differences reported,
+ *         -1 to -3 if either archive contains an invalid header as check_archive(),
+ *         -4 if an archive could not be read or memory ran out.
+ */
+int tar_diff(int old_fd, int new_fd, tar_diff_cb cb, void *arg)
+{
+    tar_op_t op;
+    op_begin(&op, old_fd, TAR_OP_DIFF, NULL);
+    return op_end(&op, tar_diff_impl(old_fd, new_fd, cb, arg));
+}
+
+/* Size of the buffers used to compare and copy ranges of archives */
+#define DELTA_BUFSIZE (64 * 1024)
+
+/* Name of the delta member wrapping the bytes past the end of the new archive, which may not be headers */
+#define DELTA_TAIL ".tar-delta-tail"
+
+/* Size of member data rounded up to whole blocks, as aligned_size() */
+static size_t aligned_size_of(size_t size)
+{
+    return (size + sizeof(tar_header_t) - 1) / sizeof(tar_header_t) * sizeof(tar_header_t);
+}
+
+/**
+ * Copies a range of one file to another, within the kernel with copy_file_range() when the
+ * file systems allow it, with pread() and pwrite() otherwise.
+ *
+ * @return 0 on success, -1 on a read or write error or an early end of file.
+ */
+static int file_copy(int in_fd, off_t in_off, int out_fd, off_t out_off, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = copy_file_range(in_fd, &in_off, out_fd, &out_off, len, 0);
+        if (n == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+        {
+            break;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        OP_COUNT(reads, 1);
+        OP_COUNT(bytes_read, n);
+        len -= n;
+    }
+    if (len == 0)
+    {
+        return 0;
+    }
+
+    uint8_t *buf = malloc(DELTA_BUFSIZE);
+    if (buf == NULL)
+    {
+        return -1;
+    }
+    while (len > 0)
+    {
+        ssize_t n = tar_pread(in_fd, buf, len < DELTA_BUFSIZE ? len : DELTA_BUFSIZE, in_off);
+        if (n <= 0 || pwrite(out_fd, buf, n, out_off) != n)
+        {
+            free(buf);
+            return -1;
+        }
+        in_off += n;
+        out_off += n;
+        len -= n;
+    }
+    free(buf);
+    return 0;
+}
+
+/* Returns 1 if two ranges of the same length hold the same bytes, 0 if not, -1 on a read error */
+static int ranges_equal(int a_fd, off_t a_off, int b_fd, off_t b_off, size_t len)
+{
+    uint8_t *buf = malloc(2 * DELTA_BUFSIZE);
+    if (buf == NULL)
+    {
+        return -1;
+    }
+    int equal = 1;
+    while (len > 0 && equal == 1)
+    {
+        size_t n = len < DELTA_BUFSIZE ? len : DELTA_BUFSIZE;
+        if (tar_pread(a_fd, buf, n, a_off) != (ssize_t)n ||
+            tar_pread(b_fd, buf + DELTA_BUFSIZE, n, b_off) != (ssize_t)n)
+        {
+            equal = -1;
+        }
+        else if (memcmp(buf, buf + DELTA_BUFSIZE, n) != 0)
+        {
+            equal = 0;
+        }
+        a_off += n;
+        b_off += n;
+        len -= n;
+    }
+    free(buf);
+    return equal;
+}
+
+/* Hashes the first `size` bytes of a file with XXH3-64, returns -1 on a read error or if memory ran out */
+static int file_xxh3(int fd, off_t size, uint64_t *hash)
+{
+    uint8_t *buf = malloc(DELTA_BUFSIZE);
+    if (buf == NULL)
+    {
+        return -1;
+    }
+    digest_t d;
+    digest_init(&d, TAR_DIGEST_XXH3);
+    for (off_t off = 0; off < size;)
+    {
+        size_t len = size - off < DELTA_BUFSIZE ? size - off : DELTA_BUFSIZE;
+        ssize_t n = tar_pread(fd, buf, len, off);
+        if (n <= 0)
+        {
+            free(buf);
+            return -1;
+        }
+        digest_update(&d, buf, n);
+        off += n;
+    }
+    free(buf);
+    *hash = xxh3_final(&d);
+    return 0;
+}
+
+static int diff_node_name_cmp(const void *key, const void *node)
+{
+    return strcmp(key, ((const diff_node_t *)node)->entry.name);
+}
+
+/* A range of the new archive in a delta recipe, merged with the next one when they are contiguous */
+typedef struct delta_range
+{
+    char source;                  /* 'o' old archive, 'd' delta, 'z' zeros */
+    off_t offset;
+    size_t len;
+} delta_range_t;
+
+/* Appends a range to the recipe, extending the previous range when it continues it */
+static void delta_range(FILE *recipe, delta_range_t *pending, char source, off_t offset, size_t len)
+{
+    if (pending->len > 0 && pending->source == source && pending->offset + (off_t)pending->len == offset)
+    {
+        pending->len += len;
+        return;
+    }
+    if (pending->len > 0)
+    {
+        fprintf(recipe, "%c %lld %zu\n", pending->source, (long long)pending->offset, pending->len);
+    }
+    *pending = (delta_range_t){source, offset, len};
+}
+
+/* Fills a ustar header for a regular file, with a zero mtime so that deltas are reproducible */
+static void make_header(tar_header_t *header, const char *name, size_t size)
+{
+    memset(header, 0, sizeof(tar_header_t));
+    snprintf(header->name, sizeof(header->name), "%s", name);
+    snprintf(header->mode, sizeof(header->mode), "%07o", 0644);
+    snprintf(header->uid, sizeof(header->uid), "%07o", 0);
+    snprintf(header->gid, sizeof(header->gid), "%07o", 0);
+    snprintf(header->size, sizeof(header->size), "%011zo", size);
+    snprintf(header->mtime, sizeof(header->mtime), "%011o", 0);
+    header->typeflag = REGTYPE;
+    memcpy(header->magic, TMAGIC, TMAGLEN);
+    memcpy(header->version, TVERSION, TVERSLEN);
+
+    memset(header->chksum, ' ', sizeof(header->chksum));
+    unsigned int sum = 0;
+    for (size_t i = 0; i < sizeof(tar_header_t); i++)
+    {
+        sum += ((unsigned char *)header)[i];
+    }
+    snprintf(header->chksum, sizeof(header->chksum), "%06o", sum);
+    header->chksum[7] = ' ';
+}
+
+static int tar_delta_create_impl(int old_fd, int new_fd, int delta_fd)
+{
+    tar_t *tar = tar_begin(new_fd);
+    struct stat st, old_st;
+    uint64_t hash, old_hash;
+    if (old_fd < 0 || new_fd < 0 || delta_fd < 0)
+    {
+        TAR_FAIL(tar, TAR_EINVAL, -1, -1, NULL);
+        return -4;
+    }
+    if (fstat(new_fd, &st) == -1 || fstat(old_fd, &old_st) == -1 ||
+        file_xxh3(new_fd, st.st_size, &hash) == -1 || file_xxh3(old_fd, old_st.st_size, &old_hash) == -1)
+    {
+        TAR_FAIL(tar, TAR_EIO, -1, -1, NULL);
+        return -4;
+    }
+
+    diff_side_t old_side = {.fd = old_fd, .check = tar_get(old_fd)->check, .counted.op = -1};
+    diff_collect(&old_side);
+    diff_account(&old_side);
+    if (old_side.ret < 0)
+    {
+        diff_fail(tar, &old_side);
+        diff_free(&old_side, 1);
+        return old_side.ret;
+    }
+
+    char *text = NULL;
+    size_t text_len = 0;
+    FILE *recipe = open_memstream(&text, &text_len);
+    char *present = calloc(old_side.count + 1, 1);
+    if (recipe == NULL || present == NULL)
+    {
+        if (recipe != NULL)
+        {
+            fclose(recipe);
+        }
+        free(text);
+        free(present);
+        diff_free(&old_side, 1);
+        TAR_FAIL(tar, TAR_ENOMEM, -1, -1, NULL);
+        return -4;
+    }
+    /* the sizes and digests of both archives, checked when the delta is applied */
+    fprintf(recipe, "tar-delta 2 %lld %016llx %lld %016llx\n", (long long)st.st_size, (unsigned long long)hash,
+            (long long)old_st.st_size, (unsigned long long)old_hash);
+
+    delta_range_t pending = {0, 0, 0};
+    off_t delta_off = 0;
+    int stored = 0;
+    int ret = 0;
+    int got;
+    tar_iter_t it;
+    iter_init(&it, new_fd);
+    off_t start = 0;
+    long nheader = 0;
+    for (; (got = iter_next(&it)) == 1; nheader++, start = it.next)
+    {
+        ret = scan_check(tar->check, &it.header);
+        if (ret < 0)
+        {
+            fail_header(tar, __func__, ret, nheader, it.entry.offset);
+            break;
+        }
+        if (ret > 0)
+        {
+            /* the archive ends at this header, which is stored with the tail */
+            it.next = start;
+            ret = 0;
+            break;
+        }
+
+        /* a member and its extension headers are taken from the old archive if it holds the same bytes */
+        size_t len = it.next - start;
+        diff_node_t *node = bsearch(it.entry.name, old_side.nodes, old_side.count, sizeof(diff_node_t),
+                                    diff_node_name_cmp);
+        int same = 0;
+        if (node != NULL)
+        {
+            present[node - old_side.nodes] = 1;
+            off_t old_end = node->entry.offset + sizeof(tar_header_t) + aligned_size_of(node->entry.size);
+            if (old_end - node->start == (off_t)len)
+            {
+                same = ranges_equal(old_fd, node->start, new_fd, start, len);
+            }
+        }
+        if (same == 1)
+        {
+            delta_range(recipe, &pending, 'o', node->start, len);
+            continue;
+        }
+        if (same == -1 || file_copy(new_fd, start, delta_fd, delta_off, len) == -1)
+        {
+            TAR_FAIL(tar, TAR_EIO, nheader, start, NULL);
+            ret = -4;
+            break;
+        }
+        delta_range(recipe, &pending, 'd', delta_off, len);
+        delta_off += len;
+        stored++;
+    }
+    iter_free(&it);
+    if (got == -3)
+    {
+        TAR_FAIL(tar, TAR_EIO, nheader, it.next, NULL);
+        ret = -4;
+    }
+
+    if (ret == 0)
+    {
+        /* the end-of-archive marker and the record padding are zeros, anything else is stored */
+        size_t tail = st.st_size > it.next ? st.st_size - it.next : 0;
+        uint8_t *zeros = calloc(tail + 1, 2);
+        if (zeros == NULL || tar_pread(new_fd, zeros, tail, it.next) != (ssize_t)tail)
+        {
+            TAR_FAIL(tar, zeros == NULL ? TAR_ENOMEM : TAR_EIO, -1, it.next, NULL);
+            ret = -4;
+        }
+        else if (memcmp(zeros, zeros + tail + 1, tail) == 0)
+        {
+            delta_range(recipe, &pending, 'z', 0, tail);
+        }
+        else
+        {
+            tar_header_t header;
+            make_header(&header, DELTA_TAIL, tail);
+            if (pwrite(delta_fd, &header, sizeof(header), delta_off) == sizeof(header)
+                && file_copy(new_fd, it.next, delta_fd, delta_off + sizeof(header), tail) == 0)
+            {
+                delta_range(recipe, &pending, 'd', delta_off + sizeof(header), tail);
+                delta_off += sizeof(header) + aligned_size_of(tail);
+            }
+            else
+            {
+                TAR_FAIL(tar, TAR_EIO, -1, it.next, NULL);
+                ret = -4;
+            }
+        }
+        free(zeros);
+    }
+    delta_range(recipe, &pending, 0, 0, 0);
+
+    /* the deletion manifest, names being prefixed by their length as they may hold any byte */
+    for (size_t i = 0; i < old_side.count; i++)
+    {
+        if (!present[i])
+        {
+            fprintf(recipe, "- %zu %s\n", strlen(old_side.nodes[i].entry.name), old_side.nodes[i].entry.name);
+        }
+    }
+    free(present);
+    diff_free(&old_side, 1);
+    if (fclose(recipe) != 0 && ret == 0)
+    {
+        TAR_FAIL(tar, TAR_ENOMEM, -1, -1, NULL);
+        ret = -4;
+    }
+
+    if (ret == 0)
+    {
+        /* the recipe is the last member, followed by the end-of-archive marker */
+        size_t padded = aligned_size_of(text_len);
+        uint8_t *block = calloc(sizeof(tar_header_t) + padded + 2 * sizeof(tar_header_t), 1);
+        if (block == NULL)
+        {
+            TAR_FAIL(tar, TAR_ENOMEM, -1, -1, NULL);
+            ret = -4;
+        }
+        else
+        {
+            make_header((tar_header_t *)block, TAR_DELTA_MANIFEST, text_len);
+            memcpy(block + sizeof(tar_header_t), text, text_len);
+            ssize_t size = sizeof(tar_header_t) + padded + 2 * sizeof(tar_header_t);
+            if (pwrite(delta_fd, block, size, delta_off) != size)
+            {
+                TAR_FAIL(tar, TAR_EIO, -1, delta_off, NULL);
+                ret = -4;
+            }
+            free(block);
+        }
+    }
+    free(text);
+    return ret < 0 ? ret : stored;
+}
+
+/**
+ * Writes a delta archive turning one archive into another.
+ *
+ * The delta is itself a tar archive: the members of the new archive whose bytes differ from the member
+ * of the same name in the old archive, stored verbatim, then a last member named TAR_DELTA_MANIFEST
+ * holding the recipe of the new archive and the names of the old members it deletes. Bytes following
+ * the end of the new archive that are not zeros are stored in a member of their own. The recipe records
+ * the size and XXH3-64 digest of both archives, as TAR_DIGEST_XXH3.
+ *
+ * @param old_fd A file descriptor of the archive the delta is applied to.
+ * @param new_fd A file descriptor of the archive the delta rebuilds. Errors are recorded in its state.
+ * @param delta_fd A file descriptor of an empty regular file, written from its start.
+ *
+ * @return the number of members stored in the delta,
+ *         -1 to -3 if either archive contains an invalid header as check_archive(),
+ *         -4 if an archive could not be read, the delta could not be written or memory ran out.
+ */
+int tar_delta_create(int old_fd, int new_fd, int delta_fd)
+{
+    tar_op_t op;
+    op_begin(&op, new_fd, TAR_OP_DELTA_CREATE, NULL);
+    return op_end(&op, tar_delta_create_impl(old_fd, new_fd, delta_fd));
+}
+
+/* Follows the recipe of a delta, writing the new archive to out_fd */
+static int delta_replay(tar_t *tar, const char *text, int old_fd, int delta_fd, int out_fd)
+{
+    char *p;
+    long long size = 0, old_size = 0;
+    unsigned long long hash = 0, old_hash = 0;
+    if (sscanf(text, "tar-delta 2 %lld %llx %lld %llx", &size, &hash, &old_size, &old_hash) != 4 ||
+        (p = strchr(text, '\n')) == NULL)
+    {
+        TAR_FAIL(tar, TAR_EINVAL, -1, -1, "manifest");
+        return -1;
+    }
+
+    /* the delta only applies to the archive it was created against */
+    struct stat st;
+    uint64_t got = 0;
+    if (fstat(old_fd, &st) == -1 || (st.st_size == old_size && file_xxh3(old_fd, old_size, &got) == -1))
+    {
+        TAR_FAIL(tar, TAR_EIO, -1, -1, NULL);
+        return -4;
+    }
+    if (st.st_size != old_size || got != old_hash)
+    {
+        TAR_FAIL(tar, TAR_EINVAL, -1, -1, "digest");
+        return -1;
+    }
+
+    uint8_t zeros[4096] = {0};
+    off_t out_off = 0;
+    while (*++p != '\0')
+    {
+        char source = *p;
+        if (source == '-')
+        {
+            /* a deleted name, nothing to write */
+            size_t len = strtoull(p + 2, &p, 10);
+            if (*p != ' ' || strnlen(p + 1, len + 1) != len + 1 || p[1 + len] != '\n')
+            {
+                TAR_FAIL(tar, TAR_EINVAL, -1, -1, "manifest");
+                return -1;
+            }
+            p += 1 + len;
+            continue;
+        }
+        long long offset = strtoll(p + 2, &p, 10);
+        size_t len = strtoull(p, &p, 10);
+        if (*p != '\n' || offset < 0 || (source != 'o' && source != 'd' && source != 'z'))
+        {
+            TAR_FAIL(tar, TAR_EINVAL, -1, -1, "manifest");
+            return -1;
+        }
+
+        if (source == 'z')
+        {
+            for (size_t done = 0; done < len;)
+            {
+                size_t n = len - done < sizeof(zeros) ? len - done : sizeof(zeros);
+                if (pwrite(out_fd, zeros, n, out_off + done) != (ssize_t)n)
+                {
+                    TAR_FAIL(tar, TAR_EIO, -1, -1, NULL);
+                    return -4;
+                }
+                done += n;
+            }
+        }
+        else if (file_copy(source == 'o' ? old_fd : delta_fd, offset, out_fd, out_off, len) == -1)
+        {
+            TAR_FAIL(tar, TAR_EIO, -1, offset, NULL);
+            return -4;
+        }
+        out_off += len;
+    }
+    if (out_off != size)
+    {
+        TAR_FAIL(tar, TAR_EINVAL, -1, -1, "manifest");
+        return -1;
+    }
+    if (file_xxh3(out_fd, size, &got) == -1)
+    {
+        TAR_FAIL(tar, TAR_EIO, -1, -1, NULL);
+        return -4;
+    }
+    if (got != hash)
+    {
+        TAR_FAIL(tar, TAR_EINVAL, -1, -1, "digest");
+        return -1;
+    }
+    return 0;
+}
+
+static int tar_delta_apply_impl(int old_fd, int delta_fd, int out_fd)
+{
+    tar_t *tar = tar_begin(delta_fd);
+    if (old_fd < 0 || delta_fd < 0 || out_fd < 0)
+    {
+        TAR_FAIL(tar, TAR_EINVAL, -1, -1, NULL);
+        return -4;
+    }
+
+    /* the last manifest of the delta wins, as for any member */
+    tar_entry_t manifest = {NULL, "", REGTYPE, 0, -1};
+    tar_iter_t it;
+    iter_init(&it, delta_fd);
+    int ret;
+    while ((ret = iter_next(&it)) == 1)
+    {
+        if (strcmp(it.entry.name, TAR_DELTA_MANIFEST) == 0 && it.entry.typeflag == REGTYPE)
+        {
+            manifest = it.entry;
+        }
+    }
+    iter_free(&it);
+    if (ret == -3)
+    {
+        TAR_FAIL(tar, TAR_EIO, -1, it.next, NULL);
+        return -4;
+    }
+    if (manifest.offset == -1)
+    {
+        TAR_FAIL(tar, TAR_ENOENT, -1, -1, "manifest");
+        return -1;
+    }
+
+    char *text = malloc(manifest.size + 1);
+    if (text == NULL)
+    {
+        TAR_FAIL(tar, TAR_ENOMEM, -1, -1, NULL);
+        return -4;
+    }
+    if (tar_pread(delta_fd, text, manifest.size, manifest.offset + sizeof(tar_header_t)) != (ssize_t)manifest.size)
+    {
+        free(text);
+        TAR_FAIL(tar, TAR_EIO, -1, manifest.offset, NULL);
+        return -4;
+    }
+    text[manifest.size] = '\0';
+    ret = delta_replay(tar, text, old_fd, delta_fd, out_fd);
+    free(text);
+    return ret;
+}
+
+/**
+ * Rebuilds an archive from an older one and a delta written by tar_delta_create().
+ * Members are copied from both files to the output with copy_file_range() where the file systems allow it.
+ * The older archive is checked against the size and digest recorded in the delta before anything is
+ * written, and the output against those of the new archive once it is rebuilt.
+ *
+ * @param old_fd A file descriptor of the archive the delta was created against.
+ * @param delta_fd A file descriptor of the delta. Errors are recorded in its state.
+ * @param out_fd A file descriptor of an empty regular file open for reading and writing, written from its start.
+ *
+ * @return 0 on success, -1 if the delta has no valid manifest or an archive does not match its digest,
+ *         -4 if a file could not be read or written or memory ran out.
+ */
+int tar_delta_apply(int old_fd, int delta_fd, int out_fd)
+{
+    tar_op_t op;
+    op_begin(&op, delta_fd, TAR_OP_DELTA_APPLY, NULL);
+    return op_end(&op, tar_delta_apply_impl(old_fd, delta_fd, out_fd));
+}
+
+/* Returns 1 if a block holds only zeros */
+static int block_is_zero(const uint8_t *block)
+{
+    for (size_t i = 0; i < sizeof(tar_header_t); i++)
+    {
+        if (block[i] != 0)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Returns 1 if a block is a header valid under the policy of the archive, not an end-of-archive block */
+static int header_ok(tar_t *tar, const tar_header_t *header)
+{
+    return tar->check(header, 1) == 0;
+}
+
+/* State of tar_recover() */
+typedef struct recover_ctx
+{
+    tar_t *tar;
+    off_t size;                   /* size of the archive file */
+    tar_index_t *index;           /* index rebuilt with the intact members, NULL without a handle */
+    tar_recover_cb cb;
+    void *arg;
+    int stopped;
+    int members;                  /* intact members found */
+} recover_ctx_t;
+
+/* Passes a member or a damaged region to the callback */
+static void recover_report(recover_ctx_t *ctx, int status, const tar_entry_t *entry, off_t start, off_t end)
+{
+    if (ctx->cb != NULL && !ctx->stopped && ctx->cb(status, entry, start, end, ctx->arg) != 0)
+    {
+        ctx->stopped = 1;
+    }
+}
+
+/**
+ * Looks for the next block holding a valid header, reading the archive in large chunks.
+ *
+ * @param pos The first block to examine.
+ * @param data_end Set past the last block that is not all zeros before the header found.
+ *
+ * @return the offset of the header found, the size of the file if there is none, -1 on a read error.
+ */
+static off_t recover_resync(recover_ctx_t *ctx, off_t pos, off_t *data_end)
+{
+    uint8_t *buf = malloc(DELTA_BUFSIZE);
+    if (buf == NULL)
+    {
+        return -1;
+    }
+    *data_end = pos;
+    while (pos + (off_t)sizeof(tar_header_t) <= ctx->size)
+    {
+        ssize_t n = tar_pread(ctx->tar->fd, buf, DELTA_BUFSIZE, pos);
+        if (n < (ssize_t)sizeof(tar_header_t))
+        {
+            free(buf);
+            return n < 0 ? -1 : ctx->size;
+        }
+        for (ssize_t i = 0; i + (ssize_t)sizeof(tar_header_t) <= n; i += sizeof(tar_header_t), pos += sizeof(tar_header_t))
+        {
+            const tar_header_t *block = (const tar_header_t *)(buf + i);
+            if (block_is_zero(buf + i))
+            {
+                continue;
+            }
+            if (header_ok(ctx->tar, block))
+            {
+                free(buf);
+                return pos;
+            }
+            *data_end = pos + sizeof(tar_header_t);
+        }
+    }
+    free(buf);
+    *data_end = ctx->size;
+    return ctx->size;
+}
+
+/* Scans the whole archive, following valid headers and resynchronizing past damaged blocks */
+static int recover_scan(recover_ctx_t *ctx)
+{
+    tar_t *tar = ctx->tar;
+    tar_iter_t it;
+    iter_init(&it, tar->fd);
+    off_t pos = 0;
+    while (!ctx->stopped && pos < ctx->size)
+    {
+        tar_header_t block;
+        ssize_t n = tar_pread(tar->fd, &block, sizeof(tar_header_t), pos);
+        if (n == -1)
+        {
+            TAR_FAIL(tar, TAR_EIO, -1, pos, NULL);
+            return -4;
+        }
+        if (n != sizeof(tar_header_t))
+        {
+            /* a partial block at the end of the file */
+            recover_report(ctx, TAR_RECOVER_DAMAGED, NULL, pos, ctx->size);
+            break;
+        }
+        if (block_is_zero((const uint8_t *)&block))
+        {
+            /* an end-of-archive marker or zeros left by the damage, members may follow */
+            pos += sizeof(tar_header_t);
+            continue;
+        }
+
+        off_t bad = pos;
+        if (header_ok(tar, &block))
+        {
+            it.next = pos;
+            errno = 0;
+            int ret = iter_next(&it);
+            if (ret == -3 && errno != 0)
+            {
+                iter_free(&it);
+                TAR_FAIL(tar, TAR_EIO, -1, pos, NULL);
+                return -4;
+            }
+            if (ret == -3)
+            {
+                /* the data of an extension header runs past the end of the file */
+                recover_report(ctx, TAR_RECOVER_DAMAGED, NULL, pos, ctx->size);
+                break;
+            }
+            if (ret == 1 && header_ok(tar, &it.header))
+            {
+                if (it.entry.offset + (off_t)sizeof(tar_header_t) + (off_t)it.entry.size > ctx->size)
+                {
+                    recover_report(ctx, TAR_RECOVER_TRUNCATED, &it.entry, pos, ctx->size);
+                    break;
+                }
+                ctx->members++;
+                if (ctx->index != NULL && index_add_member(ctx->index, &it.entry) == -1)
+                {
+                    iter_free(&it);
+                    TAR_FAIL(tar, TAR_ENOMEM, -1, -1, NULL);
+                    return -4;
+                }
+                recover_report(ctx, TAR_RECOVER_MEMBER, &it.entry, pos, it.next);
+                pos = it.next;
+                iter_free(&it);
+                continue;
+            }
+            /* extension headers whose member header is damaged or missing */
+            bad = ret == 1 ? it.entry.offset : it.next;
+            iter_free(&it);
+        }
+
+        off_t data_end;
+        off_t next = recover_resync(ctx, bad, &data_end);
+        if (next == -1)
+        {
+            TAR_FAIL(tar, TAR_EIO, -1, bad, NULL);
+            return -4;
+        }
+        recover_report(ctx, TAR_RECOVER_DAMAGED, NULL, pos, data_end > bad ? data_end : bad);
+        pos = next;
+    }
+    return 0;
+}
+
+static int tar_recover_impl(int tar_fd, tar_recover_cb cb, void *arg)
+{
+    tar_t *tar = tar_begin(tar_fd);
+    struct stat st;
+    if (fstat(tar_fd, &st) == -1)
+    {
+        TAR_FAIL(tar, TAR_EIO, -1, -1, NULL);
+        return -4;
+    }
+
+    recover_ctx_t ctx = {tar, st.st_size, NULL, cb, arg, 0, 0};
+    if (tar != &fd_state)
+    {
+        ctx.index = index_new();
+        if (ctx.index == NULL)
+        {
+            TAR_FAIL(tar, TAR_ENOMEM, -1, -1, NULL);
+            return -4;
+        }
+    }
+
+    int ret = recover_scan(&ctx);
+
+    if (ctx.index != NULL)
+    {
+        /* lookups only look again once the file changes, appended members being scanned from its end */
+        ctx.index->end = st.st_size;
+        ctx.index->stamp = file_stamp(&st);
+        if (tar->index_mode == TAR_INDEX_PERFECT)
+        {
+            index_perfect(ctx.index);
+        }
+        pthread_mutex_lock(&tar->index_lock);
+        index_publish(tar, ctx.index);
+        pthread_mutex_unlock(&tar->index_lock);
+    }
+    return ret < 0 ? ret : ctx.members;
+}
+
+/**
+ * Salvages the members of a damaged archive.
+ *
+ * Valid headers are followed as by the other scans, but a block that is not a valid header does not
+ * end the scan: the following blocks are searched for the next header with a valid magic and checksum,
+ * and the blocks skipped are reported as a damaged region. A member whose data runs past the end of
+ * the file is reported as truncated.
+ *
+ * If a handle is attached to tar_fd, its index is rebuilt with the intact members, so that exists(),
+ * read_file() and the other indexed functions can read them past the damage.
+ *
+ * @param tar_fd A file descriptor pointing to a tar archive file.
+ * @param cb Called for each member and damaged region in archive order, may be NULL.
+ * @param arg A user argument passed to `cb`.
+ *
+ * @return the number of intact members, -4 if the archive could not be read or memory ran out.
+ */
+int tar_recover(int tar_fd, tar_recover_cb cb, void *arg)
+{
+    tar_op_t op;
+    op_begin(&op, tar_fd, TAR_OP_RECOVER, NULL);
+    return op_end(&op, tar_recover_impl(tar_fd, cb, arg));
+}
+
+
+/* Prefix of the names marking an entry of the lower layers as deleted, and of an opaque directory */
+#define WHITEOUT_PREFIX ".wh."
+#define WHITEOUT_OPAQUE ".wh..wh..opq"
+
+/* A layer of an overlay */
+typedef struct overlay_layer
+{
+    int fd;
+    tar_t *tar;
+    int owned;                    /* the handle was attached by the overlay, which closes it */
+    uint64_t stamp;               /* file_stamp() when the merged index was built */
+} overlay_layer_t;
+
+struct tar_overlay
+{
+    pthread_rwlock_t lock;
+    overlay_layer_t *layers;      /* bottom layer first */
+    size_t nlayers;
+    tar_index_t *merged;          /* visible entries, each resolved in the topmost layer holding it */
+    int *owners;                  /* layer of each record of merged */
+    size_t owners_cap;
+};
+
+/* Returns the base name of a path, ignoring a trailing slash, and its length */
+static const char *base_name(const char *path, size_t *len)
+{
+    size_t n = strlen(path);
+    if (n > 0 && path[n - 1] == '/')
+    {
+        n--;
+    }
+    const char *start = path + n;
+    while (start > path && start[-1] != '/')
+    {
+        start--;
+    }
+    *len = path + n - start;
+    return start;
+}
+
+/* Looks a path up in the whiteouts of the layers above, without its trailing slash */
+static int hidden_has(tar_index_t *hidden, const char *path, size_t len, char kind)
+{
+    char key[TAR_NAME_MAX];
+    if (len >= sizeof(key))
+    {
+        return 0;
+    }
+    memcpy(key, path, len);
+    key[len] = '\0';
+    size_t found = index_lookup(hidden, key);
+    return found != 0 && hidden->types[found - 1] == kind;
+}
+
+/*
+ * Returns 1 if a path of a lower layer is hidden: a whiteout above names it or one of its parent
+ * directories, or one of its parent directories is opaque above.
+ */
+static int overlay_hidden(tar_index_t *hidden, const char *path)
+{
+    size_t len = strlen(path);
+    if (len > 0 && path[len - 1] == '/')
+    {
+        len--;
+    }
+    if (len > 0 && hidden_has(hidden, path, 0, 'o'))
+    {
+        return 1;
+    }
+    for (size_t i = 1; i <= len; i++)
+    {
+        if (i < len && path[i] != '/')
+        {
+            continue;
+        }
+        if (hidden_has(hidden, path, i, 'w') || (i < len && hidden_has(hidden, path, i, 'o')))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Adds the entry of a layer to the merged index, unless a layer above already holds it or hides it */
+static int overlay_add(tar_overlay_t *ov, tar_index_t *hidden, const tar_entry_t *entry, int layer)
+{
+    size_t len;
+    const char *base = base_name(entry->name, &len);
+    if (strncmp(base, WHITEOUT_PREFIX, strlen(WHITEOUT_PREFIX)) == 0)
+    {
+        return 0;
+    }
+    tar_index_t *merged = ov->merged;
+    if (index_lookup(merged, entry->name) != 0 ||
+        overlay_hidden(hidden, entry->name))
+    {
+        return 0;
+    }
+    if (merged->count == ov->owners_cap)
+    {
+        size_t cap = ov->owners_cap ? ov->owners_cap * 2 : 64;
+        int *grown = realloc(ov->owners, cap * sizeof(int));
+        if (grown == NULL)
+        {
+            return -1;
+        }
+        ov->owners = grown;
+        ov->owners_cap = cap;
+    }
+    ov->owners[merged->count] = layer;
+    return index_add(merged, entry);
+}
+
+/* Records the whiteouts of a layer, hiding entries of the layers below it */
+static int overlay_whiteouts(tar_index_t *hidden, tar_index_t *index)
+{
+    for (size_t i = 0; i < index->count; i++)
+    {
+        tar_entry_t entry;
+        index_entry(index, i, &entry);
+        size_t len;
+        const char *base = base_name(entry.name, &len);
+        size_t prefix_len = strlen(WHITEOUT_PREFIX);
+        if (len <= prefix_len || strncmp(base, WHITEOUT_PREFIX, prefix_len) != 0)
+        {
+            continue;
+        }
+
+        /* "dir/.wh.name" hides "dir/name", "dir/.wh..wh..opq" hides what lower layers hold in "dir/" */
+        char target[TAR_NAME_MAX];
+        tar_entry_t rule = {target, "", 'w', 0, -1};
+        if (len == strlen(WHITEOUT_OPAQUE) && strncmp(base, WHITEOUT_OPAQUE, len) == 0)
+        {
+            snprintf(target, sizeof(target), "%.*s", (int)(base - entry.name - (base > entry.name)), entry.name);
+            rule.typeflag = 'o';
+        }
+        else
+        {
+            snprintf(target, sizeof(target), "%.*s%.*s", (int)(base - entry.name), entry.name,
+                     (int)(len - prefix_len), base + prefix_len);
+        }
+        if (index_lookup(hidden, target) == 0 && index_add(hidden, &rule) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Brings the per-layer indexes up to date and rebuilds the whole merged index if a layer changed,
+ * as a whiteout appended to a layer may hide entries of any layer below. The caller holds the write lock.
+ *
+ * @return 0 on success, -1 if a layer could not be indexed or memory ran out.
+ */
+static int overlay_build(tar_overlay_t *ov)
+{
+    int changed = ov->merged == NULL;
+    for (size_t l = 0; l < ov->nlayers; l++)
+    {
+        struct stat st;
+        if (fstat(ov->layers[l].fd, &st) == -1)
+        {
+            return -1;
+        }
+        if (file_stamp(&st) != ov->layers[l].stamp)
+        {
+            if (tar_index(ov->layers[l].tar) < 0)
+            {
+                return -1;
+            }
+            ov->layers[l].stamp = file_stamp(&st);
+            changed = 1;
+        }
+    }
+    if (!changed)
+    {
+        return 0;
+    }
+
+    tar_index_t *merged = index_new();
+    tar_index_t *hidden = index_new();
+    int ret = merged == NULL || hidden == NULL ? -1 : 0;
+    index_free(ov->merged);
+    ov->merged = merged;
+    for (size_t l = ov->nlayers; l-- > 0 && ret == 0;)
+    {
+        rcu_enter();
+        tar_index_t *index = __atomic_load_n(&ov->layers[l].tar->index, __ATOMIC_SEQ_CST);
+        for (size_t i = 0; i < index->count && ret == 0; i++)
+        {
+            if (index_visible(index, i))
+            {
+                tar_entry_t entry;
+                index_entry(index, i, &entry);
+                ret = overlay_add(ov, hidden, &entry, l);
+            }
+        }
+        if (ret == 0)
+        {
+            ret = overlay_whiteouts(hidden, index);
+        }
+        rcu_exit();
+    }
+    index_free(hidden);
+    if (ret == -1)
+    {
+        /* rebuilt on the next call */
+        index_free(ov->merged);
+        ov->merged = NULL;
+    }
+    return ret;
+}
+
+/**
+ * Finds a path in the merged view, following symlinks and hard links.
+ * The caller holds the read lock, the entry stays valid while it is held.
+ *
+ * @return the layer of the entry found, -1 if there is none.
+ */
+static int overlay_find(tar_overlay_t *ov, const char *path, int follow, tar_entry_t *entry)
+{
+    char target[TAR_NAME_MAX];
+    for (int hops = 0; hops < 8; hops++)
+    {
+        size_t slot = index_lookup(ov->merged, path);
+        if (slot == 0)
+        {
+            return -1;
+        }
+        index_entry(ov->merged, slot - 1, entry);
+        /* a hard link the layer index made an alias of its target is read in place */
+        if (!follow || (entry->typeflag != SYMTYPE && (entry->typeflag != LNKTYPE || entry->size > 0)))
+        {
+            return ov->owners[slot - 1];
+        }
+        if (entry->typeflag == SYMTYPE)
+        {
+            link_target(entry->name, entry->linkname, target, sizeof(target));
+        }
+        else
+        {
+            snprintf(target, sizeof(target), "%s", entry->linkname);
+        }
+        path = target;
+    }
+    return -1;
+}
+
+/* Returns 1 if the merged index is missing or a layer changed since it was built */
+static int overlay_stale(tar_overlay_t *ov)
+{
+    if (ov->merged == NULL)
+    {
+        return 1;
+    }
+    for (size_t l = 0; l < ov->nlayers; l++)
+    {
+        struct stat st;
+        if (fstat(ov->layers[l].fd, &st) == -1 || file_stamp(&st) != ov->layers[l].stamp)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Takes the read lock on an up-to-date merged index, returns -1 if it could not be built */
+static int overlay_begin(tar_overlay_t *ov)
+{
+    pthread_rwlock_rdlock(&ov->lock);
+    while (overlay_stale(ov))
+    {
+        pthread_rwlock_unlock(&ov->lock);
+        pthread_rwlock_wrlock(&ov->lock);
+        int ret = overlay_build(ov);
+        pthread_rwlock_unlock(&ov->lock);
+        if (ret == -1)
+        {
+            return -1;
+        }
+        pthread_rwlock_rdlock(&ov->lock);
+    }
+    return 0;
+}
+
+/**
+ * Stacks archives into a single merged view, where a path resolves to the topmost layer holding it.
+ *
+ * A layer hides the entries of the layers below it with whiteouts: an entry "dir/.wh.name" deletes
+ * "dir/name" and anything under it, and an entry "dir/.wh..wh..opq" hides everything the layers below
+ * hold in "dir/". Whiteouts are not part of the view.
+ *
+ * Each layer is indexed with tar_index(), a handle being attached to its file descriptor if it has none.
+ * When a layer changes, its index only scans the members appended to it, but the merged index is then
+ * rebuilt whole from the indexes of every layer, whiteouts being resolved again across all of them.
+ *
+ * @param fds The file descriptors of the archives, the bottom layer first.
+ * @param nlayers The number of layers.
+ *
+ * @return the overlay, NULL if a layer could not be indexed or memory ran out.
+ */
+tar_overlay_t *tar_overlay_new(const int *fds, size_t nlayers)
+{
+    tar_overlay_t *ov = calloc(1, sizeof(tar_overlay_t));
+    if (ov == NULL || (ov->layers = calloc(nlayers + 1, sizeof(overlay_layer_t))) == NULL)
+    {
+        free(ov);
+        return NULL;
+    }
+    pthread_rwlock_init(&ov->lock, NULL);
+    for (size_t l = 0; l < nlayers; l++, ov->nlayers++)
+    {
+        overlay_layer_t *layer = &ov->layers[l];
+        layer->fd = fds[l];
+        layer->tar = tar_handle(fds[l]);
+        if (layer->tar == NULL)
+        {
+            layer->tar = tar_open(fds[l]);
+            layer->owned = 1;
+        }
+        if (layer->tar == NULL)
+        {
+            tar_overlay_free(ov);
+            return NULL;
+        }
+    }
+    if (overlay_build(ov) == -1)
+    {
+        tar_overlay_free(ov);
+        return NULL;
+    }
+    return ov;
+}
+
+/**
+ * Frees an overlay, closing the handles it attached to its layers. The file descriptors are not closed.
+ *
+ * @param ov The overlay to free, may be NULL.
+ */
+void tar_overlay_free(tar_overlay_t *ov)
+{
+    if (ov == NULL)
+    {
+        return;
+    }
+    for (size_t l = 0; l < ov->nlayers; l++)
+    {
+        if (ov->layers[l].owned)
+        {
+            tar_close(ov->layers[l].tar);
+        }
+    }
+    index_free(ov->merged);
+    pthread_rwlock_destroy(&ov->lock);
+    free(ov->owners);
+    free(ov->layers);
+    free(ov);
+}
+
+/**
+ * Checks whether an entry exists in the merged view.
+ *
+ * @param ov The overlay.
+ * @param path A path to an entry.
+ *
+ * @return zero if no layer shows an entry at the given path,
+ *         any other value otherwise, -1 if the merged index could not be built.
+ */
+int tar_overlay_exists(tar_overlay_t *ov, const char *path)
+{
+    if (overlay_begin(ov) == -1)
+    {
+        return -1;
+    }
+    tar_entry_t entry;
+    int found = overlay_find(ov, path, 0, &entry) >= 0;
+    pthread_rwlock_unlock(&ov->lock);
+    return found;
+}
+
+/**
+ * Checks whether an entry exists in the merged view and is a directory.
+ *
+ * @param ov The overlay.
+ * @param path A path to an entry.
+ *
+ * @return zero if no directory is shown at the given path,
+ *         any other value otherwise, -1 if the merged index could not be built.
+ */
+int tar_overlay_is_dir(tar_overlay_t *ov, const char *path)
+{
+    if (overlay_begin(ov) == -1)
+    {
+        return -1;
+    }
+    tar_entry_t entry;
+    int found = overlay_find(ov, path, 0, &entry) >= 0 && entry.typeflag == DIRTYPE;
+    pthread_rwlock_unlock(&ov->lock);
+    return found;
+}
+
+/**
+ * Lists the entries of a directory in the merged view, as list() does for one archive.
+ *
+ * @param ov The overlay.
+ * @param path A path to a directory, or to a symlink resolved to its linked-to entry.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ *                Paths are copied whole, including ustar prefixes and GNU or pax long names.
+ * @param no_entries An in-out argument.
+ *                   The caller sets it to the number of entries in `entries`.
+ *                   The callee sets it to the number of entries listed.
+ *
+ * @return 0 if no directory is shown at the given path,
+ *         a positive number for the number of entries listed,
+ *         or a negative value for an error.
+ */
+int tar_overlay_list(tar_overlay_t *ov, const char *path, char **entries, size_t *no_entries)
+{
+    if (path == NULL || entries == NULL || no_entries == NULL)
+    {
+        return -1;
+    }
+    if (overlay_begin(ov) == -1)
+    {
+        return -1;
+    }
+
+    tar_entry_t dir;
+    if (overlay_find(ov, path, 1, &dir) == -1 || dir.typeflag != DIRTYPE)
+    {
+        pthread_rwlock_unlock(&ov->lock);
+        *no_entries = 0;
+        return 0;
+    }
+
+    /* the children are a range of the name table, taken in the order of the merged records */
+    size_t dir_len = strlen(dir.name);
+    tar_index_t *merged = ov->merged;
+    const name_table_t *table = index_names(merged);
+    char key[TAR_NAME_MAX];
+    snprintf(key, sizeof(key), "%.*s", (int)(dir_len > 0 && dir.name[dir_len - 1] == '/' ? dir_len - 1 : dir_len),
+             dir.name);
+    uint32_t *range = NULL;
+    ssize_t n = table != NULL ? names_range(table, key, 1, &range) : -1;
+    if (n < 0)
+    {
+        n = merged->count;
+    }
+    else
+    {
+        qsort(range, n, sizeof(uint32_t), entry_cmp);
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < (size_t)n && count < *no_entries; i++)
+    {
+        const char *name = merged->pool + merged->names_at[range != NULL ? range[i] : i];
+        if (strncmp(name, dir.name, dir_len) != 0 || name[dir_len] == '\0')
+        {
+            continue;
+        }
+        const char *slash = strchr(name + dir_len, '/');
+        if (slash == NULL || slash[1] == '\0')
+        {
+            strcpy(entries[count], name);
+            count++;
+        }
+    }
+    free(range);
+    pthread_rwlock_unlock(&ov->lock);
+    *no_entries = count;
+    return count;
+}
+
+/**
+ * Reads a file of the merged view, as read_file() does for one archive.
+ * Symlinks and hard links are resolved in the merged view, so a link may point into another layer.
+ *
+ * @param ov The overlay.
+ * @param path A path to an entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller sets it to the size of dest.
+ *            The callee sets it to the number of bytes written to dest.
+ *
+ * @return -1 if no entry at the given path is shown or the entry is not a file,
+ *         -2 if the offset is outside the file total length,
+ *         -3 if a layer could not be read,
+ *         zero if the file was read in its entirety into the destination buffer,
+ *         a positive value if the file was partially read, representing the remaining bytes left to be read.
+ */
+ssize_t tar_overlay_read_file(tar_overlay_t *ov, const char *path, size_t offset, uint8_t *dest, size_t *len)
+{
+    if (overlay_begin(ov) == -1)
+    {
+        return -3;
+    }
+    tar_entry_t entry;
+    int layer = overlay_find(ov, path, 1, &entry);
+    ssize_t ret = -1;
+    if (layer >= 0 && (entry.typeflag == REGTYPE || entry.typeflag == AREGTYPE || entry.typeflag == LNKTYPE))
+    {
+        ret = read_indexed(ov->layers[layer].tar, &entry, offset, dest, len, 0);
+    }
+    pthread_rwlock_unlock(&ov->lock);
+    return ret;
+}
+
+/**
+ * Attaches a handle to an archive file descriptor.
+ *
+ * Every function taking `tar_fd` uses the state of the handle attached to it: errors are passed to its
+ * logger and recorded per thread and handle, so that threads sharing a handle do not see each other's.
+ * Without a handle, errors are recorded per thread.
+ * The library never prints: errors are only visible through tar_last_error() and loggers.
+ *
+ * @param tar_fd A file descriptor pointing to a tar archive file.
+ *
+ * @return the handle, NULL if a handle is already attached to tar_fd or memory ran out.
+ */
+tar_t *tar_open(int tar_fd)
+{
+    tar_t *state = tar_begin(tar_fd);
+    if (tar_fd < 0 || tar_fd >= HANDLE_CHUNK * HANDLE_CHUNKS)
+    {
+        TAR_FAIL(state, TAR_EINVAL, -1, -1, NULL);
+        return NULL;
+    }
+    if (state != &fd_state)
+    {
+        TAR_FAIL(state, TAR_EBUSY, -1, -1, NULL);
+        return NULL;
+    }
+
+    tar_t *tar = calloc(1, sizeof(tar_t));
+    if (tar == NULL)
+    {
+        TAR_FAIL(state, TAR_ENOMEM, -1, -1, NULL);
+        return NULL;
+    }
+    tar->fd = tar_fd;
+    tar->check = header_checks[TAR_DEFAULT_POLICY];
+    tar->advice = TAR_DEFAULT_ADVICE;
+    tar->direct_fd = -1;
+    tar->prefetch = TAR_DEFAULT_PREFETCH;
+    tar->index_mode = TAR_DEFAULT_INDEX_MODE;
+    tar->serial = __atomic_add_fetch(&tar_serial, 1, __ATOMIC_RELAXED);
+    pthread_mutex_init(&tar->index_lock, NULL);
+
+    pthread_mutex_lock(&handle_lock);
+    tar_t **chunk = handle_chunks[tar_fd / HANDLE_CHUNK];
+    if (chunk == NULL)
+    {
+        chunk = calloc(HANDLE_CHUNK, sizeof(tar_t *));
+        if (chunk == NULL)
+        {
+            pthread_mutex_unlock(&handle_lock);
+            free(tar);
+            TAR_FAIL(state, TAR_ENOMEM, -1, -1, NULL);
+            return NULL;
+        }
+        __atomic_store_n(&handle_chunks[tar_fd / HANDLE_CHUNK], chunk, __ATOMIC_RELEASE);
+    }
+    if (chunk[tar_fd % HANDLE_CHUNK] != NULL)
+    {
+        /* another thread attached one meanwhile */
+        pthread_mutex_unlock(&handle_lock);
+        free(tar);
+        TAR_FAIL(state, TAR_EBUSY, -1, -1, NULL);
+        return NULL;
+    }
+    __atomic_store_n(&chunk[tar_fd % HANDLE_CHUNK], tar, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&handle_lock);
+    return tar;
+}
+
+/**
+ * Detaches a handle from its file descriptor and frees it. The file descriptor is not closed.
+ * No other thread may be using the file descriptor.
+ *
+ * @param tar The handle to free, may be NULL.
+ */
+void tar_close(tar_t *tar)
+{
+    if (tar == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&handle_lock);
+    __atomic_store_n(&handle_chunks[tar->fd / HANDLE_CHUNK][tar->fd % HANDLE_CHUNK], NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&handle_lock);
+    index_free(tar->index);
+    while (tar->retired != NULL)
+    {
+        tar_index_t *older = tar->retired->older;
+        index_free(tar->retired);
+        tar->retired = older;
+    }
+    pthread_mutex_destroy(&tar->index_lock);
+    if (tar->direct_fd >= 0)
+    {
+        close(tar->direct_fd);
+    }
+    free(tar);
+}
+
+/**
+ * Returns the handle attached to a file descriptor.
+ *
+ * @param tar_fd A file descriptor.
+ *
+ * @return the handle, NULL if none is attached.
+ */
+tar_t *tar_handle(int tar_fd)
+{
+    return handle_at(tar_fd);
+}
+
+/**
+ * Returns the last error of the calling thread on a file descriptor.
+ * The error is reset to TAR_OK by each call of the thread on the file descriptor that succeeds.
+ *
+ * @param tar_fd A file descriptor. If no handle is attached to it, the last error of the calling thread
+ *               on any file descriptor without a handle is returned.
+ *
+ * @return the last error, valid until the next call on the file descriptor.
+ */
+const tar_error_t *tar_last_error(int tar_fd)
+{
+    const tar_error_t *err = tar_err(tar_get(tar_fd), 0);
+    return err != NULL ? err : &err_none;
+}
+
+/**
+ * Sets the callback receiving the errors of a handle.
+ *
+ * @param tar The handle, or NULL to set the logger of file descriptors without a handle.
+ * @param fn The callback, NULL to stop logging.
+ * @param arg A user argument passed to `fn`.
+ */
+void tar_set_logger(tar_t *tar, tar_log_fn fn, void *arg)
+{
+    if (tar == NULL)
+    {
+        fd_log = fn;
+        fd_log_arg = arg;
+        return;
+    }
+    tar->log = fn;
+    tar->log_arg = arg;
+}
+
+/**
+ * Reads the counters of a file descriptor.
+ * Counters of a handle shared by several threads sum the work of all of them.
+ *
+ * @param tar_fd A file descriptor. If no handle is attached to it, the counters of the calling thread
+ *               on all file descriptors without a handle are returned.
+ * @param stats Filled with the counters.
+ */
+void tar_get_stats(int tar_fd, tar_stats_t *stats)
+{
+    const uint64_t *src = (const uint64_t *)&tar_get(tar_fd)->stats;
+    uint64_t *dst = (uint64_t *)stats;
+    for (size_t i = 0; i < sizeof(tar_stats_t) / sizeof(uint64_t); i++)
+    {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Resets the counters of a file descriptor to zero.
+ *
+ * @param tar_fd A file descriptor, as for tar_get_stats().
+ */
+void tar_reset_stats(int tar_fd)
+{
+    uint64_t *counters = (uint64_t *)&tar_get(tar_fd)->stats;
+    for (size_t i = 0; i < sizeof(tar_stats_t) / sizeof(uint64_t); i++)
+    {
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Sets the callback receiving the start and the end of each operation of a handle.
+ * Calls made by the library on its own behalf, such as list() resolving a symlink, are not traced.
+ *
+ * @param tar The handle, or NULL to set the tracer of file descriptors without a handle.
+ * @param fn The callback, NULL to stop tracing.
+ * @param arg A user argument passed to `fn`.
+ */
+void tar_set_tracer(tar_t *tar, tar_trace_fn fn, void *arg)
+{
+    if (tar == NULL)
+    {
+        fd_trace = fn;
+        fd_trace_arg = arg;
+        return;
+    }
+    tar->trace = fn;
+    tar->trace_arg = arg;
+}
+
+/**
+ * Names an operation.
+ *
+ * @param op One of the TAR_OP_* values.
+ *
+ * @return the name of the function measured by the operation, such as "read_file".
+ */
+const char *tar_op_name(int op)
+{
+    if (op < 0 || op >= TAR_OP_COUNT)
+    {
+        return "unknown operation";
+    }
+    return op_names[op];
+}
+
+/**
+ * Sets the header validation policy of a handle, used by check_archive() and every scan that validates
+ * headers. valid_archive() always applies TAR_POLICY_USTAR.
+ *
+ * @param tar The handle, or NULL to set the policy of file descriptors without a handle.
+ * @param policy One of the TAR_POLICY_* values.
+ *
+ * @return 0 on success, -1 if the policy is unknown.
+ */
+int tar_set_policy(tar_t *tar, int policy)
+{
+    if (policy < TAR_POLICY_USTAR || policy > TAR_POLICY_PERMISSIVE)
+    {
+        if (tar != NULL)
+        {
+            TAR_FAIL(tar, TAR_EINVAL, -1, -1, NULL);
+        }
+        return -1;
+    }
+    if (tar == NULL)
+    {
+        fd_policy = policy;
+        return 0;
+    }
+    tar->check = header_checks[policy];
+    return 0;
+}
+
+/**
+ * Sets the hints a handle gives the kernel about the pages of its archive.
+ *
+ * With TAR_ADVISE_READAHEAD, header walks prefetch the header following a large member instead of
+ * reading it synchronously after seeking over the member data, successive read_file() calls on a member
+ * prefetch the part asked for next, and tar_verify() and tar_diff() read with the sequential readahead window.
+ * With TAR_ADVISE_DROPBEHIND, the pages behind header walks and tar_verify() are dropped as the scan
+ * moves on, so that a full scan of a large archive does not evict the page cache of everything else.
+ * With TAR_ADVISE_DIRECT, check_archive() and the scans building the index, finding and walking entries
+ * read headers with O_DIRECT from a descriptor of their own: only the blocks holding headers are read,
+ * batched over small members, and member data is never pulled into the page cache. This is meant for
+ * cold archives and only applies to handles on file systems supporting O_DIRECT.
+ *
+ * @param tar The handle, or NULL to set the hints of file descriptors without a handle.
+ * @param advice A mask of TAR_ADVISE_* flags, zero to give no hints.
+ *
+ * @return 0 on success, -1 if the mask holds unknown flags.
+ */
+int tar_set_advice(tar_t *tar, int advice)
+{
+    if (advice & ~(TAR_ADVISE_READAHEAD | TAR_ADVISE_DROPBEHIND | TAR_ADVISE_DIRECT))
+    {
+        if (tar != NULL)
+        {
+            TAR_FAIL(tar, TAR_EINVAL, -1, -1, NULL);
+        }
+        return -1;
+    }
+    if (tar == NULL)
+    {
+        fd_advice = advice;
+        return 0;
+    }
+    tar->advice = advice;
+    return 0;
+}
+
+/**
+ * Sets how many headers the index builds of a handle read ahead.
+ *
+ * Each header gives the offset of the next one, so a scan waits for every header read in turn. With a
+ * depth, tar_index() and the index refreshes read the chain of headers on a thread of their own, which
+ * issues the read of the next header as soon as it knows its offset, keeps up to `depth` headers ready
+ * while the scan validates and indexes the previous ones, and reads the headers of small members in
+ * batches. This pays off where reads have a high latency, such as on network file systems.
+ *
+ * @param tar The handle.
+ * @param depth The number of headers read ahead, zero to read headers in the scan itself.
+ *
+ * @return 0 on success, -1 if the depth is negative.
+ */
+int tar_set_prefetch(tar_t *tar, int depth)
+{
+    if (depth < 0)
+    {
+        TAR_FAIL(tar, TAR_EINVAL, -1, -1, NULL);
+        return -1;
+    }
+    tar->prefetch = depth;
+    return 0;
+}
+
+/**
+ * Sets the lookup table of the index versions that the index builds of a handle publish.
+ *
+ * With TAR_INDEX_HASH, names are found in an open addressing hash table, which members appended to the
+ * archive are added to. With TAR_INDEX_PERFECT, meant for archives that are not appended to once
+ * published, each version built is given a minimal perfect hash of its names instead: lookups read a
+ * single position and the table takes about 5 bytes per name rather than 11 to 21, at the cost of
+ * hashing every name again when the version is built. A version built when the archive grew starts
+ * from a hash table again, so that appending stays possible.
+ * A version published before TAR_INDEX_PERFECT was set is given its perfect hash by the next tar_index().
+ *
+ * @param tar The handle.
+ * @param mode One of the TAR_INDEX_* values.
+ *
+ * @return 0 on success, -1 if the mode is unknown.
+ */
+int tar_set_index_mode(tar_t *tar, int mode)
+{
+    if (mode != TAR_INDEX_HASH && mode != TAR_INDEX_PERFECT)
+    {
+        TAR_FAIL(tar, TAR_EINVAL, -1, -1, NULL);
+        return -1;
+    }
+    tar->index_mode = mode;
+    return 0;
+}
+
+/**
+ * Describes an error code.
+ *
+ * @param code One of the TAR_E* values.
+ *
+ * @return a static string describing the error.
+ */
+const char *tar_strerror(int code)
+{
+    static const char *const messages[] = {
+        "success",
+        "invalid arguments",
+        "archive read failed",
+        "out of memory",
+        "invalid magic value",
+        "invalid version value",
+        "invalid checksum",
+        "no such entry",
+        "wrong entry type",
+        "offset outside the entry",
+        "handle already attached",
+    };
+    if (code < 0 || code >= (int)(sizeof(messages) / sizeof(messages[0])))
+    {
+        return "unknown error";
+    }
+    return messages[code];
 }
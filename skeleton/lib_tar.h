@@ -10,6 +10,11 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <regex.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <time.h>
 
 
 typedef struct posix_header
@@ -43,11 +48,338 @@ typedef struct posix_header
 #define AREGTYPE '\0'           /* regular file */
 #define LNKTYPE  '1'            /* link */
 #define SYMTYPE  '2'            /* reserved */
+#define CHRTYPE  '3'            /* character special */
+#define BLKTYPE  '4'            /* block special */
 #define DIRTYPE  '5'            /* directory */
+#define FIFOTYPE '6'            /* FIFO special */
+#define XHDTYPE  'x'            /* pax extended header for the next entry */
+#define XGLTYPE  'g'            /* pax global extended header */
+#define GNUTYPE_LONGNAME 'L'    /* GNU long name of the next entry */
+#define GNUTYPE_LONGLINK 'K'    /* GNU long link target of the next entry */
 
 /* Converts an ASCII-encoded octal-based number into a regular integer */
 #define TAR_INT(char_ptr) strtol(char_ptr, NULL, 8)
 
+/* Error codes reported in tar_error_t.code */
+#define TAR_OK        0         /* no error */
+#define TAR_EINVAL    1         /* invalid arguments */
+#define TAR_EIO       2         /* a read or seek on the archive failed, see sys_errno */
+#define TAR_ENOMEM    3         /* memory ran out */
+#define TAR_EMAGIC    4         /* a header has an invalid magic value */
+#define TAR_EVERSION  5         /* a header has an invalid version value */
+#define TAR_ECHKSUM   6         /* a header has an invalid checksum value */
+#define TAR_ENOENT    7         /* no entry at the given path */
+#define TAR_ETYPE     8         /* the entry has the wrong type for the operation */
+#define TAR_ERANGE    9         /* the offset is outside the entry */
+#define TAR_EBUSY     10        /* a handle is already attached to the file descriptor */
+
+/**
+ * The last error of a handle, with the context in which it occurred.
+ * Context fields that do not apply are set to -1 or NULL.
+ */
+typedef struct tar_error
+{
+    int code;                     /* one of the TAR_E* values, TAR_OK if the last call succeeded */
+    int sys_errno;                /* errno of the failed system call, zero if none */
+    const char *func;             /* public function that failed */
+    long header;                  /* index of the header involved */
+    off_t offset;                 /* offset in the archive involved */
+    const char *field;            /* header field involved, such as "magic" or "chksum" */
+} tar_error_t;
+
+/**
+ * Callback receiving the errors of a handle as they occur, instead of them being printed.
+ *
+ * @param err The error, only valid for the duration of the call.
+ * @param arg The user argument given to tar_set_logger().
+ */
+typedef void (*tar_log_fn)(const tar_error_t *err, void *arg);
+
+/* Header validation policies, see tar_set_policy() */
+#define TAR_POLICY_USTAR      0 /* magic "ustar" and a null, version "00" */
+#define TAR_POLICY_GNU        1 /* also GNU tar's magic "ustar " and version " " and a null */
+#define TAR_POLICY_V7         2 /* also pre-POSIX headers without magic, ending at an empty name */
+#define TAR_POLICY_PERMISSIVE 3 /* any magic and version, checksums summed as unsigned or signed bytes */
+
+/* Policy of new handles and of file descriptors without a handle, may be set when building the library */
+#ifndef TAR_DEFAULT_POLICY
+#define TAR_DEFAULT_POLICY TAR_POLICY_USTAR
+#endif
+
+/* Hints given to the kernel about the archive pages, see tar_set_advice() */
+#define TAR_ADVISE_READAHEAD  0x1 /* prefetch the headers and data that scans and reads need next */
+#define TAR_ADVISE_DROPBEHIND 0x2 /* drop the pages behind long scans from the page cache */
+#define TAR_ADVISE_DIRECT     0x4 /* header walks of a handle read only the blocks holding headers, with O_DIRECT */
+
+/* Hints of new handles and of file descriptors without a handle, may be set when building the library */
+#ifndef TAR_DEFAULT_ADVICE
+#define TAR_DEFAULT_ADVICE (TAR_ADVISE_READAHEAD | TAR_ADVISE_DROPBEHIND)
+#endif
+
+/* Headers read ahead of index builds by new handles, see tar_set_prefetch() */
+#ifndef TAR_DEFAULT_PREFETCH
+#define TAR_DEFAULT_PREFETCH 0
+#endif
+
+/* Lookup tables of the index, see tar_set_index_mode() */
+#define TAR_INDEX_HASH    0     /* a hash table, updated in place as members are appended */
+#define TAR_INDEX_PERFECT 1     /* a minimal perfect hash, built once the archive is scanned */
+
+/* Lookup table of the index of new handles, may be set when building the library */
+#ifndef TAR_DEFAULT_INDEX_MODE
+#define TAR_DEFAULT_INDEX_MODE TAR_INDEX_HASH
+#endif
+
+/* Per-archive state attached to a file descriptor with tar_open() */
+typedef struct tar tar_t;
+
+/* Archives stacked into a single view by tar_overlay_new() */
+typedef struct tar_overlay tar_overlay_t;
+
+/* Operations measured in tar_stats_t and reported to tracers */
+#define TAR_OP_CHECK        0     /* check_archive() */
+#define TAR_OP_EXISTS       1     /* exists() */
+#define TAR_OP_FLAG         2     /* check_flag(), is_dir(), is_file() and is_symlink() */
+#define TAR_OP_LIST         3     /* list() */
+#define TAR_OP_SYMLINK      4     /* get_symlink() */
+#define TAR_OP_READ         5     /* read_file() */
+#define TAR_OP_FIND         6     /* tar_find() */
+#define TAR_OP_WALK         7     /* tar_walk() */
+#define TAR_OP_LIST_ALLOC   8     /* tar_list() */
+#define TAR_OP_VERIFY       9     /* tar_verify() */
+#define TAR_OP_CACHE_READ   10    /* tar_cache_read_file() */
+#define TAR_OP_DIFF         11    /* tar_diff() */
+#define TAR_OP_DELTA_CREATE 12    /* tar_delta_create() */
+#define TAR_OP_DELTA_APPLY  13    /* tar_delta_apply() */
+#define TAR_OP_RECOVER      14    /* tar_recover() */
+#define TAR_OP_STAT         15    /* tar_stat() */
+#define TAR_OP_COUNT        16
+
+/* Calls, failures and time spent in one operation */
+typedef struct tar_op_stats
+{
+    uint64_t calls;
+    uint64_t errors;              /* calls that returned an error */
+    uint64_t time_ns;             /* wall-clock time spent in the calls */
+} tar_op_stats_t;
+
+/* Counters of the work done on a file descriptor, see tar_get_stats() */
+typedef struct tar_stats
+{
+    uint64_t headers;             /* headers visited */
+    uint64_t reads;               /* read() and pread() calls on the archive */
+    uint64_t bytes_read;
+    uint64_t seeks;               /* lseek() calls on the archive */
+    uint64_t cache_hits;          /* tar_cache_read_file() calls served from memory */
+    uint64_t cache_misses;
+    uint64_t index_probes;        /* lookups in an index */
+    uint64_t index_filtered;      /* lookups of a path that the filter of the index showed absent */
+    tar_op_stats_t ops[TAR_OP_COUNT];
+} tar_stats_t;
+
+/* An operation starting or returning, passed to a tracer */
+typedef struct tar_trace
+{
+    int op;                       /* one of the TAR_OP_* values */
+    const char *path;             /* path or pattern argument of the call, NULL if none */
+    int end;                      /* zero when the call starts, 1 when it returns */
+    long result;                  /* at the end, the value returned, -1 for a NULL pointer and 0 for any other */
+    uint64_t time_ns;             /* at the end, the duration of the call */
+    uint64_t headers;             /* at the end, headers visited during the call */
+    uint64_t bytes_read;          /* at the end, bytes read during the call */
+} tar_trace_t;
+
+/**
+ * Callback receiving the start and the end of each operation on a file descriptor.
+ *
+ * @param trace The event, only valid for the duration of the call.
+ * @param arg The user argument given to tar_set_tracer().
+ */
+typedef void (*tar_trace_fn)(const tar_trace_t *trace, void *arg);
+
+/* Longest entry path a ustar header can hold: prefix, a slash and name */
+#define TAR_NAME_MAX 257
+
+/* Flags accepted by tar_find() */
+#define TAR_FIND_REGEX 0x1      /* pattern is a POSIX extended regex, not a glob */
+
+/* Entry types selected by tar_walk_opts_t.types */
+#define TAR_WALK_FILES    0x1   /* REGTYPE and AREGTYPE */
+#define TAR_WALK_DIRS     0x2   /* DIRTYPE */
+#define TAR_WALK_SYMLINKS 0x4   /* SYMTYPE */
+#define TAR_WALK_LINKS    0x8   /* LNKTYPE */
+#define TAR_WALK_OTHER    0x10  /* any other typeflag */
+#define TAR_WALK_ALL      0x1f
+
+/* Digest algorithms computed by tar_verify() */
+#define TAR_DIGEST_CRC32C 0     /* CRC-32C, hardware accelerated with SSE4.2 when available */
+#define TAR_DIGEST_XXH64  1     /* xxHash64 with a zero seed */
+#define TAR_DIGEST_SHA256 2     /* SHA-256 */
+#define TAR_DIGEST_XXH3   3     /* XXH3-64 with a zero seed and the default secret, vectorized with SSE2 */
+#define TAR_DIGEST_MAX    65    /* longest hex digest and a null */
+
+/* Status of a member reported by tar_verify() */
+#define TAR_VERIFY_OK       0   /* digest matches the manifest, or no manifest was given */
+#define TAR_VERIFY_MISMATCH 1   /* digest differs from the manifest */
+#define TAR_VERIFY_UNLISTED 2   /* member absent from the manifest */
+#define TAR_VERIFY_MISSING  3   /* manifest entry absent from the archive */
+
+/* Default largest member kept by a tar_cache_t */
+#define TAR_CACHE_MAX_MEMBER (1 << 20)
+
+/* Orders in which tar_walk() reports entries */
+#define TAR_WALK_ARCHIVE   0    /* archive order, streamed without buffering */
+#define TAR_WALK_PREORDER  1    /* a directory before its descendants, siblings sorted by name */
+#define TAR_WALK_POSTORDER 2    /* a directory after its descendants, siblings sorted by name */
+
+/* Status of a member reported by tar_diff() */
+#define TAR_DIFF_ADDED   1      /* member only in the new archive */
+#define TAR_DIFF_REMOVED 2      /* member only in the old archive */
+#define TAR_DIFF_CHANGED 3      /* member in both archives, with the differences given by TAR_DIFF_* bits */
+
+/* Differences of a TAR_DIFF_CHANGED member */
+#define TAR_DIFF_TYPE    0x1    /* typeflag, the two regular file typeflags being equal */
+#define TAR_DIFF_SIZE    0x2
+#define TAR_DIFF_MODE    0x4    /* permission bits */
+#define TAR_DIFF_OWNER   0x8    /* uid or gid */
+#define TAR_DIFF_MTIME   0x10
+#define TAR_DIFF_LINK    0x20   /* linkname */
+#define TAR_DIFF_CONTENT 0x40   /* data of a regular file */
+
+/* Name of the member of a delta archive holding its recipe, see tar_delta_create() */
+#define TAR_DELTA_MANIFEST ".tar-delta"
+
+/* Parts of a damaged archive reported by tar_recover() */
+#define TAR_RECOVER_MEMBER    0 /* a member whose header and data are intact */
+#define TAR_RECOVER_TRUNCATED 1 /* a member whose data runs past the end of the file */
+#define TAR_RECOVER_DAMAGED   2 /* blocks holding no valid header, skipped to find the next one */
+
+/**
+ * An entry of the archive as seen by the scanning functions.
+ * The strings are only valid for the duration of the callback receiving the entry.
+ *
+ * Names are reported in canonical form: "./a//b/" is reported as "a/b/", a directory keeping its trailing
+ * slash. Paths given to the library name an entry in any form, with or without the trailing slash.
+ */
+typedef struct tar_entry
+{
+    const char *name;             /* full path, ustar prefix included */
+    const char *linkname;         /* link target, empty if the entry is not a link */
+    char typeflag;
+    size_t size;                  /* size of the member data in bytes */
+    off_t offset;                 /* offset of the header in the archive, -1 for a directory implied by an index */
+} tar_entry_t;
+
+/**
+ * Callback receiving each entry found by a scan.
+ *
+ * @param entry The entry found.
+ * @param arg The user argument given to the scanning function.
+ *
+ * @return zero to continue the scan, any other value to stop it.
+ */
+typedef int (*tar_entry_cb)(const tar_entry_t *entry, void *arg);
+
+/**
+ * Entries listed by tar_list(), held in a single allocation released with tar_list_free().
+ * The paths are stored null-terminated and back to back in `pool`, TAR_LIST_ENTRY() returns the i-th one.
+ */
+typedef struct tar_list
+{
+    size_t count;                 /* number of entries listed */
+    size_t *offsets;              /* offset of each entry path in pool */
+    char *pool;
+} tar_list_t;
+
+#define TAR_LIST_ENTRY(list, i) ((list)->pool + (list)->offsets[i])
+
+/* Options of tar_walk(), a NULL pointer selects every entry in archive order */
+typedef struct tar_walk_opts
+{
+    int max_depth;                /* deepest level reported, 1 for direct children, zero or less for no limit */
+    int types;                    /* mask of TAR_WALK_* entry types, zero for all */
+    int order;                    /* TAR_WALK_ARCHIVE, TAR_WALK_PREORDER or TAR_WALK_POSTORDER */
+} tar_walk_opts_t;
+
+/**
+ * Callback receiving each entry reported by tar_walk().
+ *
+ * @param entry The entry found.
+ * @param depth The depth of the entry below the walked path, 1 for its direct children.
+ * @param arg The user argument given to tar_walk().
+ *
+ * @return zero to continue the walk, any other value to stop it.
+ */
+typedef int (*tar_walk_cb)(const tar_entry_t *entry, int depth, void *arg);
+
+/* An expected member digest, as lowercase or uppercase hex */
+typedef struct tar_manifest_entry
+{
+    const char *name;
+    const char *digest;
+} tar_manifest_entry_t;
+
+/* Options of tar_verify() */
+typedef struct tar_verify_opts
+{
+    int digest;                             /* TAR_DIGEST_* algorithm */
+    const tar_manifest_entry_t *manifest;   /* expected digests, NULL to only compute them */
+    size_t manifest_len;
+    int threads;                            /* members hashed concurrently, 1 or less for a single streaming pass */
+} tar_verify_opts_t;
+
+/**
+ * Callback receiving the outcome of each member checked by tar_verify().
+ *
+ * @param entry The member checked. For TAR_VERIFY_MISSING, only its name is set and its offset is -1.
+ * @param digest The hex digest of the member data, NULL for TAR_VERIFY_MISSING.
+ * @param status One of the TAR_VERIFY_* values.
+ * @param arg The user argument given to tar_verify().
+ *
+ * @return zero to continue the verification, any other value to stop it.
+ */
+typedef int (*tar_verify_cb)(const tar_entry_t *entry, const char *digest, int status, void *arg);
+
+/**
+ * Callback receiving each difference found by tar_diff().
+ *
+ * @param old_entry The member in the old archive, NULL for TAR_DIFF_ADDED.
+ * @param new_entry The member in the new archive, NULL for TAR_DIFF_REMOVED.
+ * @param status One of TAR_DIFF_ADDED, TAR_DIFF_REMOVED and TAR_DIFF_CHANGED.
+ * @param changes For TAR_DIFF_CHANGED, the TAR_DIFF_* bits of what differs, zero otherwise.
+ * @param arg The user argument given to tar_diff().
+ *
+ * @return zero to continue the comparison, any other value to stop it.
+ */
+typedef int (*tar_diff_cb)(const tar_entry_t *old_entry, const tar_entry_t *new_entry, int status, int changes,
+                           void *arg);
+
+/**
+ * Callback receiving each part of the archive scanned by tar_recover().
+ *
+ * @param status One of the TAR_RECOVER_* values.
+ * @param entry The member found, NULL for TAR_RECOVER_DAMAGED.
+ * @param start The offset of the part, the first extension header for a member.
+ * @param end The offset past the part.
+ * @param arg The user argument given to tar_recover().
+ *
+ * @return zero to continue the scan, any other value to stop it.
+ */
+typedef int (*tar_recover_cb)(int status, const tar_entry_t *entry, off_t start, off_t end, void *arg);
+
+/* A read cache of small members, shared by any number of archives and threads */
+typedef struct tar_cache tar_cache_t;
+
+/* Counters of a tar_cache_t */
+typedef struct tar_cache_stats
+{
+    uint64_t hits;                /* reads served from memory */
+    uint64_t misses;              /* reads that had to scan the archive */
+    size_t bytes;                 /* member data held, each distinct content counted once */
+    size_t entries;               /* (archive, path) pairs cached */
+    size_t blobs;                 /* distinct contents cached */
+} tar_cache_stats_t;
+
 /**
  * Checks whether the archive is valid.
  *
@@ -169,7 +501,8 @@ int is_symlink(int tar_fd, char *path);
  *   └── e/
  *
  * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive. If the entry is a symlink, it must be resolved to its linked-to entry.
+ * @param path A path to an entry in the archive. If the entry is a symlink, it must be resolved to its linked-to entry,
+ *             relative to the directory containing it.
  * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
  * @param no_entries An in-out argument.
  *                   The caller set it to the number of entries in `entries`.
@@ -182,18 +515,44 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries);
 
 char* get_symlink(int tar_fd, char *path);
 
+/**
+ * Lists the entries at a given path in the archive, like list(), into a single allocation.
+ * There is no limit on the number of entries or on the length of their paths, which include
+ * ustar prefixes and GNU or pax long names. The file offset of tar_fd is left untouched.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved relative to
+ *             the directory containing it.
+ * @param out Set to the entries listed, to be released with tar_list_free(), or to NULL on failure.
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         a positive value otherwise, even if the directory is empty,
+ *         -1 if the arguments are invalid or memory ran out,
+ *         -3 if the archive could not be read.
+ */
+int tar_list(int tar_fd, const char *path, tar_list_t **out);
+
+/**
+ * Releases the entries returned by tar_list().
+ *
+ * @param list The entries to release, may be NULL.
+ */
+void tar_list_free(tar_list_t *list);
+
 /**
  * Reads a file at a given path in the archive.
  *
  * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it must be resolved to its linked-to entry.
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it must be resolved to its linked-to entry,
+ *             relative to the directory containing it. A hard link is read as the member it links to.
  * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
  * @param dest A destination buffer to read the given file into.
  * @param len An in-out argument.
  *            The caller set it to the size of dest.
  *            The callee set it to the number of bytes written to dest.
  *
- * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
+ * @return -1 if no entry at the given path exists in the archive, the entry is not a file
+ *         or its links form a cycle,
  *         -2 if the offset is outside the file total length,
  *         zero if the file was read in its entirety into the destination buffer,
  *         a positive value if the file was partially read, representing the remaining bytes left to be read to reach
@@ -202,4 +561,517 @@ char* get_symlink(int tar_fd, char *path);
  */
 ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len);
 
+/**
+ * Finds the entries of the archive whose path matches a pattern, in a single pass over the headers.
+ *
+ * By default the pattern is a shell glob: `*` and `?` do not match a slash, `[...]` is a character class
+ * and a `**` path segment matches zero or more directories, so a pattern starting with one matches at any depth.
+ * With TAR_FIND_REGEX, the pattern is a POSIX extended regular expression matched anywhere in the path.
+ * Paths are matched in canonical form, directories without their trailing slash, and the literal leading
+ * directories of a glob are canonicalized alike, "./d/?" finding what "d/?" finds. A glob ending with a slash
+ * only matches directories.
+ * Headers outside the literal leading directories of the pattern are skipped without being matched. When the
+ * archive is indexed, only the names below them are visited, and a member shadowed by a later one of the
+ * same name is not reported.
+ * The file offset of tar_fd is left untouched.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ * @param pattern The glob or regular expression to match entry paths against.
+ * @param flags Zero or TAR_FIND_REGEX.
+ * @param cb A callback invoked for each matching entry, in archive order.
+ * @param arg A user argument passed to `cb`.
+ *
+ * @return the number of matching entries reported to `cb`,
+ *         -1 if the arguments or the pattern are invalid,
+ *         -3 if the archive could not be read.
+ */
+int tar_find(int tar_fd, const char *pattern, int flags, tar_entry_cb cb, void *arg);
+
+/**
+ * Walks all the descendants of a directory in the archive, in a single pass over the headers.
+ * Unlike list(), the walk recurses into subdirectories, up to an optional maximum depth.
+ *
+ * Example:
+ *  dir/          with max_depth 2 and TAR_WALK_PREORDER, tar_walk(..., "dir/", ...) reports
+ *   ├── a        "dir/a" (1), "dir/c/" (1) and "dir/c/d/" (2), "dir/c/d/e" is too deep
+ *   └── c/
+ *       └── d/
+ *           └── e
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ * @param path The directory to walk, NULL or "" for the whole archive. If the entry is a symlink,
+ *             it is resolved relative to the directory containing it.
+ * @param opts The depth limit, entry types and order of the walk, NULL for the defaults.
+ * @param cb A callback invoked for each entry walked.
+ * @param arg A user argument passed to `cb`.
+ *
+ * @return the number of entries reported to `cb`,
+ *         -1 if the arguments are invalid or memory ran out,
+ *         -3 if the archive could not be read.
+ */
+int tar_walk(int tar_fd, const char *path, const tar_walk_opts_t *opts, tar_walk_cb cb, void *arg);
+
+/**
+ * Verifies the contents of the archive by computing a digest of every regular file member.
+ *
+ * Headers are validated as by check_archive() while the archive is read sequentially with large reads,
+ * member data being hashed in the same pass. With more than one thread, the headers are scanned first
+ * and the members are then hashed concurrently with pread(). Each digest is compared against the
+ * manifest when one is given. Results are reported in archive order, followed by the missing entries.
+ *
+ * Digests are those of the reference implementations, as printed by xxhsum -H3 for TAR_DIGEST_XXH3,
+ * the fastest, and by xxhsum -H1 for TAR_DIGEST_XXH64, kept for the manifests written with it.
+ *
+ * @param tar_fd A file descriptor pointing to a tar archive file.
+ * @param opts The digest algorithm, the manifest and the parallelism of the verification.
+ * @param cb A callback invoked for each member checked, may be NULL.
+ * @param arg A user argument passed to `cb`.
+ *
+ * @return a zero or positive value if the archive could be read, representing the number of members
+ *         that do not match or are missing from the manifest,
+ *         -1, -2 or -3 if a header is invalid, as check_archive(),
+ *         -4 if the arguments are invalid, the archive could not be read or memory ran out.
+ */
+int tar_verify(int tar_fd, const tar_verify_opts_t *opts, tar_verify_cb cb, void *arg);
+
+/**
+ * Creates a read cache for tar_cache_read_file().
+ *
+ * Members are cached whole, keyed by the archive identity (device, inode, size and modification time)
+ * and their path, and their contents are stored once per distinct xxHash64, so identical members of
+ * different archives share memory. The least recently used entries are evicted to stay within budget.
+ *
+ * @param budget The most member data bytes held by the cache.
+ * @param max_member The largest member cached, zero for TAR_CACHE_MAX_MEMBER. Larger members are read
+ *                   from the archive on every call.
+ *
+ * @return the new cache, NULL if memory ran out.
+ */
+tar_cache_t *tar_cache_new(size_t budget, size_t max_member);
+
+/**
+ * Frees a cache and everything it holds. No other thread may be using it.
+ *
+ * @param cache The cache to free, may be NULL.
+ */
+void tar_cache_free(tar_cache_t *cache);
+
+/**
+ * Reads a file at a given path in the archive, through a cache.
+ * Same contract as read_file(), except that relative symlinks are resolved against the directory
+ * containing them and that the file offset of tar_fd is left untouched. Safe to call concurrently.
+ *
+ * @param cache The cache to serve the read from and to fill on a miss.
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ * @param path A path to an entry in the archive to read from. If the entry is a symlink, it is resolved.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return as read_file(), -3 if the archive could not be read or memory ran out.
+ */
+ssize_t tar_cache_read_file(tar_cache_t *cache, int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len);
+
+/**
+ * Reads the counters of a cache.
+ *
+ * @param cache The cache to inspect.
+ * @param stats Filled with the current counters.
+ */
+void tar_cache_stats(tar_cache_t *cache, tar_cache_stats_t *stats);
+
+/**
+ * Compares two archives without extracting them, reporting the members added, removed or changed.
+ *
+ * Both archives are scanned at once on two threads and their members merged in sorted name order,
+ * the last member of a name shadowing earlier ones. Members with the same name are compared on their
+ * header metadata first: only regular files of equal size have their contents hashed, again reading
+ * both archives at once, to tell whether the data changed.
+ *
+ * @param old_fd A file descriptor of the older archive. Errors are recorded in its state.
+ * @param new_fd A file descriptor of the newer archive.
+ * @param cb Called for each difference in name order, may be NULL to only count them.
+ * @param arg A user argument passed to `cb`.
+ *
+ * @return the number of differences reported,
+ *         -1 to -3 if either archive contains an invalid header as check_archive(),
+ *         -4 if an archive could not be read or memory ran out.
+ */
+int tar_diff(int old_fd, int new_fd, tar_diff_cb cb, void *arg);
+
+/**
+ * Writes a delta archive turning one archive into another.
+ *
+ * The delta is itself a tar archive: the members of the new archive whose bytes differ from the member
+ * of the same name in the old archive, stored verbatim, then a last member named TAR_DELTA_MANIFEST
+ * holding the recipe of the new archive and the names of the old members it deletes. Bytes following
+ * the end of the new archive that are not zeros are stored in a member of their own. The recipe records
+ * the size and XXH3-64 digest of both archives, as TAR_DIGEST_XXH3.
+ *
+ * @param old_fd A file descriptor of the archive the delta is applied to.
+ * @param new_fd A file descriptor of the archive the delta rebuilds. Errors are recorded in its state.
+ * @param delta_fd A file descriptor of an empty regular file, written from its start.
+ *
+ * @return the number of members stored in the delta,
+ *         -1 to -3 if either archive contains an invalid header as check_archive(),
+ *         -4 if an archive could not be read, the delta could not be written or memory ran out.
+ */
+int tar_delta_create(int old_fd, int new_fd, int delta_fd);
+
+/**
+ * Rebuilds an archive from an older one and a delta written by tar_delta_create().
+ * Members are copied from both files to the output with copy_file_range() where the file systems allow it.
+ * The older archive is checked against the size and digest recorded in the delta before anything is
+ * written, and the output against those of the new archive once it is rebuilt.
+ *
+ * @param old_fd A file descriptor of the archive the delta was created against.
+ * @param delta_fd A file descriptor of the delta. Errors are recorded in its state.
+ * @param out_fd A file descriptor of an empty regular file open for reading and writing, written from its start.
+ *
+ * @return 0 on success, -1 if the delta has no valid manifest or an archive does not match its digest,
+ *         -4 if a file could not be read or written or memory ran out.
+ */
+int tar_delta_apply(int old_fd, int delta_fd, int out_fd);
+
+/**
+ * Salvages the members of a damaged archive.
+ *
+ * Valid headers are followed as by the other scans, but a block that is not a valid header does not
+ * end the scan: the following blocks are searched for the next header with a valid magic and checksum,
+ * and the blocks skipped are reported as a damaged region. A member whose data runs past the end of
+ * the file is reported as truncated.
+ *
+ * If a handle is attached to tar_fd, its index is rebuilt with the intact members, so that exists(),
+ * read_file() and the other indexed functions can read them past the damage.
+ *
+ * @param tar_fd A file descriptor pointing to a tar archive file.
+ * @param cb Called for each member and damaged region in archive order, may be NULL.
+ * @param arg A user argument passed to `cb`.
+ *
+ * @return the number of intact members, -4 if the archive could not be read or memory ran out.
+ */
+int tar_recover(int tar_fd, tar_recover_cb cb, void *arg);
+
+/**
+ * Reads the attributes of an entry, as lstat() does: a symlink is described, not followed.
+ * A hard link is described by the member it links to, sharing its inode number.
+ * Uses the index of the handle when there is one, the file offset of tar_fd is then left untouched.
+ * A directory the index implies from member paths is described with mode 0755, no owner and no time.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ * @param path A path to an entry in the archive, directories ending with a slash.
+ * @param st Filled with the type and permissions, owner, size and modification time of the entry.
+ *           The inode number is derived from the offset of the member in the archive.
+ *
+ * @return 0 on success, -1 if there is no entry at the given path, -3 if the archive could not be read.
+ */
+int tar_stat(int tar_fd, const char *path, struct stat *st);
+
+/**
+ * Stacks archives into a single merged view, where a path resolves to the topmost layer holding it.
+ *
+ * A layer hides the entries of the layers below it with whiteouts: an entry "dir/.wh.name" deletes
+ * "dir/name" and anything under it, and an entry "dir/.wh..wh..opq" hides everything the layers below
+ * hold in "dir/". Whiteouts are not part of the view.
+ *
+ * Each layer is indexed with tar_index(), a handle being attached to its file descriptor if it has none.
+ * When a layer changes, its index only scans the members appended to it, but the merged index is then
+ * rebuilt whole from the indexes of every layer, whiteouts being resolved again across all of them.
+ *
+ * @param fds The file descriptors of the archives, the bottom layer first.
+ * @param nlayers The number of layers.
+ *
+ * @return the overlay, NULL if a layer could not be indexed or memory ran out.
+ */
+tar_overlay_t *tar_overlay_new(const int *fds, size_t nlayers);
+
+/**
+ * Frees an overlay, closing the handles it attached to its layers. The file descriptors are not closed.
+ *
+ * @param ov The overlay to free, may be NULL.
+ */
+void tar_overlay_free(tar_overlay_t *ov);
+
+/**
+ * Checks whether an entry exists in the merged view.
+ *
+ * @param ov The overlay.
+ * @param path A path to an entry.
+ *
+ * @return zero if no layer shows an entry at the given path,
+ *         any other value otherwise, -1 if the merged index could not be built.
+ */
+int tar_overlay_exists(tar_overlay_t *ov, const char *path);
+
+/**
+ * Checks whether an entry exists in the merged view and is a directory.
+ *
+ * @param ov The overlay.
+ * @param path A path to an entry.
+ *
+ * @return zero if no directory is shown at the given path,
+ *         any other value otherwise, -1 if the merged index could not be built.
+ */
+int tar_overlay_is_dir(tar_overlay_t *ov, const char *path);
+
+/**
+ * Lists the entries of a directory in the merged view, as list() does for one archive.
+ *
+ * @param ov The overlay.
+ * @param path A path to a directory, or to a symlink resolved to its linked-to entry.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ *                Paths are copied whole, including ustar prefixes and GNU or pax long names.
+ * @param no_entries An in-out argument.
+ *                   The caller sets it to the number of entries in `entries`.
+ *                   The callee sets it to the number of entries listed.
+ *
+ * @return 0 if no directory is shown at the given path,
+ *         a positive number for the number of entries listed,
+ *         or a negative value for an error.
+ */
+int tar_overlay_list(tar_overlay_t *ov, const char *path, char **entries, size_t *no_entries);
+
+/**
+ * Reads a file of the merged view, as read_file() does for one archive.
+ * Symlinks and hard links are resolved in the merged view, so a link may point into another layer.
+ *
+ * @param ov The overlay.
+ * @param path A path to an entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller sets it to the size of dest.
+ *            The callee sets it to the number of bytes written to dest.
+ *
+ * @return -1 if no entry at the given path is shown or the entry is not a file,
+ *         -2 if the offset is outside the file total length,
+ *         -3 if a layer could not be read,
+ *         zero if the file was read in its entirety into the destination buffer,
+ *         a positive value if the file was partially read, representing the remaining bytes left to be read.
+ */
+ssize_t tar_overlay_read_file(tar_overlay_t *ov, const char *path, size_t offset, uint8_t *dest, size_t *len);
+
+/**
+ * Attaches a handle to an archive file descriptor.
+ *
+ * Every function taking `tar_fd` uses the state of the handle attached to it: errors are passed to its
+ * logger and recorded per thread and handle, so that threads sharing a handle do not see each other's.
+ * Without a handle, errors are recorded per thread.
+ * The library never prints: errors are only visible through tar_last_error() and loggers.
+ *
+ * @param tar_fd A file descriptor pointing to a tar archive file.
+ *
+ * @return the handle, NULL if a handle is already attached to tar_fd or memory ran out.
+ */
+tar_t *tar_open(int tar_fd);
+
+/**
+ * Detaches a handle from its file descriptor and frees it. The file descriptor is not closed.
+ * No other thread may be using the file descriptor.
+ *
+ * @param tar The handle to free, may be NULL.
+ */
+void tar_close(tar_t *tar);
+
+/**
+ * Returns the handle attached to a file descriptor.
+ *
+ * @param tar_fd A file descriptor.
+ *
+ * @return the handle, NULL if none is attached.
+ */
+tar_t *tar_handle(int tar_fd);
+
+/**
+ * Indexes the entries of a handle's archive by name, so that exists(), check_flag(), get_symlink(),
+ * read_file() and tar_cache_read_file() find entries without scanning the headers.
+ *
+ * The index follows the archive as members are appended to it: whenever the file changed, only the
+ * headers past the previous end-of-archive marker are scanned, and a member named like an earlier
+ * one shadows it. Members are expected to be appended, not rewritten in place.
+ *
+ * Directories are indexed from the paths of their members as well, whether or not the archive stores
+ * them: is_dir(), list(), tar_list(), tar_walk() and tar_stat() then see "a/" in an archive holding only
+ * "a/b". Such a directory has no header, its entries have an offset of -1.
+ *
+ * The first list(), tar_list() or tar_walk() on a version of the index sorts its names into a prefix
+ * compressed table, in which the entries below a directory are a range found by binary search: listing
+ * a directory then reads its children, skipping the subtrees below them, rather than every entry.
+ *
+ * Lookups take no lock: each update publishes a new version of the index, which the calls starting
+ * afterwards see while the calls in progress finish with the version they started with.
+ * A lookup that finds the archive changed builds the new version itself, unless another thread is
+ * building one, and tar_index() waits for a build in progress before starting its own.
+ * Every lookup first checks with fstat() whether the archive changed, so that a member appended is
+ * found by the next lookup; a path that the Bloom filter of the index rules out then reads no slot.
+ *
+ * @param tar The handle of the archive.
+ *
+ * @return the number of headers read to bring the index up to date, zero if it already was,
+ *         -1 to -3 if the archive contains an invalid header as check_archive(),
+ *         -4 if the archive could not be read or memory ran out.
+ */
+int tar_index(tar_t *tar);
+
+/**
+ * Writes the index of a handle to a sidecar file, from which tar_index_load() loads it in other processes
+ * instead of scanning the headers of the archive. The sidecar holds the lookup table of the index as
+ * built, a minimal perfect hash with TAR_INDEX_PERFECT, and the Bloom filter answering lookups of absent
+ * paths. It is only valid on machines of the same layout.
+ *
+ * @param tar The handle of an indexed archive.
+ * @param index_fd A file descriptor open for writing, where the sidecar is written from its current position.
+ *
+ * @return 0 on success, -1 if the archive is not indexed, -4 if the sidecar could not be written
+ *         or the archive could not be read.
+ */
+int tar_index_save(tar_t *tar, int index_fd);
+
+/**
+ * Loads the index of a handle from a sidecar file written by tar_index_save(), in place of tar_index().
+ *
+ * The sidecar must have been saved for this archive: it is refused if the archive is smaller than when
+ * it was saved or if the header of the last member indexed changed. Members appended to the archive
+ * since are indexed by the next lookup, as with tar_index().
+ *
+ * @param tar The handle of the archive.
+ * @param index_fd A file descriptor open for reading, at the start of the sidecar.
+ *
+ * @return 0 on success, -1 if the file is not a sidecar of the archive or was written on a machine of
+ *         another layout, -4 if the sidecar or the archive could not be read or memory ran out.
+ */
+int tar_index_load(tar_t *tar, int index_fd);
+
+/**
+ * Returns the last error of the calling thread on a file descriptor.
+ * The error is reset to TAR_OK by each call of the thread on the file descriptor that succeeds.
+ *
+ * @param tar_fd A file descriptor. If no handle is attached to it, the last error of the calling thread
+ *               on any file descriptor without a handle is returned.
+ *
+ * @return the last error, valid until the next call on the file descriptor.
+ */
+const tar_error_t *tar_last_error(int tar_fd);
+
+/**
+ * Sets the callback receiving the errors of a handle.
+ *
+ * @param tar The handle, or NULL to set the logger of file descriptors without a handle.
+ * @param fn The callback, NULL to stop logging.
+ * @param arg A user argument passed to `fn`.
+ */
+void tar_set_logger(tar_t *tar, tar_log_fn fn, void *arg);
+
+/**
+ * Reads the counters of a file descriptor.
+ * Counters of a handle shared by several threads sum the work of all of them.
+ *
+ * @param tar_fd A file descriptor. If no handle is attached to it, the counters of the calling thread
+ *               on all file descriptors without a handle are returned.
+ * @param stats Filled with the counters.
+ */
+void tar_get_stats(int tar_fd, tar_stats_t *stats);
+
+/**
+ * Resets the counters of a file descriptor to zero.
+ *
+ * @param tar_fd A file descriptor, as for tar_get_stats().
+ */
+void tar_reset_stats(int tar_fd);
+
+/**
+ * Sets the callback receiving the start and the end of each operation of a handle.
+ * Calls made by the library on its own behalf, such as list() resolving a symlink, are not traced.
+ *
+ * @param tar The handle, or NULL to set the tracer of file descriptors without a handle.
+ * @param fn The callback, NULL to stop tracing.
+ * @param arg A user argument passed to `fn`.
+ */
+void tar_set_tracer(tar_t *tar, tar_trace_fn fn, void *arg);
+
+/**
+ * Names an operation.
+ *
+ * @param op One of the TAR_OP_* values.
+ *
+ * @return the name of the function measured by the operation, such as "read_file".
+ */
+const char *tar_op_name(int op);
+
+/**
+ * Sets the header validation policy of a handle, used by check_archive() and every scan that validates
+ * headers. valid_archive() always applies TAR_POLICY_USTAR.
+ *
+ * @param tar The handle, or NULL to set the policy of file descriptors without a handle.
+ * @param policy One of the TAR_POLICY_* values.
+ *
+ * @return 0 on success, -1 if the policy is unknown.
+ */
+int tar_set_policy(tar_t *tar, int policy);
+
+/**
+ * Sets the hints a handle gives the kernel about the pages of its archive.
+ *
+ * With TAR_ADVISE_READAHEAD, header walks prefetch the header following a large member instead of
+ * reading it synchronously after seeking over the member data, successive read_file() calls on a member
+ * prefetch the part asked for next, and tar_verify() and tar_diff() read with the sequential readahead window.
+ * With TAR_ADVISE_DROPBEHIND, the pages behind header walks and tar_verify() are dropped as the scan
+ * moves on, so that a full scan of a large archive does not evict the page cache of everything else.
+ * With TAR_ADVISE_DIRECT, check_archive() and the scans building the index, finding and walking entries
+ * read headers with O_DIRECT from a descriptor of their own: only the blocks holding headers are read,
+ * batched over small members, and member data is never pulled into the page cache. This is meant for
+ * cold archives and only applies to handles on file systems supporting O_DIRECT.
+ *
+ * @param tar The handle, or NULL to set the hints of file descriptors without a handle.
+ * @param advice A mask of TAR_ADVISE_* flags, zero to give no hints.
+ *
+ * @return 0 on success, -1 if the mask holds unknown flags.
+ */
+int tar_set_advice(tar_t *tar, int advice);
+
+/**
+ * Sets how many headers the index builds of a handle read ahead.
+ *
+ * Each header gives the offset of the next one, so a scan waits for every header read in turn. With a
+ * depth, tar_index() and the index refreshes read the chain of headers on a thread of their own, which
+ * issues the read of the next header as soon as it knows its offset, keeps up to `depth` headers ready
+ * while the scan validates and indexes the previous ones, and reads the headers of small members in
+ * batches. This pays off where reads have a high latency, such as on network file systems.
+ *
+ * @param tar The handle.
+ * @param depth The number of headers read ahead, zero to read headers in the scan itself.
+ *
+ * @return 0 on success, -1 if the depth is negative.
+ */
+int tar_set_prefetch(tar_t *tar, int depth);
+
+/**
+ * Sets the lookup table of the index versions that the index builds of a handle publish.
+ *
+ * With TAR_INDEX_HASH, names are found in an open addressing hash table, which members appended to the
+ * archive are added to. With TAR_INDEX_PERFECT, meant for archives that are not appended to once
+ * published, each version built is given a minimal perfect hash of its names instead: lookups read a
+ * single position and the table takes about 5 bytes per name rather than 11 to 21, at the cost of
+ * hashing every name again when the version is built. A version built when the archive grew starts
+ * from a hash table again, so that appending stays possible.
+ * A version published before TAR_INDEX_PERFECT was set is given its perfect hash by the next tar_index().
+ *
+ * @param tar The handle.
+ * @param mode One of the TAR_INDEX_* values.
+ *
+ * @return 0 on success, -1 if the mode is unknown.
+ */
+int tar_set_index_mode(tar_t *tar, int mode);
+
+/**
+ * Describes an error code.
+ *
+ * @param code One of the TAR_E* values.
+ *
+ * @return a static string describing the error.
+ */
+const char *tar_strerror(int code);
+
 #endif
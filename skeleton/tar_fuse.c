@@ -0,0 +1,339 @@
+/*
+ * Read-only file system view of a tar archive, served by lib_tar.
+ *
+ * Built with libfuse (make tar_fuse FUSE=1), the archive is mounted:
+ *     tar_fuse archive.tar mountpoint [fuse options]
+ *
+ * Built without it (make tar_fuse), a stand-in serves the same file system operations to commands
+ * read from stdin, one per line, so that the view can be browsed where libfuse is not installed:
+ *     stat PATH, ls PATH, cat PATH, readlink PATH
+ *
+ * The archive is indexed once when mounted: attributes and symlinks are looked up in the index,
+ * file data is read with pread() through a tar_cache_t, and directories are listed with tar_walk().
+ */
+#ifdef TAR_FUSE_LIBFUSE
+#define FUSE_USE_VERSION 31
+#include <fuse.h>
+#endif
+
+#include "lib_tar.h"
+
+/* Bytes of member data kept in memory by the page cache */
+#define TAR_FUSE_CACHE_BUDGET (64 << 20)
+
+/* The mounted archive, shared by the threads serving requests */
+static struct
+{
+    int fd;
+    tar_t *tar;
+    tar_cache_t *cache;
+    struct stat root;             /* attributes of the mount point, taken from the archive file */
+} mounted;
+
+/* Called with each name listed in a directory, returns nonzero to stop the listing */
+typedef int (*tf_fill_fn)(void *arg, const char *name, const struct stat *st);
+
+/* Returns the archive path of a file system path, without its leading slashes */
+static const char *tf_name(const char *path)
+{
+    while (*path == '/')
+    {
+        path++;
+    }
+    return path;
+}
+
+/* Maps a lib_tar return value to a negative errno */
+static int tf_errno(int ret)
+{
+    return ret == -3 ? -EIO : -ENOENT;
+}
+
+/*
+ * Fills the attributes of a file system path.
+ *
+ * @return 0 on success, a negative errno otherwise.
+ */
+static int tf_getattr(const char *path, struct stat *st)
+{
+    const char *name = tf_name(path);
+    if (name[0] == '\0')
+    {
+        *st = mounted.root;
+        return 0;
+    }
+
+    int ret = tar_stat(mounted.fd, name, st);
+    return ret == 0 ? 0 : tf_errno(ret);
+}
+
+typedef struct tf_readdir_ctx
+{
+    tf_fill_fn fill;
+    void *arg;
+} tf_readdir_ctx_t;
+
+static int tf_readdir_entry(const tar_entry_t *entry, int depth, void *arg)
+{
+    tf_readdir_ctx_t *ctx = arg;
+    char name[TAR_NAME_MAX];
+    snprintf(name, sizeof(name), "%s", entry->name);
+
+    size_t len = strlen(name);
+    if (len > 0 && name[len - 1] == '/')
+    {
+        name[--len] = '\0';
+    }
+    const char *base = strrchr(name, '/');
+    return ctx->fill(ctx->arg, base != NULL ? base + 1 : name, NULL);
+}
+
+/*
+ * Lists the direct children of a directory, "." and ".." first.
+ *
+ * @return 0 on success, a negative errno otherwise: -ENOENT if there is no such entry, -ENOTDIR if it is
+ *         not a directory.
+ */
+static int tf_readdir(const char *path, tf_fill_fn fill, void *arg)
+{
+    struct stat st;
+    int ret = tf_getattr(path, &st);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    if (!S_ISDIR(st.st_mode))
+    {
+        return -ENOTDIR;
+    }
+
+    fill(arg, ".", NULL);
+    fill(arg, "..", NULL);
+    tar_walk_opts_t opts = {1, 0, TAR_WALK_ARCHIVE};
+    tf_readdir_ctx_t ctx = {fill, arg};
+    ret = tar_walk(mounted.fd, tf_name(path), &opts, tf_readdir_entry, &ctx);
+    return ret < 0 ? -EIO : 0;
+}
+
+/*
+ * Reads a file through the page cache.
+ *
+ * @return the number of bytes read, zero past the end of the file, a negative errno otherwise:
+ *         -EISDIR for a directory.
+ */
+static int tf_read(const char *path, char *buf, size_t size, off_t offset)
+{
+    size_t len = size;
+    ssize_t ret = tar_cache_read_file(mounted.cache, mounted.fd, (char *)tf_name(path), offset, (uint8_t *)buf, &len);
+    if (ret == -2)
+    {
+        return 0;
+    }
+    struct stat st;
+    if (ret == -1 && tf_getattr(path, &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        return -EISDIR;
+    }
+    return ret < 0 ? tf_errno(ret) : (int)len;
+}
+
+/*
+ * Reads the target of a symlink as a null-terminated string, truncated to size.
+ *
+ * @return 0 on success, a negative errno otherwise.
+ */
+static int tf_readlink(const char *path, char *buf, size_t size)
+{
+    char *target = get_symlink(mounted.fd, (char *)tf_name(path));
+    if (target == NULL)
+    {
+        return -ENOENT;
+    }
+    snprintf(buf, size, "%s", target);
+    free(target);
+    return 0;
+}
+
+#ifdef TAR_FUSE_LIBFUSE
+
+static int fuse_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+    return tf_getattr(path, st);
+}
+
+typedef struct fuse_fill_ctx
+{
+    void *buf;
+    fuse_fill_dir_t filler;
+} fuse_fill_ctx_t;
+
+static int fuse_fill(void *arg, const char *name, const struct stat *st)
+{
+    fuse_fill_ctx_t *ctx = arg;
+    return ctx->filler(ctx->buf, name, st, 0, 0);
+}
+
+static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+                        struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+    fuse_fill_ctx_t ctx = {buf, filler};
+    return tf_readdir(path, fuse_fill, &ctx);
+}
+
+static int fuse_open(const char *path, struct fuse_file_info *fi)
+{
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+    {
+        return -EROFS;
+    }
+    /* members never change under a mount, the kernel may keep their pages */
+    fi->keep_cache = 1;
+    return 0;
+}
+
+static int fuse_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    return tf_read(path, buf, size, offset);
+}
+
+static int fuse_readlink(const char *path, char *buf, size_t size)
+{
+    return tf_readlink(path, buf, size);
+}
+
+static const struct fuse_operations tar_fuse_ops = {
+    .getattr = fuse_getattr,
+    .readdir = fuse_readdir,
+    .open = fuse_open,
+    .read = fuse_read,
+    .readlink = fuse_readlink,
+};
+
+static int serve(int argc, char **argv)
+{
+    /* the archive argument is ours, the mount point and options are for libfuse */
+    argv[1] = argv[0];
+    return fuse_main(argc - 1, argv + 1, &tar_fuse_ops, NULL);
+}
+
+#else
+
+static int print_name(void *arg, const char *name, const struct stat *st)
+{
+    printf("%s\n", name);
+    return 0;
+}
+
+/* Writes a whole file to stdout through tf_read() */
+static int cat(const char *path)
+{
+    char buf[1 << 16];
+    off_t offset = 0;
+    int ret;
+    while ((ret = tf_read(path, buf, sizeof(buf), offset)) > 0)
+    {
+        fwrite(buf, 1, ret, stdout);
+        offset += ret;
+    }
+    return ret;
+}
+
+static int serve(int argc, char **argv)
+{
+    char line[TAR_NAME_MAX + 16];
+    while (fgets(line, sizeof(line), stdin) != NULL)
+    {
+        line[strcspn(line, "\n")] = '\0';
+        char *path = strchr(line, ' ');
+        path = path != NULL ? path + 1 : "/";
+        int ret = 0;
+
+        if (strncmp(line, "stat", 4) == 0)
+        {
+            struct stat st;
+            if ((ret = tf_getattr(path, &st)) == 0)
+            {
+                printf("%s mode %o size %lld uid %d gid %d mtime %lld ino %llu\n", path, (unsigned)st.st_mode,
+                       (long long)st.st_size, (int)st.st_uid, (int)st.st_gid, (long long)st.st_mtime,
+                       (unsigned long long)st.st_ino);
+            }
+        }
+        else if (strncmp(line, "ls", 2) == 0)
+        {
+            ret = tf_readdir(path, print_name, NULL);
+        }
+        else if (strncmp(line, "cat", 3) == 0)
+        {
+            ret = cat(path);
+        }
+        else if (strncmp(line, "readlink", 8) == 0)
+        {
+            char target[TAR_NAME_MAX];
+            if ((ret = tf_readlink(path, target, sizeof(target))) == 0)
+            {
+                printf("%s\n", target);
+            }
+        }
+        else if (line[0] != '\0')
+        {
+            ret = -EINVAL;
+        }
+
+        if (ret < 0)
+        {
+            fprintf(stderr, "%s: %s\n", line, strerror(-ret));
+        }
+        fflush(stdout);
+    }
+    return 0;
+}
+
+#endif
+
+int main(int argc, char **argv)
+{
+#ifdef TAR_FUSE_LIBFUSE
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: %s archive.tar mountpoint [fuse options]\n", argv[0]);
+        return 1;
+    }
+#else
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s archive.tar < commands\n", argv[0]);
+        return 1;
+    }
+#endif
+
+    mounted.fd = open(argv[1], O_RDONLY);
+    if (mounted.fd == -1 || fstat(mounted.fd, &mounted.root) == -1)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    mounted.root.st_mode = S_IFDIR | 0555;
+    mounted.root.st_nlink = 2;
+    mounted.root.st_size = 0;
+
+    mounted.tar = tar_open(mounted.fd);
+    mounted.cache = tar_cache_new(TAR_FUSE_CACHE_BUDGET, 0);
+    if (mounted.tar == NULL || mounted.cache == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", argv[1], strerror(ENOMEM));
+        return 1;
+    }
+    /* archives to browse are mostly written by GNU tar */
+    tar_set_policy(mounted.tar, TAR_POLICY_GNU);
+    if (tar_index(mounted.tar) < 0)
+    {
+        fprintf(stderr, "%s: %s\n", argv[1], tar_strerror(tar_last_error(mounted.fd)->code));
+        return 1;
+    }
+
+    int ret = serve(argc, argv);
+    tar_cache_free(mounted.cache);
+    tar_close(mounted.tar);
+    close(mounted.fd);
+    return ret;
+}
@@ -9,6 +9,1416 @@
  * You are free to use this file to write tests for your implementation
  */
 
+/* Assertions on archives written into a scratch directory, run after the listing of the archive given */
+static int checks, failures;
+static char scratch[] = "/tmp/lib_tar_tests.XXXXXX";
+
+#define CHECK(cond) do { \
+    checks++; \
+    if (!(cond)) { \
+        failures++; \
+        printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+    } \
+} while (0)
+
+/* Returns the path of a file of the scratch directory, in a static buffer */
+static const char *scratch_path(const char *name) {
+    static char path[sizeof(scratch) + 64];
+    snprintf(path, sizeof(path), "%s/%s", scratch, name);
+    return path;
+}
+
+/*
+ * Writes a ustar member at offset `off` of fd, linking to `linkname` if not NULL, and returns the offset following it.
+ * A name too long for the name field is split into the ustar prefix at a slash.
+ */
+static off_t put_entry(int fd, off_t off, const char *name, char typeflag, const char *linkname, const char *data) {
+    tar_header_t h;
+    size_t size = data != NULL ? strlen(data) : 0;
+    memset(&h, 0, sizeof(h));
+    const char *split = strlen(name) >= sizeof(h.name) ? strchr(name + strlen(name) - sizeof(h.name), '/') : NULL;
+    if (split != NULL && split[1] != '\0') {
+        memcpy(h.prefix, name, split - name);
+        name = split + 1;
+    }
+    snprintf(h.name, sizeof(h.name), "%s", name);
+    if (linkname != NULL) {
+        strncpy(h.linkname, linkname, sizeof(h.linkname));
+    }
+    snprintf(h.mode, sizeof(h.mode), "%07o", typeflag == DIRTYPE ? 0755 : 0644);
+    snprintf(h.uid, sizeof(h.uid), "%07o", 0);
+    snprintf(h.gid, sizeof(h.gid), "%07o", 0);
+    snprintf(h.size, sizeof(h.size), "%011o", (unsigned) size);
+    snprintf(h.mtime, sizeof(h.mtime), "%011o", 0);
+    h.typeflag = typeflag;
+    memcpy(h.magic, TMAGIC, TMAGLEN);
+    memcpy(h.version, TVERSION, TVERSLEN);
+    memset(h.chksum, ' ', sizeof(h.chksum));
+    unsigned sum = 0;
+    for (size_t i = 0; i < sizeof(h); i++) {
+        sum += ((unsigned char *) &h)[i];
+    }
+    snprintf(h.chksum, sizeof(h.chksum), "%06o", sum);
+    h.chksum[7] = ' ';
+
+    char block[512] = {0};
+    pwrite(fd, &h, sizeof(h), off);
+    off += sizeof(h);
+    for (size_t done = 0; done < size; done += sizeof(block)) {
+        size_t n = size - done < sizeof(block) ? size - done : sizeof(block);
+        memset(block, 0, sizeof(block));
+        memcpy(block, data + done, n);
+        pwrite(fd, block, sizeof(block), off);
+        off += sizeof(block);
+    }
+    return off;
+}
+
+/* Writes a ustar member without a link at offset `off` of fd and returns the offset following it */
+static off_t put_member(int fd, off_t off, const char *name, char typeflag, const char *data) {
+    return put_entry(fd, off, name, typeflag, NULL, data);
+}
+
+/* Writes the end-of-archive marker at offset `off` of fd */
+static void put_end(int fd, off_t off) {
+    char zeros[1024] = {0};
+    pwrite(fd, zeros, sizeof(zeros), off);
+}
+
+/*
+ * Creates a scratch archive of the members named in `names`: directories end with a slash, "name -> target"
+ * is a symlink and "name => target" a hard link, the others are regular files holding their own name.
+ */
+static int make_archive(const char *file, const char **names, size_t count) {
+    int fd = open(scratch_path(file), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    off_t off = 0;
+    for (size_t i = 0; i < count; i++) {
+        char name[256];
+        snprintf(name, sizeof(name), "%s", names[i]);
+        char *arrow = strstr(name, " -> ") != NULL ? strstr(name, " -> ") : strstr(name, " => ");
+        if (arrow != NULL) {
+            *arrow = '\0';
+            off = put_entry(fd, off, name, arrow[1] == '-' ? SYMTYPE : LNKTYPE, arrow + 4, NULL);
+            continue;
+        }
+        size_t len = strlen(name);
+        off = put_member(fd, off, name, name[len - 1] == '/' ? DIRTYPE : REGTYPE,
+                         name[len - 1] == '/' ? NULL : name);
+    }
+    put_end(fd, off);
+    return fd;
+}
+
+/* Returns 1 if two files hold the same bytes */
+static int same_bytes(int a, int b) {
+    char x[4096], y[4096];
+    for (off_t off = 0;; off += sizeof(x)) {
+        ssize_t n = pread(a, x, sizeof(x), off);
+        if (n != pread(b, y, sizeof(y), off) || memcmp(x, y, n > 0 ? n : 0) != 0) {
+            return 0;
+        }
+        if (n <= 0) {
+            return n == 0;
+        }
+    }
+}
+
+/* Names reported by a scan, joined by spaces */
+typedef struct found {
+    int count;
+    char names[512];
+} found_t;
+
+static int collect_entry(const tar_entry_t *entry, void *arg) {
+    found_t *found = arg;
+    size_t used = strlen(found->names);
+    snprintf(found->names + used, sizeof(found->names) - used, "%s%s", used > 0 ? " " : "", entry->name);
+    found->count++;
+    return 0;
+}
+
+static int header_offset(const tar_entry_t *entry, void *arg) {
+    *(off_t *) arg = entry->offset;
+    return 0;
+}
+
+/* Runs tar_find() and checks it reports `expected`, the names joined by spaces in archive order */
+static int find_is(int fd, const char *pattern, int flags, const char *expected) {
+    found_t found = {0, ""};
+    int ret = tar_find(fd, pattern, flags, collect_entry, &found);
+    if (ret != found.count || strcmp(found.names, expected) != 0) {
+        printf("tar_find(\"%s\") returned %d: \"%s\"\n", pattern, ret, found.names);
+        return 0;
+    }
+    return 1;
+}
+
+static int collect_walked(const tar_entry_t *entry, int depth, void *arg) {
+    found_t *found = arg;
+    size_t used = strlen(found->names);
+    snprintf(found->names + used, sizeof(found->names) - used, "%s%s:%d", used > 0 ? " " : "", entry->name, depth);
+    found->count++;
+    return 0;
+}
+
+/* Runs tar_walk() and checks it reports `expected`, each name followed by its depth */
+static int walk_is(int fd, const char *path, int max_depth, int types, int order, const char *expected) {
+    tar_walk_opts_t opts = {max_depth, types, order};
+    found_t found = {0, ""};
+    lseek(fd, 0, SEEK_SET);
+    int ret = tar_walk(fd, path, &opts, collect_walked, &found);
+    if (ret != found.count || strcmp(found.names, expected) != 0) {
+        printf("tar_walk(\"%s\", %d, %#x, %d) returned %d: \"%s\"\n", path, max_depth, types, order, ret, found.names);
+        return 0;
+    }
+    return 1;
+}
+
+/* Reads a whole member into buf as a string from the start of the archive, returns what read_file() returned */
+static ssize_t read_string(int fd, const char *path, char *buf, size_t size) {
+    size_t len = size - 1;
+    lseek(fd, 0, SEEK_SET);
+    ssize_t ret = read_file(fd, (char *) path, 0, (uint8_t *) buf, &len);
+    buf[ret >= 0 ? len : 0] = '\0';
+    return ret;
+}
+
+static const char *small[] = {"d/", "d/a", "d/b", "c"};
+
+/* Invalid headers are reported as check_archive() does by every scan, a header without magic ends the archive */
+static void test_error_codes(void) {
+    int good = make_archive("good.tar", small, 4);
+    int bad = make_archive("badsum.tar", small, 4);
+    int nomagic = make_archive("nomagic.tar", small, 4);
+    /* the third header, following a directory and a member of one block */
+    pwrite(bad, "0000000", 7, 1536 + 148);
+    pwrite(nomagic, "\0\0\0\0\0\0", 6, 1536 + 257);
+
+    CHECK(check_archive(good) == 4);
+    lseek(bad, 0, SEEK_SET);
+    CHECK(check_archive(bad) == -3);
+    for (int threads = 1; threads <= 4; threads += 3) {
+        tar_verify_opts_t opts = {TAR_DIGEST_XXH64, NULL, 0, threads};
+        lseek(bad, 0, SEEK_SET);
+        CHECK(tar_verify(bad, &opts, NULL, NULL) == -3);
+        CHECK(tar_last_error(bad)->code == TAR_ECHKSUM);
+        lseek(nomagic, 0, SEEK_SET);
+        CHECK(tar_verify(nomagic, &opts, NULL, NULL) == 0);
+    }
+    CHECK(tar_diff(bad, good, NULL, NULL) == -3);
+    CHECK(tar_last_error(bad)->code == TAR_ECHKSUM);
+
+    int delta = open(scratch_path("bad.delta"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(tar_delta_create(good, bad, delta) == -3);
+    CHECK(tar_last_error(bad)->code == TAR_ECHKSUM);
+    close(delta);
+
+    tar_t *tar = tar_open(bad);
+    CHECK(tar_index(tar) == -3);
+    CHECK(tar_last_error(bad)->code == TAR_ECHKSUM);
+    tar_close(tar);
+
+    lseek(nomagic, 0, SEEK_SET);
+    CHECK(check_archive(nomagic) == 2);
+    tar = tar_open(nomagic);
+    CHECK(tar_index(tar) == 2);
+    CHECK(exists(nomagic, "d/a") != 0);
+    CHECK(exists(nomagic, "d/b") == 0);
+    CHECK(exists(nomagic, "c") == 0);
+    tar_close(tar);
+
+    close(good);
+    close(bad);
+    close(nomagic);
+}
+
+typedef struct verified {
+    char small[TAR_DIGEST_MAX];
+    char big[TAR_DIGEST_MAX];
+    int status[4];                /* members reported with each TAR_VERIFY_* status */
+} verified_t;
+
+static int record_digest(const tar_entry_t *entry, const char *digest, int status, void *arg) {
+    verified_t *seen = arg;
+    if (digest != NULL) {
+        snprintf(strcmp(entry->name, "c") == 0 ? seen->small : seen->big, TAR_DIGEST_MAX, "%s", digest);
+    }
+    seen->status[status]++;
+    return 0;
+}
+
+/* Globs match by path segment, regular expressions anywhere in the path, with or without an index */
+static void test_find(void) {
+    static const char *members[] = {
+        "src/", "src/a.c", "src/b.h", "src/lib/", "src/lib/x.c", "src/lib/deep/", "src/lib/deep/y.c", "doc/readme", "top.c",
+    };
+    int fd = make_archive("find.tar", members, 9);
+    for (int indexed = 0; indexed <= 1; indexed++) {
+        tar_t *tar = indexed ? tar_open(fd) : NULL;
+        if (indexed) {
+            CHECK(tar_index(tar) == 9);
+        }
+        CHECK(find_is(fd, "*.c", 0, "top.c"));
+        CHECK(find_is(fd, "src/*.c", 0, "src/a.c"));
+        CHECK(find_is(fd, "**/*.c", 0, "src/a.c src/lib/x.c src/lib/deep/y.c top.c"));
+        CHECK(find_is(fd, "src/**/*.c", 0, "src/a.c src/lib/x.c src/lib/deep/y.c"));
+        CHECK(find_is(fd, "src/?.[ch]", 0, "src/a.c src/b.h"));
+        CHECK(find_is(fd, "src/[!a].?", 0, "src/b.h"));
+        CHECK(find_is(fd, "./src//lib/*", 0, "src/lib/x.c src/lib/deep/"));
+        CHECK(find_is(fd, "src/*/", 0, "src/lib/"));
+        CHECK(find_is(fd, "nothing/*", 0, ""));
+        CHECK(find_is(fd, "\\.h$", TAR_FIND_REGEX, "src/b.h"));
+        CHECK(find_is(fd, "^src/lib/.*c$", TAR_FIND_REGEX, "src/lib/x.c src/lib/deep/y.c"));
+        CHECK(find_is(fd, "lib", TAR_FIND_REGEX, "src/lib/ src/lib/x.c src/lib/deep/ src/lib/deep/y.c"));
+        CHECK(tar_find(fd, "(", TAR_FIND_REGEX, NULL, NULL) == -1);
+        tar_close(tar);
+    }
+    close(fd);
+}
+
+/* Walks stop at the depth limit, report only the selected types and sort siblings in tree orders */
+static void test_walk(void) {
+    static const char *members[] = {
+        "dir/", "dir/h => dir/a", "dir/c/", "dir/c/d/", "dir/c/d/e", "dir/a", "dir/l -> a", "dir/b", "top",
+    };
+    int fd = make_archive("walk.tar", members, 9);
+    for (int indexed = 0; indexed <= 1; indexed++) {
+        tar_t *tar = indexed ? tar_open(fd) : NULL;
+        if (indexed) {
+            CHECK(tar_index(tar) == 9);
+        }
+        CHECK(walk_is(fd, "dir/", 0, 0, TAR_WALK_ARCHIVE,
+                      "dir/h:1 dir/c/:1 dir/c/d/:2 dir/c/d/e:3 dir/a:1 dir/l:1 dir/b:1"));
+        CHECK(walk_is(fd, "dir/", 2, 0, TAR_WALK_PREORDER, "dir/a:1 dir/b:1 dir/c/:1 dir/c/d/:2 dir/h:1 dir/l:1"));
+        CHECK(walk_is(fd, "dir/", 0, 0, TAR_WALK_POSTORDER,
+                      "dir/a:1 dir/b:1 dir/c/d/e:3 dir/c/d/:2 dir/c/:1 dir/h:1 dir/l:1"));
+        CHECK(walk_is(fd, "dir/", 1, TAR_WALK_DIRS, TAR_WALK_PREORDER, "dir/c/:1"));
+        CHECK(walk_is(fd, "dir/", 0, TAR_WALK_FILES, TAR_WALK_PREORDER, "dir/a:1 dir/b:1 dir/c/d/e:3"));
+        CHECK(walk_is(fd, "dir/", 0, TAR_WALK_SYMLINKS | TAR_WALK_LINKS, TAR_WALK_ARCHIVE, "dir/h:1 dir/l:1"));
+        CHECK(walk_is(fd, "dir/c", 0, 0, TAR_WALK_PREORDER, "dir/c/d/:1 dir/c/d/e:2"));
+        CHECK(walk_is(fd, "", 1, 0, TAR_WALK_PREORDER, "dir/:1 top:1"));
+        CHECK(walk_is(fd, "top", 0, 0, TAR_WALK_ARCHIVE, ""));
+        tar_close(tar);
+    }
+    close(fd);
+}
+
+/* Digests of a member short enough for the one-shot path of each algorithm and of one of several blocks */
+static void test_verify_digests(void) {
+    static const char *expected[][2] = {
+        [TAR_DIGEST_CRC32C] = {"20eb33c7", "1f25db95"},
+        [TAR_DIGEST_XXH64] = {"a3dad144c40657ed", "096a63e35a30f11a"},
+        [TAR_DIGEST_SHA256] = {"2e7d2c03a9507ae265ecf5b5356885a53393a2029d241394997265a1a25aefc6",
+                               "644090ab6e49739abb46db2952ef7b27db65289cd24c00cd711ff81a9ae30024"},
+        [TAR_DIGEST_XXH3] = {"8c40219a46b9f81b", "a6c336f952bfeadd"},
+    };
+    char big[3001];
+    for (int i = 0; i < 3000; i++) {
+        big[i] = (char) ((i * 7 + 3) % 251 + 1);
+    }
+    big[3000] = '\0';
+    int fd = open(scratch_path("digest.tar"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    off_t off = put_member(fd, 0, "d/", DIRTYPE, NULL);
+    off = put_member(fd, off, "c", REGTYPE, "c");
+    off = put_member(fd, off, "big", REGTYPE, big);
+    put_end(fd, off);
+
+    for (int alg = TAR_DIGEST_CRC32C; alg <= TAR_DIGEST_XXH3; alg++) {
+        for (int threads = 1; threads <= 4; threads += 3) {
+            tar_verify_opts_t opts = {alg, NULL, 0, threads};
+            verified_t seen = {"", "", {0}};
+            lseek(fd, 0, SEEK_SET);
+            CHECK(tar_verify(fd, &opts, record_digest, &seen) == 0);
+            CHECK(strcmp(seen.small, expected[alg][0]) == 0);
+            CHECK(strcmp(seen.big, expected[alg][1]) == 0);
+        }
+    }
+
+    tar_manifest_entry_t manifest[] = {{"c", expected[TAR_DIGEST_XXH3][0]}, {"big", "0000000000000000"}, {"gone", "0"}};
+    tar_verify_opts_t opts = {TAR_DIGEST_XXH3, manifest, 3, 1};
+    verified_t seen = {"", "", {0}};
+    lseek(fd, 0, SEEK_SET);
+    CHECK(tar_verify(fd, &opts, record_digest, &seen) == 2);
+    CHECK(seen.status[TAR_VERIFY_OK] == 1 && seen.status[TAR_VERIFY_MISMATCH] == 1);
+    CHECK(seen.status[TAR_VERIFY_MISSING] == 1 && seen.status[TAR_VERIFY_UNLISTED] == 0);
+    opts.digest = TAR_DIGEST_XXH3 + 1;
+    CHECK(tar_verify(fd, &opts, NULL, NULL) == -4);
+    close(fd);
+}
+
+/* Checks that tar_list() lists `expected`, the paths joined by spaces in archive order, and returns what it returned */
+static int tar_list_is(int fd, const char *path, const char *expected) {
+    tar_list_t *entries = NULL;
+    char names[1024] = "";
+    int ret = tar_list(fd, path, &entries);
+    for (size_t i = 0; entries != NULL && i < entries->count; i++) {
+        size_t used = strlen(names);
+        snprintf(names + used, sizeof(names) - used, "%s%s", used > 0 ? " " : "", TAR_LIST_ENTRY(entries, i));
+    }
+    tar_list_free(entries);
+    if (strcmp(names, expected) != 0) {
+        printf("tar_list(\"%s\") returned %d: \"%s\"\n", path, ret, names);
+        return -100;
+    }
+    return ret;
+}
+
+/* tar_list() has no limit on entries or path lengths, and leaves the file offset alone */
+static void test_list(void) {
+    char long_dir[128], long_file[192], expected[512];
+    snprintf(long_dir, sizeof(long_dir), "d/%090d/", 0);
+    snprintf(long_file, sizeof(long_file), "%s%060d", long_dir, 1);
+    const char *members[] = {"d/", "d/a", "d/sub/", "d/sub/x", long_dir, long_file, "e/", "f", "ln -> d"};
+    int fd = make_archive("list.tar", members, 9);
+    snprintf(expected, sizeof(expected), "d/a d/sub/ %s", long_dir);
+    for (int indexed = 0; indexed <= 1; indexed++) {
+        tar_t *tar = indexed ? tar_open(fd) : NULL;
+        if (indexed) {
+            CHECK(tar_index(tar) == 9);
+        }
+        lseek(fd, 1234, SEEK_SET);
+        CHECK(tar_list_is(fd, "d", expected) > 0);
+        CHECK(tar_list_is(fd, "./d/", expected) > 0);
+        CHECK(tar_list_is(fd, "ln", expected) > 0);
+        CHECK(tar_list_is(fd, long_dir, long_file) > 0);
+        CHECK(tar_list_is(fd, "e/", "") > 0);
+        CHECK(tar_list_is(fd, "f", "") == 0);
+        CHECK(tar_list_is(fd, "missing/", "") == 0);
+        CHECK(lseek(fd, 0, SEEK_CUR) == 1234);
+        CHECK(tar_list(fd, NULL, NULL) == -1);
+        tar_close(tar);
+    }
+    close(fd);
+
+    fd = open(scratch_path("list_many.tar"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    off_t off = put_member(fd, 0, "many/", DIRTYPE, NULL);
+    for (int i = 0; i < 3000; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "many/f%d", i);
+        off = put_member(fd, off, name, REGTYPE, NULL);
+    }
+    put_end(fd, off);
+    tar_list_t *entries;
+    CHECK(tar_list(fd, "many", &entries) > 0);
+    CHECK(entries != NULL && entries->count == 3000);
+    CHECK(entries != NULL && strcmp(TAR_LIST_ENTRY(entries, 2999), "many/f2999") == 0);
+    tar_list_free(entries);
+    close(fd);
+}
+
+/* Events received by record_trace() */
+typedef struct traced {
+    int count;
+    tar_trace_t events[8];
+    char paths[8][32];
+} traced_t;
+
+static void record_trace(const tar_trace_t *trace, void *arg) {
+    traced_t *traced = arg;
+    if (traced->count < 8) {
+        traced->events[traced->count] = *trace;
+        snprintf(traced->paths[traced->count], sizeof(traced->paths[0]), "%s", trace->path != NULL ? trace->path : "");
+    }
+    traced->count++;
+}
+
+/* Each call is counted, timed and traced once, work done on the library's own behalf included in it */
+static void test_stats(void) {
+    static const char *members[] = {"d/", "d/a", "d/b", "ln -> d"};
+    int fd = make_archive("stats.tar", members, 4);
+    tar_t *tar = tar_open(fd);
+    traced_t traced = {0};
+    tar_stats_t stats;
+    uint8_t buf[16];
+    size_t len = sizeof(buf);
+    char path[32];
+    CHECK(strcmp(tar_op_name(TAR_OP_READ), "read_file") == 0);
+    CHECK(strcmp(tar_op_name(TAR_OP_LIST_ALLOC), "tar_list") == 0);
+    tar_set_tracer(tar, record_trace, &traced);
+
+    strcpy(path, "d/b");
+    CHECK(read_file(fd, path, 0, buf, &len) == 0);
+    CHECK(traced.count == 2);
+    CHECK(traced.events[0].op == TAR_OP_READ && traced.events[0].end == 0 && strcmp(traced.paths[0], "d/b") == 0);
+    CHECK(traced.events[1].op == TAR_OP_READ && traced.events[1].end == 1 && traced.events[1].result == 0);
+    CHECK(traced.events[1].headers == 3 && traced.events[1].bytes_read >= 3 * 512 + 3);
+    tar_get_stats(fd, &stats);
+    CHECK(stats.ops[TAR_OP_READ].calls == 1 && stats.ops[TAR_OP_READ].errors == 0);
+    CHECK(stats.headers == 3 && stats.reads > 0 && stats.bytes_read == traced.events[1].bytes_read);
+
+    strcpy(path, "d/c");
+    len = sizeof(buf);
+    CHECK(read_file(fd, path, 0, buf, &len) == -1);
+    CHECK(traced.count == 4 && traced.events[3].result == -1);
+    tar_get_stats(fd, &stats);
+    CHECK(stats.ops[TAR_OP_READ].calls == 2 && stats.ops[TAR_OP_READ].errors == 1);
+
+    char storage[4][32];
+    char *entries[4] = {storage[0], storage[1], storage[2], storage[3]};
+    size_t count = 4;
+    strcpy(path, "ln");
+    CHECK(list(fd, path, entries, &count) != 0 && count == 2);
+    CHECK(traced.count == 6 && traced.events[4].op == TAR_OP_LIST && traced.events[5].op == TAR_OP_LIST);
+    tar_get_stats(fd, &stats);
+    CHECK(stats.ops[TAR_OP_LIST].calls == 1 && stats.ops[TAR_OP_SYMLINK].calls == 0 && stats.ops[TAR_OP_FLAG].calls == 0);
+
+    tar_reset_stats(fd);
+    tar_get_stats(fd, &stats);
+    CHECK(stats.headers == 0 && stats.bytes_read == 0 && stats.ops[TAR_OP_READ].calls == 0);
+    tar_set_tracer(tar, NULL, NULL);
+    CHECK(exists(fd, path) != 0);
+    CHECK(traced.count == 6);
+    tar_get_stats(fd, &stats);
+    CHECK(stats.ops[TAR_OP_EXISTS].calls == 1);
+    tar_close(tar);
+
+    tar_reset_stats(fd);
+    lseek(fd, 0, SEEK_SET);
+    CHECK(exists(fd, path) != 0);
+    tar_get_stats(fd, &stats);
+    CHECK(stats.ops[TAR_OP_EXISTS].calls == 1 && stats.headers == 4);
+    close(fd);
+}
+
+/* Reads `path` through a cache and checks it yields `expected` from `offset` on */
+static int cached_is(tar_cache_t *cache, int fd, const char *path, size_t offset, const char *expected) {
+    uint8_t buf[256];
+    size_t len = sizeof(buf);
+    char name[256];
+    snprintf(name, sizeof(name), "%s", path);
+    ssize_t ret = tar_cache_read_file(cache, fd, name, offset, buf, &len);
+    return ret == 0 && len == strlen(expected) && memcmp(buf, expected, len) == 0;
+}
+
+/* Repeated reads hit the cache, identical members of any archive share one blob, large members bypass it */
+static void test_cache(void) {
+    char big[101];
+    memset(big, 'b', 100);
+    big[100] = '\0';
+    int a = open(scratch_path("cache_a.tar"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    off_t off = put_member(a, 0, "a/one", REGTYPE, "shared content");
+    off = put_member(a, off, "a/two", REGTYPE, "shared content");
+    off = put_member(a, off, "a/other", REGTYPE, "other content!");
+    off = put_entry(a, off, "a/link", SYMTYPE, "one", NULL);
+    put_end(a, put_member(a, off, "big", REGTYPE, big));
+    int b = open(scratch_path("cache_b.tar"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    put_end(b, put_member(b, 0, "b/one", REGTYPE, "shared content"));
+
+    tar_cache_t *cache = tar_cache_new(1 << 20, 64);
+    tar_cache_stats_t stats;
+    CHECK(cache != NULL);
+    CHECK(cached_is(cache, a, "a/one", 0, "shared content"));
+    CHECK(cached_is(cache, a, "a/one", 0, "shared content"));
+    CHECK(cached_is(cache, a, "a/one", 7, "content"));
+    tar_cache_stats(cache, &stats);
+    CHECK(stats.hits == 2 && stats.misses == 1);
+    CHECK(stats.entries == 1 && stats.blobs == 1 && stats.bytes == 14);
+
+    CHECK(cached_is(cache, a, "a/two", 0, "shared content"));
+    CHECK(cached_is(cache, b, "b/one", 0, "shared content"));
+    tar_cache_stats(cache, &stats);
+    CHECK(stats.misses == 3 && stats.entries == 3 && stats.blobs == 1 && stats.bytes == 14);
+
+    CHECK(cached_is(cache, a, "a/other", 0, "other content!"));
+    CHECK(cached_is(cache, a, "a/link", 0, "shared content"));
+    CHECK(cached_is(cache, a, "big", 0, big));
+    CHECK(cached_is(cache, a, "big", 90, "bbbbbbbbbb"));
+    tar_cache_stats(cache, &stats);
+    CHECK(stats.blobs == 2 && stats.bytes == 28);
+
+    uint8_t buf[16];
+    size_t len = sizeof(buf);
+    char missing[] = "a/missing";
+    CHECK(tar_cache_read_file(cache, a, missing, 0, buf, &len) == -1);
+    tar_cache_free(cache);
+
+    cache = tar_cache_new(20, 0);
+    CHECK(cached_is(cache, a, "a/one", 0, "shared content"));
+    CHECK(cached_is(cache, a, "a/other", 0, "other content!"));
+    CHECK(cached_is(cache, a, "a/one", 0, "shared content"));
+    tar_cache_stats(cache, &stats);
+    CHECK(stats.hits == 0 && stats.misses == 3 && stats.bytes <= 20);
+    tar_cache_free(cache);
+    close(a);
+    close(b);
+}
+
+static int collect_diff(const tar_entry_t *old_entry, const tar_entry_t *new_entry, int status, int changes, void *arg) {
+    found_t *found = arg;
+    size_t used = strlen(found->names);
+    snprintf(found->names + used, sizeof(found->names) - used, "%s%s:%d:%#x", used > 0 ? " " : "",
+             (new_entry != NULL ? new_entry : old_entry)->name, status, changes);
+    found->count++;
+    return 0;
+}
+
+/* Members are merged by name, the last of a name winning, and compared on metadata before contents */
+static void test_diff(void) {
+    int old_fd = open(scratch_path("diff_old.tar"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    off_t off = put_member(old_fd, 0, "d/", DIRTYPE, NULL);
+    off = put_member(old_fd, off, "d/same", REGTYPE, "same");
+    off = put_member(old_fd, off, "d/content", REGTYPE, "abc");
+    off = put_member(old_fd, off, "d/size", REGTYPE, "ab");
+    off = put_member(old_fd, off, "d/type", REGTYPE, NULL);
+    off = put_member(old_fd, off, "d/areg", REGTYPE, "a");
+    off = put_entry(old_fd, off, "d/link", SYMTYPE, "a", NULL);
+    off = put_member(old_fd, off, "shadow", REGTYPE, "1");
+    off = put_member(old_fd, off, "gone", REGTYPE, NULL);
+    put_end(old_fd, put_member(old_fd, off, "shadow", REGTYPE, "2"));
+
+    int new_fd = open(scratch_path("diff_new.tar"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    off = put_member(new_fd, 0, "new", REGTYPE, NULL);
+    off = put_member(new_fd, off, "shadow", REGTYPE, "2");
+    off = put_member(new_fd, off, "d/", DIRTYPE, NULL);
+    off = put_entry(new_fd, off, "d/link", SYMTYPE, "b", NULL);
+    off = put_member(new_fd, off, "d/areg", AREGTYPE, "a");
+    off = put_member(new_fd, off, "d/type", CHRTYPE, NULL);
+    off = put_member(new_fd, off, "d/size", REGTYPE, "abc");
+    off = put_member(new_fd, off, "d/content", REGTYPE, "abd");
+    put_end(new_fd, put_member(new_fd, off, "d/same", REGTYPE, "same"));
+
+    found_t found = {0, ""};
+    CHECK(tar_diff(old_fd, new_fd, collect_diff, &found) == 6);
+    CHECK(strcmp(found.names, "d/content:3:0x40 d/link:3:0x20 d/size:3:0x42 d/type:3:0x1 gone:2:0 new:1:0") == 0);
+    CHECK(tar_diff(new_fd, old_fd, NULL, NULL) == 6);
+    CHECK(tar_diff(old_fd, old_fd, NULL, NULL) == 0);
+
+    char bad = '9';
+    pwrite(new_fd, &bad, 1, 148);
+    CHECK(tar_diff(old_fd, new_fd, NULL, NULL) == -3);
+    close(old_fd);
+    close(new_fd);
+}
+
+/* Rewrites the magic and version of the header at `off` with `magic_version` and its checksum, summing signed bytes if `sign` */
+static void reheader(int fd, off_t off, const char *magic_version, int sign) {
+    tar_header_t h;
+    pread(fd, &h, sizeof(h), off);
+    memcpy(h.magic, magic_version, TMAGLEN + TVERSLEN);
+    memset(h.chksum, ' ', sizeof(h.chksum));
+    int sum = 0;
+    for (size_t i = 0; i < sizeof(h); i++) {
+        sum += sign ? ((signed char *) &h)[i] : ((unsigned char *) &h)[i];
+    }
+    snprintf(h.chksum, sizeof(h.chksum), "%06o", sum);
+    h.chksum[7] = ' ';
+    pwrite(fd, &h, sizeof(h), off);
+}
+
+/* Returns what check_archive() returns on fd under `policy`, set on a handle or on file descriptors without one */
+static int check_under(int fd, int policy, int with_handle) {
+    tar_t *tar = with_handle ? tar_open(fd) : NULL;
+    tar_set_policy(tar, policy);
+    lseek(fd, 0, SEEK_SET);
+    int ret = check_archive(fd);
+    if (with_handle) {
+        tar_close(tar);
+    } else {
+        tar_set_policy(NULL, TAR_DEFAULT_POLICY);
+    }
+    return ret;
+}
+
+/* Each policy accepts the headers of the stricter ones and of its own dialect */
+static void test_policy(void) {
+    static const char *members[] = {"d/", "d/a", "d/b"};
+    int gnu = make_archive("policy_gnu.tar", members, 3);
+    int v7 = make_archive("policy_v7.tar", members, 3);
+    int sign = make_archive("policy_signed.tar", members, 3);
+    put_end(sign, put_member(sign, 2560, "d/caf\xe9", REGTYPE, NULL));
+    reheader(sign, 2560, "ustar\0" TVERSION, 1);
+    static const off_t headers[] = {0, 512, 1536};
+    for (int i = 0; i < 3; i++) {
+        reheader(gnu, headers[i], "ustar  ", 0);
+        reheader(v7, headers[i], "\0\0\0\0\0\0\0", 0);
+    }
+    for (int with_handle = 0; with_handle <= 1; with_handle++) {
+        CHECK(check_under(gnu, TAR_POLICY_USTAR, with_handle) == -1);
+        CHECK(check_under(gnu, TAR_POLICY_GNU, with_handle) == 3);
+        CHECK(check_under(gnu, TAR_POLICY_V7, with_handle) == 3);
+        CHECK(check_under(gnu, TAR_POLICY_PERMISSIVE, with_handle) == 3);
+        /* the stricter policies take a header without magic for the end of the archive */
+        CHECK(check_under(v7, TAR_POLICY_USTAR, with_handle) < 3);
+        CHECK(check_under(v7, TAR_POLICY_GNU, with_handle) < 3);
+        CHECK(check_under(v7, TAR_POLICY_V7, with_handle) == 3);
+        CHECK(check_under(v7, TAR_POLICY_PERMISSIVE, with_handle) == 3);
+        CHECK(check_under(sign, TAR_POLICY_USTAR, with_handle) == -3);
+        CHECK(check_under(sign, TAR_POLICY_V7, with_handle) == -3);
+        CHECK(check_under(sign, TAR_POLICY_PERMISSIVE, with_handle) == 4);
+    }
+
+    char path[] = "d/b";
+    tar_t *tar = tar_open(gnu);
+    CHECK(tar_set_policy(tar, 99) == -1);
+    CHECK(tar_index(tar) < 0);
+    CHECK(tar_set_policy(tar, TAR_POLICY_GNU) == 0);
+    CHECK(tar_index(tar) == 3);
+    CHECK(exists(gnu, path) != 0);
+    tar_close(tar);
+    close(gnu);
+    close(v7);
+    close(sign);
+}
+
+/* A delta rebuilds the new archive byte for byte, and only from the archive it was created against */
+static void test_delta(void) {
+    static const char *newer[] = {"d/", "d/a", "d/b2", "e", "c"};
+    int old = make_archive("old.tar", small, 4);
+    int new = make_archive("new.tar", newer, 5);
+    int other = make_archive("other.tar", newer, 4);
+    int delta = open(scratch_path("new.delta"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int out = open(scratch_path("out.tar"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    CHECK(tar_delta_create(old, new, delta) > 0);
+    CHECK(tar_delta_apply(old, delta, out) == 0);
+    CHECK(same_bytes(out, new));
+
+    char recipe[256];
+    CHECK(read_string(delta, TAR_DELTA_MANIFEST, recipe, sizeof(recipe)) == 0);
+    CHECK(strncmp(recipe, "tar-delta 2 ", 12) == 0);
+
+    ftruncate(out, 0);
+    CHECK(tar_delta_apply(other, delta, out) == -1);
+    CHECK(tar_last_error(delta)->code == TAR_EINVAL);
+
+    /* an old archive of the same size whose data changed is told apart by its digest */
+    int changed = make_archive("changed.tar", small, 4);
+    pwrite(changed, "D", 1, 1024);
+    ftruncate(out, 0);
+    CHECK(tar_delta_apply(changed, delta, out) == -1);
+    CHECK(tar_last_error(delta)->code == TAR_EINVAL && strcmp(tar_last_error(delta)->field, "digest") == 0);
+    close(changed);
+
+    close(old);
+    close(new);
+    close(other);
+    close(delta);
+    close(out);
+}
+
+typedef struct recovered {
+    int members;
+    int damaged;
+} recovered_t;
+
+static int count_recovered(int status, const tar_entry_t *entry, off_t start, off_t end, void *arg) {
+    recovered_t *seen = arg;
+    if (status == TAR_RECOVER_MEMBER) {
+        seen->members++;
+    } else if (status == TAR_RECOVER_DAMAGED) {
+        seen->damaged++;
+    }
+    return 0;
+}
+
+/* tar_recover() resynchronizes on the next valid header past a damaged one */
+static void test_recover(void) {
+    static const char *members[] = {"x1", "x2", "x3"};
+    int fd = make_archive("damaged.tar", members, 3);
+    char garbage[512];
+    memset(garbage, 'Z', sizeof(garbage));
+    pwrite(fd, garbage, sizeof(garbage), 1024);
+
+    lseek(fd, 0, SEEK_SET);
+    CHECK(check_archive(fd) < 0);
+    tar_t *tar = tar_open(fd);
+    recovered_t seen = {0, 0};
+    CHECK(tar_recover(fd, count_recovered, &seen) == 2);
+    CHECK(seen.members == 2);
+    CHECK(seen.damaged >= 1);
+    CHECK(exists(fd, "x1") != 0);
+    CHECK(exists(fd, "x2") == 0);
+    CHECK(exists(fd, "x3") != 0);
+
+    uint8_t buf[16];
+    size_t len = sizeof(buf);
+    CHECK(read_file(fd, "x3", 0, buf, &len) == 0);
+    CHECK(len == 2 && memcmp(buf, "x3", 2) == 0);
+    tar_close(tar);
+    close(fd);
+}
+
+/* read_file() follows symlinks relative to their directory and hard links by full path, with or without an index */
+static void test_links(void) {
+    static const char *members[] = {
+        "d/", "d/f", "f", "d/l -> f", "d/abs -> /f", "d/h => d/f", "d/chain -> l", "e -> d/l",
+        "loop1 -> loop2", "loop2 -> loop1",
+    };
+    int fd = make_archive("links.tar", members, 10);
+    for (int indexed = 0; indexed <= 1; indexed++) {
+        tar_t *tar = indexed ? tar_open(fd) : NULL;
+        if (indexed) {
+            CHECK(tar_index(tar) == 10);
+        }
+        char buf[64];
+        CHECK(read_string(fd, "d/l", buf, sizeof(buf)) == 0 && strcmp(buf, "d/f") == 0);
+        CHECK(read_string(fd, "d/abs", buf, sizeof(buf)) == 0 && strcmp(buf, "f") == 0);
+        CHECK(read_string(fd, "d/h", buf, sizeof(buf)) == 0 && strcmp(buf, "d/f") == 0);
+        CHECK(read_string(fd, "d/chain", buf, sizeof(buf)) == 0 && strcmp(buf, "d/f") == 0);
+        CHECK(read_string(fd, "e", buf, sizeof(buf)) == 0 && strcmp(buf, "d/f") == 0);
+
+        CHECK(read_string(fd, "loop1", buf, sizeof(buf)) == -1);
+        const tar_error_t *err = tar_last_error(fd);
+        CHECK(err->code == TAR_ENOENT && err->field != NULL && strcmp(err->field, "linkname") == 0);
+        tar_close(tar);
+    }
+    close(fd);
+}
+
+/* Offsets of the first entries walked, in order */
+typedef struct offsets {
+    int count;
+    off_t offsets[4];
+} offsets_t;
+
+static int walked_offset(const tar_entry_t *entry, int depth, void *arg) {
+    offsets_t *walked = arg;
+    if (walked->count < 4) {
+        walked->offsets[walked->count] = entry->offset;
+    }
+    walked->count++;
+    return 0;
+}
+
+/* An index sees the directories that member paths imply, with no header behind them */
+static void test_implied(void) {
+    static const char *members[] = {"a/b/c", "a/d", "x/", "x/y/z", "f"};
+    int fd = make_archive("implied.tar", members, 5);
+    tar_t *tar = tar_open(fd);
+    CHECK(tar_index(tar) == 5);
+    char a[] = "a", ab[] = "a/b/", f[] = "f", f_dir[] = "f/", xy[] = "x/y";
+    CHECK(is_dir(fd, a) != 0 && is_dir(fd, ab) != 0 && is_dir(fd, xy) != 0);
+    CHECK(is_file(fd, a) == 0 && is_dir(fd, f) == 0 && is_dir(fd, f_dir) == 0);
+    CHECK(tar_list_is(fd, "a", "a/b/ a/d") > 0);
+    CHECK(walk_is(fd, "", 1, 0, TAR_WALK_PREORDER, "a/:1 f:1 x/:1"));
+    CHECK(walk_is(fd, "", 0, TAR_WALK_DIRS, TAR_WALK_PREORDER, "a/:1 a/b/:2 x/:1 x/y/:2"));
+
+    struct stat st;
+    CHECK(tar_stat(fd, "a/b/", &st) == 0 && S_ISDIR(st.st_mode) && (st.st_mode & 0777) == 0755);
+    CHECK(st.st_uid == 0 && st.st_mtime == 0);
+    CHECK(tar_stat(fd, "a/b/c", &st) == 0 && S_ISREG(st.st_mode));
+    offsets_t walked = {0, {0}};
+    tar_walk_opts_t opts = {1, TAR_WALK_DIRS, TAR_WALK_PREORDER};
+    CHECK(tar_walk(fd, "", &opts, walked_offset, &walked) == 2);
+    CHECK(walked.offsets[0] == -1 && walked.offsets[1] == 2048);
+
+    /* directories implied by members appended later */
+    off_t end = lseek(fd, 0, SEEK_END) - 1024;
+    put_end(fd, put_member(fd, end, "n/m/k", REGTYPE, NULL));
+    CHECK(tar_list_is(fd, "n", "n/m/") > 0);
+    CHECK(walk_is(fd, "", 1, 0, TAR_WALK_PREORDER, "a/:1 f:1 n/:1 x/:1"));
+    tar_close(tar);
+    close(fd);
+}
+
+/* Any spelling of a path finds the entry stored under any other, and entries are reported in canonical form */
+static void test_canonical(void) {
+    static const char *members[] = {"./p/", "./p//q", "p/./r/", "/abs/x", "t/u"};
+    static const char *spellings[] = {"p/q", "./p/q", "p//q", "/p/q", "p/./q", "p/q/", "./././p///q"};
+    int fd = make_archive("canonical.tar", members, 5);
+    for (int indexed = 0; indexed <= 1; indexed++) {
+        tar_t *tar = indexed ? tar_open(fd) : NULL;
+        if (indexed) {
+            CHECK(tar_index(tar) == 5);
+        }
+        for (int i = 0; i < 7; i++) {
+            char path[32], content[32];
+            snprintf(path, sizeof(path), "%s", spellings[i]);
+            lseek(fd, 0, SEEK_SET);
+            CHECK(exists(fd, path) != 0);
+            CHECK(read_string(fd, spellings[i], content, sizeof(content)) == 0 && strcmp(content, "./p//q") == 0);
+        }
+        char p[] = "./p", r[] = "p//r/", x[] = "abs/x", up[] = "p/../p/q", t[] = "./t/./u";
+        lseek(fd, 0, SEEK_SET);
+        CHECK(is_dir(fd, p) != 0);
+        lseek(fd, 0, SEEK_SET);
+        CHECK(is_dir(fd, r) != 0);
+        lseek(fd, 0, SEEK_SET);
+        CHECK(is_file(fd, x) != 0);
+        lseek(fd, 0, SEEK_SET);
+        CHECK(is_file(fd, t) != 0);
+        lseek(fd, 0, SEEK_SET);
+        CHECK(exists(fd, up) == 0);
+
+        struct stat st;
+        lseek(fd, 0, SEEK_SET);
+        CHECK(tar_stat(fd, "p/r", &st) == 0 && S_ISDIR(st.st_mode));
+        CHECK(tar_list_is(fd, "p//", "p/q p/r/") > 0);
+        CHECK(walk_is(fd, "/./p", 0, 0, TAR_WALK_ARCHIVE, "p/q:1 p/r/:1"));
+        CHECK(find_is(fd, "p/*", 0, "p/q p/r/"));
+        CHECK(find_is(fd, "abs/*", 0, "abs/x"));
+        tar_close(tar);
+    }
+    close(fd);
+}
+
+/* Returns 1 if `name` is one of the `count` entries listed */
+static int listed(char **entries, size_t count, const char *name) {
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(entries[i], name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Whiteouts of an upper layer hide lower entries, also once appended to a layer already merged */
+static void test_overlay(void) {
+    static const char *lower_names[] = {"etc/", "etc/a", "etc/b", "opt/", "opt/x/", "opt/x/k"};
+    static const char *upper_names[] = {"etc/", "etc/.wh.b", "etc/c", "opt/.wh..wh..opq", "opt/n"};
+    int fds[2] = {make_archive("lower.tar", lower_names, 6), make_archive("upper.tar", upper_names, 5)};
+    tar_overlay_t *ov = tar_overlay_new(fds, 2);
+    CHECK(ov != NULL);
+    CHECK(tar_overlay_exists(ov, "etc/a") != 0);
+    CHECK(tar_overlay_exists(ov, "etc/b") == 0);
+    CHECK(tar_overlay_exists(ov, "etc/.wh.b") == 0);
+    CHECK(tar_overlay_exists(ov, "opt/x/k") == 0);
+    CHECK(tar_overlay_exists(ov, "opt/n") != 0);
+
+    char *entries[8], names[8][64];
+    for (int i = 0; i < 8; i++) {
+        entries[i] = names[i];
+    }
+    size_t count = 8;
+    CHECK(tar_overlay_list(ov, "etc", entries, &count) > 0);
+    CHECK(count == 2 && listed(entries, count, "etc/a") && listed(entries, count, "etc/c"));
+
+    /* the upper layer is merged again with the whiteout written over its end-of-archive marker */
+    off_t off = put_member(fds[1], lseek(fds[1], 0, SEEK_END) - 1024, "etc/.wh.a", REGTYPE, NULL);
+    put_end(fds[1], off);
+    CHECK(tar_overlay_exists(ov, "etc/a") == 0);
+    CHECK(tar_overlay_exists(ov, "etc/c") != 0);
+    count = 8;
+    CHECK(tar_overlay_list(ov, "etc", entries, &count) > 0);
+    CHECK(count == 1 && strcmp(entries[0], "etc/c") == 0);
+
+    tar_overlay_free(ov);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/* Lookups running while index versions are published and retired */
+typedef struct reader {
+    int fd;
+    int stop;
+    long lookups;
+    long misses;
+    long foreign_errors;
+} reader_t;
+
+static void *read_published(void *arg) {
+    reader_t *r = arg;
+    while (!__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) {
+        uint8_t buf[8];
+        size_t len = sizeof(buf);
+        int found = exists(r->fd, "g0") != 0 && read_file(r->fd, "g1", 0, buf, &len) == 0 &&
+                    len == 2 && memcmp(buf, "g1", 2) == 0;
+        __atomic_add_fetch(&r->lookups, 1, __ATOMIC_RELAXED);
+        if (!found) {
+            __atomic_add_fetch(&r->misses, 1, __ATOMIC_RELAXED);
+        }
+        /* the last error is the thread's own, whatever the others sharing the handle do */
+        len = sizeof(buf);
+        int failed = read_file(r->fd, "absent", 0, buf, &len) == -1 &&
+                     tar_last_error(r->fd)->code == TAR_ENOENT;
+        int cleared = exists(r->fd, "g0") != 0 && tar_last_error(r->fd)->code == TAR_OK;
+        if (!failed || !cleared) {
+            __atomic_add_fetch(&r->foreign_errors, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+/* A successful call, made on another thread than the one checking its last error */
+static void *exists_g0(void *arg) {
+    return exists(*(int *) arg, "g0") != 0 ? arg : NULL;
+}
+
+static void test_index_publish(void) {
+    static const char *first[] = {"g0", "g1"};
+    int writer = make_archive("grow.tar", first, 2);
+    int fd = open(scratch_path("grow.tar"), O_RDONLY);
+    tar_t *tar = tar_open(fd);
+    CHECK(tar_index(tar) == 2);
+
+    reader_t r = {fd, 0, 0, 0, 0};
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) {
+        pthread_create(&threads[i], NULL, read_published, &r);
+    }
+    /* each member is written over the end-of-archive marker, followed by a new one */
+    off_t off = 2 * 1024;
+    for (int i = 2; i < 40; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "g%d", i);
+        off = put_member(writer, off, name, REGTYPE, name);
+        put_end(writer, off);
+        if (i % 4 == 0) {
+            CHECK(tar_index(tar) >= 0);
+        }
+    }
+    __atomic_store_n(&r.stop, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    CHECK(r.misses == 0);
+    CHECK(r.foreign_errors == 0);
+    CHECK(tar_last_error(fd)->code == TAR_OK);
+
+    uint8_t buf[8];
+    size_t len = sizeof(buf);
+    void *found;
+    CHECK(read_file(fd, "absent", 0, buf, &len) == -1);
+    pthread_create(&threads[0], NULL, exists_g0, &fd);
+    pthread_join(threads[0], &found);
+    CHECK(found != NULL);
+    CHECK(tar_last_error(fd)->code == TAR_ENOENT);
+    CHECK(tar_index(tar) >= 0);
+    int missing = 0;
+    for (int i = 0; i < 40; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "g%d", i);
+        missing += exists(fd, name) == 0;
+    }
+    CHECK(missing == 0);
+    tar_close(tar);
+    close(fd);
+    close(writer);
+}
+
+/* Writes an archive of `count` empty members named "p/dDD/fNNNN" */
+static int make_many(const char *file, int count) {
+    int fd = open(scratch_path(file), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    off_t off = 0;
+    for (int i = 0; i < count; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "p/d%02d/f%d", i % 50, i);
+        off = put_member(fd, off, name, REGTYPE, NULL);
+    }
+    put_end(fd, off);
+    return fd;
+}
+
+/* Writes an archive of `count` members of sizes from zero to a few pages, every 50th of 200000 bytes */
+static int make_mixed(const char *file, int count) {
+    static char data[200001];
+    int fd = open(scratch_path(file), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    off_t off = put_member(fd, 0, "m/", DIRTYPE, NULL);
+    for (int i = 0; i < count; i++) {
+        char name[32];
+        size_t size = i % 50 == 49 ? 200000 : (size_t) (i * 977) % 9000;
+        snprintf(name, sizeof(name), "m/d%d/f%d", i % 7, i);
+        memset(data, 'a' + i % 26, size);
+        data[size] = '\0';
+        off = put_member(fd, off, name, REGTYPE, data);
+    }
+    put_end(fd, off);
+    return fd;
+}
+
+/* Summary of the entries a walk reported and their order */
+typedef struct fingerprint {
+    size_t count;
+    uint64_t hash;
+} fingerprint_t;
+
+static void fingerprint_bytes(fingerprint_t *print, const void *bytes, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        print->hash = (print->hash ^ ((const uint8_t *) bytes)[i]) * 0x100000001B3ULL;
+    }
+}
+
+/* Directories only implied by the names of an index are left out, a scan of the headers not having them */
+static int fingerprint_entry(const tar_entry_t *entry, int depth, void *arg) {
+    fingerprint_t *print = arg;
+    if (entry->offset == -1) {
+        return 0;
+    }
+    print->count++;
+    fingerprint_bytes(print, entry->name, strlen(entry->name) + 1);
+    fingerprint_bytes(print, &entry->typeflag, sizeof(entry->typeflag));
+    fingerprint_bytes(print, &entry->size, sizeof(entry->size));
+    fingerprint_bytes(print, &entry->offset, sizeof(entry->offset));
+    fingerprint_bytes(print, &depth, sizeof(depth));
+    return 0;
+}
+
+/* Walks the whole archive in archive order, from its start when it has no handle */
+static fingerprint_t walk_fingerprint(int fd) {
+    fingerprint_t print = {0, 0xCBF29CE484222325ULL};
+    lseek(fd, 0, SEEK_SET);
+    tar_walk(fd, "", NULL, fingerprint_entry, &print);
+    return print;
+}
+
+static int fingerprint_digest(const tar_entry_t *entry, const char *digest, int status, void *arg) {
+    fingerprint_bytes(arg, entry->name, strlen(entry->name) + 1);
+    fingerprint_bytes(arg, digest, strlen(digest) + 1);
+    return 0;
+}
+
+/* Everything the scans of fd report: headers checked, entries walked and found, a large member read piecewise and digests */
+static fingerprint_t scan_fingerprint(int fd) {
+    fingerprint_t print = walk_fingerprint(fd);
+    lseek(fd, 0, SEEK_SET);
+    int ret = check_archive(fd);
+    fingerprint_bytes(&print, &ret, sizeof(ret));
+    lseek(fd, 0, SEEK_SET);
+    ret = tar_find(fd, "m/d6/*", 0, NULL, NULL);
+    fingerprint_bytes(&print, &ret, sizeof(ret));
+    char path[] = "m/d0/f49";
+    uint8_t buf[4096];
+    for (size_t offset = 0;; offset += sizeof(buf)) {
+        size_t len = sizeof(buf);
+        lseek(fd, 0, SEEK_SET);
+        ssize_t left = read_file(fd, path, offset, buf, &len);
+        fingerprint_bytes(&print, buf, len);
+        if (left <= 0) {
+            fingerprint_bytes(&print, &left, sizeof(left));
+            break;
+        }
+    }
+    tar_verify_opts_t opts = {TAR_DIGEST_XXH3, NULL, 0, 1};
+    lseek(fd, 0, SEEK_SET);
+    ret = tar_verify(fd, &opts, fingerprint_digest, &print);
+    fingerprint_bytes(&print, &ret, sizeof(ret));
+    return print;
+}
+
+/* Readahead and drop-behind hints change what the kernel caches, never what the scans report */
+static void test_advice(void) {
+    int fd = make_mixed("advice.tar", 300);
+    tar_t *tar = tar_open(fd);
+    CHECK(tar_set_advice(tar, 0) == 0);
+    fingerprint_t plain = scan_fingerprint(fd);
+    CHECK(plain.count == 301);
+    static const int masks[] = {TAR_ADVISE_READAHEAD, TAR_ADVISE_DROPBEHIND, TAR_DEFAULT_ADVICE};
+    for (int i = 0; i < 3; i++) {
+        CHECK(tar_set_advice(tar, masks[i]) == 0);
+        fingerprint_t advised = scan_fingerprint(fd);
+        CHECK(advised.count == plain.count && advised.hash == plain.hash);
+    }
+    CHECK(tar_index(tar) == 301);
+    fingerprint_t indexed = scan_fingerprint(fd);
+    CHECK(indexed.count == plain.count && indexed.hash == plain.hash);
+    CHECK(tar_set_advice(tar, 0x80) == -1);
+    tar_close(tar);
+
+    CHECK(tar_set_advice(NULL, TAR_ADVISE_READAHEAD) == 0);
+    fingerprint_t unhandled = scan_fingerprint(fd);
+    CHECK(unhandled.count == plain.count && unhandled.hash == plain.hash);
+    tar_set_advice(NULL, TAR_DEFAULT_ADVICE);
+    close(fd);
+}
+
+/* O_DIRECT header walks skip the data of large members and report what buffered scans report, bad headers included */
+static void test_direct(void) {
+    int fd = make_mixed("direct.tar", 300);
+    off_t size = lseek(fd, 0, SEEK_END);
+    tar_t *tar = tar_open(fd);
+    CHECK(tar_set_advice(tar, 0) == 0);
+    fingerprint_t plain = scan_fingerprint(fd);
+    CHECK(tar_set_advice(tar, TAR_ADVISE_DIRECT) == 0);
+    fingerprint_t direct = scan_fingerprint(fd);
+    CHECK(direct.count == plain.count && direct.hash == plain.hash);
+    CHECK(tar_set_advice(tar, TAR_ADVISE_DIRECT | TAR_DEFAULT_ADVICE) == 0);
+    tar_stats_t stats;
+    tar_reset_stats(fd);
+    lseek(fd, 0, SEEK_SET);
+    CHECK(check_archive(fd) == 301);
+    tar_get_stats(fd, &stats);
+    /* small members are read in batches, the six members of 200000 bytes skipped */
+    CHECK(stats.bytes_read + 1000000 <= (uint64_t) size);
+    CHECK(tar_index(tar) == 301);
+    direct = scan_fingerprint(fd);
+    CHECK(direct.count == plain.count && direct.hash == plain.hash);
+    tar_close(tar);
+
+    /* a bad checksum past large members is found at the same header */
+    off_t bad = -1;
+    lseek(fd, 0, SEEK_SET);
+    CHECK(tar_find(fd, "m/d5/f250", 0, header_offset, &bad) == 1);
+    pwrite(fd, "0000000", 7, bad + 148);
+    tar = tar_open(fd);
+    lseek(fd, 0, SEEK_SET);
+    int scanned = check_archive(fd);
+    CHECK(tar_set_advice(tar, TAR_ADVISE_DIRECT) == 0);
+    lseek(fd, 0, SEEK_SET);
+    CHECK(scanned == -3 && check_archive(fd) == scanned);
+    CHECK(tar_index(tar) == scanned);
+    tar_close(tar);
+    close(fd);
+}
+
+/* Index builds reading headers ahead on the pipeline thread find what a scan of the headers finds */
+static void test_prefetch(void) {
+    int fd = make_mixed("mixed.tar", 400);
+    fingerprint_t plain = walk_fingerprint(fd);
+    CHECK(plain.count == 401);
+    for (int depth = 0; depth <= 64; depth = depth == 0 ? 1 : depth * 8) {
+        tar_t *tar = tar_open(fd);
+        CHECK(tar_set_prefetch(tar, depth) == 0);
+        CHECK(tar_index(tar) == 401);
+        fingerprint_t indexed = walk_fingerprint(fd);
+        CHECK(indexed.count == plain.count && indexed.hash == plain.hash);
+        tar_close(tar);
+    }
+    tar_t *tar = tar_open(fd);
+    CHECK(tar_set_prefetch(tar, -1) == -1);
+    tar_close(tar);
+
+    /* members appended are indexed through the pipe too, and a bad header is reported as by a scan */
+    tar = tar_open(fd);
+    CHECK(tar_set_prefetch(tar, 8) == 0);
+    CHECK(tar_index(tar) == 401);
+    off_t end = lseek(fd, 0, SEEK_END) - 1024;
+    off_t off = put_member(fd, end, "m/late", REGTYPE, "late");
+    off = put_member(fd, off, "m/bad", REGTYPE, "bad");
+    put_end(fd, off);
+    CHECK(tar_index(tar) == 2);
+    CHECK(exists(fd, "m/late") != 0 && exists(fd, "m/bad") != 0);
+    pwrite(fd, "0000000", 7, end + 1024 + 148);
+    tar_close(tar);
+    lseek(fd, 0, SEEK_SET);
+    int scanned = check_archive(fd);
+    tar = tar_open(fd);
+    CHECK(tar_set_prefetch(tar, 8) == 0);
+    CHECK(scanned == -3 && tar_index(tar) == scanned);
+    tar_close(tar);
+    close(fd);
+}
+
+/* Counts the members of make_many() that exists() does not find */
+static int count_missing(int fd, int count) {
+    int missing = 0;
+    for (int i = 0; i < count; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "p/d%02d/f%d", i % 50, i);
+        missing += exists(fd, name) == 0;
+    }
+    return missing;
+}
+
+/* The columns of the index keep every entry's name, link, size and shadowing as its table grows through refreshes */
+static void test_columns(void) {
+    int fd = make_many("columns.tar", 4000);
+    tar_t *tar = tar_open(fd);
+    CHECK(tar_index(tar) == 4000);
+    CHECK(count_missing(fd, 4000) == 0);
+
+    off_t off = lseek(fd, 0, SEEK_END) - 1024;
+    off = put_member(fd, off, "p/d07/f7", REGTYPE, "new");
+    off = put_entry(fd, off, "p/ln", SYMTYPE, "d07/f7", NULL);
+    off = put_entry(fd, off, "p/hl", LNKTYPE, "p/d07/f7", NULL);
+    for (int i = 4000; i < 20000; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "p/d%02d/f%d", i % 50, i);
+        off = put_member(fd, off, name, REGTYPE, NULL);
+    }
+    put_end(fd, off);
+    CHECK(tar_index(tar) == 16003);
+    CHECK(count_missing(fd, 20000) == 0);
+
+    char content[16], ln[] = "p/ln", hl[] = "p/hl", missing[] = "p/d07/f20007";
+    CHECK(read_string(fd, "p/d07/f7", content, sizeof(content)) == 0 && strcmp(content, "new") == 0);
+    CHECK(read_string(fd, "p/ln", content, sizeof(content)) == 0 && strcmp(content, "new") == 0);
+    CHECK(read_string(fd, "p/hl", content, sizeof(content)) == 0 && strcmp(content, "new") == 0);
+    char *target = get_symlink(fd, ln);
+    CHECK(target != NULL && strcmp(target, "d07/f7") == 0);
+    free(target);
+    target = get_symlink(fd, hl);
+    CHECK(target != NULL && strcmp(target, "p/d07/f7") == 0);
+    free(target);
+    CHECK(is_symlink(fd, ln) != 0 && exists(fd, missing) == 0);
+
+    struct stat st, first;
+    CHECK(tar_stat(fd, "p/d07/f7", &st) == 0 && st.st_size == 3);
+    CHECK(tar_stat(fd, "p/d07/f57", &first) == 0 && first.st_size == 0 && first.st_ino != st.st_ino);
+    found_t found = {0, ""};
+    CHECK(tar_find(fd, "p/d07/f7", 0, collect_entry, &found) == 1);
+    tar_close(tar);
+    close(fd);
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/* Checks that list() at `path` lists the names of `expected`, joined by spaces in sorted order */
+static int list_sorted_is(int fd, const char *path, const char *expected) {
+    char storage[16][TAR_NAME_MAX];
+    char *entries[16], names[512] = "", dir[64];
+    size_t count = 16;
+    for (int i = 0; i < 16; i++) {
+        entries[i] = storage[i];
+    }
+    snprintf(dir, sizeof(dir), "%s", path);
+    lseek(fd, 0, SEEK_SET);
+    list(fd, dir, entries, &count);
+    qsort(entries, count, sizeof(entries[0]), compare_names);
+    for (size_t i = 0; i < count; i++) {
+        size_t used = strlen(names);
+        snprintf(names + used, sizeof(names) - used, "%s%s", used > 0 ? " " : "", entries[i]);
+    }
+    if (strcmp(names, expected) != 0) {
+        printf("list(\"%s\") listed \"%s\"\n", path, names);
+        return 0;
+    }
+    return 1;
+}
+
+/* Listing a directory from the sorted name table stops at its last descendant, whatever names sort around it */
+static void test_range_list(void) {
+    static const char *members[] = {
+        "a/", "a-b/", "a-b/x", "a/c/", "a/c/e/", "a/c/e/f", "a.c", "a/b", "a0/", "a0/y", "ab", "a/c/d", "a/c/z",
+        "a/c\x7f", "b/", "b/a/", "b/a/c",
+    };
+    int fd = make_archive("range.tar", members, 17);
+    for (int indexed = 0; indexed <= 1; indexed++) {
+        tar_t *tar = indexed ? tar_open(fd) : NULL;
+        if (indexed) {
+            CHECK(tar_index(tar) == 17);
+        }
+        CHECK(list_sorted_is(fd, "a", "a/b a/c/ a/c\x7f"));
+        CHECK(list_sorted_is(fd, "a/c/", "a/c/d a/c/e/ a/c/z"));
+        CHECK(list_sorted_is(fd, "a/c/e", "a/c/e/f"));
+        CHECK(list_sorted_is(fd, "a-b", "a-b/x"));
+        CHECK(list_sorted_is(fd, "a0", "a0/y"));
+        CHECK(list_sorted_is(fd, "b/a", "b/a/c"));
+        CHECK(list_sorted_is(fd, "ab", ""));
+        CHECK(tar_list_is(fd, "a/c", "a/c/e/ a/c/d a/c/z") > 0);
+        CHECK(tar_list_is(fd, "a", "a/c/ a/b a/c\x7f") > 0);
+        CHECK(walk_is(fd, "a", 0, 0, TAR_WALK_PREORDER, "a/b:1 a/c/:1 a/c/d:2 a/c/e/:2 a/c/e/f:3 a/c/z:2 a/c\x7f:1"));
+        CHECK(walk_is(fd, "a", 1, 0, TAR_WALK_POSTORDER, "a/b:1 a/c/:1 a/c\x7f:1"));
+        CHECK(walk_is(fd, "b", 0, 0, TAR_WALK_PREORDER, "b/a/:1 b/a/c:2"));
+        tar_close(tar);
+    }
+
+    /* a member appended after the table was sorted is listed from the next version */
+    tar_t *tar = tar_open(fd);
+    CHECK(tar_index(tar) == 17);
+    CHECK(list_sorted_is(fd, "a/c", "a/c/d a/c/e/ a/c/z"));
+    put_end(fd, put_member(fd, lseek(fd, 0, SEEK_END) - 1024, "a/c/y", REGTYPE, NULL));
+    CHECK(list_sorted_is(fd, "a/c", "a/c/d a/c/e/ a/c/y a/c/z"));
+    CHECK(walk_is(fd, "a/c", 1, TAR_WALK_FILES, TAR_WALK_PREORDER, "a/c/d:1 a/c/y:1 a/c/z:1"));
+    tar_close(tar);
+    close(fd);
+}
+
+/* A perfect hash index, saved to a sidecar and loaded back */
+static void test_perfect_sidecar(void) {
+    int fd = make_many("perfect.tar", 500);
+    tar_t *tar = tar_open(fd);
+    CHECK(tar_set_index_mode(tar, TAR_INDEX_PERFECT) == 0);
+    CHECK(tar_index(tar) == 500);
+    CHECK(count_missing(fd, 500) == 0);
+    CHECK(exists(fd, "p/d00/f1") == 0);
+    CHECK(exists(fd, "p/d00/") != 0);
+
+    int side = open(scratch_path("perfect.idx"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(tar_index_save(tar, side) == 0);
+    tar_close(tar);
+
+    tar = tar_open(fd);
+    lseek(side, 0, SEEK_SET);
+    CHECK(tar_index_load(tar, side) == 0);
+    CHECK(count_missing(fd, 500) == 0);
+    CHECK(exists(fd, "p/d49/f500") == 0);
+    tar_close(tar);
+
+    /* a sidecar is refused for another archive */
+    int other = make_many("other.tar", 400);
+    tar = tar_open(other);
+    lseek(side, 0, SEEK_SET);
+    CHECK(tar_index_load(tar, side) == -1);
+    tar_close(tar);
+
+    close(other);
+    close(side);
+    close(fd);
+}
+
+/* The Bloom filter never hides a member and answers most lookups of absent paths */
+static void test_bloom(void) {
+    int fd = make_many("bloom.tar", 5000);
+    tar_t *tar = tar_open(fd);
+    CHECK(tar_index(tar) == 5000);
+    CHECK(count_missing(fd, 5000) == 0);
+
+    tar_stats_t before, after;
+    tar_get_stats(fd, &before);
+    int found = 0;
+    for (int i = 0; i < 10000; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "p/d%02d/absent%d", i % 50, i);
+        found += exists(fd, name) != 0;
+    }
+    tar_get_stats(fd, &after);
+    CHECK(found == 0);
+    CHECK(after.index_filtered - before.index_filtered >= 9900);
+
+    /* members appended are found by the next lookup, though the filter of the version indexed rules them out */
+    off_t off = 5000 * 512;
+    int late = 0;
+    for (int i = 0; i < 100; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "p/late%d", i);
+        off = put_member(fd, off, name, REGTYPE, NULL);
+        put_end(fd, off);
+        late += exists(fd, name) != 0;
+    }
+    CHECK(late == 100);
+    tar_close(tar);
+    close(fd);
+}
+
+/* Runs the assertions, returns the number that failed */
+static int run_checks(void) {
+    if (mkdtemp(scratch) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    test_error_codes();
+    test_find();
+    test_walk();
+    test_verify_digests();
+    test_cache();
+    test_list();
+    test_stats();
+    test_diff();
+    test_policy();
+    test_delta();
+    test_recover();
+    test_links();
+    test_implied();
+    test_canonical();
+    test_overlay();
+    test_index_publish();
+    test_columns();
+    test_range_list();
+    test_advice();
+    test_direct();
+    test_prefetch();
+    test_perfect_sidecar();
+    test_bloom();
+
+    DIR *dir = opendir(scratch);
+    struct dirent *ent;
+    while (dir != NULL && (ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] != '.') {
+            unlink(scratch_path(ent->d_name));
+        }
+    }
+    if (dir != NULL) {
+        closedir(dir);
+    }
+    rmdir(scratch);
+
+    printf("Checks: %d run, %d failed\n", checks, failures);
+    return failures;
+}
+
 void debug_dump(const uint8_t *bytes, size_t len) {
     for (int i = 0; i < len;) {
         printf("%04x:  ", (int) i);
@@ -25,12 +1435,13 @@ void debug_dump(const uint8_t *bytes, size_t len) {
 }
 
 int main(int argc, char **argv) {
-    if (argc < 2) {
-        printf("Usage: %s tar_file\n", argv[0]);
+    int verbose = argc > 2 && strcmp(argv[1], "-v") == 0;
+    if (argc < 2 + verbose) {
+        printf("Usage: %s [-v] tar_file\n", argv[0]);
         return -1;
     }
 
-    int fd = open(argv[1], O_RDONLY);
+    int fd = open(argv[1 + verbose], O_RDONLY);
     if (fd == -1) {
         perror("open(tar_file)");
         return -1;
@@ -52,23 +1463,44 @@ int main(int argc, char **argv) {
         }
     }
 
+    /* the listing of the archive given is only printed with -v, list() and tar_list() must agree on it */
     int result = list(fd, "testar/sym", entries, &no_entries);
-    if (result < 0) {
-        printf("Error occurred during list operation.\n");
-    } else if (result == 0) {
-        printf("No directory found at given path in the archive.\n");
-    } else {
-        printf("Entries listed:\n");
-        for (size_t i = 0; i < no_entries; i++) {
-            printf("%zu : %s\n", i, entries[i]);
+    if (verbose) {
+        if (result < 0) {
+            printf("Error occurred during list operation.\n");
+        } else if (result == 0) {
+            printf("No directory found at given path in the archive.\n");
+        } else {
+            printf("Entries listed:\n");
+            for (size_t i = 0; i < no_entries; i++) {
+                printf("%zu : %s\n", i, entries[i]);
+            }
         }
+        printf("Number of entries: %zu\n", no_entries);
+    }
+
+    tar_list_t *listed;
+    int listed_result = tar_list(fd, "testar/sym", &listed);
+    CHECK((result > 0) == (listed_result > 0));
+    if (listed_result > 0) {
+        CHECK(listed->count == no_entries);
+        for (size_t i = 0; i < listed->count && i < no_entries; i++) {
+            CHECK(strcmp(TAR_LIST_ENTRY(listed, i), entries[i]) == 0);
+        }
+        if (verbose) {
+            printf("Entries listed by tar_list:\n");
+            for (size_t i = 0; i < listed->count; i++) {
+                printf("%zu : %s\n", i, TAR_LIST_ENTRY(listed, i));
+            }
+        }
+        tar_list_free(listed);
+    } else if (verbose) {
+        printf("tar_list returned %d\n", listed_result);
     }
-    printf("Number of entries: %zu\n", no_entries);
 
     for (size_t i = 0; i < 10; i++) {
         free(entries[i]);
     }
-
     close(fd);
-    return 0;
-}
\ No newline at end of file
+    return run_checks() == 0 ? 0 : 1;
+}